@@ -3,4 +3,9 @@
 from dials.algorithms.background.glm.algorithm import BackgroundAlgorithm
 from dials_algorithms_background_glm_ext import *  # noqa: F403; lgtm
 
-__all__ = ("BackgroundAlgorithm", "Creator", "RobustPoissonMean")  # noqa: F405
+__all__ = (  # noqa: F405
+    "BackgroundAlgorithm",
+    "Creator",
+    "RobustPoissonMean",
+    "TiledCreator",
+)
@@ -5,7 +5,13 @@ class BackgroundAlgorithm:
     """Class to do background subtraction."""
 
     def __init__(
-        self, experiments, model="constant3d", tuning_constant=1.345, min_pixels=10
+        self,
+        experiments,
+        model="constant3d",
+        tuning_constant=1.345,
+        min_pixels=10,
+        tile_size=None,
+        nthreads=1,
     ):
         """
         Initialise the algorithm.
@@ -13,8 +19,11 @@ def __init__(
         :param experiments: The list of experiments
         :param model: The background model
         :param tuning_constant: The robust tuning constant
+        :param tile_size: If set, fit the background of an image volume once
+                          per tile of this size on each frame
+        :param nthreads: The number of threads used to fit the tiles
         """
-        from dials.algorithms.background.glm import Creator
+        from dials.algorithms.background.glm import Creator, TiledCreator
 
         if model == "constant2d":
             model = Creator.model.constant2d
@@ -32,6 +41,16 @@ def __init__(
             max_iter=100,
             min_pixels=min_pixels,
         )
+        if tile_size is not None:
+            self._create_tiled = TiledCreator(
+                tile_size=tile_size,
+                tuning_constant=tuning_constant,
+                max_iter=100,
+                min_pixels=min_pixels,
+                nthreads=nthreads,
+            )
+        else:
+            self._create_tiled = None
 
     def compute_background(self, reflections, image_volume=None):
         """
@@ -45,6 +64,8 @@ def compute_background(self, reflections, image_volume=None):
             reflections["background.mean"] = reflections[
                 "shoebox"
             ].mean_modelled_background()
+        elif self._create_tiled is not None:
+            success = self._create_tiled(reflections, image_volume)
         else:
             success = self._create(reflections, image_volume)
         reflections.set_flags(~success, reflections.flags.dont_integrate)
@@ -12,6 +12,7 @@
 #include <boost/python/def.hpp>
 #include <dials/algorithms/background/glm/robust_poisson_mean.h>
 #include <dials/algorithms/background/glm/creator.h>
+#include <dials/algorithms/background/glm/tiled_creator.h>
 
 namespace dials { namespace algorithms { namespace background { namespace boost_python {
 
@@ -37,6 +38,15 @@ namespace dials { namespace algorithms { namespace background { namespace boost_
       .def("__call__", &GLMBackgroundCreator::shoebox)
       .def("__call__", &GLMBackgroundCreator::volume);
 
+    class_<GLMTiledBackgroundCreator>("TiledCreator", no_init)
+      .def(init<std::size_t, double, std::size_t, std::size_t, std::size_t>(
+        (arg("tile_size"),
+         arg("tuning_constant"),
+         arg("max_iter"),
+         arg("min_pixels") = 10,
+         arg("nthreads") = 1)))
+      .def("__call__", &GLMTiledBackgroundCreator::volume);
+
     scope in_creator = creator;
 
     enum_<GLMBackgroundCreator::Model>("model")
@@ -39,6 +39,10 @@ namespace dials { namespace algorithms {
       return temp[temp.size() / 2];
     }
 
+    inline double median(const CountHistogram &x) {
+      return x.median();
+    }
+
   }  // namespace detail
 
   /**
@@ -168,6 +172,23 @@ namespace dials { namespace algorithms {
       };
     }
 
+    /**
+     * Compute the robust poisson mean of the background pixels, using the
+     * median as the starting value
+     * @param Y The background pixel values or a histogram of them
+     * @returns The mean background
+     */
+    template <typename Observations>
+    double compute_mean(const Observations &Y) const {
+      double median = detail::median(Y);
+      if (median == 0) {
+        median = 1.0;
+      }
+      RobustPoissonMean result(Y, median, tuning_constant_, 1e-3, max_iter_);
+      DIALS_ASSERT(result.converged());
+      return result.mean();
+    }
+
     /**
      * Compute the background values for a single shoebox
      * @param sbox The shoebox
@@ -177,47 +198,45 @@ namespace dials { namespace algorithms {
                              af::ref<T, af::c_grid<3> > background,
                              af::ref<int, af::c_grid<3> > mask) const {
       for (std::size_t k = 0; k < data.accessor()[0]; ++k) {
-        // Compute number of background pixels
+        // Compute number of background pixels and a histogram of their values
         std::size_t num_background = 0;
         int mask_code = Valid | Background;
+        CountHistogram histogram;
+        bool is_integer = true;
         for (std::size_t j = 0; j < data.accessor()[1]; ++j) {
           for (std::size_t i = 0; i < data.accessor()[2]; ++i) {
             if ((mask(k, j, i) & mask_code) == mask_code
                 && ((mask(k, j, i) & Overlapped) == 0)) {
+              DIALS_ASSERT(data(k, j, i) >= 0);
+              if (is_integer) {
+                is_integer = histogram.add(data(k, j, i));
+              }
               num_background++;
             }
           }
         }
         DIALS_ASSERT(num_background >= min_pixels_);
 
-        // Allocate some arrays
-        af::shared<double> Y(num_background, 0);
-        std::size_t l = 0;
-        for (std::size_t j = 0; j < data.accessor()[1]; ++j) {
-          for (std::size_t i = 0; i < data.accessor()[2]; ++i) {
-            if ((mask(k, j, i) & mask_code) == mask_code
-                && ((mask(k, j, i) & Overlapped) == 0)) {
-              DIALS_ASSERT(l < Y.size());
-              DIALS_ASSERT(data(k, j, i) >= 0);
-              Y[l++] = data(k, j, i);
+        // Compute the robust mean from the histogram if possible, otherwise
+        // from the list of pixel values
+        double mean_background = 0;
+        if (is_integer) {
+          mean_background = compute_mean(histogram);
+        } else {
+          af::shared<double> Y(num_background, 0);
+          std::size_t l = 0;
+          for (std::size_t j = 0; j < data.accessor()[1]; ++j) {
+            for (std::size_t i = 0; i < data.accessor()[2]; ++i) {
+              if ((mask(k, j, i) & mask_code) == mask_code
+                  && ((mask(k, j, i) & Overlapped) == 0)) {
+                DIALS_ASSERT(l < Y.size());
+                Y[l++] = data(k, j, i);
+              }
             }
           }
+          DIALS_ASSERT(l == Y.size());
+          mean_background = compute_mean(Y.const_ref());
         }
-        DIALS_ASSERT(l == Y.size());
-
-        // Compute the median value for the starting value
-        double median = detail::median(Y.const_ref());
-        if (median == 0) {
-          median = 1.0;
-        }
-
-        // Compute the result
-        RobustPoissonMean result(
-          Y.const_ref(), median, tuning_constant_, 1e-3, max_iter_);
-        DIALS_ASSERT(result.converged());
-
-        // Compute the background
-        double mean_background = result.mean();
 
         // Fill in the background shoebox values
         for (std::size_t j = 0; j < data.accessor()[1]; ++j) {
@@ -240,41 +259,39 @@ namespace dials { namespace algorithms {
     void compute_constant_3d(const af::const_ref<T, af::c_grid<3> > &data,
                              af::ref<T, af::c_grid<3> > background,
                              af::ref<int, af::c_grid<3> > mask) const {
-      // Compute number of background pixels
+      // Compute number of background pixels and a histogram of their values
       std::size_t num_background = 0;
       int mask_code = Valid | Background;
+      CountHistogram histogram;
+      bool is_integer = true;
       for (std::size_t i = 0; i < mask.size(); ++i) {
         if ((mask[i] & mask_code) == mask_code && ((mask[i] & Overlapped) == 0)) {
+          DIALS_ASSERT(data[i] >= 0);
+          if (is_integer) {
+            is_integer = histogram.add(data[i]);
+          }
           num_background++;
         }
       }
       DIALS_ASSERT(num_background >= min_pixels_);
 
-      // Allocate some arrays
-      af::shared<double> Y(num_background, 0);
-      std::size_t j = 0;
-      for (std::size_t i = 0; i < mask.size(); ++i) {
-        if ((mask[i] & mask_code) == mask_code && ((mask[i] & Overlapped) == 0)) {
-          DIALS_ASSERT(j < Y.size());
-          DIALS_ASSERT(data[i] >= 0);
-          Y[j++] = data[i];
+      // Compute the robust mean from the histogram if possible, otherwise
+      // from the list of pixel values
+      double mean_background = 0;
+      if (is_integer) {
+        mean_background = compute_mean(histogram);
+      } else {
+        af::shared<double> Y(num_background, 0);
+        std::size_t j = 0;
+        for (std::size_t i = 0; i < mask.size(); ++i) {
+          if ((mask[i] & mask_code) == mask_code && ((mask[i] & Overlapped) == 0)) {
+            DIALS_ASSERT(j < Y.size());
+            Y[j++] = data[i];
+          }
         }
+        DIALS_ASSERT(j == Y.size());
+        mean_background = compute_mean(Y.const_ref());
       }
-      DIALS_ASSERT(j == Y.size());
-
-      // Compute the median value for the starting value
-      double median = detail::median(Y.const_ref());
-      if (median == 0) {
-        median = 1.0;
-      }
-
-      // Compute the result
-      RobustPoissonMean result(
-        Y.const_ref(), median, tuning_constant_, 1e-3, max_iter_);
-      DIALS_ASSERT(result.converged());
-
-      // Compute the background
-      double mean_background = result.mean();
 
       // Fill in the background shoebox values
       for (std::size_t i = 0; i < background.size(); ++i) {
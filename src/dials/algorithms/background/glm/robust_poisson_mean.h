@@ -11,6 +11,7 @@
 #ifndef SCITBX_GLMTBX_ROBUST_POISSON_MEAN_H
 #define SCITBX_GLMTBX_ROBUST_POISSON_MEAN_H
 
+#include <algorithm>
 #include <dials/array_family/scitbx_shared_and_versa.h>
 #include <scitbx/matrix/inversion.h>
 #include <scitbx/matrix/multiply.h>
@@ -20,6 +21,85 @@
 
 namespace dials { namespace algorithms {
 
+  /**
+   * A histogram of small non-negative integer counts held in fixed storage.
+   * Background pixel values are nearly always small integers so the robust
+   * Poisson mean can be computed from the histogram with a cost proportional
+   * to the number of distinct values rather than the number of pixels.
+   */
+  class CountHistogram {
+  public:
+    static const std::size_t max_size = 1024;
+
+    CountHistogram() : size_(0), num_obs_(0) {}
+
+    /**
+     * Add a value to the histogram
+     * @param value The value
+     * @returns False if the value is not a small non-negative integer
+     */
+    bool add(double value) {
+      if (!(value >= 0 && value < max_size)) {
+        return false;
+      }
+      std::size_t index = (std::size_t)value;
+      if (index != value) {
+        return false;
+      }
+      if (index >= size_) {
+        std::fill(counts_ + size_, counts_ + index + 1, 0);
+        size_ = index + 1;
+      }
+      counts_[index]++;
+      num_obs_++;
+      return true;
+    }
+
+    /**
+     * @returns The number of bins up to and including the largest value
+     */
+    std::size_t size() const {
+      return size_;
+    }
+
+    /**
+     * @returns The number of observations with the value
+     */
+    std::size_t operator[](std::size_t index) const {
+      DIALS_ASSERT(index < size_);
+      return counts_[index];
+    }
+
+    /**
+     * @returns The total number of observations
+     */
+    std::size_t num_obs() const {
+      return num_obs_;
+    }
+
+    /**
+     * @returns The element at position n / 2 in the sorted observations
+     */
+    double median() const {
+      DIALS_ASSERT(num_obs_ > 0);
+      std::size_t target = num_obs_ / 2;
+      std::size_t cumulative = 0;
+      for (std::size_t i = 0; i < size_; ++i) {
+        cumulative += counts_[i];
+        if (cumulative > target) {
+          return i;
+        }
+      }
+      DIALS_ASSERT(false);
+      return 0;
+    }
+
+  private:
+    std::size_t counts_[max_size];
+    std::size_t size_;
+    std::size_t num_obs_;
+  };
+
   /**
    * An algorithm to do robust generalized linear model as described in
    * Cantoni and Rochetti (2001) "Robust Inference for Generalized Linear
@@ -53,7 +133,31 @@ namespace dials { namespace algorithms {
       SCITBX_ASSERT(tolerance > 0);
       SCITBX_ASSERT(max_iter > 0);
       beta_ = std::log(mean0);
-      compute(Y);
+      compute(Y.size(), sum_psi_values(Y));
+    }
+
+    /**
+     * Compute the robust mean from a histogram of integer counts. Each IRLS
+     * iteration costs O(number of distinct values).
+     * @param Y The histogram of observations
+     * @param mean0 The initial estimate
+     * @param c The huber tuning constant
+     * @param tolerance The stopping criteria
+     * @param max_iter The maximum number of iterations
+     */
+    RobustPoissonMean(const CountHistogram &Y,
+                      double mean0,
+                      double c,
+                      double tolerance,
+                      std::size_t max_iter)
+        : niter_(0), error_(0), c_(c), tolerance_(tolerance), max_iter_(max_iter) {
+      SCITBX_ASSERT(Y.num_obs() > 0);
+      SCITBX_ASSERT(mean0 > 0);
+      SCITBX_ASSERT(c > 0);
+      SCITBX_ASSERT(tolerance > 0);
+      SCITBX_ASSERT(max_iter > 0);
+      beta_ = std::log(mean0);
+      compute(Y.num_obs(), sum_psi_histogram(Y));
     }
 
     /**
@@ -86,15 +190,42 @@ namespace dials { namespace algorithms {
     }
 
   private:
-    void compute(const af::const_ref<double> &Y) {
-      // Number of observations and coefficients
-      std::size_t n_obs = Y.size();
+    /**
+     * Compute the sum of huber psi over a list of observations
+     */
+    struct sum_psi_values {
+      const af::const_ref<double> &Y;
+      sum_psi_values(const af::const_ref<double> &Y_) : Y(Y_) {}
+      double operator()(double mu, double svar, double c) const {
+        double sum = 0;
+        for (std::size_t i = 0; i < Y.size(); ++i) {
+          sum += scitbx::glmtbx::huber((Y[i] - mu) / svar, c);
+        }
+        return sum;
+      }
+    };
 
+    /**
+     * Compute the sum of huber psi over a histogram of observations
+     */
+    struct sum_psi_histogram {
+      const CountHistogram &Y;
+      sum_psi_histogram(const CountHistogram &Y_) : Y(Y_) {}
+      double operator()(double mu, double svar, double c) const {
+        double sum = 0;
+        for (std::size_t i = 0; i < Y.size(); ++i) {
+          if (Y[i] > 0) {
+            sum += Y[i] * scitbx::glmtbx::huber((i - mu) / svar, c);
+          }
+        }
+        return sum;
+      }
+    };
+
+    template <typename SumPsi>
+    void compute(std::size_t n_obs, const SumPsi &sum_psi) {
       // Loop until we reach the maximum number of iterations
       for (niter_ = 0; niter_ < max_iter_; ++niter_) {
-        // Initialize the sum to zero
-        double U = 0;
-        double H = 0;
         double w = 1.0;
         double eta = beta_;
         double mu = family::linkinv(eta);
@@ -111,22 +242,10 @@ namespace dials { namespace algorithms {
         // The value of the b diagonal parts
         double b = epsi.epsi2 * w * dmu * dmu / svar;
 
-        // Build the matrices from the observations
-        for (std::size_t i = 0; i < n_obs; ++i) {
-          // Compute some required values
-          double res = (Y[i] - mu) / svar;
-
-          // Compute the difference between psi and its expected value
-          double psi = scitbx::glmtbx::huber(res, c_);
-          double psi_m_epsi = psi - epsi.epsi1;
-
-          // Compute the value of Psi and B_diag for this observation
-          double q = psi_m_epsi * w * dmu / svar;
-
-          // Update the BX = B * X and U matrices
-          U += q;
-          H += b;
-        }
+        // The difference between psi and its expected value summed over all
+        // observations gives U; every observation has the same value of b.
+        double U = (sum_psi(mu, svar, c_) - n_obs * epsi.epsi1) * w * dmu / svar;
+        double H = n_obs * b;
 
         // Compute delta = H^-1 U
         U = U / H;
@@ -0,0 +1,394 @@
+/*
+ * tiled_creator.h
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+
+#ifndef DIALS_ALGORITHMS_BACKGROUND_GLM_TILED_CREATOR_H
+#define DIALS_ALGORITHMS_BACKGROUND_GLM_TILED_CREATOR_H
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+#include <dials/algorithms/background/glm/robust_poisson_mean.h>
+#include <dials/array_family/reflection_table.h>
+#include <dials/array_family/scitbx_shared_and_versa.h>
+#include <dials/model/data/image_volume.h>
+#include <dials/model/data/mask_code.h>
+#include <dials/util/thread_pool.h>
+#include <dials/error.h>
+
+namespace dials { namespace algorithms {
+
+  using model::Foreground;
+  using model::ImageVolume;
+  using model::MultiPanelImageVolume;
+  using model::Valid;
+
+  /**
+   * The background model for a single panel. Each frame is divided into
+   * square tiles and a robust constant background is fitted once to all the
+   * valid pixels in each tile which are not in the foreground of any
+   * reflection. Any shoebox on the panel can then be served from the fitted
+   * tiles rather than fitting the background of each shoebox independently.
+   */
+  class TiledBackgroundModel {
+  public:
+    TiledBackgroundModel() : frame0_(0), tile_size_(1) {}
+
+    /**
+     * Allocate the model
+     * @param frame0 The first frame
+     * @param accessor The size of the image volume
+     * @param tile_size The size of the tiles
+     */
+    TiledBackgroundModel(int frame0, af::c_grid<3> accessor, std::size_t tile_size)
+        : frame0_(frame0),
+          tile_size_(tile_size),
+          mean_(af::c_grid<3>(accessor[0],
+                              (accessor[1] + tile_size - 1) / tile_size,
+                              (accessor[2] + tile_size - 1) / tile_size),
+                0),
+          fitted_(mean_.accessor(), false) {
+      DIALS_ASSERT(tile_size > 0);
+    }
+
+    /**
+     * @returns The size of the tiles
+     */
+    std::size_t tile_size() const {
+      return tile_size_;
+    }
+
+    /**
+     * @returns The number of frames and tiles in y and x
+     */
+    af::c_grid<3> accessor() const {
+      return mean_.accessor();
+    }
+
+    /**
+     * @returns The mean background of each tile on each frame
+     */
+    af::versa<double, af::c_grid<3> > mean() const {
+      return mean_;
+    }
+
+    /**
+     * @returns Whether the background was fitted for each tile on each frame
+     */
+    af::versa<bool, af::c_grid<3> > fitted() const {
+      return fitted_;
+    }
+
+    /**
+     * Set the mean background of the tile
+     */
+    void set(std::size_t k, std::size_t j, std::size_t i, double mean) {
+      mean_(k, j, i) = mean;
+      fitted_(k, j, i) = true;
+    }
+
+    /**
+     * Check the background was fitted for all tiles within the bbox
+     * @param bbox The bounding box in image volume coordinates
+     * @returns True/False
+     */
+    bool contains(int6 bbox) const {
+      DIALS_ASSERT(bbox[4] >= frame0_);
+      DIALS_ASSERT(bbox[5] - frame0_ <= (int)mean_.accessor()[0]);
+      for (int k = bbox[4]; k < bbox[5]; ++k) {
+        for (std::size_t j = bbox[2] / tile_size_; j <= (bbox[3] - 1) / tile_size_;
+             ++j) {
+          for (std::size_t i = bbox[0] / tile_size_;
+               i <= (bbox[1] - 1) / tile_size_;
+               ++i) {
+            if (!fitted_(k - frame0_, j, i)) {
+              return false;
+            }
+          }
+        }
+      }
+      return true;
+    }
+
+    /**
+     * Fill the background of the image volume from the tiles
+     * @param volume The image volume
+     */
+    template <typename FloatType>
+    void fill(ImageVolume<FloatType> volume) const {
+      af::versa<FloatType, af::c_grid<3> > background = volume.background();
+      af::c_grid<3> grid = background.accessor();
+      DIALS_ASSERT(grid[0] == mean_.accessor()[0]);
+      for (std::size_t k = 0; k < grid[0]; ++k) {
+        for (std::size_t j = 0; j < grid[1]; ++j) {
+          for (std::size_t i = 0; i < grid[2]; ++i) {
+            background(k, j, i) = mean_(k, j / tile_size_, i / tile_size_);
+          }
+        }
+      }
+    }
+
+  private:
+    int frame0_;
+    std::size_t tile_size_;
+    af::versa<double, af::c_grid<3> > mean_;
+    af::versa<bool, af::c_grid<3> > fitted_;
+  };
+
+  /**
+   * A class to create the background model from tiles of the image volume.
+   * The cost of the fit scales with the area of the detector rather than
+   * with the total area of the shoeboxes, which for dense data with large
+   * shoeboxes is many times the detector area.
+   */
+  class GLMTiledBackgroundCreator {
+  public:
+    /**
+     * Initialise the creator
+     * @param tile_size The size of the tiles in pixels
+     * @param tuning_constant The robust tuning constant
+     * @param max_iter The maximum number of iterations
+     * @param min_pixels The minimum number of pixels needed in a tile
+     * @param nthreads The number of threads
+     */
+    GLMTiledBackgroundCreator(std::size_t tile_size,
+                              double tuning_constant,
+                              std::size_t max_iter,
+                              std::size_t min_pixels,
+                              std::size_t nthreads)
+        : tile_size_(tile_size),
+          tuning_constant_(tuning_constant),
+          max_iter_(max_iter),
+          min_pixels_(min_pixels),
+          nthreads_(nthreads) {
+      DIALS_ASSERT(tile_size > 0);
+      DIALS_ASSERT(tuning_constant > 0);
+      DIALS_ASSERT(max_iter > 0);
+      DIALS_ASSERT(min_pixels > 0);
+      DIALS_ASSERT(nthreads > 0);
+    }
+
+    /**
+     * Fit the background model of each panel in the image volume. Each frame
+     * of each panel is fitted independently, in parallel if requested. The
+     * arrays are shared handles whose reference counts are not thread safe,
+     * so the jobs are given references taken here on the calling thread.
+     * @param volume The image volume
+     * @returns The background model of each panel
+     */
+    std::vector<TiledBackgroundModel> model(MultiPanelImageVolume<> volume) const {
+      std::vector<TiledBackgroundModel> result;
+      std::vector<af::versa<float, af::c_grid<3> > > data;
+      std::vector<af::versa<int, af::c_grid<3> > > mask;
+      result.reserve(volume.size());
+      for (std::size_t p = 0; p < volume.size(); ++p) {
+        ImageVolume<> v = volume.get(p);
+        result.push_back(TiledBackgroundModel(v.frame0(), v.accessor(), tile_size_));
+        data.push_back(v.data());
+        mask.push_back(v.mask());
+      }
+      std::vector<frame_job> jobs;
+      for (std::size_t p = 0; p < volume.size(); ++p) {
+        for (std::size_t k = 0; k < data[p].accessor()[0]; ++k) {
+          jobs.push_back(
+            frame_job(this, data[p].const_ref(), mask[p].const_ref(), &result[p], k));
+        }
+      }
+      if (nthreads_ == 1 || jobs.size() <= 1) {
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+          job_runner(&jobs[i])();
+        }
+      } else {
+        dials::util::ThreadPool pool(std::min(nthreads_, jobs.size()));
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+          pool.post(job_runner(&jobs[i]));
+        }
+        pool.wait();
+      }
+      for (std::size_t i = 0; i < jobs.size(); ++i) {
+        if (!jobs[i].error.empty()) {
+          throw DIALS_ERROR(jobs[i].error);
+        }
+      }
+      return result;
+    }
+
+    /**
+     * Compute the background values
+     * @param reflections The reflection table
+     * @param volume The image volume
+     * @returns Success True/False
+     */
+    af::shared<bool> volume(af::reflection_table reflections,
+                            MultiPanelImageVolume<> volume) const {
+      DIALS_ASSERT(reflections.contains("bbox"));
+      DIALS_ASSERT(reflections.contains("panel"));
+      af::const_ref<int6> bbox = reflections["bbox"];
+      af::const_ref<std::size_t> panel = reflections["panel"];
+
+      // Fit the tiles once for each panel and frame and write the background
+      // into the image volume
+      std::vector<TiledBackgroundModel> models = model(volume);
+      for (std::size_t p = 0; p < models.size(); ++p) {
+        models[p].fill(volume.get(p));
+      }
+
+      // The fit succeeded if all the tiles under the reflection were fitted
+      af::shared<bool> success(bbox.size(), true);
+      for (std::size_t i = 0; i < bbox.size(); ++i) {
+        DIALS_ASSERT(panel[i] < models.size());
+        ImageVolume<> v = volume.get(panel[i]);
+        success[i] = models[panel[i]].contains(v.trim_bbox(bbox[i]));
+      }
+      return success;
+    }
+
+  private:
+    /**
+     * The tiles on a single frame of a single panel
+     */
+    struct frame_job {
+      const GLMTiledBackgroundCreator *creator;
+      af::const_ref<float, af::c_grid<3> > data;
+      af::const_ref<int, af::c_grid<3> > mask;
+      TiledBackgroundModel *model;
+      std::size_t frame;
+      std::string error;
+
+      frame_job(const GLMTiledBackgroundCreator *creator_,
+                const af::const_ref<float, af::c_grid<3> > &data_,
+                const af::const_ref<int, af::c_grid<3> > &mask_,
+                TiledBackgroundModel *model_,
+                std::size_t frame_)
+          : creator(creator_),
+            data(data_),
+            mask(mask_),
+            model(model_),
+            frame(frame_) {}
+    };
+
+    /**
+     * Fit the tiles for a single job, catching any errors
+     */
+    struct job_runner {
+      frame_job *job;
+      job_runner(frame_job *job_) : job(job_) {}
+      void operator()() const {
+        try {
+          job->creator->compute_frame(job->data, job->mask, *job->model, job->frame);
+        } catch (const std::exception &e) {
+          job->error = e.what();
+        } catch (...) {
+          job->error = "Unknown error fitting background tiles";
+        }
+      }
+    };
+
+    /**
+     * Fit each tile on a frame. Tiles with too few background pixels, or for
+     * which the fit fails, are left unfitted.
+     */
+    void compute_frame(const af::const_ref<float, af::c_grid<3> > &data,
+                       const af::const_ref<int, af::c_grid<3> > &mask,
+                       TiledBackgroundModel &model,
+                       std::size_t k) const {
+      std::size_t height = data.accessor()[1];
+      std::size_t width = data.accessor()[2];
+      for (std::size_t tj = 0; tj < model.accessor()[1]; ++tj) {
+        std::size_t j0 = tj * tile_size_;
+        std::size_t j1 = std::min(j0 + tile_size_, height);
+        for (std::size_t ti = 0; ti < model.accessor()[2]; ++ti) {
+          std::size_t i0 = ti * tile_size_;
+          std::size_t i1 = std::min(i0 + tile_size_, width);
+          try {
+            model.set(k, tj, ti, compute_tile(data, mask, k, j0, j1, i0, i1));
+          } catch (scitbx::error const &) {
+            continue;
+          } catch (dials::error const &) {
+            continue;
+          }
+        }
+      }
+    }
+
+    /**
+     * Compute the robust mean background of a single tile
+     */
+    double compute_tile(const af::const_ref<float, af::c_grid<3> > &data,
+                        const af::const_ref<int, af::c_grid<3> > &mask,
+                        std::size_t k,
+                        std::size_t j0,
+                        std::size_t j1,
+                        std::size_t i0,
+                        std::size_t i1) const {
+      // Compute number of background pixels and a histogram of their values
+      std::size_t num_background = 0;
+      CountHistogram histogram;
+      bool is_integer = true;
+      for (std::size_t j = j0; j < j1; ++j) {
+        for (std::size_t i = i0; i < i1; ++i) {
+          if (is_background(mask(k, j, i))) {
+            DIALS_ASSERT(data(k, j, i) >= 0);
+            if (is_integer) {
+              is_integer = histogram.add(data(k, j, i));
+            }
+            num_background++;
+          }
+        }
+      }
+      DIALS_ASSERT(num_background >= min_pixels_);
+
+      // Compute the robust mean from the histogram if possible, otherwise
+      // from the list of pixel values
+      if (is_integer) {
+        return compute_mean(histogram, histogram.median());
+      }
+      af::shared<double> Y;
+      Y.reserve(num_background);
+      for (std::size_t j = j0; j < j1; ++j) {
+        for (std::size_t i = i0; i < i1; ++i) {
+          if (is_background(mask(k, j, i))) {
+            Y.push_back(data(k, j, i));
+          }
+        }
+      }
+      std::vector<double> temp(Y.begin(), Y.end());
+      std::nth_element(temp.begin(), temp.begin() + temp.size() / 2, temp.end());
+      return compute_mean(Y.const_ref(), temp[temp.size() / 2]);
+    }
+
+    /**
+     * Pixels are background if they are valid and not in the foreground of
+     * any reflection
+     */
+    static bool is_background(int code) {
+      return (code & Valid) && !(code & Foreground);
+    }
+
+    /**
+     * Compute the robust poisson mean, using the median as the starting value
+     */
+    template <typename Observations>
+    double compute_mean(const Observations &Y, double median) const {
+      if (median == 0) {
+        median = 1.0;
+      }
+      RobustPoissonMean result(Y, median, tuning_constant_, 1e-3, max_iter_);
+      DIALS_ASSERT(result.converged());
+      return result.mean();
+    }
+
+    std::size_t tile_size_;
+    double tuning_constant_;
+    std::size_t max_iter_;
+    std::size_t min_pixels_;
+    std::size_t nthreads_;
+  };
+
+}}  // namespace dials::algorithms
+
+#endif  // DIALS_ALGORITHMS_BACKGROUND_GLM_TILED_CREATOR_H
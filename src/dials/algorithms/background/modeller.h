@@ -40,18 +40,22 @@ namespace dials { namespace algorithms {
       typedef ImageVolume<>::float_type FloatType;
       af::const_ref<FloatType, af::c_grid<3> > data = volume.data().const_ref();
       af::const_ref<int, af::c_grid<3> > mask = volume.mask().const_ref();
-      for (std::size_t j = 0; j < accessor_[0]; ++j) {
-        for (std::size_t i = 0; i < accessor_[1]; ++i) {
-          for (std::size_t k = 0; k < data.accessor()[0]; ++k) {
-            double d = data(k, j, i);
-            int m = mask(k, j, i);
-            if ((m & Valid) && !(m & Foreground)) {
-              sum_(j, i) += d;
-              sum_sq_(j, i) += d * d;
-              num_(j, i) += 1;
-              if (min_(j, i) == -1 || min_(j, i) > d) min_(j, i) = d;
-              if (max_(j, i) == -1 || max_(j, i) < d) max_(j, i) = d;
-            }
+
+      // Loop over the frames in memory order. Each pixel still sees the frames
+      // in increasing order so the sums are the same.
+      std::size_t npixels = accessor_[0] * accessor_[1];
+      for (std::size_t k = 0; k < data.accessor()[0]; ++k) {
+        const FloatType *frame_data = &data[k * npixels];
+        const int *frame_mask = &mask[k * npixels];
+        for (std::size_t i = 0; i < npixels; ++i) {
+          double d = frame_data[i];
+          int m = frame_mask[i];
+          if ((m & Valid) && !(m & Foreground)) {
+            sum_[i] += d;
+            sum_sq_[i] += d * d;
+            num_[i] += 1;
+            if (min_[i] == -1 || min_[i] > d) min_[i] = d;
+            if (max_[i] == -1 || max_[i] < d) max_[i] = d;
           }
         }
       }
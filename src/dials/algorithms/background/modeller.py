@@ -24,13 +24,21 @@ class FinalizeModel:
     A class to finalize the background model
     """
 
-    def __init__(self, experiments, filter_type="median", kernel_size=10, niter=100):
+    def __init__(
+        self,
+        experiments,
+        filter_type="median",
+        kernel_size=10,
+        niter=100,
+        nthreads=1,
+    ):
         """
         Initialize the finalizer
 
         :param experiments: The experiment list
         :param kernel_size: The median filter kernel size
         :param niter: The number of iterations for filling holes
+        :param nthreads: The number of threads for the median filter
         """
         from dials.algorithms.background.gmodel import PolarTransform
 
@@ -38,6 +46,7 @@ def __init__(self, experiments, filter_type="median", kernel_size=10, niter=100)
         self.filter_type = filter_type
         self.kernel_size = kernel_size
         self.niter = niter
+        self.nthreads = nthreads
 
         # Check the input
         assert len(experiments) == 1
@@ -87,7 +96,13 @@ def finalize(self, data, mask):
         if self.kernel_size > 0:
             if self.filter_type == "median":
                 logger.info("Applying median filter")
-                data = median_filter(data, mask, (self.kernel_size, 0), periodic=True)
+                data = median_filter(
+                    data,
+                    mask,
+                    (self.kernel_size, 0),
+                    periodic=True,
+                    nthreads=self.nthreads,
+                )
                 sub_data = data.as_1d().select(mask.as_1d())
                 logger.info("Median polar image statistics:")
                 logger.info("  min:  %d", int(flex.min(sub_data)))
@@ -188,6 +203,7 @@ def __init__(self, experiments, params):
             filter_type=params.modeller.filter_type,
             kernel_size=params.modeller.kernel_size,
             niter=params.modeller.niter,
+            nthreads=params.modeller.nproc,
         )
         self.result = None
 
@@ -11,78 +11,362 @@
 #ifndef DIALS_ALGORITHMS_IMAGE_FILTER_ANISOTROPIC_DIFFUSION_H
 #define DIALS_ALGORITHMS_IMAGE_FILTER_ANISOTROPIC_DIFFUSION_H
 
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
 #include <dials/array_family/scitbx_shared_and_versa.h>
+#include <dials/util/thread_pool.h>
 #include <dials/error.h>
 
 namespace dials { namespace algorithms {
 
+  namespace detail {
+
+    /**
+     * Anisotropic diffusion over cache sized tiles.
+     *
+     * The iterations are done in blocks. For each block, each tile is copied
+     * into a local buffer together with a halo as wide as the number of
+     * iterations in the block, and all the iterations in the block are done
+     * on the local buffer. The pixels on the edge of the buffer are never
+     * updated, so after n iterations only the pixels within n of the edge of
+     * the buffer are wrong, which is exactly the halo. The tile is then copied
+     * into the output. Each pixel is updated with the same arithmetic as a
+     * full image iteration, so the result is identical. The tiles are
+     * processed in parallel and the threads are only synchronised at the end
+     * of each block.
+     */
+    class AnisotropicDiffusionFilter {
+    public:
+      /**
+       * @param data The image
+       * @param mask The mask (or null for no mask)
+       * @param niter The number of iterations
+       * @param kappa The diffusion parameter
+       * @param gamma The step for each iteration
+       */
+      AnisotropicDiffusionFilter(const af::const_ref<double, af::c_grid<2> > &data,
+                                 const bool *mask,
+                                 std::size_t niter,
+                                 double kappa,
+                                 double gamma)
+          : data_(data),
+            mask_(mask),
+            niter_(niter),
+            kappa_inv2_(1.0 / (kappa * kappa)),
+            gamma_(gamma),
+            height_(data.accessor()[0]),
+            width_(data.accessor()[1]) {
+        DIALS_ASSERT(niter > 0);
+        DIALS_ASSERT(kappa > 0);
+        DIALS_ASSERT(gamma > 0);
+        DIALS_ASSERT(height_ > 0 && width_ > 0);
+      }
+
+      /**
+       * Filter the image
+       * @param result The filtered image
+       * @param nthreads The number of threads
+       */
+      void operator()(af::ref<double, af::c_grid<2> > result,
+                      std::size_t nthreads) const {
+        DIALS_ASSERT(nthreads > 0);
+        DIALS_ASSERT(result.accessor().all_eq(data_.accessor()));
+        DIALS_ASSERT(result.end() <= data_.begin() || result.begin() >= data_.end());
+
+        // The tiles of the image
+        std::vector<tile> tiles;
+        for (int y0 = 0; y0 < height_; y0 += tile_size) {
+          for (int x0 = 0; x0 < width_; x0 += tile_size) {
+            tile t;
+            t.filter = this;
+            t.src = 0;
+            t.dst = 0;
+            t.niter = 0;
+            t.y0 = y0;
+            t.y1 = std::min(y0 + tile_size, height_);
+            t.x0 = x0;
+            t.x1 = std::min(x0 + tile_size, width_);
+            tiles.push_back(t);
+          }
+        }
+
+        // The blocks alternate between the result and a scratch image so
+        // that the last block writes into the result. The scratch image is
+        // only needed if there is more than one block.
+        std::size_t nblocks = (niter_ + block_size - 1) / block_size;
+        std::vector<double> scratch;
+        if (nblocks > 1) {
+          scratch.resize(result.size());
+        }
+        const double *src = data_.begin();
+        std::size_t remaining = niter_;
+        std::size_t nworkers = std::min(nthreads, tiles.size());
+        dials::util::ThreadPool pool(nworkers > 1 ? nworkers : 0);
+        for (std::size_t b = 0; b < nblocks; ++b) {
+          double *dst = ((nblocks - 1 - b) % 2 == 0) ? result.begin() : &scratch[0];
+          int n = std::min(remaining, (std::size_t)block_size);
+          remaining -= n;
+          for (std::size_t i = 0; i < tiles.size(); ++i) {
+            tiles[i].src = src;
+            tiles[i].dst = dst;
+            tiles[i].niter = n;
+          }
+          if (nworkers <= 1) {
+            for (std::size_t i = 0; i < tiles.size(); ++i) {
+              tiles[i]();
+            }
+          } else {
+            for (std::size_t i = 0; i < tiles.size(); ++i) {
+              pool.post(tile_runner(&tiles[i]));
+            }
+            pool.wait();
+          }
+          for (std::size_t i = 0; i < tiles.size(); ++i) {
+            if (!tiles[i].error.empty()) {
+              throw DIALS_ERROR(tiles[i].error);
+            }
+          }
+          src = dst;
+        }
+      }
+
+    private:
+      /**
+       * The size of the tiles and the number of iterations in each block. The
+       * tile buffers are (tile_size + 2 * block_size)^2 doubles.
+       */
+      static const int tile_size = 128;
+      static const std::size_t block_size = 8;
+
+      /**
+       * A tile of the image processed by one thread
+       */
+      struct tile {
+        const AnisotropicDiffusionFilter *filter;
+        const double *src;
+        double *dst;
+        int niter;
+        int y0;
+        int y1;
+        int x0;
+        int x1;
+        std::string error;
+
+        void operator()() {
+          try {
+            filter->process(*this);
+          } catch (const std::exception &e) {
+            error = e.what();
+          } catch (...) {
+            error = "Unknown error in anisotropic diffusion";
+          }
+        }
+      };
+
+      struct tile_runner {
+        tile *t;
+        tile_runner(tile *t_) : t(t_) {}
+        void operator()() const {
+          (*t)();
+        }
+      };
+
+      /**
+       * Do the iterations in the block for a single tile
+       */
+      void process(const tile &t) const {
+        // The tile with its halo
+        int ya = std::max(0, t.y0 - t.niter);
+        int yb = std::min(height_, t.y1 + t.niter);
+        int xa = std::max(0, t.x0 - t.niter);
+        int xb = std::min(width_, t.x1 + t.niter);
+        int h = yb - ya;
+        int w = xb - xa;
+
+        // Copy into both local buffers so the edges are set in both
+        std::vector<double> A(h * w);
+        for (int j = 0; j < h; ++j) {
+          const double *row = t.src + (ya + j) * width_ + xa;
+          std::copy(row, row + w, &A[j * w]);
+        }
+        std::vector<double> B(A);
+
+        // Iterate
+        for (int iter = 0; iter < t.niter; ++iter) {
+          if (mask_ == 0) {
+            step(&A[0], &B[0], h, w);
+          } else {
+            masked_step(&A[0], &B[0], ya, xa, h, w);
+          }
+          A.swap(B);
+        }
+
+        // Copy the tile into the output
+        for (int j = t.y0; j < t.y1; ++j) {
+          const double *row = &A[(j - ya) * w + (t.x0 - xa)];
+          std::copy(row, row + (t.x1 - t.x0), t.dst + j * width_ + t.x0);
+        }
+      }
+
+      /**
+       * Do one iteration over the interior of a buffer
+       */
+      void step(const double *A, double *B, int h, int w) const {
+        for (int j = 1; j < h - 1; ++j) {
+          const double *AN = A + (j - 1) * w;
+          const double *AP = A + j * w;
+          const double *AS = A + (j + 1) * w;
+          double *BP = B + j * w;
+          for (int i = 1; i < w - 1; ++i) {
+            // Gradients
+            double DN = AP[i] - AN[i];
+            double DE = AP[i] - AP[i - 1];
+            double DS = AS[i] - AP[i];
+            double DW = AP[i + 1] - AP[i];
+
+            // Diffusion stuff
+            double CN = 1.0 / (1.0 + (DN * DN * kappa_inv2_));
+            double CE = 1.0 / (1.0 + (DE * DE * kappa_inv2_));
+            double CS = 1.0 / (1.0 + (DS * DS * kappa_inv2_));
+            double CW = 1.0 / (1.0 + (DW * DW * kappa_inv2_));
+
+            // Components
+            double N = CN * DN;
+            double E = CE * DE;
+            double S = CS * DS;
+            double W = CW * DW;
+
+            // Update image
+            BP[i] = AP[i] + gamma_ * (S - N + W - E);
+          }
+        }
+      }
+
+      /**
+       * Do one iteration over the interior of a buffer with a mask. The
+       * masked pixels are not updated and do not contribute to the gradients.
+       */
+      void masked_step(const double *A, double *B, int ya, int xa, int h, int w)
+        const {
+        for (int j = 1; j < h - 1; ++j) {
+          const double *AN = A + (j - 1) * w;
+          const double *AP = A + j * w;
+          const double *AS = A + (j + 1) * w;
+          const bool *MN = mask_ + (ya + j - 1) * width_ + xa;
+          const bool *MP = mask_ + (ya + j) * width_ + xa;
+          const bool *MS = mask_ + (ya + j + 1) * width_ + xa;
+          double *BP = B + j * w;
+          for (int i = 1; i < w - 1; ++i) {
+            if (!MP[i]) {
+              BP[i] = AP[i];
+              continue;
+            }
+
+            // Points
+            double P = AP[i];
+            double PN = MN[i] ? AN[i] : P;
+            double PS = MS[i] ? AS[i] : P;
+            double PE = MP[i - 1] ? AP[i - 1] : P;
+            double PW = MP[i + 1] ? AP[i + 1] : P;
+
+            // Gradients
+            double DN = P - PN;
+            double DE = P - PE;
+            double DS = PS - P;
+            double DW = PW - P;
+
+            // Diffusion stuff
+            double CN = 1.0 / (1.0 + (DN * DN * kappa_inv2_));
+            double CE = 1.0 / (1.0 + (DE * DE * kappa_inv2_));
+            double CS = 1.0 / (1.0 + (DS * DS * kappa_inv2_));
+            double CW = 1.0 / (1.0 + (DW * DW * kappa_inv2_));
+
+            // Components
+            double N = CN * DN;
+            double E = CE * DE;
+            double S = CS * DS;
+            double W = CW * DW;
+
+            // Update image
+            BP[i] = P + gamma_ * (S - N + W - E);
+          }
+        }
+      }
+
+      af::const_ref<double, af::c_grid<2> > data_;
+      const bool *mask_;
+      std::size_t niter_;
+      double kappa_inv2_;
+      double gamma_;
+      int height_;
+      int width_;
+    };
+
+  }  // namespace detail
+
+  /**
+   * Do anisotropic filtering on an image
+   * @param data The image
+   * @param result The filtered image
+   * @param niter The number of iterations
+   * @param kappa The diffusion parameter, small values stop diffusion across edges
+   * @param gamma The step for each iteration (0 < gamma < 1.0)
+   * @param nthreads The number of threads
+   */
+  inline void anisotropic_diffusion(const af::const_ref<double, af::c_grid<2> > &data,
+                                    af::ref<double, af::c_grid<2> > result,
+                                    std::size_t niter,
+                                    double kappa,
+                                    double gamma,
+                                    std::size_t nthreads = 1) {
+    detail::AnisotropicDiffusionFilter(data, 0, niter, kappa, gamma)(result,
+                                                                     nthreads);
+  }
+
   /**
    * Do anisotropic filtering on an image
    * @param data The image
    * @param niter The number of iterations
    * @param kappa The diffusion parameter, small values stop diffusion across edges
    * @param gamma The step for each iteration (0 < gamma < 1.0)
+   * @param nthreads The number of threads
    * @return The filtered image
    */
   inline af::versa<double, af::c_grid<2> > anisotropic_diffusion(
     const af::const_ref<double, af::c_grid<2> > &data,
     std::size_t niter,
     double kappa,
-    double gamma) {
-    // Check input
-    DIALS_ASSERT(niter > 0);
-    DIALS_ASSERT(kappa > 0);
-    DIALS_ASSERT(gamma > 0);
-
-    // Initialise stuff
-    std::size_t height = data.accessor()[0];
-    std::size_t width = data.accessor()[1];
-    af::versa<double, af::c_grid<2> > AA(data.accessor());
-    af::versa<double, af::c_grid<2> > BB(data.accessor(), 0);
-    af::ref<double, af::c_grid<2> > A = AA.ref();
-    af::ref<double, af::c_grid<2> > B = BB.ref();
-    std::copy(data.begin(), data.end(), A.begin());
-
-    // Compute inv of kappa
-    double kappa_inv2 = 1.0 / (kappa * kappa);
-
-    // Iterate
-    for (std::size_t iter = 0; iter < niter; ++iter) {
-      for (std::size_t j = 1; j < height - 1; ++j) {
-        for (std::size_t i = 1; i < width - 1; ++i) {
-          // Gradients
-          double DN = A(j, i) - A(j - 1, i);
-          double DE = A(j, i) - A(j, i - 1);
-          double DS = A(j + 1, i) - A(j, i);
-          double DW = A(j, i + 1) - A(j, i);
-
-          // Diffusion stuff
-          // double CN = std::exp(-(DN*DN*kappa_inv2));
-          // double CE = std::exp(-(DE*DE*kappa_inv2));
-          // double CS = std::exp(-(DS*DS*kappa_inv2));
-          // double CW = std::exp(-(DW*DW*kappa_inv2));
-          double CN = 1.0 / (1.0 + (DN * DN * kappa_inv2));
-          double CE = 1.0 / (1.0 + (DE * DE * kappa_inv2));
-          double CS = 1.0 / (1.0 + (DS * DS * kappa_inv2));
-          double CW = 1.0 / (1.0 + (DW * DW * kappa_inv2));
-
-          // Components
-          double N = CN * DN;
-          double E = CE * DE;
-          double S = CS * DS;
-          double W = CW * DW;
-
-          // Update image
-          B(j, i) = gamma * (S - N + W - E);
-        }
-      }
-      for (std::size_t i = 0; i < B.size(); ++i) {
-        A[i] += B[i];
-      }
-    }
+    double gamma,
+    std::size_t nthreads = 1) {
+    af::versa<double, af::c_grid<2> > result(data.accessor(),
+                                             af::init_functor_null<double>());
+    anisotropic_diffusion(data, result.ref(), niter, kappa, gamma, nthreads);
+    return result;
+  }
 
-    // Return filtered image
-    return AA;
+  /**
+   * Do anisotropic filtering on an image
+   * @param data The image
+   * @param mask The mask
+   * @param result The filtered image
+   * @param niter The number of iterations
+   * @param kappa The diffusion parameter, small values stop diffusion across edges
+   * @param gamma The step for each iteration (0 < gamma < 1.0)
+   * @param nthreads The number of threads
+   */
+  inline void masked_anisotropic_diffusion(
+    const af::const_ref<double, af::c_grid<2> > &data,
+    const af::const_ref<bool, af::c_grid<2> > &mask,
+    af::ref<double, af::c_grid<2> > result,
+    std::size_t niter,
+    double kappa,
+    double gamma,
+    std::size_t nthreads = 1) {
+    DIALS_ASSERT(mask.accessor().all_eq(data.accessor()));
+    detail::AnisotropicDiffusionFilter(data, mask.begin(), niter, kappa, gamma)(
+      result, nthreads);
   }
 
   /**
@@ -92,6 +376,7 @@ namespace dials { namespace algorithms {
    * @param niter The number of iterations
    * @param kappa The diffusion parameter, small values stop diffusion across edges
    * @param gamma The step for each iteration (0 < gamma < 1.0)
+   * @param nthreads The number of threads
    * @return The filtered image
    */
   inline af::versa<double, af::c_grid<2> > masked_anisotropic_diffusion(
@@ -99,72 +384,13 @@ namespace dials { namespace algorithms {
     const af::const_ref<bool, af::c_grid<2> > &mask,
     std::size_t niter,
     double kappa,
-    double gamma) {
-    // Check input
-    DIALS_ASSERT(niter > 0);
-    DIALS_ASSERT(kappa > 0);
-    DIALS_ASSERT(gamma > 0);
-
-    // Initialise stuff
-    std::size_t height = data.accessor()[0];
-    std::size_t width = data.accessor()[1];
-    af::versa<double, af::c_grid<2> > AA(data.accessor());
-    af::versa<double, af::c_grid<2> > BB(data.accessor(), 0);
-    af::ref<double, af::c_grid<2> > A = AA.ref();
-    af::ref<double, af::c_grid<2> > B = BB.ref();
-    std::copy(data.begin(), data.end(), A.begin());
-
-    // Compute inv of kappa
-    double kappa_inv2 = 1.0 / (kappa * kappa);
-
-    // Iterate
-    for (std::size_t iter = 0; iter < niter; ++iter) {
-      for (std::size_t j = 1; j < height - 1; ++j) {
-        for (std::size_t i = 1; i < width - 1; ++i) {
-          if (mask(j, i)) {
-            // Points
-            double AP = A(j, i);
-            double AN = mask(j - 1, i) ? A(j - 1, i) : AP;
-            double AS = mask(j + 1, i) ? A(j + 1, i) : AP;
-            double AE = mask(j, i - 1) ? A(j, i - 1) : AP;
-            double AW = mask(j, i + 1) ? A(j, i + 1) : AP;
-
-            // Gradients
-            double DN = AP - AN;
-            double DE = AP - AE;
-            double DS = AS - AP;
-            double DW = AW - AP;
-
-            // Diffusion stuff
-            // double CN = std::exp(-(DN*DN*kappa_inv2));
-            // double CE = std::exp(-(DE*DE*kappa_inv2));
-            // double CS = std::exp(-(DS*DS*kappa_inv2));
-            // double CW = std::exp(-(DW*DW*kappa_inv2));
-            double CN = 1.0 / (1.0 + (DN * DN * kappa_inv2));
-            double CE = 1.0 / (1.0 + (DE * DE * kappa_inv2));
-            double CS = 1.0 / (1.0 + (DS * DS * kappa_inv2));
-            double CW = 1.0 / (1.0 + (DW * DW * kappa_inv2));
-
-            // Components
-            double N = CN * DN;
-            double E = CE * DE;
-            double S = CS * DS;
-            double W = CW * DW;
-
-            // Update image
-            B(j, i) = gamma * (S - N + W - E);
-          } else {
-            B(j, i) = 0;
-          }
-        }
-      }
-      for (std::size_t i = 0; i < B.size(); ++i) {
-        A[i] += B[i];
-      }
-    }
-
-    // Return filtered image
-    return AA;
+    double gamma,
+    std::size_t nthreads = 1) {
+    af::versa<double, af::c_grid<2> > result(data.accessor(),
+                                             af::init_functor_null<double>());
+    masked_anisotropic_diffusion(
+      data, mask, result.ref(), niter, kappa, gamma, nthreads);
+    return result;
   }
 
 }}  // namespace dials::algorithms
@@ -17,17 +17,35 @@ namespace dials { namespace algorithms { namespace boost_python {
   using namespace boost::python;
 
   void export_anisotropic_diffusion() {
+    typedef af::versa<double, af::c_grid<2> > result_type;
+    typedef af::const_ref<double, af::c_grid<2> > image_type;
+
+    result_type (*unmasked)(
+      const image_type &, std::size_t, double, double, std::size_t) =
+      &anisotropic_diffusion;
+    result_type (*masked)(const image_type &,
+                          const af::const_ref<bool, af::c_grid<2> > &,
+                          std::size_t,
+                          double,
+                          double,
+                          std::size_t) = &masked_anisotropic_diffusion;
+
     def("anisotropic_diffusion",
-        &anisotropic_diffusion,
-        (arg("data"), arg("niter") = 1, arg("kappa") = 50, arg("gamma") = 0.1));
+        unmasked,
+        (arg("data"),
+         arg("niter") = 1,
+         arg("kappa") = 50,
+         arg("gamma") = 0.1,
+         arg("nthreads") = 1));
 
     def("anisotropic_diffusion",
-        &masked_anisotropic_diffusion,
+        masked,
         (arg("data"),
          arg("mask"),
          arg("niter") = 1,
          arg("kappa") = 50,
-         arg("gamma") = 0.1));
+         arg("gamma") = 0.1,
+         arg("nthreads") = 1));
   }
 
 }}}  // namespace dials::algorithms::boost_python
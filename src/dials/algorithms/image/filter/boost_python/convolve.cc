@@ -18,11 +18,27 @@ namespace dials { namespace algorithms { namespace boost_python {
 
   template <typename FloatType>
   void convolve_suite() {
-    def("convolve", &convolve<FloatType>, (arg("image"), arg("kernel")));
+    typedef af::versa<FloatType, af::c_grid<2> > result_type;
+    typedef af::const_ref<FloatType, af::c_grid<2> > image_type;
 
-    def("convolve_row", &convolve_row<FloatType>, (arg("image"), arg("kernel")));
+    result_type (*convolve_2d)(
+      const image_type &, const image_type &, std::size_t) = &convolve<FloatType>;
+    result_type (*convolve_1d_row)(const image_type &,
+                                   const af::const_ref<FloatType> &,
+                                   std::size_t) = &convolve_row<FloatType>;
+    result_type (*convolve_1d_col)(const image_type &,
+                                   const af::const_ref<FloatType> &,
+                                   std::size_t) = &convolve_col<FloatType>;
 
-    def("convolve_col", &convolve_col<FloatType>, (arg("image"), arg("kernel")));
+    def("convolve", convolve_2d, (arg("image"), arg("kernel"), arg("nthreads") = 1));
+
+    def("convolve_row",
+        convolve_1d_row,
+        (arg("image"), arg("kernel"), arg("nthreads") = 1));
+
+    def("convolve_col",
+        convolve_1d_col,
+        (arg("image"), arg("kernel"), arg("nthreads") = 1));
   }
 
   void export_convolve() {
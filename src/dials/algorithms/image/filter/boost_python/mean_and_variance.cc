@@ -60,12 +60,22 @@ namespace dials { namespace algorithms { namespace boost_python {
     return MeanAndVarianceFilterMasked<FloatType>(image, mask, size, min_size);
   }
 
+  template <typename FloatType>
+  af::versa<FloatType, af::c_grid<2> > make_mean_filter_masked(
+    const af::const_ref<FloatType, af::c_grid<2> > &image,
+    af::ref<int, af::c_grid<2> > mask,
+    int2 size,
+    int min_count,
+    bool ignore_masked) {
+    return mean_filter_masked(image, mask, size, min_count, ignore_masked);
+  }
+
   template <typename FloatType>
   void mean_and_variance_filter_suite() {
     def("mean_filter", &mean_filter<FloatType>, (arg("image"), arg("size")));
 
     def("mean_filter",
-        &mean_filter_masked<FloatType>,
+        &make_mean_filter_masked<FloatType>,
         (arg("image"),
          arg("mask"),
          arg("size"),
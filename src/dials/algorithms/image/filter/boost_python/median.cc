@@ -18,11 +18,17 @@ namespace dials { namespace algorithms { namespace boost_python {
 
   template <typename T>
   void median_filter_suite() {
-    def("median_filter", &median_filter<T>, (arg("image"), arg("kernel")));
+    def("median_filter",
+        &median_filter<T>,
+        (arg("image"), arg("kernel"), arg("nthreads") = 1));
 
     def("median_filter",
         &median_filter_masked<T>,
-        (arg("image"), arg("mask"), arg("kernel"), arg("periodic") = false));
+        (arg("image"),
+         arg("mask"),
+         arg("kernel"),
+         arg("periodic") = false,
+         arg("nthreads") = 1));
   }
 
   void export_median() {
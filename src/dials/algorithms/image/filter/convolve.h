@@ -15,61 +15,403 @@
 
 #include <algorithm>
 #include <cmath>
+#include <exception>
+#include <limits>
+#include <string>
+#include <vector>
 #include <scitbx/array_family/tiny_types.h>
 #include <scitbx/array_family/ref_reductions.h>
 #include <dials/array_family/scitbx_shared_and_versa.h>
+#include <dials/util/thread_pool.h>
 #include <dials/error.h>
 
 namespace dials { namespace algorithms {
 
   using scitbx::af::int2;
 
+  namespace detail {
+
+    /**
+     * A rectangular tile of the output image, [y0, y1) x [x0, x1)
+     */
+    struct convolve_tile {
+      int y0;
+      int y1;
+      int x0;
+      int x1;
+      std::string error;
+    };
+
+    /**
+     * Call the job for a single tile, catching any errors
+     */
+    template <typename Job>
+    struct convolve_tile_runner {
+      const Job *job;
+      convolve_tile *tile;
+      convolve_tile_runner(const Job *job_, convolve_tile *tile_)
+          : job(job_), tile(tile_) {}
+      void operator()() const {
+        try {
+          (*job)(*tile);
+        } catch (const std::exception &e) {
+          tile->error = e.what();
+        } catch (...) {
+          tile->error = "Unknown error in convolution";
+        }
+      }
+    };
+
+    /**
+     * Split the image into tiles and call the job on each tile, in parallel
+     * if requested. Each tile writes only its own part of the output.
+     * @param size The image size
+     * @param tile_size The tile size
+     * @param job The job to call on each tile
+     * @param nthreads The number of threads
+     */
+    template <typename Job>
+    void for_each_tile(int2 size,
+                       int2 tile_size,
+                       const Job &job,
+                       std::size_t nthreads) {
+      DIALS_ASSERT(nthreads > 0);
+      DIALS_ASSERT(tile_size.all_gt(0));
+      std::vector<convolve_tile> tiles;
+      for (int y0 = 0; y0 < size[0]; y0 += tile_size[0]) {
+        for (int x0 = 0; x0 < size[1]; x0 += tile_size[1]) {
+          convolve_tile tile;
+          tile.y0 = y0;
+          tile.y1 = std::min(y0 + tile_size[0], size[0]);
+          tile.x0 = x0;
+          tile.x1 = std::min(x0 + tile_size[1], size[1]);
+          tiles.push_back(tile);
+        }
+      }
+      if (nthreads == 1 || tiles.size() <= 1) {
+        for (std::size_t i = 0; i < tiles.size(); ++i) {
+          convolve_tile_runner<Job>(&job, &tiles[i])();
+        }
+      } else {
+        dials::util::ThreadPool pool(std::min(nthreads, tiles.size()));
+        for (std::size_t i = 0; i < tiles.size(); ++i) {
+          pool.post(convolve_tile_runner<Job>(&job, &tiles[i]));
+        }
+        pool.wait();
+      }
+      for (std::size_t i = 0; i < tiles.size(); ++i) {
+        if (!tiles[i].error.empty()) {
+          throw DIALS_ERROR(tiles[i].error);
+        }
+      }
+    }
+
+    /**
+     * Clamp the index into the range [0, n)
+     */
+    inline int clamp_index(int index, int n) {
+      return index < 0 ? 0 : (index >= n ? n - 1 : index);
+    }
+
+    /**
+     * Accumulate the convolution of a row with a 1D kernel into the output
+     * for the pixels [x0, x1). The pixels beyond the edge of the row are
+     * given the value of the edge pixel. The pixels which need no clamping
+     * are done in a separate contiguous loop which the compiler can
+     * vectorise. The terms are summed in kernel order so the result is
+     * identical to summing each pixel in turn.
+     * @param row The image row
+     * @param width The width of the row
+     * @param kernel The kernel
+     * @param ksize The size of the kernel
+     * @param x0 The first pixel
+     * @param x1 The last pixel
+     * @param result The output for pixels [x0, x1)
+     */
+    template <typename FloatType>
+    void accumulate_row(const FloatType *row,
+                        int width,
+                        const FloatType *kernel,
+                        int ksize,
+                        int x0,
+                        int x1,
+                        FloatType *result) {
+      int mid = ksize / 2;
+      FloatType first = row[0];
+      FloatType last = row[width - 1];
+      for (int k = 0; k < ksize; ++k) {
+        int d = k - mid;
+        int i0 = std::min(std::max(x0, -d), x1);
+        int i1 = std::max(std::min(x1, width - d), i0);
+        FloatType w = kernel[k];
+        FloatType *r = result - x0;
+        for (int i = x0; i < i0; ++i) {
+          r[i] += first * w;
+        }
+        for (int i = i0; i < i1; ++i) {
+          r[i] += row[i + d] * w;
+        }
+        for (int i = i1; i < x1; ++i) {
+          r[i] += last * w;
+        }
+      }
+    }
+
+    /**
+     * Accumulate a scaled row into the output
+     */
+    template <typename FloatType>
+    void accumulate_scaled(const FloatType *row,
+                           FloatType w,
+                           int n,
+                           FloatType *result) {
+      for (int i = 0; i < n; ++i) {
+        result[i] += row[i] * w;
+      }
+    }
+
+    /**
+     * Convolve the rows of a tile with a 1D kernel
+     */
+    template <typename FloatType>
+    struct convolve_row_job {
+      af::const_ref<FloatType, af::c_grid<2> > image;
+      af::const_ref<FloatType> kernel;
+      FloatType *result;
+
+      void operator()(const convolve_tile &t) const {
+        int width = image.accessor()[1];
+        for (int j = t.y0; j < t.y1; ++j) {
+          FloatType *r = result + j * width + t.x0;
+          std::fill(r, r + (t.x1 - t.x0), FloatType(0));
+          accumulate_row(&image(j, 0),
+                         width,
+                         kernel.begin(),
+                         (int)kernel.size(),
+                         t.x0,
+                         t.x1,
+                         r);
+        }
+      }
+    };
+
+    /**
+     * Convolve the columns of a tile with a 1D kernel. Each output row is
+     * accumulated from whole input rows so memory access is contiguous.
+     */
+    template <typename FloatType>
+    struct convolve_col_job {
+      af::const_ref<FloatType, af::c_grid<2> > image;
+      af::const_ref<FloatType> kernel;
+      FloatType *result;
+
+      void operator()(const convolve_tile &t) const {
+        int height = image.accessor()[0];
+        int width = image.accessor()[1];
+        int ksize = kernel.size();
+        int mid = ksize / 2;
+        int n = t.x1 - t.x0;
+        for (int j = t.y0; j < t.y1; ++j) {
+          FloatType *r = result + j * width + t.x0;
+          std::fill(r, r + n, FloatType(0));
+          for (int k = 0; k < ksize; ++k) {
+            int jj = clamp_index(j + k - mid, height);
+            accumulate_scaled(&image(jj, t.x0), kernel[k], n, r);
+          }
+        }
+      }
+    };
+
+    /**
+     * Convolve a tile with a 2D kernel
+     */
+    template <typename FloatType>
+    struct convolve_2d_job {
+      af::const_ref<FloatType, af::c_grid<2> > image;
+      af::const_ref<FloatType, af::c_grid<2> > kernel;
+      FloatType *result;
+
+      void operator()(const convolve_tile &t) const {
+        int height = image.accessor()[0];
+        int width = image.accessor()[1];
+        int ksize0 = kernel.accessor()[0];
+        int ksize1 = kernel.accessor()[1];
+        int mid = ksize0 / 2;
+        for (int j = t.y0; j < t.y1; ++j) {
+          FloatType *r = result + j * width + t.x0;
+          std::fill(r, r + (t.x1 - t.x0), FloatType(0));
+          for (int k = 0; k < ksize0; ++k) {
+            int jj = clamp_index(j + k - mid, height);
+            accumulate_row(
+              &image(jj, 0), width, &kernel(k, 0), ksize1, t.x0, t.x1, r);
+          }
+        }
+      }
+    };
+
+    /**
+     * Convolve a tile with a separable 2D kernel. The row kernel is applied
+     * to the rows of the tile and its halo in a buffer local to the tile and
+     * the column kernel is then applied to the buffer, so no temporary image
+     * is needed.
+     */
+    template <typename FloatType>
+    struct convolve_separable_job {
+      af::const_ref<FloatType, af::c_grid<2> > image;
+      const std::vector<FloatType> *row_kernel;
+      const std::vector<FloatType> *col_kernel;
+      FloatType *result;
+
+      void operator()(const convolve_tile &t) const {
+        int height = image.accessor()[0];
+        int width = image.accessor()[1];
+        int ksize = col_kernel->size();
+        int mid = ksize / 2;
+        int n = t.x1 - t.x0;
+
+        // Apply the row kernel to all the rows needed by the tile
+        int ya = std::max(0, t.y0 - mid);
+        int yb = std::min(height, t.y1 + mid);
+        std::vector<FloatType> buffer((yb - ya) * n, FloatType(0));
+        for (int j = ya; j < yb; ++j) {
+          accumulate_row(&image(j, 0),
+                         width,
+                         &(*row_kernel)[0],
+                         (int)row_kernel->size(),
+                         t.x0,
+                         t.x1,
+                         &buffer[(j - ya) * n]);
+        }
+
+        // Apply the column kernel to the buffer
+        for (int j = t.y0; j < t.y1; ++j) {
+          FloatType *r = result + j * width + t.x0;
+          std::fill(r, r + n, FloatType(0));
+          for (int k = 0; k < ksize; ++k) {
+            int jj = clamp_index(j + k - mid, height);
+            accumulate_scaled(&buffer[(jj - ya) * n], (*col_kernel)[k], n, r);
+          }
+        }
+      }
+    };
+
+    /**
+     * Check if a 2D kernel is the outer product of a column and a row
+     * kernel, to within rounding error, and if so compute the two kernels.
+     * @param kernel The 2D kernel
+     * @param row_kernel The row kernel
+     * @param col_kernel The column kernel
+     * @returns True if the kernel is separable
+     */
+    template <typename FloatType>
+    bool separate_kernel(const af::const_ref<FloatType, af::c_grid<2> > &kernel,
+                         std::vector<FloatType> &row_kernel,
+                         std::vector<FloatType> &col_kernel) {
+      int2 ksz = kernel.accessor();
+      std::size_t pivot = 0;
+      for (std::size_t i = 1; i < kernel.size(); ++i) {
+        if (std::abs(kernel[i]) > std::abs(kernel[pivot])) {
+          pivot = i;
+        }
+      }
+      FloatType kmax = kernel[pivot];
+      if (kmax == 0) {
+        return false;
+      }
+      int p = pivot / ksz[1];
+      int q = pivot % ksz[1];
+      row_kernel.resize(ksz[1]);
+      col_kernel.resize(ksz[0]);
+      for (int i = 0; i < ksz[1]; ++i) {
+        row_kernel[i] = kernel(p, i);
+      }
+      for (int j = 0; j < ksz[0]; ++j) {
+        col_kernel[j] = kernel(j, q) / kmax;
+      }
+      FloatType tolerance =
+        16 * std::numeric_limits<FloatType>::epsilon() * std::abs(kmax);
+      for (int j = 0; j < ksz[0]; ++j) {
+        for (int i = 0; i < ksz[1]; ++i) {
+          if (std::abs(kernel(j, i) - col_kernel[j] * row_kernel[i]) > tolerance) {
+            return false;
+          }
+        }
+      }
+      return true;
+    }
+
+    /**
+     * The size of the output tiles. Each tile is a short band of rows so
+     * that the rows needed by a tile stay in cache.
+     */
+    inline int2 convolve_tile_size() {
+      return int2(32, 512);
+    }
+
+    /**
+     * Check the output does not overlap the input
+     */
+    template <typename FloatType>
+    void check_convolve_output(const af::const_ref<FloatType, af::c_grid<2> > &image,
+                               const af::ref<FloatType, af::c_grid<2> > &result) {
+      DIALS_ASSERT(image.accessor().all_gt(0));
+      DIALS_ASSERT(result.accessor().all_eq(image.accessor()));
+      DIALS_ASSERT(result.end() <= image.begin() || result.begin() >= image.end());
+    }
+
+  }  // namespace detail
+
   /**
-   * Perform a simple convolution between an image and kernel
+   * Perform a simple convolution between an image and kernel. Pixels beyond
+   * the edge of the image are given the value of the nearest edge pixel. If
+   * the kernel is separable, it is applied as a row pass followed by a column
+   * pass, in which case the result agrees with the direct convolution to
+   * within rounding error.
    * @param image The image to filter
    * @param kernel The kernel to convolve with
-   * @returns The convolved image
+   * @param result The convolved image
+   * @param nthreads The number of threads
    */
   template <typename FloatType>
-  af::versa<FloatType, af::c_grid<2> > convolve(
-    const af::const_ref<FloatType, af::c_grid<2> > &image,
-    const af::const_ref<FloatType, af::c_grid<2> > &kernel) {
+  void convolve(const af::const_ref<FloatType, af::c_grid<2> > &image,
+                const af::const_ref<FloatType, af::c_grid<2> > &kernel,
+                af::ref<FloatType, af::c_grid<2> > result,
+                std::size_t nthreads = 1) {
     // Only allow odd-sized kernel sizes
     DIALS_ASSERT(kernel.accessor()[0] & 1);
     DIALS_ASSERT(kernel.accessor()[1] & 1);
-
-    // The image sizes and mid-point
-    int2 isz = image.accessor();
-    int2 ksz = kernel.accessor();
-    int2 mid(ksz[0] / 2, ksz[1] / 2);
-
-    // Create the output
-    af::versa<FloatType, af::c_grid<2> > result(image.accessor(),
-                                                af::init_functor_null<FloatType>());
+    detail::check_convolve_output(image, result);
 
     // Convolve the image with the kernel
-    for (int j = 0; j < isz[0]; ++j) {
-      for (int i = 0; i < isz[1]; ++i) {
-        result(j, i) = 0.0;
-        for (int jj = 0; jj < ksz[0]; ++jj) {
-          for (int ii = 0; ii < ksz[1]; ++ii) {
-            int jjj = j + jj - mid[0];
-            int iii = i + ii - mid[1];
-            if (jjj < 0)
-              jjj = 0;
-            else if (jjj >= isz[0])
-              jjj = isz[0] - 1;
-            if (iii < 0)
-              iii = 0;
-            else if (iii >= isz[1])
-              iii = isz[1] - 1;
-            result(j, i) += image(jjj, iii) * kernel(jj, ii);
-          }
-        }
-      }
+    std::vector<FloatType> row_kernel;
+    std::vector<FloatType> col_kernel;
+    if (detail::separate_kernel(kernel, row_kernel, col_kernel)) {
+      detail::convolve_separable_job<FloatType> job = {
+        image, &row_kernel, &col_kernel, result.begin()};
+      detail::for_each_tile(
+        image.accessor(), detail::convolve_tile_size(), job, nthreads);
+    } else {
+      detail::convolve_2d_job<FloatType> job = {image, kernel, result.begin()};
+      detail::for_each_tile(
+        image.accessor(), detail::convolve_tile_size(), job, nthreads);
     }
+  }
 
-    // Return the result
+  /**
+   * Perform a simple convolution between an image and kernel
+   * @param image The image to filter
+   * @param kernel The kernel to convolve with
+   * @param nthreads The number of threads
+   * @returns The convolved image
+   */
+  template <typename FloatType>
+  af::versa<FloatType, af::c_grid<2> > convolve(
+    const af::const_ref<FloatType, af::c_grid<2> > &image,
+    const af::const_ref<FloatType, af::c_grid<2> > &kernel,
+    std::size_t nthreads = 1) {
+    af::versa<FloatType, af::c_grid<2> > result(image.accessor(),
+                                                af::init_functor_null<FloatType>());
+    convolve(image, kernel, result.ref(), nthreads);
     return result;
   }
 
@@ -77,40 +419,39 @@ namespace dials { namespace algorithms {
    * Perform a separable row convolution between an image and kernel
    * @param image The image to filter
    * @param kernel The kernel to convolve with
-   * @returns The convolved image
+   * @param result The convolved image
+   * @param nthreads The number of threads
    */
   template <typename FloatType>
-  af::versa<FloatType, af::c_grid<2> > convolve_row(
-    const af::const_ref<FloatType, af::c_grid<2> > &image,
-    const af::const_ref<FloatType> &kernel) {
+  void convolve_row(const af::const_ref<FloatType, af::c_grid<2> > &image,
+                    const af::const_ref<FloatType> &kernel,
+                    af::ref<FloatType, af::c_grid<2> > result,
+                    std::size_t nthreads = 1) {
     // Only allow odd-sized kernel sizes
     DIALS_ASSERT(kernel.size() & 1);
+    detail::check_convolve_output(image, result);
 
-    // The image sizes and mid-point
-    int2 isz = image.accessor();
-    std::size_t ksz = kernel.size();
-    std::size_t mid = ksz / 2;
+    // Convolve the image with the kernel
+    detail::convolve_row_job<FloatType> job = {image, kernel, result.begin()};
+    detail::for_each_tile(
+      image.accessor(), detail::convolve_tile_size(), job, nthreads);
+  }
 
-    // Create the output
+  /**
+   * Perform a separable row convolution between an image and kernel
+   * @param image The image to filter
+   * @param kernel The kernel to convolve with
+   * @param nthreads The number of threads
+   * @returns The convolved image
+   */
+  template <typename FloatType>
+  af::versa<FloatType, af::c_grid<2> > convolve_row(
+    const af::const_ref<FloatType, af::c_grid<2> > &image,
+    const af::const_ref<FloatType> &kernel,
+    std::size_t nthreads = 1) {
     af::versa<FloatType, af::c_grid<2> > result(image.accessor(),
                                                 af::init_functor_null<FloatType>());
-
-    // Convolve the image with the kernel
-    for (int j = 0; j < isz[0]; ++j) {
-      for (int i = 0; i < isz[1]; ++i) {
-        result(j, i) = 0.0;
-        for (int ii = 0; ii < ksz; ++ii) {
-          int iii = i + ii - mid;
-          if (iii < 0)
-            iii = 0;
-          else if (iii >= isz[1])
-            iii = isz[1] - 1;
-          result(j, i) += image(j, iii) * kernel[ii];
-        }
-      }
-    }
-
-    // Return the result
+    convolve_row(image, kernel, result.ref(), nthreads);
     return result;
   }
 
@@ -118,40 +459,39 @@ namespace dials { namespace algorithms {
    * Perform a separable column convolution between an image and kernel
    * @param image The image to filter
    * @param kernel The kernel to convolve with
-   * @returns The convolved image
+   * @param result The convolved image
+   * @param nthreads The number of threads
    */
   template <typename FloatType>
-  af::versa<FloatType, af::c_grid<2> > convolve_col(
-    const af::const_ref<FloatType, af::c_grid<2> > &image,
-    const af::const_ref<FloatType> &kernel) {
+  void convolve_col(const af::const_ref<FloatType, af::c_grid<2> > &image,
+                    const af::const_ref<FloatType> &kernel,
+                    af::ref<FloatType, af::c_grid<2> > result,
+                    std::size_t nthreads = 1) {
     // Only allow odd-sized kernel sizes
     DIALS_ASSERT(kernel.size() & 1);
+    detail::check_convolve_output(image, result);
 
-    // The image sizes and mid-point
-    int2 isz = image.accessor();
-    std::size_t ksz = kernel.size();
-    std::size_t mid = ksz / 2;
+    // Convolve the image with the kernel
+    detail::convolve_col_job<FloatType> job = {image, kernel, result.begin()};
+    detail::for_each_tile(
+      image.accessor(), detail::convolve_tile_size(), job, nthreads);
+  }
 
-    // Create the output
+  /**
+   * Perform a separable column convolution between an image and kernel
+   * @param image The image to filter
+   * @param kernel The kernel to convolve with
+   * @param nthreads The number of threads
+   * @returns The convolved image
+   */
+  template <typename FloatType>
+  af::versa<FloatType, af::c_grid<2> > convolve_col(
+    const af::const_ref<FloatType, af::c_grid<2> > &image,
+    const af::const_ref<FloatType> &kernel,
+    std::size_t nthreads = 1) {
     af::versa<FloatType, af::c_grid<2> > result(image.accessor(),
                                                 af::init_functor_null<FloatType>());
-
-    // Convolve the image with the kernel
-    for (int j = 0; j < isz[0]; ++j) {
-      for (int i = 0; i < isz[1]; ++i) {
-        result(j, i) = 0.0;
-        for (int jj = 0; jj < ksz; ++jj) {
-          int jjj = j + jj - mid;
-          if (jjj < 0)
-            jjj = 0;
-          else if (jjj >= isz[0])
-            jjj = isz[0] - 1;
-          result(j, i) += image(jjj, i) * kernel[jj];
-        }
-      }
-    }
-
-    // Return the result
+    convolve_col(image, kernel, result.ref(), nthreads);
     return result;
   }
 
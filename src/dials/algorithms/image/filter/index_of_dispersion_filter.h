@@ -109,23 +109,25 @@ namespace dials { namespace algorithms {
                                   const af::const_ref<int, af::c_grid<2> > &mask,
                                   int2 size,
                                   int min_count) {
-      // Get the mean and variance maps
-      MeanAndVarianceFilterMasked<FloatType> filter(image, mask, size, min_count);
-      mean_ = filter.mean();
-      var_ = filter.sample_variance();
-      mask_ = filter.mask();
-      count_ = filter.count();
+      SummedAreaWorkspace workspace;
+      init(workspace, image, mask, size, min_count);
+    }
 
-      // Calculate the filtered image.
-      index_of_dispersion_ = af::versa<FloatType, af::c_grid<2> >(var_.accessor(), 0);
-      for (std::size_t i = 0; i < var_.size(); ++i) {
-        if (mask_[i] && mean_[i] > 0) {
-          index_of_dispersion_[i] = var_[i] / mean_[i];
-        } else {
-          index_of_dispersion_[i] = 1.0;
-          mask_[i] = 0;
-        }
-      }
+    /**
+     * Calculate the masked index of dispersion filtered image reusing the
+     * workspace.
+     * @param workspace The workspace
+     * @param image The image to filter
+     * @param mask The mask to use
+     * @param size Size of the filter kernel (2 * size + 1)
+     * @param min_count The minimum counts under the filter to include the pixel
+     */
+    IndexOfDispersionFilterMasked(SummedAreaWorkspace &workspace,
+                                  const af::const_ref<FloatType, af::c_grid<2> > &image,
+                                  const af::const_ref<int, af::c_grid<2> > &mask,
+                                  int2 size,
+                                  int min_count) {
+      init(workspace, image, mask, size, min_count);
     }
 
     /**
@@ -164,6 +166,97 @@ namespace dials { namespace algorithms {
     }
 
   private:
+    /**
+     * Compute the count, mean, sample variance and index of dispersion from
+     * the box sums in a single pass and update the mask
+     */
+    struct visitor {
+      af::const_ref<FloatType, af::c_grid<2> > image;
+      af::const_ref<int, af::c_grid<2> > mask_in;
+      af::ref<int, af::c_grid<2> > mask;
+      af::ref<int, af::c_grid<2> > count;
+      af::ref<FloatType, af::c_grid<2> > mean;
+      af::ref<FloatType, af::c_grid<2> > var;
+      af::ref<FloatType, af::c_grid<2> > index_of_dispersion;
+      int min_count;
+
+      visitor(af::const_ref<FloatType, af::c_grid<2> > image_,
+              af::const_ref<int, af::c_grid<2> > mask_in_,
+              af::ref<int, af::c_grid<2> > mask_,
+              af::ref<int, af::c_grid<2> > count_,
+              af::ref<FloatType, af::c_grid<2> > mean_,
+              af::ref<FloatType, af::c_grid<2> > var_,
+              af::ref<FloatType, af::c_grid<2> > index_of_dispersion_,
+              int min_count_)
+          : image(image_),
+            mask_in(mask_in_),
+            mask(mask_),
+            count(count_),
+            mean(mean_),
+            var(var_),
+            index_of_dispersion(index_of_dispersion_),
+            min_count(min_count_) {}
+
+      void operator()(std::size_t k, int m, double x, double y) const {
+        const FloatType BIG = (1 << 24);  // About 1.6m counts
+        count[k] = m;
+        mean[k] = 0;
+        var[k] = 0;
+        index_of_dispersion[k] = 1.0;
+        mask[k] = 0;
+        if (mask_in[k] && image[k] < BIG && m >= min_count) {
+          FloatType s = x;
+          FloatType s2 = y;
+          mean[k] = s / m;
+          var[k] = (s2 - (s * s / m)) / (m - 1);
+          if (mean[k] > 0) {
+            index_of_dispersion[k] = var[k] / mean[k];
+            mask[k] = 1;
+          }
+        }
+      }
+    };
+
+    void init(SummedAreaWorkspace &workspace,
+              const af::const_ref<FloatType, af::c_grid<2> > &image,
+              const af::const_ref<int, af::c_grid<2> > &mask,
+              int2 size,
+              int min_count) {
+      // Check the input is valid
+      DIALS_ASSERT(size.all_gt(0));
+      DIALS_ASSERT(image.accessor().all_gt(0));
+      DIALS_ASSERT(image.accessor().all_eq(mask.accessor()));
+
+      // Ensure the min counts are valid
+      if (min_count <= 0) {
+        min_count = (2 * size[0] + 1) * (2 * size[1] + 1);
+      } else {
+        DIALS_ASSERT(min_count <= (2 * size[0] + 1) * (2 * size[1] + 1)
+                     && min_count > 1);
+      }
+
+      // Calculate the filtered images
+      af::c_grid<2> grid = image.accessor();
+      count_ = af::versa<int, af::c_grid<2> >(grid, af::init_functor_null<int>());
+      mask_ = af::versa<int, af::c_grid<2> >(grid, af::init_functor_null<int>());
+      mean_ =
+        af::versa<FloatType, af::c_grid<2> >(grid, af::init_functor_null<FloatType>());
+      var_ =
+        af::versa<FloatType, af::c_grid<2> >(grid, af::init_functor_null<FloatType>());
+      index_of_dispersion_ =
+        af::versa<FloatType, af::c_grid<2> >(grid, af::init_functor_null<FloatType>());
+      workspace.compute(image, mask);
+      visitor visit(image,
+                    mask,
+                    mask_.ref(),
+                    count_.ref(),
+                    mean_.ref(),
+                    var_.ref(),
+                    index_of_dispersion_.ref(),
+                    min_count);
+      workspace.apply(size, visit);
+    }
+
     af::versa<int, af::c_grid<2> > count_;
     af::versa<int, af::c_grid<2> > mask_;
     af::versa<FloatType, af::c_grid<2> > index_of_dispersion_;
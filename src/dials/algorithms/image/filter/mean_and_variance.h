@@ -22,6 +22,74 @@ namespace dials { namespace algorithms {
 
   using scitbx::af::int2;
 
+  namespace detail {
+
+    /**
+     * Compute the masked mean from the box sums and update the mask
+     */
+    template <typename FloatType>
+    struct mean_filter_visitor {
+      af::ref<int, af::c_grid<2> > mask;
+      af::ref<FloatType, af::c_grid<2> > mean;
+      int min_count;
+      bool ignore_masked;
+
+      mean_filter_visitor(af::ref<int, af::c_grid<2> > mask_,
+                          af::ref<FloatType, af::c_grid<2> > mean_,
+                          int min_count_,
+                          bool ignore_masked_)
+          : mask(mask_),
+            mean(mean_),
+            min_count(min_count_),
+            ignore_masked(ignore_masked_) {}
+
+      void operator()(std::size_t k, int m, double x, double) const {
+        bool valid = m >= min_count;
+        mask[k] *= valid;
+        mean[k] = ((!ignore_masked || mask[k]) && valid) ? x / m : 0.0;
+      }
+    };
+
+    /**
+     * Store the masked box sums and update the mask. Pixels above the
+     * maximum value are excluded from the mask but kept in the sums.
+     */
+    template <typename FloatType>
+    struct mean_and_variance_visitor {
+      af::const_ref<FloatType, af::c_grid<2> > image;
+      af::const_ref<int, af::c_grid<2> > mask_in;
+      af::ref<int, af::c_grid<2> > mask;
+      af::ref<int, af::c_grid<2> > count;
+      af::ref<FloatType, af::c_grid<2> > sum;
+      af::ref<FloatType, af::c_grid<2> > sum_sq;
+      int min_count;
+
+      mean_and_variance_visitor(af::const_ref<FloatType, af::c_grid<2> > image_,
+                                af::const_ref<int, af::c_grid<2> > mask_in_,
+                                af::ref<int, af::c_grid<2> > mask_,
+                                af::ref<int, af::c_grid<2> > count_,
+                                af::ref<FloatType, af::c_grid<2> > sum_,
+                                af::ref<FloatType, af::c_grid<2> > sum_sq_,
+                                int min_count_)
+          : image(image_),
+            mask_in(mask_in_),
+            mask(mask_),
+            count(count_),
+            sum(sum_),
+            sum_sq(sum_sq_),
+            min_count(min_count_) {}
+
+      void operator()(std::size_t k, int m, double x, double y) const {
+        const FloatType BIG = (1 << 24);  // About 1.6m counts
+        mask[k] = (mask_in[k] && image[k] < BIG && m >= min_count) ? 1 : 0;
+        count[k] = m;
+        sum[k] = x;
+        sum_sq[k] = y;
+      }
+    };
+
+  }  // namespace detail
+
   /**
    * Calculate the mean box filtered image.
    * @param image The image to filter
@@ -59,6 +127,7 @@ namespace dials { namespace algorithms {
    *
    * The mask is updated with those pixels which are not filtered.
    *
+   * @param workspace The workspace to reuse
    * @param image The image to filter
    * @param mask The mask to use (0 = off, 1 == on)
    * @param size The size of the filter kernel (2 * size + 1)
@@ -68,6 +137,7 @@ namespace dials { namespace algorithms {
    */
   template <typename FloatType>
   af::versa<FloatType, af::c_grid<2> > mean_filter_masked(
+    SummedAreaWorkspace &workspace,
     const af::const_ref<FloatType, af::c_grid<2> > &image,
     af::ref<int, af::c_grid<2> > mask,
     int2 size,
@@ -85,32 +155,32 @@ namespace dials { namespace algorithms {
       DIALS_ASSERT(min_count <= (2 * size[0] + 1) * (2 * size[1] + 1));
     }
 
-    // Calculate the summed area under the mask
-    af::versa<int, af::c_grid<2> > summed_mask = summed_area<int>(mask, size);
+    // Calculate the summed area under the mask and the masked image
+    workspace.compute(image, mask);
 
-    // Ensure that all masked pixels are zero in the image and update the mask
-    af::versa<FloatType, af::c_grid<2> > temp(image.accessor(),
-                                              af::init_functor_null<FloatType>());
-    for (std::size_t i = 0; i < image.size(); ++i) {
-      temp[i] = image[i] * (mask[i] != 0);
-      mask[i] *= (summed_mask[i] >= min_count);
-    }
-
-    // Calculate the summed area under the image
-    af::versa<FloatType, af::c_grid<2> > summed_image =
-      summed_area<FloatType>(temp.const_ref(), size);
-
-    // Calculate the mean filtered image
-    for (std::size_t i = 0; i < image.size(); ++i) {
-      if ((!ignore_masked || mask[i]) && summed_mask[i] >= min_count) {
-        summed_image[i] /= (FloatType)summed_mask[i];
-      } else {
-        summed_image[i] = 0.0;
-      }
-    }
+    // Calculate the mean filtered image and update the mask
+    af::versa<FloatType, af::c_grid<2> > result(image.accessor(),
+                                                af::init_functor_null<FloatType>());
+    detail::mean_filter_visitor<FloatType> visitor(
+      mask, result.ref(), min_count, ignore_masked);
+    workspace.apply(size, visitor);
+    return result;
+  }
 
-    // Return the filtered image
-    return summed_image;
+  /**
+   * Calculate the masked mean box filtered image using a temporary workspace.
+   * @see mean_filter_masked
+   */
+  template <typename FloatType>
+  af::versa<FloatType, af::c_grid<2> > mean_filter_masked(
+    const af::const_ref<FloatType, af::c_grid<2> > &image,
+    af::ref<int, af::c_grid<2> > mask,
+    int2 size,
+    int min_count,
+    bool ignore_masked = true) {
+    SummedAreaWorkspace workspace;
+    return mean_filter_masked(
+      workspace, image, mask, size, min_count, ignore_masked);
   }
 
   /**
@@ -224,45 +294,25 @@ namespace dials { namespace algorithms {
     MeanAndVarianceFilterMasked(const af::const_ref<FloatType, af::c_grid<2> > &image,
                                 const af::const_ref<int, af::c_grid<2> > &mask,
                                 int2 size,
-                                int min_count)
-        : min_count_(min_count), mask_(mask.accessor()) {
-      const FloatType BIG = (1 << 24);  // About 1.6m counts
-
-      // Check the input is valid
-      DIALS_ASSERT(size.all_gt(0));
-      DIALS_ASSERT(image.accessor().all_gt(0));
-      DIALS_ASSERT(image.accessor().all_eq(mask.accessor()));
-
-      // Copy the mask array
-      for (std::size_t i = 0; i < mask.size(); ++i) {
-        mask_[i] = mask[i] && image[i] < BIG;
-      }
-
-      // Ensure the min counts are valid
-      if (min_count_ <= 0) {
-        min_count_ = (2 * size[0] + 1) * (2 * size[1] + 1);
-      } else {
-        DIALS_ASSERT(min_count_ <= (2 * size[0] + 1) * (2 * size[1] + 1)
-                     && min_count_ > 1);
-      }
-
-      // Calculate the summed area under the mask
-      summed_mask_ = summed_area<int>(mask, size);
-
-      // Ensure that all masked pixels are zero in the image and update the mask
-      af::versa<FloatType, af::c_grid<2> > temp(image.accessor(),
-                                                af::init_functor_null<FloatType>());
-      af::versa<FloatType, af::c_grid<2> > image_sq(image.accessor(),
-                                                    af::init_functor_null<FloatType>());
-      for (std::size_t i = 0; i < image.size(); ++i) {
-        temp[i] = image[i] * (mask[i] != 0);
-        mask_[i] *= (summed_mask_[i] >= min_count_);
-        image_sq[i] = temp[i] * temp[i];
-      }
+                                int min_count) {
+      SummedAreaWorkspace workspace;
+      init(workspace, image, mask, size, min_count);
+    }
 
-      // Calculate the summed image and the summed image**2
-      summed_image_ = summed_area<FloatType>(temp.const_ref(), size);
-      summed_image_sq_ = summed_area<FloatType>(image_sq.const_ref(), size);
+    /**
+     * Initialise the algorithm reusing the workspace
+     * @param workspace The workspace
+     * @param image The image to filter
+     * @param mask The mask to use (0 = off, 1 == on)
+     * @param size The size of the filter kernel (2 * size + 1)
+     * @param min_count The minimum counts to use
+     */
+    MeanAndVarianceFilterMasked(SummedAreaWorkspace &workspace,
+                                const af::const_ref<FloatType, af::c_grid<2> > &image,
+                                const af::const_ref<int, af::c_grid<2> > &mask,
+                                int2 size,
+                                int min_count) {
+      init(workspace, image, mask, size, min_count);
     }
 
     /**
@@ -326,6 +376,45 @@ namespace dials { namespace algorithms {
     }
 
   private:
+    void init(SummedAreaWorkspace &workspace,
+              const af::const_ref<FloatType, af::c_grid<2> > &image,
+              const af::const_ref<int, af::c_grid<2> > &mask,
+              int2 size,
+              int min_count) {
+      // Check the input is valid
+      DIALS_ASSERT(size.all_gt(0));
+      DIALS_ASSERT(image.accessor().all_gt(0));
+      DIALS_ASSERT(image.accessor().all_eq(mask.accessor()));
+
+      // Ensure the min counts are valid
+      min_count_ = min_count;
+      if (min_count_ <= 0) {
+        min_count_ = (2 * size[0] + 1) * (2 * size[1] + 1);
+      } else {
+        DIALS_ASSERT(min_count_ <= (2 * size[0] + 1) * (2 * size[1] + 1)
+                     && min_count_ > 1);
+      }
+
+      // Calculate the summed mask, image and image**2 and update the mask
+      mask_ = af::versa<int, af::c_grid<2> >(mask.accessor(),
+                                             af::init_functor_null<int>());
+      summed_mask_ = af::versa<int, af::c_grid<2> >(mask.accessor(),
+                                                    af::init_functor_null<int>());
+      summed_image_ = af::versa<FloatType, af::c_grid<2> >(
+        image.accessor(), af::init_functor_null<FloatType>());
+      summed_image_sq_ = af::versa<FloatType, af::c_grid<2> >(
+        image.accessor(), af::init_functor_null<FloatType>());
+      workspace.compute(image, mask);
+      detail::mean_and_variance_visitor<FloatType> visitor(image,
+                                                           mask,
+                                                           mask_.ref(),
+                                                           summed_mask_.ref(),
+                                                           summed_image_.ref(),
+                                                           summed_image_sq_.ref(),
+                                                           min_count_);
+      workspace.apply(size, visitor);
+    }
+
     int min_count_;
     af::versa<int, af::c_grid<2> > mask_;
     af::versa<int, af::c_grid<2> > summed_mask_;
@@ -12,64 +12,373 @@
 #define DIALS_ALGORITHMS_IMAGE_FILTER_MEDIAN_H
 
 #include <algorithm>
+#include <cmath>
+#include <exception>
+#include <limits>
+#include <string>
+#include <vector>
 #include <scitbx/array_family/tiny_types.h>
 #include <dials/array_family/scitbx_shared_and_versa.h>
+#include <dials/util/thread_pool.h>
 #include <dials/error.h>
 
 namespace dials { namespace algorithms {
 
   using scitbx::af::int2;
 
+  namespace detail {
+
+    /**
+     * A histogram of the pixels in a window, indexed by the position of each
+     * pixel value in the sorted list of distinct image values. The counts are
+     * kept at two levels so that the k-th smallest value in the window can be
+     * found in O(sqrt(number of distinct values)).
+     */
+    class MedianHistogram {
+    public:
+      MedianHistogram(std::size_t nbins)
+          : block_size_(std::max<std::size_t>(
+            1, (std::size_t)std::ceil(std::sqrt((double)nbins)))),
+            fine_(nbins, 0),
+            coarse_((nbins + block_size_ - 1) / block_size_, 0),
+            count_(0) {}
+
+      void add(std::size_t bin) {
+        fine_[bin]++;
+        coarse_[bin / block_size_]++;
+        count_++;
+      }
+
+      void remove(std::size_t bin) {
+        fine_[bin]--;
+        coarse_[bin / block_size_]--;
+        count_--;
+      }
+
+      std::size_t count() const {
+        return count_;
+      }
+
+      /**
+       * @returns The bin of the k-th smallest value (counting from zero)
+       */
+      std::size_t kth(std::size_t k) const {
+        DIALS_ASSERT(k < count_);
+        std::size_t block = 0;
+        while (k >= coarse_[block]) {
+          k -= coarse_[block++];
+        }
+        std::size_t bin = block * block_size_;
+        while (k >= fine_[bin]) {
+          k -= fine_[bin++];
+        }
+        return bin;
+      }
+
+    private:
+      std::size_t block_size_;
+      std::vector<unsigned int> fine_;
+      std::vector<unsigned int> coarse_;
+      std::size_t count_;
+    };
+
+    /**
+     * A median filter with two strategies. The sliding window histogram
+     * replaces each pixel value by its index in the sorted list of distinct
+     * image values, and slides the window along each row, removing the
+     * pixels in the column which leaves the window and adding those in the
+     * column which enters it. This costs O(kernel height + sqrt(number of
+     * distinct values)) per pixel. Otherwise, the pixels in the window are
+     * copied and partially sorted with nth_element for each pixel, which
+     * costs O(kernel area) per pixel but is faster for small kernels or
+     * images with a large range of values. Both give identical results.
+     * Bands of rows are filtered on separate threads.
+     */
+    template <typename T>
+    class MedianFilter {
+    public:
+      MedianFilter(const af::const_ref<T, af::c_grid<2> > &image,
+                   const af::const_ref<bool, af::c_grid<2> > &mask,
+                   int2 size,
+                   bool periodic)
+          : image_(image),
+            mask_(mask),
+            size_(size),
+            periodic_(periodic),
+            ysize_(image.accessor()[0]),
+            xsize_(image.accessor()[1]) {
+        DIALS_ASSERT(size.all_ge(0));
+        DIALS_ASSERT(image.accessor().all_gt(0));
+        DIALS_ASSERT(image.accessor().all_eq(mask.accessor()));
+        use_histogram_ = false;
+        if (use_histogram(size, 1)) {
+          compute_bins();
+          use_histogram_ = use_histogram(size, value_.size());
+          if (!use_histogram_) {
+            bin_ = std::vector<std::size_t>();
+            value_ = std::vector<T>();
+          }
+        }
+      }
+
+      /**
+       * Choose the sliding window histogram if the pixels in the two columns
+       * updated per step, plus the bins searched for the median, are fewer
+       * than the pixels in the window copied for nth_element.
+       * @param size The size of the filter kernel
+       * @param nbins The number of distinct image values
+       * @returns True/False use the histogram
+       */
+      static bool use_histogram(int2 size, std::size_t nbins) {
+        double height = 2 * size[0] + 1;
+        double width = 2 * size[1] + 1;
+        return 2 * height + 2 * std::sqrt((double)nbins) < height * width;
+      }
+
+      /**
+       * Filter the image
+       * @param nthreads The number of threads
+       * @returns The filtered image
+       */
+      af::versa<T, af::c_grid<2> > operator()(std::size_t nthreads) const {
+        DIALS_ASSERT(nthreads > 0);
+        af::versa<T, af::c_grid<2> > median(image_.accessor(), T(0));
+        std::size_t nbands = std::min(nthreads, ysize_);
+        std::vector<band> bands(nbands);
+        for (std::size_t b = 0; b < nbands; ++b) {
+          bands[b].filter = this;
+          bands[b].median = &median;
+          bands[b].first = (b * ysize_) / nbands;
+          bands[b].last = ((b + 1) * ysize_) / nbands;
+        }
+        if (nbands == 1) {
+          bands[0]();
+        } else {
+          dials::util::ThreadPool pool(nbands);
+          for (std::size_t b = 0; b < nbands; ++b) {
+            pool.post(band_runner(&bands[b]));
+          }
+          pool.wait();
+        }
+        for (std::size_t b = 0; b < nbands; ++b) {
+          if (!bands[b].error.empty()) {
+            throw DIALS_ERROR(bands[b].error);
+          }
+        }
+        return median;
+      }
+
+    private:
+      /**
+       * A band of rows filtered by one thread
+       */
+      struct band {
+        const MedianFilter *filter;
+        af::versa<T, af::c_grid<2> > *median;
+        std::size_t first;
+        std::size_t last;
+        std::string error;
+
+        void operator()() {
+          try {
+            if (filter->use_histogram_) {
+              filter->filter_rows_histogram(median->ref(), first, last);
+            } else {
+              filter->filter_rows_nth_element(median->ref(), first, last);
+            }
+          } catch (const std::exception &e) {
+            error = e.what();
+          } catch (...) {
+            error = "Unknown error in median filter";
+          }
+        }
+      };
+
+      struct band_runner {
+        band *b;
+        band_runner(band *b_) : b(b_) {}
+        void operator()() const {
+          (*b)();
+        }
+      };
+
+      /**
+       * Replace each pixel value by its index in the sorted list of distinct
+       * values. For integers with a small range the index is just the offset
+       * from the minimum value.
+       */
+      void compute_bins() {
+        std::size_t n = image_.size();
+        bin_.resize(n);
+        T vmin = *std::min_element(image_.begin(), image_.end());
+        T vmax = *std::max_element(image_.begin(), image_.end());
+        const double max_range = 1 << 20;
+        if (std::numeric_limits<T>::is_integer
+            && (double)vmax - (double)vmin < max_range) {
+          std::size_t nbins = (std::size_t)((double)vmax - (double)vmin) + 1;
+          value_.resize(nbins);
+          for (std::size_t i = 0; i < nbins; ++i) {
+            value_[i] = (T)(vmin + (T)i);
+          }
+          for (std::size_t i = 0; i < n; ++i) {
+            bin_[i] = (std::size_t)(image_[i] - vmin);
+          }
+        } else {
+          value_.assign(image_.begin(), image_.end());
+          std::sort(value_.begin(), value_.end());
+          value_.erase(std::unique(value_.begin(), value_.end()), value_.end());
+          for (std::size_t i = 0; i < n; ++i) {
+            bin_[i] = std::lower_bound(value_.begin(), value_.end(), image_[i])
+                      - value_.begin();
+          }
+        }
+      }
+
+      /**
+       * @returns The index wrapped into the range [0, n)
+       */
+      static int wrap(int index, int n) {
+        return ((index % n) + n) % n;
+      }
+
+      /**
+       * Add or remove the pixels in the window rows of a column
+       */
+      void update_column(MedianHistogram &histogram,
+                         const std::vector<std::size_t> &rows,
+                         int column,
+                         bool add) const {
+        if (periodic_) {
+          column = wrap(column, (int)xsize_);
+        } else if (column < 0 || column >= (int)xsize_) {
+          return;
+        }
+        for (std::size_t r = 0; r < rows.size(); ++r) {
+          std::size_t k = rows[r] * xsize_ + column;
+          if (mask_[k]) {
+            if (add) {
+              histogram.add(bin_[k]);
+            } else {
+              histogram.remove(bin_[k]);
+            }
+          }
+        }
+      }
+
+      /**
+       * Filter the rows in the range [first, last) with nth_element
+       */
+      void filter_rows_nth_element(af::ref<T, af::c_grid<2> > median,
+                                   std::size_t first,
+                                   std::size_t last) const {
+        std::vector<T> pixels((2 * size_[0] + 1) * (2 * size_[1] + 1));
+        for (int j = (int)first; j < (int)last; ++j) {
+          for (int i = 0; i < (int)xsize_; ++i) {
+            std::size_t npix = 0;
+            for (int jj = j - size_[0]; jj <= j + size_[0]; ++jj) {
+              for (int ii = i - size_[1]; ii <= i + size_[1]; ++ii) {
+                int jjj = jj;
+                int iii = ii;
+                if (periodic_) {
+                  jjj = wrap(jj, (int)ysize_);
+                  iii = wrap(ii, (int)xsize_);
+                } else if (jj < 0 || ii < 0 || jj >= (int)ysize_
+                           || ii >= (int)xsize_) {
+                  continue;
+                }
+                if (mask_(jjj, iii)) {
+                  pixels[npix++] = image_(jjj, iii);
+                }
+              }
+            }
+            if (npix > 0) {
+              std::size_t n = npix / 2;
+              std::nth_element(
+                pixels.begin(), pixels.begin() + n, pixels.begin() + npix);
+              median(j, i) = pixels[n];
+            }
+          }
+        }
+      }
+
+      /**
+       * Filter the rows in the range [first, last) with the sliding window
+       * histogram
+       */
+      void filter_rows_histogram(af::ref<T, af::c_grid<2> > median,
+                                 std::size_t first,
+                                 std::size_t last) const {
+        MedianHistogram histogram(value_.size());
+        std::vector<std::size_t> rows;
+        int w = size_[1];
+        for (std::size_t j = first; j < last; ++j) {
+          // The rows in the window, repeated if the window wraps onto itself
+          rows.clear();
+          for (int jj = (int)j - size_[0]; jj <= (int)j + size_[0]; ++jj) {
+            if (periodic_) {
+              rows.push_back(wrap(jj, (int)ysize_));
+            } else if (jj >= 0 && jj < (int)ysize_) {
+              rows.push_back(jj);
+            }
+          }
+
+          // Fill the window for the first pixel and slide it along the row
+          for (int ii = -w; ii <= w; ++ii) {
+            update_column(histogram, rows, ii, true);
+          }
+          for (std::size_t i = 0; i < xsize_; ++i) {
+            if (histogram.count() > 0) {
+              median(j, i) = value_[histogram.kth(histogram.count() / 2)];
+            }
+            update_column(histogram, rows, (int)i - w, false);
+            update_column(histogram, rows, (int)i + w + 1, true);
+          }
+
+          // Empty the window for the next row
+          for (int ii = (int)xsize_ - w; ii <= (int)xsize_ + w; ++ii) {
+            update_column(histogram, rows, ii, false);
+          }
+          DIALS_ASSERT(histogram.count() == 0);
+        }
+      }
+
+      af::const_ref<T, af::c_grid<2> > image_;
+      af::const_ref<bool, af::c_grid<2> > mask_;
+      int2 size_;
+      bool periodic_;
+      std::size_t ysize_;
+      std::size_t xsize_;
+      bool use_histogram_;
+      std::vector<std::size_t> bin_;
+      std::vector<T> value_;
+    };
+
+  }  // namespace detail
+
   /**
    * Apply a median filter to an image
    * @param image The image to filter
    * @param size The size of the filter kernel
+   * @param nthreads The number of threads
    * @returns The filtered image
    */
   template <typename T>
   af::versa<T, af::c_grid<2> > median_filter(
     const af::const_ref<T, af::c_grid<2> > &image,
-    int2 size) {
-    // Check the input is valid
-    DIALS_ASSERT(size.all_ge(0));
-    DIALS_ASSERT(image.accessor().all_gt(0));
-
-    // The array for output
-    af::versa<T, af::c_grid<2> > median(image.accessor(), T(0));
-
-    // Create the array to sort to get the median
-    std::size_t ysize = image.accessor()[0];
-    std::size_t xsize = image.accessor()[1];
-    af::shared<T> pixels_array((2 * size[0] + 1) * (2 * size[1] + 1), T(0));
-    af::ref<T> pixels = pixels_array.ref();
-
-    // For each pixel obtain the median value
-    for (std::size_t j = 0; j < ysize; ++j) {
-      for (std::size_t i = 0; i < xsize; ++i) {
-        std::size_t npix = 0;
-        for (int jj = (int)j - size[0]; jj <= (int)j + size[0]; ++jj) {
-          for (int ii = (int)i - size[1]; ii <= (int)i + size[1]; ++ii) {
-            if (jj >= 0 && ii >= 0 && jj < ysize && ii < xsize) {
-              pixels[npix++] = image(jj, ii);
-            }
-          }
-        }
-        size_t n = npix / 2;
-        std::nth_element(pixels.begin(), pixels.begin() + n, pixels.begin() + npix);
-        median(j, i) = pixels[n];
-      }
-    }
-
-    // Return the median filtered image
-    return median;
+    int2 size,
+    std::size_t nthreads = 1) {
+    af::versa<bool, af::c_grid<2> > mask(image.accessor(), true);
+    return detail::MedianFilter<T>(image, mask.const_ref(), size, false)(nthreads);
   }
 
   /**
-   * Apply a median filter to an image with a mask
+   * Apply a median filter to an image with a mask. Pixels with no unmasked
+   * pixels in their window are set to zero.
    * @param image The image to filter
    * @param mask The image mask
    * @param size The size of the filter kernel
    * @param periodic Wrap the filter
+   * @param nthreads The number of threads
    * @returns The filtered image
    */
   template <typename T>
@@ -77,55 +386,9 @@ namespace dials { namespace algorithms {
     const af::const_ref<T, af::c_grid<2> > &image,
     const af::const_ref<bool, af::c_grid<2> > &mask,
     int2 size,
-    bool periodic) {
-    // Check the input is valid
-    DIALS_ASSERT(size.all_ge(0));
-    DIALS_ASSERT(image.accessor().all_gt(0));
-    DIALS_ASSERT(image.accessor().all_eq(mask.accessor()));
-
-    // The array for output
-    af::versa<T, af::c_grid<2> > median(image.accessor(), T(0));
-
-    // Create the array to sort to get the median
-    std::size_t ysize = image.accessor()[0];
-    std::size_t xsize = image.accessor()[1];
-    af::shared<T> pixels_array((2 * size[0] + 1) * (2 * size[1] + 1), T(0));
-    af::ref<T> pixels = pixels_array.ref();
-
-    // For each pixel obtain the median value
-    for (int j = 0; j < (int)ysize; ++j) {
-      for (int i = 0; i < (int)xsize; ++i) {
-        std::size_t npix = 0;
-        for (int jj = j - size[0]; jj <= j + size[0]; ++jj) {
-          for (int ii = i - size[1]; ii <= i + size[1]; ++ii) {
-            if (periodic) {
-              std::size_t jjj = (jj % ysize + ysize) % ysize;
-              std::size_t iii = (ii % xsize + xsize) % xsize;
-              DIALS_ASSERT(jjj >= 0 && iii >= 0 && jjj < ysize && iii < xsize);
-              if (mask(jjj, iii)) {
-                DIALS_ASSERT(npix < pixels.size());
-                pixels[npix++] = image(jjj, iii);
-              }
-            } else {
-              if (jj >= 0 && ii >= 0 && jj < ysize && ii < xsize) {
-                if (mask(jj, ii)) {
-                  pixels[npix++] = image(jj, ii);
-                }
-              }
-            }
-          }
-        }
-        DIALS_ASSERT(npix <= pixels.size());
-        if (npix > 0) {
-          size_t n = npix / 2;
-          std::nth_element(pixels.begin(), pixels.begin() + n, pixels.begin() + npix);
-          median(j, i) = pixels[n];
-        }
-      }
-    }
-
-    // Return the median filtered image
-    return median;
+    bool periodic,
+    std::size_t nthreads = 1) {
+    return detail::MedianFilter<T>(image, mask, size, periodic)(nthreads);
   }
 
 }}  // namespace dials::algorithms
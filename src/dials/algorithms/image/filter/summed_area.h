@@ -13,6 +13,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <vector>
 #include <scitbx/array_family/tiny_types.h>
 #include <scitbx/array_family/ref_reductions.h>
 #include <dials/array_family/scitbx_shared_and_versa.h>
@@ -106,6 +107,144 @@ namespace dials { namespace algorithms {
     return sum_arr;
   }
 
+  /**
+   * A reusable workspace to compute masked box filters. The summed area tables
+   * of the mask, the masked image and the masked image squared are computed
+   * together in a single pass into buffers which are kept between calls, so
+   * filtering a series of images of the same size does not allocate any
+   * temporary images. The tables are padded with a row and column of zeros so
+   * that the box sums need no special cases at the image edges, and are kept
+   * in double precision whatever the image type.
+   *
+   * A workspace must only be used by one thread at a time.
+   */
+  class SummedAreaWorkspace {
+  public:
+    SummedAreaWorkspace() : ysize_(0), xsize_(0) {}
+
+    /**
+     * Compute the summed area tables
+     * @param image The image array
+     * @param mask The mask array (0 = off, otherwise on)
+     */
+    template <typename FloatType>
+    void compute(const af::const_ref<FloatType, af::c_grid<2> > &image,
+                 const af::const_ref<int, af::c_grid<2> > &mask) {
+      DIALS_ASSERT(image.accessor().all_gt(0));
+      DIALS_ASSERT(image.accessor().all_eq(mask.accessor()));
+      resize(image.accessor()[0], image.accessor()[1]);
+      std::size_t stride = xsize_ + 1;
+      for (std::size_t j = 0; j < ysize_; ++j) {
+        const FloatType *src = &image[j * xsize_];
+        const int *msk = &mask[j * xsize_];
+        const int *m0 = &m_[j * stride];
+        const double *x0 = &x_[j * stride];
+        const double *y0 = &y_[j * stride];
+        int *m1 = &m_[(j + 1) * stride];
+        double *x1 = &x_[(j + 1) * stride];
+        double *y1 = &y_[(j + 1) * stride];
+        int m = 0;
+        double x = 0;
+        double y = 0;
+        for (std::size_t i = 0; i < xsize_; ++i) {
+          double v = msk[i] != 0 ? (double)src[i] : 0.0;
+          m += msk[i];
+          x += v;
+          y += v * v;
+          m1[i + 1] = m0[i + 1] + m;
+          x1[i + 1] = x0[i + 1] + x;
+          y1[i + 1] = y0[i + 1] + y;
+        }
+      }
+    }
+
+    /**
+     * Compute the box sums under a kernel of size (2 * size + 1) centred on
+     * each pixel, truncated at the image edges. The visitor is called in
+     * pixel order as visit(index, count, sum, sum_sq).
+     * @param size The size of the filter kernel
+     * @param visit The visitor
+     */
+    template <typename Visitor>
+    void apply(int2 size, Visitor &visit) const {
+      DIALS_ASSERT(size.all_ge(0));
+      DIALS_ASSERT(ysize_ > 0 && xsize_ > 0);
+      std::size_t stride = xsize_ + 1;
+      std::size_t kx = size[1];
+      std::size_t ky = size[0];
+
+      // The first and last pixels whose kernel is not truncated in x
+      std::size_t i0 = std::min(kx, xsize_);
+      std::size_t i1 = std::max(i0, xsize_ > kx ? xsize_ - kx : 0);
+      for (std::size_t j = 0; j < ysize_; ++j) {
+        std::size_t jlo = j > ky ? j - ky : 0;
+        std::size_t jhi = std::min(j + ky + 1, ysize_);
+        row r(&m_[jlo * stride],
+              &m_[jhi * stride],
+              &x_[jlo * stride],
+              &x_[jhi * stride],
+              &y_[jlo * stride],
+              &y_[jhi * stride]);
+        std::size_t k = j * xsize_;
+        for (std::size_t i = 0; i < i0; ++i) {
+          r.visit(visit, k + i, 0, std::min(i + kx + 1, xsize_));
+        }
+        for (std::size_t i = i0; i < i1; ++i) {
+          r.visit(visit, k + i, i - kx, i + kx + 1);
+        }
+        for (std::size_t i = i1; i < xsize_; ++i) {
+          r.visit(visit, k + i, i > kx ? i - kx : 0, xsize_);
+        }
+      }
+    }
+
+  private:
+    /**
+     * The rows of the tables above and below the kernel
+     */
+    struct row {
+      const int *m0, *m1;
+      const double *x0, *x1;
+      const double *y0, *y1;
+
+      row(const int *m0_,
+          const int *m1_,
+          const double *x0_,
+          const double *x1_,
+          const double *y0_,
+          const double *y1_)
+          : m0(m0_), m1(m1_), x0(x0_), x1(x1_), y0(y0_), y1(y1_) {}
+
+      template <typename Visitor>
+      void visit(Visitor &v, std::size_t k, std::size_t ilo, std::size_t ihi) const {
+        v(k,
+          (m1[ihi] - m1[ilo]) - (m0[ihi] - m0[ilo]),
+          (x1[ihi] - x1[ilo]) - (x0[ihi] - x0[ilo]),
+          (y1[ihi] - y1[ilo]) - (y0[ihi] - y0[ilo]));
+      }
+    };
+
+    /**
+     * Resize the buffers if the image size has changed
+     */
+    void resize(std::size_t ysize, std::size_t xsize) {
+      if (ysize != ysize_ || xsize != xsize_) {
+        std::size_t n = (ysize + 1) * (xsize + 1);
+        m_.assign(n, 0);
+        x_.assign(n, 0);
+        y_.assign(n, 0);
+        ysize_ = ysize;
+        xsize_ = xsize;
+      }
+    }
+
+    std::size_t ysize_;
+    std::size_t xsize_;
+    std::vector<int> m_;
+    std::vector<double> x_;
+    std::vector<double> y_;
+  };
+
 }}  // namespace dials::algorithms
 
 #endif /* DIALS_ALGORITHMS_IMAGE_FILTER_SUMMED_AREA_H */
@@ -886,9 +886,11 @@ namespace dials { namespace algorithms {
         temp[i] = mask[i] ? 1 : 0;
       }
 
-      // Calculate the masked index_of_dispersion filtered image
+      // Calculate the masked index_of_dispersion filtered image. The summed area
+      // tables are kept in a workspace which is reused for the second filter.
+      SummedAreaWorkspace workspace;
       IndexOfDispersionFilterMasked<double> filter(
-        image, temp.const_ref(), size, min_count);
+        workspace, image, temp.const_ref(), size, min_count);
       mean_ = filter.mean();
       variance_ = filter.sample_variance();
       cv_ = filter.index_of_dispersion();
@@ -925,7 +927,8 @@ namespace dials { namespace algorithms {
       // Widen the kernel slightly and compute the mean image without strong pixels
       size[0] += 2;
       size[1] += 2;
-      mean2_ = mean_filter_masked(image, temp_mask.ref(), size, 2, false);
+      mean2_ = mean_filter_masked(
+        workspace, image, temp_mask.ref(), size, 2, false);
 
       // Compute the final thresholds
       for (std::size_t i = 0; i < image.size(); ++i) {
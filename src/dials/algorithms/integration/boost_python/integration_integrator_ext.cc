@@ -308,14 +308,25 @@ namespace dials { namespace algorithms { namespace boost_python {
       .def("shoebox_memory", &job_list_shoebox_memory);
 
     class_<ReflectionManager>("ReflectionManager", no_init)
-      .def(init<const JobList &, af::reflection_table>((arg("jobs"), arg("data"))))
+      .def(init<const JobList &, af::reflection_table, std::size_t>(
+        (arg("jobs"), arg("data"), arg("nthreads") = 1)))
       .def("__len__", &ReflectionManager::size)
       .def("finished", &ReflectionManager::finished)
       .def("accumulate", &ReflectionManager::accumulate)
       .def("split", &ReflectionManager::split)
       .def("job", &ReflectionManager::job, return_internal_reference<>())
       .def("data", &ReflectionManager::data)
-      .def("num_reflections", &ReflectionManager::num_reflections);
+      .def("num_reflections", &ReflectionManager::num_reflections)
+      .def("stream",
+           &ReflectionManager::stream,
+           (arg("filename"),
+            arg("rows_per_group") = 65536,
+            arg("compression_level") = 1,
+            arg("keep_in_memory") = true,
+            arg("append") = false,
+            arg("index_offset") = 0))
+      .def("streaming", &ReflectionManager::streaming)
+      .def("stream_row_groups", &ReflectionManager::stream_row_groups);
 
     class_<ReflectionManagerPerImage>("ReflectionManagerPerImage", no_init)
       .def(init<int2, af::reflection_table>((arg("frames"), arg("data"))))
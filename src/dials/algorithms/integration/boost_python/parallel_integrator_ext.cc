@@ -437,7 +437,11 @@ namespace dials { namespace algorithms { namespace boost_python {
       .def("block_index", &SimpleBlockList::block_index);
 
     class_<SimpleReflectionManager>("SimpleReflectionManager", no_init)
-      .def(init<const SimpleBlockList &, af::reflection_table, std::size_t>())
+      .def(init<const SimpleBlockList &,
+                af::reflection_table,
+                std::size_t,
+                std::size_t>(
+        (arg("blocks"), arg("data"), arg("njobs"), arg("nthreads") = 1)))
       .def("data", &SimpleReflectionManager::data)
       .def("finished", &SimpleReflectionManager::finished)
       .def("block", &SimpleReflectionManager::block)
@@ -445,6 +449,16 @@ namespace dials { namespace algorithms { namespace boost_python {
       .def("num_reflections", &SimpleReflectionManager::num_reflections)
       .def("split", &SimpleReflectionManager::split)
       .def("accumulate", &SimpleReflectionManager::accumulate)
+      .def("stream",
+           &SimpleReflectionManager::stream,
+           (arg("filename"),
+            arg("rows_per_group") = 65536,
+            arg("compression_level") = 1,
+            arg("keep_in_memory") = true,
+            arg("append") = false,
+            arg("index_offset") = 0))
+      .def("streaming", &SimpleReflectionManager::streaming)
+      .def("stream_row_groups", &SimpleReflectionManager::stream_row_groups)
       .def("__len__", &SimpleReflectionManager::size);
   }
 
@@ -18,12 +18,15 @@
 #include <algorithm>
 #include <numeric>
 #include <list>
+#include <memory>
 #include <vector>
 #include <dials/model/data/image.h>
 #include <dials/model/data/shoebox.h>
 #include <dials/array_family/reflection_table.h>
 #include <dxtbx/array_family/flex_table_suite.h>
 #include <dials/array_family/boost_python/reflection_table_suite.h>
+#include <dials/algorithms/integration/interval_index.h>
+#include <dials/algorithms/integration/reflection_stream.h>
 
 namespace dials { namespace algorithms {
 
@@ -280,48 +283,21 @@ namespace dials { namespace algorithms {
         }
       }
       DIALS_ASSERT(group_.size() == groups[groups.size() - 1].expr()[1]);
-      offset_.push_back(0);
       for (std::size_t i = 0; i < groups.size(); ++i) {
         tiny<int, 2> f = groups[i].frames();
         DIALS_ASSERT(f[1] > f[0]);
-        frame0_.push_back(f[0]);
-        offset_.push_back(offset_.back() + f[1] - f[0]);
-      }
-      DIALS_ASSERT(offset_.back() > 0);
-      lookup0_.resize(offset_.back());
-      lookup1_.resize(offset_.back());
-      for (std::size_t i = 0; i < groups.size(); ++i) {
         std::size_t job0 = groups[i].index()[0];
         std::size_t job1 = groups[i].index()[1];
         DIALS_ASSERT(job1 > job0 && job1 <= jobs.size());
-        std::size_t off0 = offset_[i];
-        std::size_t off1 = offset_[i + 1];
-        DIALS_ASSERT(off1 > off0 && off1 <= lookup0_.size());
-        int frame0 = groups[i].frames()[0];
-        int frame1 = groups[i].frames()[1];
-        DIALS_ASSERT(frame1 > frame0);
-        DIALS_ASSERT(frame1 - frame0 == off1 - off0);
-        int frame = frame0;
-        for (std::size_t i = job0; i < job1; ++i) {
-          tiny<int, 2> b = jobs[i].frames();
-          DIALS_ASSERT(frame >= b[0]);
-          for (; frame < b[1]; ++frame) {
-            lookup0_[off0 + frame - frame0] = i;
-          }
-        }
-        DIALS_ASSERT(frame == frame1);
-        for (std::size_t i = job1; i > job0; --i) {
-          tiny<int, 2> b = jobs[i - 1].frames();
-          DIALS_ASSERT(frame <= b[1]);
-          for (; frame > b[0]; --frame) {
-            lookup1_[off0 + frame - frame0 - 1] = i - 1;
-          }
-        }
-        DIALS_ASSERT(frame == frame0);
-        for (std::size_t i = off0 + 1; i < off1; ++i) {
-          DIALS_ASSERT(lookup0_[i] >= lookup0_[i - 1]);
-          DIALS_ASSERT(lookup1_[i] >= lookup1_[i - 1]);
+        std::vector<tiny<int, 2> > ranges;
+        for (std::size_t j = job0; j < job1; ++j) {
+          ranges.push_back(jobs[j].frames());
         }
+        DIALS_ASSERT(ranges.front()[0] == f[0]);
+        DIALS_ASSERT(ranges.back()[1] == f[1]);
+        frames_.push_back(f);
+        job0_.push_back(job0);
+        index_.push_back(SortedIntervalIndex(ranges));
       }
     }
 
@@ -329,40 +305,37 @@ namespace dials { namespace algorithms {
      * Get the first job index
      */
     std::size_t first(std::size_t id, int frame) const {
-      DIALS_ASSERT(id < group_.size());
-      std::size_t group = group_[id];
-      DIALS_ASSERT(group < offset_.size() - 1);
-      std::size_t offset = offset_[group];
-      int frame0 = frame0_[group];
-      DIALS_ASSERT(frame >= frame0);
-      DIALS_ASSERT(frame < frame0 + (int)offset_[group + 1]);
-      std::size_t index = offset + (std::size_t)(frame - frame0);
-      DIALS_ASSERT(index < lookup0_.size());
-      return lookup0_[index];
+      std::size_t group = find(id, frame);
+      std::size_t index = index_[group].first(frame);
+      DIALS_ASSERT(index < index_[group].size());
+      return job0_[group] + index;
     }
 
     /**
      * Get the second job index
      */
     std::size_t last(std::size_t id, int frame) const {
+      std::size_t group = find(id, frame);
+      return job0_[group] + index_[group].last(frame);
+    }
+
+  private:
+    /**
+     * Get the group and check the frame is within it
+     */
+    std::size_t find(std::size_t id, int frame) const {
       DIALS_ASSERT(id < group_.size());
       std::size_t group = group_[id];
-      DIALS_ASSERT(group < offset_.size() - 1);
-      std::size_t offset = offset_[group];
-      int frame0 = frame0_[group];
-      DIALS_ASSERT(frame >= frame0);
-      DIALS_ASSERT(frame < frame0 + (int)offset_[group + 1]);
-      std::size_t index = offset + (std::size_t)(frame - frame0);
-      DIALS_ASSERT(index < lookup1_.size());
-      return lookup1_[index];
+      DIALS_ASSERT(group < frames_.size());
+      DIALS_ASSERT(frame >= frames_[group][0]);
+      DIALS_ASSERT(frame < frames_[group][1]);
+      return group;
     }
 
-  private:
-    std::vector<std::size_t> lookup0_;
-    std::vector<std::size_t> lookup1_;
-    std::vector<std::size_t> offset_;
     std::vector<std::size_t> group_;
-    std::vector<int> frame0_;
+    std::vector<tiny<int, 2> > frames_;
+    std::vector<std::size_t> job0_;
+    std::vector<SortedIntervalIndex> index_;
   };
 
   /**
@@ -373,11 +346,12 @@ namespace dials { namespace algorithms {
     ReflectionLookup(const af::const_ref<int> &id,
                      const af::const_ref<std::size_t> &flags,
                      const af::const_ref<int6> &bbox,
-                     const JobList &jobs)
+                     const JobList &jobs,
+                     std::size_t nthreads = 1)
         : jobs_(jobs) {
       DIALS_ASSERT(jobs_.size() > 0);
-
-      typedef std::vector<std::size_t> job_list_type;
+      DIALS_ASSERT(id.size() == bbox.size());
+      DIALS_ASSERT(flags.size() == bbox.size());
 
       // Check all the reflections are in range
       for (std::size_t i = 0; i < bbox.size(); ++i) {
@@ -390,68 +364,13 @@ namespace dials { namespace algorithms {
       // Compute the job range lookup table
       JobRangeLookup lookup(jobs);
 
-      // Get which reflections to process in which job and task
-      std::vector<job_list_type> indices(jobs_.size());
-      for (std::size_t index = 0; index < bbox.size(); ++index) {
-        std::size_t eid = id[index];
-        int z0 = bbox[index][4];
-        int z1 = bbox[index][5];
-        const std::size_t &f = flags[index];
-        if (!(f & af::DontIntegrate)) {
-          std::size_t j0 = lookup.first(eid, z0);
-          std::size_t j1 = lookup.last(eid, z1 - 1);
-          DIALS_ASSERT(j0 < jobs_.size());
-          DIALS_ASSERT(j1 < jobs_.size());
-          DIALS_ASSERT(j1 >= j0);
-          DIALS_ASSERT(z0 >= jobs_[j0].frames()[0]);
-          DIALS_ASSERT(z1 <= jobs_[j1].frames()[1]);
-          std::size_t jmin = 0;
-          double dmin = 0;
-          bool inside = false;
-          for (std::size_t j = j0; j <= j1; ++j) {
-            int jz0 = jobs_[j].frames()[0];
-            int jz1 = jobs_[j].frames()[1];
-            if (z0 >= jz0 && z1 <= jz1) {
-              double zc = (z1 + z0) / 2.0;
-              double jc = (jz1 + jz0) / 2.0;
-              double d = std::abs(zc - jc);
-              if (!inside || d < dmin) {
-                jmin = j;
-                dmin = d;
-                inside = true;
-              }
-            }
-          }
-          int jz0 = jobs_[jmin].frames()[0];
-          int jz1 = jobs_[jmin].frames()[1];
-          DIALS_ASSERT(inside == true);
-          DIALS_ASSERT(z0 >= jz0 && z1 <= jz1);
-          indices[jmin].push_back(index);
-        }
-      }
-
-      // Compute number of reflections in each task
-      std::vector<std::size_t> num(jobs_.size(), 0);
-      for (std::size_t i = 0; i < num.size(); ++i) {
-        num[i] = indices[i].size();
-      }
-
-      // Compute offsests
-      offset_.push_back(0);
-      std::partial_sum(num.begin(), num.end(), std::back_inserter(offset_));
-
-      // Compute indices
-      indices_.resize(offset_.back());
-      std::size_t k = 0;
-      for (std::size_t i = 0; i < indices.size(); ++i) {
-        const job_list_type &ind = indices[i];
-        for (std::size_t j = 0; j < ind.size(); ++j, ++k) {
-          DIALS_ASSERT(k < indices_.size());
-          indices_[k] = ind[j];
-          DIALS_ASSERT(indices_[k] < bbox.size());
-        }
-      }
-      DIALS_ASSERT(k == indices_.size());
+      // Get which reflections to process in which job
+      BucketIndex index(bbox.size(),
+                        jobs_.size(),
+                        assign_job(id, flags, bbox, jobs_, lookup),
+                        nthreads);
+      offset_ = index.offset();
+      indices_ = index.indices();
     }
 
     /**
@@ -486,6 +405,63 @@ namespace dials { namespace algorithms {
     JobList jobs_;
     af::shared<std::size_t> offset_;
     af::shared<std::size_t> indices_;
+
+  private:
+    /**
+     * Assign each reflection to the job which fully contains it and whose
+     * centre is closest to the centre of the reflection. Reflections which are
+     * not to be integrated are not assigned to any job.
+     */
+    struct assign_job {
+      const af::const_ref<int> &id;
+      const af::const_ref<std::size_t> &flags;
+      const af::const_ref<int6> &bbox;
+      const JobList &jobs;
+      const JobRangeLookup &lookup;
+
+      assign_job(const af::const_ref<int> &id_,
+                 const af::const_ref<std::size_t> &flags_,
+                 const af::const_ref<int6> &bbox_,
+                 const JobList &jobs_,
+                 const JobRangeLookup &lookup_)
+          : id(id_), flags(flags_), bbox(bbox_), jobs(jobs_), lookup(lookup_) {}
+
+      template <typename Visitor>
+      void operator()(std::size_t index, Visitor visit) const {
+        if (flags[index] & af::DontIntegrate) {
+          return;
+        }
+        std::size_t eid = id[index];
+        int z0 = bbox[index][4];
+        int z1 = bbox[index][5];
+        std::size_t j0 = lookup.first(eid, z0);
+        std::size_t j1 = lookup.last(eid, z1 - 1);
+        DIALS_ASSERT(j0 < jobs.size());
+        DIALS_ASSERT(j1 < jobs.size());
+        DIALS_ASSERT(j1 >= j0);
+        DIALS_ASSERT(z0 >= jobs[j0].frames()[0]);
+        DIALS_ASSERT(z1 <= jobs[j1].frames()[1]);
+        std::size_t jmin = 0;
+        double dmin = 0;
+        bool inside = false;
+        for (std::size_t j = j0; j <= j1; ++j) {
+          int jz0 = jobs[j].frames()[0];
+          int jz1 = jobs[j].frames()[1];
+          if (z0 >= jz0 && z1 <= jz1) {
+            double zc = (z1 + z0) / 2.0;
+            double jc = (jz1 + jz0) / 2.0;
+            double d = std::abs(zc - jc);
+            if (!inside || d < dmin) {
+              jmin = j;
+              dmin = d;
+              inside = true;
+            }
+          }
+        }
+        DIALS_ASSERT(inside == true);
+        visit(jmin);
+      }
+    };
   };
 
   /**
@@ -498,17 +474,72 @@ namespace dials { namespace algorithms {
      * @param jobs The job calculator
      * @param groups The group that each experiment is in
      * @param data The reflection data
+     * @param nthreads The number of threads used to build the lookup
      */
-    ReflectionManager(const JobList &jobs, af::reflection_table data)
-        : lookup_(init(jobs, data)), data_(data), finished_(lookup_.size(), false) {
+    ReflectionManager(const JobList &jobs,
+                      af::reflection_table data,
+                      std::size_t nthreads = 1)
+        : lookup_(init(jobs, data, nthreads)),
+          data_(data),
+          finished_(lookup_.size(), false),
+          keep_in_memory_(true) {
       DIALS_ASSERT(finished_.size() > 0);
     }
 
+    /**
+     * Stream the results of each job to a chunked reflection file as soon as
+     * they are accumulated. The rows are written with their index in the
+     * input table, plus the offset, in the stream_index column. The rows in
+     * no job and the file index are written once all the jobs have finished;
+     * if processing stops early, the jobs already written can still be
+     * recovered from the file.
+     * @param filename The output filename
+     * @param rows_per_group The number of rows in each row group
+     * @param compression_level The zlib compression level
+     * @param keep_in_memory Also merge the results into the input table
+     * @param append Append to an existing file
+     * @param index_offset The offset added to the row indices
+     */
+    void stream(const std::string &filename,
+                std::size_t rows_per_group,
+                int compression_level,
+                bool keep_in_memory,
+                bool append,
+                std::size_t index_offset) {
+      DIALS_ASSERT(finished_.all_eq(false));
+      stream_ = std::make_shared<ReflectionStream>(filename,
+                                                   rows_per_group,
+                                                   compression_level,
+                                                   append,
+                                                   index_offset,
+                                                   data_.size());
+      keep_in_memory_ = keep_in_memory;
+    }
+
+    /**
+     * @returns Are the results being streamed to file
+     */
+    bool streaming() const {
+      return stream_ != NULL;
+    }
+
+    /**
+     * @returns The row groups written to the stream file
+     */
+    af::shared<std::size_t> stream_row_groups() const {
+      DIALS_ASSERT(stream_ != NULL);
+      DIALS_ASSERT(finished());
+      return stream_->row_groups();
+    }
+
     /**
      * @returns The result data
      */
     af::reflection_table data() {
       DIALS_ASSERT(finished());
+      if (!keep_in_memory_) {
+        throw DIALS_ERROR("Reflections were streamed to file and not kept in memory");
+      }
       return data_;
     }
 
@@ -593,30 +624,44 @@ namespace dials { namespace algorithms {
       /*   id[i] += expr[0]; */
       /* } */
 
+      // Write the result to file
+      if (stream_ != NULL) {
+        stream_->write(data_, ind, result);
+      }
+
       // Set the result
-      dxtbx::af::flex_table_suite::set_selected_rows_index(data_, ind, result);
+      if (keep_in_memory_) {
+        dxtbx::af::flex_table_suite::set_selected_rows_index(data_, ind, result);
+      }
 
-      // Set finished flag
+      // Set finished flag and write the rest of the file when done
       finished_[index] = true;
+      if (stream_ != NULL && finished()) {
+        stream_->close(data_);
+      }
     }
 
   private:
     /**
      * Initialise the indexer
      */
-    ReflectionLookup init(const JobList &jobs, af::reflection_table data) {
+    ReflectionLookup init(const JobList &jobs,
+                          af::reflection_table data,
+                          std::size_t nthreads) {
       DIALS_ASSERT(data.is_consistent());
       DIALS_ASSERT(data.size() > 0);
       DIALS_ASSERT(data.contains("id"));
       DIALS_ASSERT(data.contains("flags"));
       DIALS_ASSERT(data.contains("bbox"));
       DIALS_ASSERT(jobs.size() > 0);
-      return ReflectionLookup(data["id"], data["flags"], data["bbox"], jobs);
+      return ReflectionLookup(data["id"], data["flags"], data["bbox"], jobs, nthreads);
     }
 
     ReflectionLookup lookup_;
     af::reflection_table data_;
     af::shared<bool> finished_;
+    std::shared_ptr<ReflectionStream> stream_;
+    bool keep_in_memory_;
   };
 
 }}  // namespace dials::algorithms
@@ -121,6 +121,33 @@ def generate_phil_scope():
 
       }
 
+      stream {
+
+        filename = None
+          .type = path
+          .help = "If set, write the integrated reflections of each job to this"
+                  "chunked reflection file as soon as the job finishes. The file"
+                  "index is written once all jobs are complete; if processing"
+                  "stops early the jobs already written can still be read. The"
+                  "rows are in the order the jobs finish, with the row of the"
+                  "input table in the stream_index column. When the reflections"
+                  "are processed in subsets, each subset is added to the file."
+
+        rows_per_group = 65536
+          .type = int(value_min=1)
+          .help = "The number of rows in each row group of the file"
+
+        compression_level = 1
+          .type = int(value_min=0, value_max=9)
+          .help = "The zlib compression level (0 for none)"
+
+        keep_in_memory = True
+          .type = bool
+          .help = "Also merge the results into the in-memory reflection table."
+                  "If False, the results are read back from the file once all"
+                  "jobs are complete."
+      }
+
       use_dynamic_mask = True
         .type = bool
         .help = "Use dynamic mask if available"
@@ -426,6 +453,7 @@ def from_phil(params):
         result.integration.debug.select = params.debug.select
         result.integration.debug.separate_files = params.debug.separate_files
         result.integration.summation = params.summation
+        result.integration.stream.update(params.stream)
         result.integration.integrator = params.integrator
 
         result.debug_reference_filename = params.debug.reference.filename
@@ -467,7 +495,9 @@ def _initialize_rotation(experiments, params, reflections):
     reflections.compute_zeta_multi(experiments)
     reflections.compute_d(experiments)
     reflections.compute_bbox(
-        experiments, sigma_b_multiplier=params.profile.sigma_b_multiplier
+        experiments,
+        sigma_b_multiplier=params.profile.sigma_b_multiplier,
+        nthreads=params.mp.nproc,
     )
 
     # Filter the reflections by zeta
@@ -488,7 +518,9 @@ def _initialize_stills(experiments, params, reflections):
     # Compute some reflection properties
     reflections.compute_d(experiments)
     reflections.compute_bbox(
-        experiments, sigma_b_multiplier=params.profile.sigma_b_multiplier
+        experiments,
+        sigma_b_multiplier=params.profile.sigma_b_multiplier,
+        nthreads=params.mp.nproc,
     )
 
     # Check the bounding boxes are all 1 frame in width
@@ -1265,7 +1297,7 @@ def _iterative_table_split(tables, experiments, available_memory):
             # some tables were split - so need to check again that all are ok
             return _iterative_table_split(split_tables, experiments, available_memory)
 
-        def _run_processor(reflections):
+        def _run_processor(reflections, append=False, index_offset=0):
             processor = build_processor(
                 self.ProcessorClass,
                 self.experiments,
@@ -1273,6 +1305,9 @@ def _run_processor(reflections):
                 self.params.integration,
             )
             processor.executor = executor
+            # Subsets after the first are added to the same stream file
+            processor.params.stream.append = append
+            processor.params.stream.index_offset = index_offset
             # Process the reflections
             reflections, _, time_info = processor.process()
             return reflections, time_info
@@ -1284,6 +1319,7 @@ def _run_processor(reflections):
             # necessary. Only want to split if we can't even process with nproc = 1
 
             if self.params.integration.mp.n_subset_split:
+                flex.set_random_seed(0)
                 tables = self.reflections.random_split(
                     self.params.integration.mp.n_subset_split
                 )
@@ -1312,11 +1348,15 @@ def _run_processor(reflections):
 """,
                     len(tables),
                 )
+                index_offset = 0
                 for i, table in enumerate(tables):
                     logger.info("Processing subset %s of reflection table", i + 1)
-                    processed, this_time_info = _run_processor(table)
+                    processed, this_time_info = _run_processor(
+                        table, append=i > 0, index_offset=index_offset
+                    )
                     reflections.extend(processed)
                     time_info += this_time_info
+                    index_offset += len(table)
                 self.reflections = reflections
 
         # Finalize the reflections
@@ -1456,6 +1496,7 @@ def initialise(self):
         self.reflections.compute_bbox(
             self.experiments,
             sigma_b_multiplier=self.params.integration.profile.sigma_b_multiplier,
+            nthreads=self.params.integration.mp.nproc,
         )
 
         # Filter the reflections by zeta
@@ -0,0 +1,347 @@
+/*
+ * interval_index.h
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+#ifndef DIALS_ALGORITHMS_INTEGRATION_INTERVAL_INDEX_H
+#define DIALS_ALGORITHMS_INTEGRATION_INTERVAL_INDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <string>
+#include <vector>
+#include <scitbx/array_family/tiny_types.h>
+#include <dials/array_family/scitbx_shared_and_versa.h>
+#include <dials/util/thread_pool.h>
+#include <dials/error.h>
+
+namespace dials { namespace algorithms {
+
+  using scitbx::af::tiny;
+
+  /**
+   * An index over a list of frame ranges, such as the blocks or jobs used in
+   * integration. The ranges may overlap but their first and last frames must
+   * both be sorted in increasing order. All queries are done by binary search
+   * over the sorted end points.
+   */
+  class SortedIntervalIndex {
+  public:
+    SortedIntervalIndex() {}
+
+    /**
+     * Index the frame ranges
+     * @param ranges The sorted list of frame ranges
+     */
+    SortedIntervalIndex(const std::vector<tiny<int, 2> > &ranges) {
+      first_.reserve(ranges.size());
+      last_.reserve(ranges.size());
+      for (std::size_t i = 0; i < ranges.size(); ++i) {
+        DIALS_ASSERT(ranges[i][1] > ranges[i][0]);
+        if (i > 0) {
+          DIALS_ASSERT(ranges[i][0] >= ranges[i - 1][0]);
+          DIALS_ASSERT(ranges[i][1] >= ranges[i - 1][1]);
+        }
+        first_.push_back(ranges[i][0]);
+        last_.push_back(ranges[i][1]);
+      }
+    }
+
+    /**
+     * @returns The number of ranges
+     */
+    std::size_t size() const {
+      return first_.size();
+    }
+
+    /**
+     * @returns The frame range
+     */
+    tiny<int, 2> operator[](std::size_t index) const {
+      DIALS_ASSERT(index < size());
+      return tiny<int, 2>(first_[index], last_[index]);
+    }
+
+    /**
+     * Get the first range which contains or is after the frame
+     * @param frame The frame number
+     * @returns The index of the first range whose last frame is after frame
+     */
+    std::size_t first(int frame) const {
+      return std::upper_bound(last_.begin(), last_.end(), frame) - last_.begin();
+    }
+
+    /**
+     * Get the last range which contains or is before the frame
+     * @param frame The frame number
+     * @returns The index of the last range whose first frame is <= frame
+     */
+    std::size_t last(int frame) const {
+      std::size_t index =
+        std::upper_bound(first_.begin(), first_.end(), frame) - first_.begin();
+      DIALS_ASSERT(index > 0);
+      return index - 1;
+    }
+
+    /**
+     * Get the range whose centre is closest to the centre of the frame. Since
+     * the centres are sorted, the closest range is one of the two either side
+     * of the frame. Ties go to the earlier range.
+     * @param frame The frame number
+     * @returns The index of the closest range
+     */
+    std::size_t closest(int frame) const {
+      DIALS_ASSERT(size() > 0);
+      double z = frame + 0.5;
+      std::size_t lo = 0;
+      std::size_t hi = size();
+      while (lo < hi) {
+        std::size_t mid = lo + (hi - lo) / 2;
+        if (centre(mid) < z) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      if (lo == size()) {
+        return size() - 1;
+      }
+      if (lo > 0 && std::abs(centre(lo - 1) - z) <= std::abs(centre(lo) - z)) {
+        return lo - 1;
+      }
+      return lo;
+    }
+
+  private:
+    double centre(std::size_t index) const {
+      return (first_[index] + last_[index]) / 2.0;
+    }
+
+    std::vector<int> first_;
+    std::vector<int> last_;
+  };
+
+  /**
+   * A compressed lookup of the items in each of a number of buckets (e.g. the
+   * reflections in each job). The items are assigned to buckets with a
+   * counting sort which is split over a number of threads. Each thread counts
+   * and then scatters a contiguous range of items so the items within each
+   * bucket are always in increasing order, independent of the number of
+   * threads.
+   */
+  class BucketIndex {
+  public:
+    BucketIndex() : offset_(1, 0) {}
+
+    /**
+     * Assign the items to buckets.
+     *
+     * The assign function is called as assign(item, visit) and must call
+     * visit(bucket) once for each bucket the item belongs to. It must be safe
+     * to call from multiple threads.
+     *
+     * @param nitems The number of items
+     * @param nbuckets The number of buckets
+     * @param assign The function to assign items to buckets
+     * @param nthreads The number of threads
+     */
+    template <typename Assign>
+    BucketIndex(std::size_t nitems,
+                std::size_t nbuckets,
+                Assign assign,
+                std::size_t nthreads = 1) {
+      DIALS_ASSERT(nthreads > 0);
+      std::size_t nchunks = std::max<std::size_t>(1, std::min(nthreads, nitems));
+      std::vector<chunk> chunks(nchunks);
+      for (std::size_t i = 0; i < nchunks; ++i) {
+        chunks[i].first = (i * nitems) / nchunks;
+        chunks[i].last = ((i + 1) * nitems) / nchunks;
+        chunks[i].count.assign(nbuckets, 0);
+      }
+
+      // Count the number of items from each chunk in each bucket
+      run(chunks, count_job<Assign>(assign, nbuckets), nthreads);
+
+      // Compute the bucket offsets and the position of each chunk within
+      // each bucket. This replaces the chunk counts.
+      offset_.resize(nbuckets + 1);
+      offset_[0] = 0;
+      std::size_t position = 0;
+      for (std::size_t j = 0; j < nbuckets; ++j) {
+        for (std::size_t i = 0; i < nchunks; ++i) {
+          std::size_t n = chunks[i].count[j];
+          chunks[i].count[j] = position;
+          position += n;
+        }
+        offset_[j + 1] = position;
+      }
+
+      // Scatter the item indices and check each chunk filled exactly the
+      // positions reserved for it
+      std::vector<std::vector<std::size_t> > end(nchunks);
+      for (std::size_t i = 0; i < nchunks; ++i) {
+        end[i] = (i + 1 < nchunks) ? chunks[i + 1].count
+                                   : std::vector<std::size_t>(offset_.begin() + 1,
+                                                              offset_.end());
+      }
+      indices_.resize(position);
+      run(chunks, scatter_job<Assign>(assign, indices_.begin()), nthreads);
+      for (std::size_t i = 0; i < nchunks; ++i) {
+        DIALS_ASSERT(chunks[i].count == end[i]);
+      }
+    }
+
+    /**
+     * @returns The number of buckets
+     */
+    std::size_t size() const {
+      return offset_.size() - 1;
+    }
+
+    /**
+     * @returns The items in the bucket
+     */
+    af::const_ref<std::size_t> indices(std::size_t index) const {
+      DIALS_ASSERT(index < size());
+      std::size_t i0 = offset_[index];
+      std::size_t i1 = offset_[index + 1];
+      DIALS_ASSERT(i1 >= i0);
+      DIALS_ASSERT(i1 <= indices_.size());
+      return af::const_ref<std::size_t>(indices_.begin() + i0, i1 - i0);
+    }
+
+    /**
+     * @returns The offset of each bucket
+     */
+    af::shared<std::size_t> offset() const {
+      return offset_;
+    }
+
+    /**
+     * @returns The items in bucket order
+     */
+    af::shared<std::size_t> indices() const {
+      return indices_;
+    }
+
+  private:
+    /**
+     * A contiguous range of items processed by one thread
+     */
+    struct chunk {
+      std::size_t first;
+      std::size_t last;
+      std::vector<std::size_t> count;
+      std::string error;
+    };
+
+    /**
+     * Count the items in each bucket
+     */
+    template <typename Assign>
+    struct count_job {
+      struct visitor {
+        std::vector<std::size_t> &count;
+        std::size_t nbuckets;
+        visitor(std::vector<std::size_t> &count_, std::size_t nbuckets_)
+            : count(count_), nbuckets(nbuckets_) {}
+        void operator()(std::size_t bucket) const {
+          DIALS_ASSERT(bucket < nbuckets);
+          count[bucket]++;
+        }
+      };
+
+      Assign assign;
+      std::size_t nbuckets;
+      count_job(Assign assign_, std::size_t nbuckets_)
+          : assign(assign_), nbuckets(nbuckets_) {}
+
+      void operator()(chunk &c) const {
+        visitor visit(c.count, nbuckets);
+        for (std::size_t i = c.first; i < c.last; ++i) {
+          assign(i, visit);
+        }
+      }
+    };
+
+    /**
+     * Write the items into their bucket positions
+     */
+    template <typename Assign>
+    struct scatter_job {
+      struct visitor {
+        std::vector<std::size_t> &position;
+        std::size_t *indices;
+        std::size_t item;
+        visitor(std::vector<std::size_t> &position_,
+                std::size_t *indices_,
+                std::size_t item_)
+            : position(position_), indices(indices_), item(item_) {}
+        void operator()(std::size_t bucket) const {
+          indices[position[bucket]++] = item;
+        }
+      };
+
+      Assign assign;
+      std::size_t *indices;
+      scatter_job(Assign assign_, std::size_t *indices_)
+          : assign(assign_), indices(indices_) {}
+
+      void operator()(chunk &c) const {
+        for (std::size_t i = c.first; i < c.last; ++i) {
+          assign(i, visitor(c.count, indices, i));
+        }
+      }
+    };
+
+    /**
+     * Call the job for a single chunk, catching any errors
+     */
+    template <typename Job>
+    struct chunk_runner {
+      Job job;
+      chunk *c;
+      chunk_runner(Job job_, chunk *c_) : job(job_), c(c_) {}
+      void operator()() const {
+        try {
+          job(*c);
+        } catch (const std::exception &e) {
+          c->error = e.what();
+        } catch (...) {
+          c->error = "Unknown error assigning items to buckets";
+        }
+      }
+    };
+
+    /**
+     * Run the job on each chunk, in parallel if requested
+     */
+    template <typename Job>
+    static void run(std::vector<chunk> &chunks, Job job, std::size_t nthreads) {
+      if (nthreads == 1 || chunks.size() == 1) {
+        for (std::size_t i = 0; i < chunks.size(); ++i) {
+          chunk_runner<Job>(job, &chunks[i])();
+        }
+      } else {
+        dials::util::ThreadPool pool(std::min(nthreads, chunks.size()));
+        for (std::size_t i = 0; i < chunks.size(); ++i) {
+          pool.post(chunk_runner<Job>(job, &chunks[i]));
+        }
+        pool.wait();
+      }
+      for (std::size_t i = 0; i < chunks.size(); ++i) {
+        if (!chunks[i].error.empty()) {
+          throw DIALS_ERROR(chunks[i].error);
+        }
+      }
+    }
+
+    af::shared<std::size_t> offset_;
+    af::shared<std::size_t> indices_;
+  };
+
+}}  // namespace dials::algorithms
+
+#endif  // DIALS_ALGORITHMS_INTEGRATION_INTERVAL_INDEX_H
@@ -24,6 +24,7 @@
 #include <dials/array_family/reflection_table.h>
 #include <dxtbx/array_family/flex_table_suite.h>
 #include <dials/array_family/boost_python/reflection_table_suite.h>
+#include <dials/algorithms/integration/interval_index.h>
 
 namespace dials { namespace algorithms {
 
@@ -52,42 +53,11 @@ namespace dials { namespace algorithms {
         DIALS_ASSERT(bbox[i][5] <= frames[1]);
       }
 
-      // Count the number of reflections on each image
-      std::vector<int> count(frames_.size(), 0);
-      for (std::size_t i = 0; i < bbox.size(); ++i) {
-        for (int j = bbox[i][4]; j < bbox[i][5]; ++j) {
-          int k = j - frames[0];
-          DIALS_ASSERT(k >= 0);
-          DIALS_ASSERT(k < count.size());
-          count[k]++;
-        }
-      }
-
-      // Compute offsests
-      offset_.push_back(0);
-      std::partial_sum(count.begin(), count.end(), std::back_inserter(offset_));
-      DIALS_ASSERT(offset_.size() == count.size() + 1);
-
-      // Compute indices
-      indices_.resize(offset_.back());
-      count.assign(count.size(), 0);
-      for (std::size_t i = 0; i < bbox.size(); ++i) {
-        for (int j = bbox[i][4]; j < bbox[i][5]; ++j) {
-          int k = j - frames[0];
-          DIALS_ASSERT(k >= 0);
-          DIALS_ASSERT(k < count.size());
-          std::size_t l = offset_[k] + count[k]++;
-          DIALS_ASSERT(l < offset_[k + 1]);
-          DIALS_ASSERT(l < indices_.size());
-          indices_[l] = i;
-        }
-      }
+      // Get which reflections are recorded on which image
+      BucketIndex index(bbox.size(), frames_.size(), assign_frames(bbox, frames[0]));
+      offset_ = index.offset();
+      indices_ = index.indices();
       DIALS_ASSERT(indices_.size() == bbox.size());
-
-      // Check we didn't make any mistakes
-      for (std::size_t i = 0; i < count.size(); ++i) {
-        DIALS_ASSERT(offset_[i] + count[i] == offset_[i + 1]);
-      }
     }
 
     /**
@@ -122,6 +92,25 @@ namespace dials { namespace algorithms {
     af::shared<int2> frames_;
     af::shared<std::size_t> offset_;
     af::shared<std::size_t> indices_;
+
+  private:
+    /**
+     * Assign each reflection to every image it is recorded on
+     */
+    struct assign_frames {
+      const af::const_ref<int6> &bbox;
+      int frame0;
+
+      assign_frames(const af::const_ref<int6> &bbox_, int frame0_)
+          : bbox(bbox_), frame0(frame0_) {}
+
+      template <typename Visitor>
+      void operator()(std::size_t index, Visitor visit) const {
+        for (int j = bbox[index][4]; j < bbox[index][5]; ++j) {
+          visit(j - frame0);
+        }
+      }
+    };
   };
 
   class ReflectionManagerPerImage {
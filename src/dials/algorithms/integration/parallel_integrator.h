@@ -13,6 +13,7 @@
 #define DIALS_ALGORITHMS_INTEGRATION_PARALLEL_INTEGRATOR_H
 
 #include <atomic>
+#include <memory>
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <dxtbx/model/beam.h>
 #include <dxtbx/model/detector.h>
@@ -23,6 +24,7 @@
 #include <dials/array_family/reflection.h>
 #include <dials/error.h>
 #include <dials/util/thread_pool.h>
+#include <dials/algorithms/integration/reflection_stream.h>
 #include <dials/algorithms/shoebox/find_overlapping.h>
 #include <dials/algorithms/integration/sum/summation.h>
 #include <dials/algorithms/centroid/centroid.h>
@@ -31,6 +33,7 @@
 #include <map>
 
 #include <dials/algorithms/integration/interfaces.h>
+#include <dials/algorithms/integration/interval_index.h>
 
 namespace dials { namespace algorithms {
 
@@ -525,12 +528,12 @@ namespace dials { namespace algorithms {
       reflection = reflection_list[index];
 
       // Get the adjacent reflections
-      adjacent_reflections.reserve(adjacency_list.vertex_num_edges(index));
-      AdjacencyList::edge_iterator_range edges = adjacency_list.edges(index);
-      for (AdjacencyList::edge_iterator it = edges.first; it != edges.second; ++it) {
-        DIALS_ASSERT(it->first == index);
-        DIALS_ASSERT(it->second < reflection_list.size());
-        adjacent_reflections.push_back(reflection_list[it->second]);
+      af::const_ref<AdjacencyList::vertex_index> adjacent =
+        adjacency_list.adjacent_vertices(index);
+      adjacent_reflections.reserve(adjacent.size());
+      for (std::size_t i = 0; i < adjacent.size(); ++i) {
+        DIALS_ASSERT(adjacent[i] < reflection_list.size());
+        adjacent_reflections.push_back(reflection_list[adjacent[i]]);
       }
     }
 
@@ -1117,7 +1120,7 @@ namespace dials { namespace algorithms {
       reset_flags(flags);
 
       // Find the overlapping reflections
-      AdjacencyList overlaps = find_overlapping_multi_panel(bbox, panel);
+      AdjacencyList overlaps = find_overlapping_multi_panel(bbox, panel, nthreads);
 
       // Allocate the array for the image data
       double mask_value = min_trusted - 1.0;
@@ -1337,7 +1340,7 @@ namespace dials { namespace algorithms {
      */
     SimpleBlockList(tiny<int, 2> range, int block_size) {
       construct_block_list(range, block_size);
-      construct_frame_to_block_lookup();
+      construct_index();
     }
 
     /**
@@ -1355,7 +1358,7 @@ namespace dials { namespace algorithms {
         DIALS_ASSERT(blocks[i][0] <= blocks[i - 1][1]);
         blocks_.push_back(blocks[i]);
       }
-      construct_frame_to_block_lookup();
+      construct_index();
     }
 
     /**
@@ -1395,16 +1398,7 @@ namespace dials { namespace algorithms {
      * @returns The block index
      */
     std::size_t block_index(int frame) const {
-      int index = frame - blocks_.front()[0];
-      if (index < 0) {
-        index = 0;
-      }
-      if (index >= frame_to_block_lookup_.size()) {
-        index = frame_to_block_lookup_.size() - 1;
-      }
-      DIALS_ASSERT(index >= 0);
-      DIALS_ASSERT(index < frame_to_block_lookup_.size());
-      return frame_to_block_lookup_[index];
+      return index_.closest(frame);
     }
 
   private:
@@ -1469,9 +1463,9 @@ namespace dials { namespace algorithms {
     }
 
     /**
-     * Construct the frame to block lookup table
+     * Construct the index used to find the block closest to a frame
      */
-    void construct_frame_to_block_lookup() {
+    void construct_index() {
       // Check all the jobs overlap and are in order
       for (std::size_t i = 0; i < blocks_.size() - 1; ++i) {
         DIALS_ASSERT(blocks_[i][0] < blocks_[i][1]);
@@ -1480,38 +1474,11 @@ namespace dials { namespace algorithms {
         DIALS_ASSERT(blocks_[i][1] >= blocks_[i + 1][0]);
         DIALS_ASSERT(blocks_[i][1] < blocks_[i + 1][1]);
       }
-
-      // set the first and last frames
-      int first_frame = blocks_.front()[0];
-      int last_frame = blocks_.back()[1];
-      DIALS_ASSERT(first_frame < last_frame);
-
-      // Loop through all the frames and find the block to which the frame is
-      // closest to the centre. Add the frame to that block
-      std::size_t closest_index = 0;
-      for (int frame = first_frame; frame < last_frame; ++frame) {
-        int z0 = blocks_[closest_index][0];
-        int z1 = blocks_[closest_index][1];
-        double zc = (z0 + z1) / 2.0;
-        double closest_distance = std::abs(zc - (frame + 0.5));
-        for (std::size_t i = closest_index + 1; i < blocks_.size(); ++i) {
-          int zz0 = blocks_[i][0];
-          int zz1 = blocks_[i][1];
-          double zzc = (zz0 + zz1) / 2.0;
-          double distance = std::abs(zzc - (frame + 0.5));
-          if (distance < closest_distance) {
-            closest_distance = distance;
-            closest_index = i;
-          } else {
-            break;
-          }
-        }
-        frame_to_block_lookup_.push_back(closest_index);
-      }
+      index_ = SortedIntervalIndex(blocks_);
     }
 
     std::vector<tiny<int, 2> > blocks_;
-    std::vector<std::size_t> frame_to_block_lookup_;
+    SortedIntervalIndex index_;
   };
 
   /**
@@ -1524,14 +1491,17 @@ namespace dials { namespace algorithms {
      * Construct the lookup
      * @param blocks The block list
      * @param data The reflections
+     * @param nthreads The number of threads used to build the lookup
      */
-    SimpleReflectionLookup(const SimpleBlockList &blocks, af::reflection_table data)
+    SimpleReflectionLookup(const SimpleBlockList &blocks,
+                           af::reflection_table data,
+                           std::size_t nthreads = 1)
         : blocks_(blocks), first_frame_(0), last_frame_(0) {
       // Split the reflections along block boundaries
       data_ = split_reflections(data);
 
       // Construct the lookup table
-      construct_block_to_reflection_lookup();
+      construct_block_to_reflection_lookup(nthreads);
     }
 
     /**
@@ -1547,9 +1517,7 @@ namespace dials { namespace algorithms {
      * @returns The list of reflection indices
      */
     af::const_ref<std::size_t> indices(std::size_t index) const {
-      DIALS_ASSERT(index < block_to_reflection_lookup_.size());
-      return af::const_ref<std::size_t>(&block_to_reflection_lookup_[index][0],
-                                        block_to_reflection_lookup_[index].size());
+      return block_to_reflection_lookup_.indices(index);
     }
 
     /**
@@ -1574,7 +1542,7 @@ namespace dials { namespace algorithms {
     /**
      * Create the lookup of reflections in each job
      */
-    void construct_block_to_reflection_lookup() {
+    void construct_block_to_reflection_lookup(std::size_t nthreads) {
       DIALS_ASSERT(data_.is_consistent());
       DIALS_ASSERT(data_.size() > 0);
       DIALS_ASSERT(data_.contains("bbox"));
@@ -1587,19 +1555,32 @@ namespace dials { namespace algorithms {
       // that range. Now find the block closest to that z point. Check that the
       // splitting has worked correctly and that the reflection is within the
       // block frame range. Then add the reflection to the list for the block.
-      block_to_reflection_lookup_.resize(blocks_.size());
-      for (std::size_t i = 0; i < bbox.size(); ++i) {
+      block_to_reflection_lookup_ =
+        BucketIndex(bbox.size(), blocks_.size(), assign_block(bbox, blocks_), nthreads);
+    }
+
+    /**
+     * Assign each reflection to the block closest to its centre
+     */
+    struct assign_block {
+      const af::const_ref<int6> &bbox;
+      const SimpleBlockList &blocks;
+
+      assign_block(const af::const_ref<int6> &bbox_, const SimpleBlockList &blocks_)
+          : bbox(bbox_), blocks(blocks_) {}
+
+      template <typename Visitor>
+      void operator()(std::size_t i, Visitor visit) const {
         int z0 = bbox[i][4];
         int z1 = bbox[i][5];
         int zc = (int)std::floor((z0 + z1) / 2.0);
-        int index = block_index(zc);
-        tiny<int, 2> block = block_range(index);
+        std::size_t index = blocks.block_index(zc);
+        tiny<int, 2> block = blocks[index];
         DIALS_ASSERT(z0 >= block[0]);
         DIALS_ASSERT(z1 <= block[1]);
-        DIALS_ASSERT(index < block_to_reflection_lookup_.size());
-        block_to_reflection_lookup_[index].push_back(i);
+        visit(index);
       }
-    }
+    };
 
     /**
      * Split the reflections overlapping job boundaries
@@ -1726,7 +1707,7 @@ namespace dials { namespace algorithms {
     int first_frame_;
     int last_frame_;
     af::reflection_table data_;
-    std::vector<std::vector<std::size_t> > block_to_reflection_lookup_;
+    BucketIndex block_to_reflection_lookup_;
   };
 
   /**
@@ -1738,14 +1719,18 @@ namespace dials { namespace algorithms {
      * Construct from the job list and reflection data
      * @param jobs The job list
      * @param data The reflection data
+     * @param njobs The number of jobs
+     * @param nthreads The number of threads used to build the lookup
      */
     SimpleReflectionManager(const SimpleBlockList &blocks,
                             af::reflection_table data,
-                            std::size_t njobs)
-        : lookup_(blocks, data),
+                            std::size_t njobs,
+                            std::size_t nthreads = 1)
+        : lookup_(blocks, data, nthreads),
           njobs_(std::min(njobs, blocks.size())),
           finished_(njobs_, false),
-          job_blocks_(njobs_) {
+          job_blocks_(njobs_),
+          keep_in_memory_(true) {
       DIALS_ASSERT(njobs_ > 0);
       std::size_t nblocks = blocks.size();
       DIALS_ASSERT(nblocks > 0);
@@ -1775,11 +1760,58 @@ namespace dials { namespace algorithms {
       DIALS_ASSERT(total_blocks_in_job_list == nblocks);
     }
 
+    /**
+     * Stream the results of each job to a chunked reflection file as soon as
+     * they are accumulated. The rows are written with their index in the
+     * lookup table, plus the offset, in the stream_index column. The rows in
+     * no job and the file index are written once all the jobs have finished.
+     * @param filename The output filename
+     * @param rows_per_group The number of rows in each row group
+     * @param compression_level The zlib compression level
+     * @param keep_in_memory Also merge the results into the input table
+     * @param append Append to an existing file
+     * @param index_offset The offset added to the row indices
+     */
+    void stream(const std::string &filename,
+                std::size_t rows_per_group,
+                int compression_level,
+                bool keep_in_memory,
+                bool append,
+                std::size_t index_offset) {
+      DIALS_ASSERT(finished_.all_eq(false));
+      stream_ = std::make_shared<ReflectionStream>(filename,
+                                                   rows_per_group,
+                                                   compression_level,
+                                                   append,
+                                                   index_offset,
+                                                   lookup_.data().size());
+      keep_in_memory_ = keep_in_memory;
+    }
+
+    /**
+     * @returns Are the results being streamed to file
+     */
+    bool streaming() const {
+      return stream_ != NULL;
+    }
+
+    /**
+     * @returns The row groups written to the stream file
+     */
+    af::shared<std::size_t> stream_row_groups() const {
+      DIALS_ASSERT(stream_ != NULL);
+      DIALS_ASSERT(finished());
+      return stream_->row_groups();
+    }
+
     /**
      * @returns The result data
      */
     af::reflection_table data() {
       DIALS_ASSERT(finished());
+      if (!keep_in_memory_) {
+        throw DIALS_ERROR("Reflections were streamed to file and not kept in memory");
+      }
       return lookup_.data();
     }
 
@@ -1935,12 +1967,22 @@ namespace dials { namespace algorithms {
       // Resize the input reflections to just those that were processed
       result.resize(indices.size());
 
-      // Get the data array
+      // Write the result to file
       af::reflection_table data = lookup_.data();
+      if (stream_ != NULL) {
+        stream_->write(data, indices.const_ref(), result);
+      }
 
       // Set the result in the lookup data
-      set_selected_rows_index(data, indices.const_ref(), result);
+      if (keep_in_memory_) {
+        set_selected_rows_index(data, indices.const_ref(), result);
+      }
+
+      // Set finished flag and write the rest of the file when done
       finished_[index] = true;
+      if (stream_ != NULL && finished()) {
+        stream_->close(data);
+      }
     }
 
   private:
@@ -1948,6 +1990,8 @@ namespace dials { namespace algorithms {
     std::size_t njobs_;
     af::shared<bool> finished_;
     af::shared<tiny<int, 2> > job_blocks_;
+    std::shared_ptr<ReflectionStream> stream_;
+    bool keep_in_memory_;
   };
 
 }}  // namespace dials::algorithms
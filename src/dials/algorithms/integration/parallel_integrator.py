@@ -7,7 +7,11 @@
 from libtbx import Auto
 
 import dials.algorithms.integration
-from dials.algorithms.integration.processor import NullTask, execute_parallel_task
+from dials.algorithms.integration.processor import (
+    NullTask,
+    execute_parallel_task,
+    read_streamed_reflections,
+)
 from dials.array_family import flex
 from dials.util import tabulate
 from dials.util.mp import multi_node_parallel_map
@@ -561,8 +565,19 @@ def initialize(self):
 
         # Create the reflection manager
         self.manager = SimpleReflectionManager(
-            self.blocks, self.reflections, self.params.integration.mp.njobs
+            self.blocks,
+            self.reflections,
+            self.params.integration.mp.njobs,
+            nthreads=self.params.integration.mp.nproc,
         )
+        stream = self.params.integration.stream
+        if stream.filename:
+            self.manager.stream(
+                stream.filename,
+                rows_per_group=stream.rows_per_group,
+                compression_level=stream.compression_level,
+                keep_in_memory=stream.keep_in_memory,
+            )
 
     def task(self, index):
         """
@@ -617,6 +632,11 @@ def result(self):
         :return: The result
         """
         assert self.finalized, "Manager is not finalized"
+        stream = self.params.integration.stream
+        if self.manager.streaming() and not stream.keep_in_memory:
+            return read_streamed_reflections(
+                stream.filename, self.manager.stream_row_groups()
+            )
         return self.manager.data()
 
     def finished(self):
@@ -1028,7 +1048,10 @@ def initialize(self):
 
         # Create the reflection manager
         self.manager = SimpleReflectionManager(
-            self.blocks, self.reflections, self.params.integration.mp.njobs
+            self.blocks,
+            self.reflections,
+            self.params.integration.mp.njobs,
+            nthreads=self.params.integration.mp.nproc,
         )
 
     def task(self, index):
@@ -167,12 +167,12 @@ namespace dials { namespace algorithms {
       reflection = reflection_list[index];
 
       // Get the adjacent reflections
-      adjacent_reflections.reserve(adjacency_list.vertex_num_edges(index));
-      AdjacencyList::edge_iterator_range edges = adjacency_list.edges(index);
-      for (AdjacencyList::edge_iterator it = edges.first; it != edges.second; ++it) {
-        DIALS_ASSERT(it->first == index);
-        DIALS_ASSERT(it->second < reflection_list.size());
-        adjacent_reflections.push_back(reflection_list[it->second]);
+      af::const_ref<AdjacencyList::vertex_index> adjacent =
+        adjacency_list.adjacent_vertices(index);
+      adjacent_reflections.reserve(adjacent.size());
+      for (std::size_t i = 0; i < adjacent.size(); ++i) {
+        DIALS_ASSERT(adjacent[i] < reflection_list.size());
+        adjacent_reflections.push_back(reflection_list[adjacent[i]]);
       }
     }
 
@@ -477,7 +477,7 @@ namespace dials { namespace algorithms {
       reset_flags(flags);
 
       // Find the overlapping reflections
-      AdjacencyList overlaps = find_overlapping_multi_panel(bbox, panel);
+      AdjacencyList overlaps = find_overlapping_multi_panel(bbox, panel, nthreads);
 
       // Allocate the array for the image data
       double mask_value = min_trusted - 1.0;
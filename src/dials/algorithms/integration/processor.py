@@ -27,6 +27,7 @@
     ReflectionManagerPerImage,
     ShoeboxProcessor,
 )
+from dials_array_family_flex_ext import ChunkedReflectionTableReader
 
 try:
     import resource
@@ -176,6 +177,28 @@ def update(self, other):
         self.separate_files = other.separate_files
 
 
+class Stream:
+    """
+    Streaming output parameters. The integrator sets append and index_offset
+    when it processes the reflections in more than one subset, so that each
+    subset is added to the same file.
+    """
+
+    def __init__(self):
+        self.filename = None
+        self.rows_per_group = 65536
+        self.compression_level = 1
+        self.keep_in_memory = True
+        self.append = False
+        self.index_offset = 0
+
+    def update(self, other):
+        self.filename = other.filename
+        self.rows_per_group = other.rows_per_group
+        self.compression_level = other.compression_level
+        self.keep_in_memory = other.keep_in_memory
+
+
 class Parameters:
     """
     Class to handle parameters for the processor
@@ -190,6 +213,7 @@ def __init__(self):
         self.block = Block()
         self.shoebox = Shoebox()
         self.debug = Debug()
+        self.stream = Stream()
 
     def update(self, other):
         """
@@ -200,6 +224,26 @@ def update(self, other):
         self.block.update(other.block)
         self.shoebox.update(other.shoebox)
         self.debug.update(other.debug)
+        self.stream.update(other.stream)
+
+
+def read_streamed_reflections(filename, row_groups):
+    """
+    Read back the reflections streamed to file by a reflection manager. The
+    rows are sorted into the order of the input table and the stream_index
+    column is removed.
+
+    :param filename: The stream filename
+    :param row_groups: The row groups written by the reflection manager
+    :return: The reflection table
+    """
+    reader = ChunkedReflectionTableReader(filename)
+    reflections = reader.read(row_groups, flex.std_string(reader.keys()))
+    reflections = reflections.select(
+        flex.sort_permutation(reflections["stream_index"])
+    )
+    del reflections["stream_index"]
+    return reflections
 
 
 def execute_parallel_task(task):
@@ -571,7 +615,18 @@ def initialize(self):
         self.compute_processors()
 
         # Create the reflection manager
-        self.manager = ReflectionManager(self.jobs, self.reflections)
+        self.manager = ReflectionManager(
+            self.jobs, self.reflections, nthreads=self.params.mp.nproc
+        )
+        if self.params.stream.filename:
+            self.manager.stream(
+                self.params.stream.filename,
+                rows_per_group=self.params.stream.rows_per_group,
+                compression_level=self.params.stream.compression_level,
+                keep_in_memory=self.params.stream.keep_in_memory,
+                append=self.params.stream.append,
+                index_offset=self.params.stream.index_offset,
+            )
 
         # Set the initialization time
         self.time.initialize = time() - start_time
@@ -639,6 +694,12 @@ def result(self):
         :return: The result
         """
         assert self.finalized, "Manager is not finalized"
+        stream = self.params.stream
+        if self.manager.streaming() and not stream.keep_in_memory:
+            reflections = read_streamed_reflections(
+                stream.filename, self.manager.stream_row_groups()
+            )
+            return reflections, self.data
         return self.manager.data(), self.data
 
     def finished(self):
@@ -0,0 +1,147 @@
+/*
+ * reflection_stream.h
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+#ifndef DIALS_ALGORITHMS_INTEGRATION_REFLECTION_STREAM_H
+#define DIALS_ALGORITHMS_INTEGRATION_REFLECTION_STREAM_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <dials/array_family/reflection_table.h>
+#include <dials/array_family/reflection_table_chunked_file.h>
+#include <dxtbx/array_family/flex_table_suite.h>
+#include <dials/array_family/boost_python/reflection_table_suite.h>
+#include <dials/error.h>
+
+namespace dials { namespace algorithms {
+
+  /**
+   * Write the rows of a reflection table to a chunked reflection file as the
+   * jobs processing them finish. Jobs finish in any order, so each row is
+   * written with its index in the input table, plus an offset, in the
+   * stream_index column; reading the rows back and sorting them on this
+   * column gives the input order. The rows written are the same as those
+   * the reflection managers merge into the input table in memory: the input
+   * columns of the row updated with the columns of the result. Rows which
+   * are in no job are written with the input values when the stream is
+   * closed.
+   */
+  class ReflectionStream {
+  public:
+    /**
+     * Open the file
+     * @param filename The output filename
+     * @param rows_per_group The number of rows in each row group
+     * @param compression_level The zlib compression level
+     * @param append Append to an existing file
+     * @param index_offset The offset added to the row indices
+     * @param nrows The number of rows in the input table
+     */
+    ReflectionStream(const std::string &filename,
+                     std::size_t rows_per_group,
+                     int compression_level,
+                     bool append,
+                     std::size_t index_offset,
+                     std::size_t nrows)
+        : writer_(filename, rows_per_group, compression_level, append),
+          index_offset_(index_offset),
+          written_(nrows, false),
+          first_group_(writer_.n_row_groups()),
+          last_group_(first_group_),
+          has_columns_(false) {}
+
+    /**
+     * Write the result of a job
+     * @param data The input table
+     * @param index The rows of the input table processed by the job
+     * @param result The result of the job
+     */
+    void write(af::reflection_table data,
+               const af::const_ref<std::size_t> &index,
+               af::reflection_table result) {
+      using dials::af::boost_python::reflection_table_suite::select_rows_index;
+      using dxtbx::af::flex_table_suite::set_selected_rows_index;
+      DIALS_ASSERT(index.size() == result.size());
+      if (index.size() == 0) {
+        return;
+      }
+      af::reflection_table rows = select_rows_index(data, index);
+      af::shared<std::size_t> all(index.size());
+      for (std::size_t i = 0; i < index.size(); ++i) {
+        DIALS_ASSERT(index[i] < written_.size());
+        DIALS_ASSERT(written_[index[i]] == false);
+        written_[index[i]] = true;
+        all[i] = i;
+      }
+      set_selected_rows_index(rows, all.const_ref(), result);
+      if (!has_columns_) {
+        columns_ = select_rows_index(rows, af::const_ref<std::size_t>(0, 0));
+        has_columns_ = true;
+      }
+      write_rows(rows, index);
+    }
+
+    /**
+     * Write the rows which were in no job and the file index
+     * @param data The input table
+     */
+    void close(af::reflection_table data) {
+      using dials::af::boost_python::reflection_table_suite::select_rows_index;
+      using dxtbx::af::flex_table_suite::set_selected_rows_index;
+      af::shared<std::size_t> index;
+      for (std::size_t i = 0; i < written_.size(); ++i) {
+        if (!written_[i]) {
+          index.push_back(i);
+        }
+      }
+      if (index.size() > 0) {
+        af::reflection_table rows = select_rows_index(data, index.const_ref());
+        if (has_columns_) {
+          set_selected_rows_index(rows, af::const_ref<std::size_t>(0, 0), columns_);
+        }
+        write_rows(rows, index.const_ref());
+      }
+      writer_.close();
+      last_group_ = writer_.n_row_groups();
+    }
+
+    /**
+     * @returns The row groups written to the file by this stream
+     */
+    af::shared<std::size_t> row_groups() const {
+      af::shared<std::size_t> result;
+      for (std::size_t i = first_group_; i < last_group_; ++i) {
+        result.push_back(i);
+      }
+      return result;
+    }
+
+  private:
+    /**
+     * Write the rows with their index and flush them to disk
+     */
+    void write_rows(af::reflection_table rows,
+                    const af::const_ref<std::size_t> &index) {
+      af::shared<std::size_t> stream_index = rows["stream_index"];
+      for (std::size_t i = 0; i < index.size(); ++i) {
+        stream_index[i] = index_offset_ + index[i];
+      }
+      writer_.write(rows);
+      writer_.flush();
+    }
+
+    af::ChunkedReflectionTableWriter writer_;
+    std::size_t index_offset_;
+    std::vector<bool> written_;
+    std::size_t first_group_;
+    std::size_t last_group_;
+    af::reflection_table columns_;
+    bool has_columns_;
+  };
+
+}}  // namespace dials::algorithms
+
+#endif  // DIALS_ALGORITHMS_INTEGRATION_REFLECTION_STREAM_H
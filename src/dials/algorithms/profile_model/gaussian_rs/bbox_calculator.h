@@ -23,6 +23,7 @@
 #include <dxtbx/model/scan.h>
 #include <dials/array_family/scitbx_shared_and_versa.h>
 #include <dials/algorithms/profile_model/gaussian_rs/coordinate_system.h>
+#include <dials/algorithms/profile_model/gaussian_rs/parallel_calculator.h>
 
 namespace dials {
   namespace algorithms {
@@ -45,6 +46,26 @@ namespace dials {
   using std::ceil;
   using std::floor;
 
+  namespace detail {
+
+    /**
+     * Compute the bounding box of a single reflection
+     */
+    template <typename Calculator>
+    struct bbox_function {
+      const Calculator *calculator;
+      const vec3<double> *s1;
+      const double *frame;
+      const std::size_t *panel;
+      int6 *result;
+
+      void operator()(std::size_t i) const {
+        result[i] = calculator->single(s1[i], frame[i], panel[i]);
+      }
+    };
+
+  }  // namespace detail
+
   /**
    * Interface for bounding box calculator.
    */
@@ -57,6 +78,27 @@ namespace dials {
     virtual af::shared<int6> array(const af::const_ref<vec3<double> > &s1,
                                    const af::const_ref<double> &frame,
                                    const af::const_ref<std::size_t> &panel) const = 0;
+
+    /**
+     * Calculate the bounding boxes for an array of reflections, split into
+     * chunks on multiple threads. The result is the same as that of array.
+     * @param s1 The array of diffracted beam vectors
+     * @param frame The array of frame numbers.
+     * @param panel The array of panel numbers
+     * @param nthreads The number of threads
+     */
+    af::shared<int6> parallel_array(const af::const_ref<vec3<double> > &s1,
+                                    const af::const_ref<double> &frame,
+                                    const af::const_ref<std::size_t> &panel,
+                                    std::size_t nthreads) const {
+      DIALS_ASSERT(s1.size() == frame.size());
+      DIALS_ASSERT(s1.size() == panel.size());
+      af::shared<int6> result(s1.size(), af::init_functor_null<int6>());
+      detail::bbox_function<BBoxCalculatorIface> function = {
+        this, s1.begin(), frame.begin(), panel.begin(), result.begin()};
+      detail::run_calculator(function, s1.size(), nthreads);
+      return result;
+    }
   };
 
   /** Calculate the bounding box for each reflection */
@@ -375,23 +417,44 @@ namespace dials {
      * @param s1 The array of diffracted beam vectors
      * @param phi The array of rotation angles.
      * @param panel The panel number
+     * @param nthreads The number of threads
      */
     af::shared<int6> operator()(const af::const_ref<std::size_t> &id,
                                 const af::const_ref<vec3<double> > &s1,
                                 const af::const_ref<double> &phi,
-                                const af::const_ref<std::size_t> &panel) const {
+                                const af::const_ref<std::size_t> &panel,
+                                std::size_t nthreads = 1) const {
       DIALS_ASSERT(s1.size() == id.size());
       DIALS_ASSERT(s1.size() == phi.size());
       DIALS_ASSERT(s1.size() == panel.size());
-      af::shared<int6> result(s1.size(), af::init_functor_null<int6>());
-      for (std::size_t i = 0; i < s1.size(); ++i) {
+      for (std::size_t i = 0; i < id.size(); ++i) {
         DIALS_ASSERT(id[i] < size());
-        result[i] = compute_[id[i]]->single(s1[i], phi[i], panel[i]);
       }
+      af::shared<int6> result(s1.size(), af::init_functor_null<int6>());
+      single_function function = {
+        this, id.begin(), s1.begin(), phi.begin(), panel.begin(), result.begin()};
+      detail::run_calculator(function, s1.size(), nthreads);
       return result;
     }
 
   private:
+    /**
+     * Compute the bounding box of a single reflection with the calculator
+     * for its experiment
+     */
+    struct single_function {
+      const BBoxMultiCalculator *calculator;
+      const std::size_t *id;
+      const vec3<double> *s1;
+      const double *phi;
+      const std::size_t *panel;
+      int6 *result;
+
+      void operator()(std::size_t i) const {
+        result[i] = calculator->compute_[id[i]]->single(s1[i], phi[i], panel[i]);
+      }
+    };
+
     std::vector<std::shared_ptr<BBoxCalculatorIface> > compute_;
   };
 
@@ -179,7 +179,10 @@ namespace dials {
              (arg("s1"), arg("frame"), arg("panel")))
         .def("__call__",
              &BBoxCalculatorIface::array,
-             (arg("s1"), arg("frame"), arg("panel")));
+             (arg("s1"), arg("frame"), arg("panel")))
+        .def("__call__",
+             &BBoxCalculatorIface::parallel_array,
+             (arg("s1"), arg("frame"), arg("panel"), arg("nthreads")));
 
       class_<BBoxCalculator3D, bases<BBoxCalculatorIface> >("BBoxCalculator3D", no_init)
         .def(init<const BeamBase&,
@@ -215,7 +218,9 @@ namespace dials {
       class_<BBoxMultiCalculator>("BBoxMultiCalculator")
         .def("append", &BBoxMultiCalculator::push_back)
         .def("__len__", &BBoxMultiCalculator::size)
-        .def("__call__", &BBoxMultiCalculator::operator());
+        .def("__call__",
+             &BBoxMultiCalculator::operator(),
+             (arg("id"), arg("s1"), arg("frame"), arg("panel"), arg("nthreads") = 1));
 
       class_<MaskCalculatorIface, boost::noncopyable>("MaskCalculatorIface", no_init)
         .def("__call__",
@@ -226,7 +231,10 @@ namespace dials {
              (arg("shoebox"), arg("s1"), arg("frame"), arg("panel")))
         .def("__call__",
              &MaskCalculatorIface::volume,
-             (arg("volume"), arg("bbox"), arg("s1"), arg("frame"), arg("panel")));
+             (arg("volume"), arg("bbox"), arg("s1"), arg("frame"), arg("panel")))
+        .def("__call__",
+             &MaskCalculatorIface::parallel_array,
+             (arg("shoebox"), arg("s1"), arg("frame"), arg("panel"), arg("nthreads")));
 
       class_<PartialityCalculatorIface, boost::noncopyable>("PartialityCalculatorIface",
                                                             no_init)
@@ -235,7 +243,10 @@ namespace dials {
              (arg("s1"), arg("frame"), arg("bbox")))
         .def("__call__",
              &PartialityCalculatorIface::array,
-             (arg("s1"), arg("frame"), arg("bbox")));
+             (arg("s1"), arg("frame"), arg("bbox")))
+        .def("__call__",
+             &PartialityCalculatorIface::parallel_array,
+             (arg("s1"), arg("frame"), arg("bbox"), arg("nthreads")));
 
       class_<PartialityCalculator3D, bases<PartialityCalculatorIface> >(
         "PartialityCalculator3D", no_init)
@@ -254,7 +265,9 @@ namespace dials {
       class_<PartialityMultiCalculator>("PartialityMultiCalculator")
         .def("append", &PartialityMultiCalculator::push_back)
         .def("__len__", &PartialityMultiCalculator::size)
-        .def("__call__", &PartialityMultiCalculator::operator());
+        .def("__call__",
+             &PartialityMultiCalculator::operator(),
+             (arg("id"), arg("s1"), arg("frame"), arg("bbox"), arg("nthreads") = 1));
 
       class_<MaskCalculator3D, bases<MaskCalculatorIface> >("MaskCalculator3D", no_init)
         .def(init<const BeamBase&,
@@ -290,7 +303,14 @@ namespace dials {
       class_<MaskMultiCalculator>("MaskMultiCalculator")
         .def("append", &MaskMultiCalculator::push_back)
         .def("__len__", &MaskMultiCalculator::size)
-        .def("__call__", &MaskMultiCalculator::operator());
+        .def("__call__",
+             &MaskMultiCalculator::operator(),
+             (arg("id"),
+              arg("shoebox"),
+              arg("s1"),
+              arg("frame"),
+              arg("panel"),
+              arg("nthreads") = 1));
 
       def("ideal_profile_float", &ideal_profile<float>);
       def("ideal_profile_double", &ideal_profile<double>);
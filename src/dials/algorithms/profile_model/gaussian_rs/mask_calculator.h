@@ -11,16 +11,22 @@
 #ifndef DIALS_ALGORITHMS_PROFILE_MODEL_GAUSSIAN_RS_MASK_FOREGROUND_H
 #define DIALS_ALGORITHMS_PROFILE_MODEL_GAUSSIAN_RS_MASK_FOREGROUND_H
 
+#include <cmath>
 #include <memory>
+#include <typeinfo>
+#include <vector>
 #include <scitbx/vec2.h>
 #include <scitbx/vec3.h>
+#include <scitbx/mat3.h>
 #include <dxtbx/model/beam.h>
 #include <dxtbx/model/goniometer.h>
 #include <dxtbx/model/detector.h>
+#include <dxtbx/model/pixel_to_millimeter.h>
 #include <dxtbx/model/scan.h>
 #include <dials/model/data/shoebox.h>
 #include <dials/model/data/image_volume.h>
 #include <dials/algorithms/profile_model/gaussian_rs/coordinate_system.h>
+#include <dials/algorithms/profile_model/gaussian_rs/parallel_calculator.h>
 #include <dials/algorithms/shoebox/mask_code.h>
 #include <dials/error.h>
 
@@ -41,10 +47,80 @@ namespace dials {
   using dxtbx::model::Goniometer;
   using dxtbx::model::Panel;
   using dxtbx::model::Scan;
+  using dxtbx::model::SimplePxMmStrategy;
+  using scitbx::mat3;
   using scitbx::vec2;
   using scitbx::vec3;
   using scitbx::af::int6;
 
+  namespace detail {
+
+    /**
+     * Mask the shoebox of a single reflection
+     */
+    template <typename Calculator>
+    struct mask_function {
+      const Calculator *calculator;
+      Shoebox<> *shoeboxes;
+      const vec3<double> *s1;
+      const double *frame;
+      const std::size_t *panel;
+
+      void operator()(std::size_t i) const {
+        calculator->single(shoeboxes[i], s1[i], frame[i], panel[i]);
+      }
+    };
+
+    /**
+     * Mark the pixels of a slice by their e1/e2 distance alone
+     */
+    struct footprint_shoebox {
+      static const bool use_e3 = false;
+
+      static void mask_slice(int *mask, const double *dxy, std::size_t n, double) {
+        for (std::size_t p = 0; p < n; ++p) {
+          mask[p] |= (dxy[p] <= 1.0) ? Foreground : Background;
+        }
+      }
+    };
+
+    /**
+     * Mask a flattened shoebox. The single slice holds the sum over the
+     * frames, so it gets the footprint of the reflection.
+     */
+    struct flat_shoebox : footprint_shoebox {
+      static const bool flat = true;
+    };
+
+    /**
+     * Mask a shoebox with one slice per frame. Each frame in the scan gets
+     * the same foreground/background footprint.
+     */
+    struct normal_shoebox : footprint_shoebox {
+      static const bool flat = false;
+    };
+
+    /**
+     * Mark the pixels of a shoebox which are inside the ellipsoid of an
+     * adjacent reflection as overlapped. The e3 distance of the frame is
+     * added to the e1/e2 distance of each pixel.
+     */
+    struct adjacent_shoebox {
+      static const bool flat = false;
+      static const bool use_e3 = true;
+
+      static void mask_slice(int *mask,
+                             const double *dxy,
+                             std::size_t n,
+                             double gzc2) {
+        for (std::size_t p = 0; p < n; ++p) {
+          mask[p] |= (dxy[p] + gzc2 <= 1.0) ? Overlapped : 0;
+        }
+      }
+    };
+
+  }  // namespace detail
+
   /**
    * Interface for bounding mask calculator.
    */
@@ -69,6 +145,30 @@ namespace dials {
       const af::const_ref<vec3<double> > &s1,
       const af::const_ref<double> &frame,
       const af::const_ref<std::size_t> &panel) const = 0;
+
+    /**
+     * Mask the shoeboxes of an array of reflections, split into chunks on
+     * multiple threads. Each shoebox is only written by one thread, so the
+     * result is the same as that of array. Masking an image volume writes
+     * pixels shared between reflections, so that stays serial.
+     * @param shoeboxes The shoebox list
+     * @param s1 The list of beam vectors
+     * @param frame The list of frame numbers
+     * @param panel The list of panel numbers
+     * @param nthreads The number of threads
+     */
+    void parallel_array(af::ref<Shoebox<> > shoeboxes,
+                        const af::const_ref<vec3<double> > &s1,
+                        const af::const_ref<double> &frame,
+                        const af::const_ref<std::size_t> &panel,
+                        std::size_t nthreads) const {
+      DIALS_ASSERT(shoeboxes.size() == s1.size());
+      DIALS_ASSERT(shoeboxes.size() == frame.size());
+      DIALS_ASSERT(shoeboxes.size() == panel.size());
+      detail::mask_function<MaskCalculatorIface> function = {
+        this, shoeboxes.begin(), s1.begin(), frame.begin(), panel.begin()};
+      detail::run_calculator(function, shoeboxes.size(), nthreads);
+    }
   };
 
   /**
@@ -155,9 +255,11 @@ namespace dials {
                         bool adjacent = false) const {
       DIALS_ASSERT(shoebox.is_consistent());
       if (shoebox.flat) {
-        single_flat(shoebox, s1, frame, panel);
+        single_kernel<detail::flat_shoebox>(shoebox, s1, frame, panel);
+      } else if (adjacent) {
+        single_kernel<detail::adjacent_shoebox>(shoebox, s1, frame, panel);
       } else {
-        single_normal(shoebox, s1, frame, panel, adjacent);
+        single_kernel<detail::normal_shoebox>(shoebox, s1, frame, panel);
       }
     }
 
@@ -251,7 +353,6 @@ namespace dials {
 
       // Create the coordinate system and generators
       CoordinateSystem cs(m2_, s0_, s1, phi);
-      double s0_length = s0_.length();
 
       // Loop through all the pixels in the shoebox, transform the point
       // to the reciprocal space coordinate system and check that it is
@@ -261,14 +362,8 @@ namespace dials {
       // Background.
 
       af::versa<double, af::c_grid<2> > dxy_array(af::c_grid<2>(ysize + 1, xsize + 1));
-      for (int j = 0; j <= ysize; ++j) {
-        for (int i = 0; i <= xsize; ++i) {
-          vec2<double> gxy = cs.from_beam_vector(
-            panel.get_pixel_lab_coord(vec2<double>(x0 + i, y0 + j)).normalize()
-            * s0_length);
-          dxy_array(j, i) = (gxy[0] * gxy[0] + gxy[1] * gxy[1]) * delta_b_r2;
-        }
-      }
+      corner_distance(
+        panel, cs, x0, y0, xsize, ysize, delta_b_r2, false, 0.0, dxy_array.begin());
 
       int num1 = 0;
       int num2 = 0;
@@ -299,17 +394,90 @@ namespace dials {
     }
 
     /**
-     * Set all the foreground/background pixels in the shoebox mask.
+     * Compute (c1^2 + c2^2) / delta_b^2 at the pixel corners of a shoebox.
+     * With the simple pixel to millimetre conversion the lab coordinate of a
+     * corner is a fast axis term for its column plus a slow axis term for its
+     * row plus the origin, added in the same order as get_pixel_lab_coord, so
+     * the terms are computed once per column and row. Other conversions, such
+     * as parallax correction, go through the panel for every corner.
+     * @param panel The panel
+     * @param cs The coordinate system of the reflection
+     * @param x0 The first column
+     * @param y0 The first row
+     * @param xsize The number of columns
+     * @param ysize The number of rows
+     * @param delta_b_r2 1 / delta_b^2
+     * @param attenuate Use the attenuation length in the conversion
+     * @param attenuation_length The attenuation length
+     * @param dxy The (ysize + 1) x (xsize + 1) corner distances
+     */
+    void corner_distance(const Panel &panel,
+                         const CoordinateSystem &cs,
+                         int x0,
+                         int y0,
+                         int xsize,
+                         int ysize,
+                         double delta_b_r2,
+                         bool attenuate,
+                         double attenuation_length,
+                         double *dxy) const {
+      double s0_length = s0_.length();
+      vec3<double> s1 = cs.s1();
+      double s1_length = s1.length();
+      DIALS_ASSERT(s1_length > 0);
+      vec3<double> scaled_e1 = cs.e1_axis() / s1_length;
+      vec3<double> scaled_e2 = cs.e2_axis() / s1_length;
+      if (typeid(*panel.get_px_mm_strategy()) == typeid(SimplePxMmStrategy)) {
+        vec2<double> pixel_size = panel.get_pixel_size();
+        mat3<double> d = panel.get_d_matrix();
+        vec3<double> fast(d[0], d[3], d[6]);
+        vec3<double> slow(d[1], d[4], d[7]);
+        vec3<double> origin(d[2], d[5], d[8]);
+        std::vector<vec3<double> > column(xsize + 1);
+        for (int i = 0; i <= xsize; ++i) {
+          column[i] = fast * ((double)(x0 + i) * pixel_size[0]);
+        }
+        for (int j = 0; j <= ysize; ++j) {
+          vec3<double> row = slow * ((double)(y0 + j) * pixel_size[1]);
+          for (int i = 0; i <= xsize; ++i) {
+            vec3<double> ds =
+              ((column[i] + row) + origin).normalize() * s0_length - s1;
+            double c1 = scaled_e1 * ds;
+            double c2 = scaled_e2 * ds;
+            *dxy++ = (c1 * c1 + c2 * c2) * delta_b_r2;
+          }
+        }
+      } else {
+        for (int j = 0; j <= ysize; ++j) {
+          for (int i = 0; i <= xsize; ++i) {
+            vec2<double> xy(x0 + i, y0 + j);
+            vec3<double> lab = attenuate
+                                 ? panel.get_pixel_lab_coord(xy, attenuation_length)
+                                 : panel.get_pixel_lab_coord(xy);
+            vec3<double> ds = lab.normalize() * s0_length - s1;
+            double c1 = scaled_e1 * ds;
+            double c2 = scaled_e2 * ds;
+            *dxy++ = (c1 * c1 + c2 * c2) * delta_b_r2;
+          }
+        }
+      }
+    }
+
+    /**
+     * Set the pixels in the shoebox mask. The layout of the shoebox decides
+     * which slices are masked and with what. The e1/e2 distance of a pixel
+     * is the same on every frame, so it is computed once and used for all
+     * the slices, and the e3 distance is computed once per frame.
      * @param shoebox The shoebox to mask
      * @param s1 The beam vector
      * @param frame The frame number
      * @param panel The panel number
      */
-    void single_normal(Shoebox<> &shoebox,
+    template <typename Layout>
+    void single_kernel(Shoebox<> &shoebox,
                        vec3<double> s1,
                        double frame,
-                       std::size_t panel_number,
-                       bool adjacent = false) const {
+                       std::size_t panel_number) const {
       // Get some bits from the shoebox
       af::ref<int, af::c_grid<3> > mask = shoebox.mask.ref();
       int6 bbox = shoebox.bbox;
@@ -346,147 +514,77 @@ namespace dials {
       const Panel &panel = detector_[panel_number];
 
       // Check the size of the mask
-      DIALS_ASSERT(mask.accessor()[0] == zsize);
+      if (Layout::flat) {
+        DIALS_ASSERT(mask.accessor()[0] == 1);
+        DIALS_ASSERT(zsize >= 1);
+      } else {
+        DIALS_ASSERT(mask.accessor()[0] == zsize);
+      }
       DIALS_ASSERT(mask.accessor()[1] == ysize);
       DIALS_ASSERT(mask.accessor()[2] == xsize);
 
       // Create the coordinate system and generators
       CoordinateSystem cs(m2_, s0_, s1, phi);
-      double s0_length = s0_.length();
-
-      // Loop through all the pixels in the shoebox, transform the point
-      // to the reciprocal space coordinate system and check that it is
-      // within the ellipse defined by:
-      // (c1 / delta_b)^2 + (c2 / delta_b)^2 <= 1
-      // Mark those points within as Foreground and those without as
-      // Background.
-
-      vec2<double> shoebox_centroid_px = panel.get_ray_intersection_px(s1);
-      double attenuation_length = panel.attenuation_length(shoebox_centroid_px);
 
-      af::versa<double, af::c_grid<2> > dxy_array(af::c_grid<2>(ysize + 1, xsize + 1));
-      for (int j = 0; j <= ysize; ++j) {
-        for (int i = 0; i <= xsize; ++i) {
-          vec2<double> gxy = cs.from_beam_vector(
-            panel.get_pixel_lab_coord(vec2<double>(x0 + i, y0 + j), attenuation_length)
-              .normalize()
-            * s0_length);
-          dxy_array(j, i) = (gxy[0] * gxy[0] + gxy[1] * gxy[1]) * delta_b_r2;
-        }
+      // Shoeboxes which are not flat use the parallax correction at the
+      // position of the reflection
+      double attenuation_length = 0.0;
+      if (!Layout::flat) {
+        vec2<double> shoebox_centroid_px = panel.get_ray_intersection_px(s1);
+        attenuation_length = panel.attenuation_length(shoebox_centroid_px);
       }
 
+      // Transform the pixel corners to the reciprocal space coordinate system
+      // and give each pixel the smallest e1/e2 distance of its corners. The
+      // points within the ellipse defined by:
+      // (c1 / delta_b)^2 + (c2 / delta_b)^2 <= 1
+      // are marked as Foreground and those without as Background.
+      std::size_t npixels = (std::size_t)ysize * xsize;
+      if (npixels == 0) {
+        return;
+      }
+      std::vector<double> corners((ysize + 1) * (xsize + 1));
+      corner_distance(panel,
+                      cs,
+                      x0,
+                      y0,
+                      xsize,
+                      ysize,
+                      delta_b_r2,
+                      !Layout::flat,
+                      attenuation_length,
+                      &corners[0]);
+      std::vector<double> dxy(npixels);
       for (int j = 0; j < ysize; ++j) {
+        const double *row1 = &corners[j * (xsize + 1)];
+        const double *row2 = row1 + xsize + 1;
+        double *out = &dxy[0] + j * xsize;
         for (int i = 0; i < xsize; ++i) {
-          double dxy1 = dxy_array(j, i);
-          double dxy2 = dxy_array(j + 1, i);
-          double dxy3 = dxy_array(j, i + 1);
-          double dxy4 = dxy_array(j + 1, i + 1);
-          double dxy = std::min(std::min(dxy1, dxy2), std::min(dxy3, dxy4));
-          for (std::size_t k = 0; k < zsize; ++k) {
-            if (z0 + (int)k >= index0_ && z0 + (int)k < index1_) {
-              double gz1 =
-                cs.from_rotation_angle_fast(phi0_ + (z0 + k - index0_) * dphi_);
-              double gz2 =
-                cs.from_rotation_angle_fast(phi0_ + (z0 + k + 1 - index0_) * dphi_);
-              double gz = std::abs(gz1) < std::abs(gz2) ? gz1 : gz2;
-              double gzc2 = gz * gz * delta_m_r2;
-              /* int mask_value = (dxy + gzc2 <= 1.0) ? Foreground : Background; */
-              if (!adjacent) {
-                int mask_value = (dxy <= 1.0) ? Foreground : Background;
-                mask(k, j, i) |= mask_value;
-              } else {
-                if (dxy + gzc2 <= 1.0) {
-                  mask(k, j, i) |= Overlapped;
-                }
-              }
-            }
-          }
+          out[i] =
+            std::min(std::min(row1[i], row2[i]), std::min(row1[i + 1], row2[i + 1]));
         }
       }
-    }
-
-    /**
-     * Set all the foreground/background pixels in the shoebox mask.
-     * @param shoebox The shoebox to mask
-     * @param s1 The beam vector
-     * @param frame The frame number
-     * @param panel The panel number
-     */
-    void single_flat(Shoebox<> &shoebox,
-                     vec3<double> s1,
-                     double frame,
-                     std::size_t panel_number) const {
-      // Get some bits from the shoebox
-      af::ref<int, af::c_grid<3> > mask = shoebox.mask.ref();
-      int6 bbox = shoebox.bbox;
-      double phi = phi0_ + (frame - index0_) * dphi_;
-      int x0 = bbox[0], x1 = bbox[1];
-      int y0 = bbox[2], y1 = bbox[3];
-      int z0 = bbox[4], z1 = bbox[5];
-      int xsize = x1 - x0;
-      int ysize = y1 - y0;
-      int zsize = z1 - z0;
 
-      // Get the divergence and mosaicity for this point
-      double delta_b_r2 = 0.0;
-      // double delta_m_r2 = 0.0;
-      if (delta_b_r_.size() == 1) {
-        delta_b_r2 = delta_b_r_[0] * delta_b_r_[0];
-        // delta_m_r2 = delta_m_r_[0]*delta_m_r_[0];
-      } else {
-        int frame0 = index0_;
-        int index = (int)std::floor(frame) - frame0;
-        if (index < 0) {
-          delta_b_r2 = delta_b_r_.front() * delta_b_r_.front();
-          // delta_m_r2 = delta_m_r_.front()*delta_m_r_.front();
-        } else if (index >= delta_b_r_.size()) {
-          delta_b_r2 = delta_b_r_.back() * delta_b_r_.back();
-          // delta_m_r2 = delta_m_r_.back()*delta_m_r_.back();
-        } else {
-          delta_b_r2 = delta_b_r_[index] * delta_b_r_[index];
-          // delta_m_r2 = delta_m_r_[index]*delta_m_r_[index];
-        }
+      // A flat shoebox has a single slice. Otherwise only the frames within
+      // the scan are masked, with the e3 distance of the closest frame edge
+      // when the layout needs it.
+      if (Layout::flat) {
+        Layout::mask_slice(mask.begin(), &dxy[0], npixels, 0.0);
+        return;
       }
-
-      // Get the panel
-      const Panel &panel = detector_[panel_number];
-
-      // Check the size of the mask
-      DIALS_ASSERT(mask.accessor()[0] == 1);
-      DIALS_ASSERT(zsize >= 1);
-      DIALS_ASSERT(mask.accessor()[1] == ysize);
-      DIALS_ASSERT(mask.accessor()[2] == xsize);
-
-      // Create the coordinate system and generators
-      CoordinateSystem cs(m2_, s0_, s1, phi);
-
-      double s0_length = s0_.length();
-
-      // Loop through all the pixels in the shoebox, transform the point
-      // to the reciprocal space coordinate system and check that it is
-      // within the ellipse defined by:
-      // (c1 / delta_b)^2 + (c2 / delta_b)^2 <= 1
-      // Mark those points within as Foreground and those without as
-      // Background.
-      af::versa<double, af::c_grid<2> > dxy_array(af::c_grid<2>(ysize + 1, xsize + 1));
-      for (int j = 0; j <= ysize; ++j) {
-        for (int i = 0; i <= xsize; ++i) {
-          vec2<double> gxy = cs.from_beam_vector(
-            panel.get_pixel_lab_coord(vec2<double>(x0 + i, y0 + j)).normalize()
-            * s0_length);
-          dxy_array(j, i) = (gxy[0] * gxy[0] + gxy[1] * gxy[1]) * delta_b_r2;
+      for (int k = 0; k < zsize; ++k) {
+        int z = z0 + k;
+        if (z < index0_ || z >= index1_) {
+          continue;
         }
-      }
-      for (int j = 0; j < ysize; ++j) {
-        for (int i = 0; i < xsize; ++i) {
-          double dxy1 = dxy_array(j, i);
-          double dxy2 = dxy_array(j + 1, i);
-          double dxy3 = dxy_array(j, i + 1);
-          double dxy4 = dxy_array(j + 1, i + 1);
-          double dxy = std::min(std::min(dxy1, dxy2), std::min(dxy3, dxy4));
-          int mask_value = (dxy <= 1.0) ? Foreground : Background;
-          mask(0, j, i) |= mask_value;
+        double gzc2 = 0.0;
+        if (Layout::use_e3) {
+          double gz1 = cs.from_rotation_angle_fast(phi0_ + (z - index0_) * dphi_);
+          double gz2 = cs.from_rotation_angle_fast(phi0_ + (z + 1 - index0_) * dphi_);
+          double gz = std::abs(gz1) < std::abs(gz2) ? gz1 : gz2;
+          gzc2 = gz * gz * delta_m_r2;
         }
+        Layout::mask_slice(mask.begin() + k * npixels, &dxy[0], npixels, gzc2);
       }
     }
 
@@ -738,23 +836,45 @@ namespace dials {
      * @param shoeboxes The shoebox list
      * @param s1 The list of beam vectors
      * @param frame The list of frame numbers
+     * @param panel The list of panel numbers
+     * @param nthreads The number of threads
      */
     void operator()(const af::const_ref<int> &id,
                     af::ref<Shoebox<> > shoeboxes,
                     const af::const_ref<vec3<double> > &s1,
                     const af::const_ref<double> &frame,
-                    const af::const_ref<std::size_t> &panel) const {
+                    const af::const_ref<std::size_t> &panel,
+                    std::size_t nthreads = 1) const {
       DIALS_ASSERT(shoeboxes.size() == id.size());
       DIALS_ASSERT(shoeboxes.size() == s1.size());
       DIALS_ASSERT(shoeboxes.size() == frame.size());
       DIALS_ASSERT(shoeboxes.size() == panel.size());
-      for (std::size_t i = 0; i < shoeboxes.size(); ++i) {
+      for (std::size_t i = 0; i < id.size(); ++i) {
         DIALS_ASSERT(id[i] < size());
-        compute_[id[i]]->single(shoeboxes[i], s1[i], frame[i], panel[i]);
       }
+      single_function function = {
+        this, id.begin(), shoeboxes.begin(), s1.begin(), frame.begin(), panel.begin()};
+      detail::run_calculator(function, shoeboxes.size(), nthreads);
     }
 
   private:
+    /**
+     * Mask the shoebox of a single reflection with the calculator for its
+     * experiment
+     */
+    struct single_function {
+      const MaskMultiCalculator *calculator;
+      const int *id;
+      Shoebox<> *shoeboxes;
+      const vec3<double> *s1;
+      const double *frame;
+      const std::size_t *panel;
+
+      void operator()(std::size_t i) const {
+        calculator->compute_[id[i]]->single(shoeboxes[i], s1[i], frame[i], panel[i]);
+      }
+    };
+
     std::vector<std::shared_ptr<MaskCalculatorIface> > compute_;
   };
 
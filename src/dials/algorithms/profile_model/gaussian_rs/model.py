@@ -450,7 +450,15 @@ def predict_reflections(
         return predict()
 
     def compute_partiality(
-        self, reflections, crystal, beam, detector, goniometer=None, scan=None, **kwargs
+        self,
+        reflections,
+        crystal,
+        beam,
+        detector,
+        goniometer=None,
+        scan=None,
+        nthreads=1,
+        **kwargs,
     ):
         """
         Given an experiment and list of reflections, compute the partiality of the
@@ -462,6 +470,7 @@ def compute_partiality(
         :param detector: The detector model
         :param goniometer: The goniometer model
         :param scan: The scan model
+        :param nthreads: The number of threads
         """
         from dials.algorithms.profile_model.gaussian_rs import PartialityCalculator
 
@@ -472,7 +481,10 @@ def compute_partiality(
 
         # Compute the partiality
         partiality = calculate(
-            reflections["s1"], reflections["xyzcal.px"].parts()[2], reflections["bbox"]
+            reflections["s1"],
+            reflections["xyzcal.px"].parts()[2],
+            reflections["bbox"],
+            nthreads=nthreads,
         )
 
         # Return the partiality
@@ -487,6 +499,7 @@ def compute_bbox(
         goniometer=None,
         scan=None,
         sigma_b_multiplier=2.0,
+        nthreads=1,
         **kwargs,
     ):
         """Given an experiment and list of reflections, compute the
@@ -498,6 +511,7 @@ def compute_bbox(
         :param detector: The detector model
         :param goniometer: The goniometer model
         :param scan: The scan model
+        :param nthreads: The number of threads
         """
         from dials.algorithms.profile_model.gaussian_rs import BBoxCalculator
 
@@ -516,7 +530,10 @@ def compute_bbox(
 
         # Calculate the bounding boxes of all the reflections
         bbox = calculate(
-            reflections["s1"], reflections["xyzcal.px"].parts()[2], reflections["panel"]
+            reflections["s1"],
+            reflections["xyzcal.px"].parts()[2],
+            reflections["panel"],
+            nthreads=nthreads,
         )
 
         # Return the bounding boxes
@@ -531,6 +548,7 @@ def compute_mask(
         goniometer=None,
         scan=None,
         image_volume=None,
+        nthreads=1,
         **kwargs,
     ):
         """
@@ -543,6 +561,8 @@ def compute_mask(
         :param detector: The detector model
         :param goniometer: The goniometer model
         :param scan: The scan model
+        :param image_volume: The image volume to mask, in place of the shoeboxes
+        :param nthreads: The number of threads, when masking the shoeboxes
         """
         from dials.algorithms.profile_model.gaussian_rs import MaskCalculator
 
@@ -563,6 +583,7 @@ def compute_mask(
                 reflections["s1"],
                 reflections["xyzcal.px"].parts()[2],
                 reflections["panel"],
+                nthreads=nthreads,
             )
         else:
             return mask_foreground(
@@ -0,0 +1,105 @@
+/*
+ * parallel_calculator.h
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+#ifndef DIALS_ALGORITHMS_PROFILE_MODEL_GAUSSIAN_RS_PARALLEL_CALCULATOR_H
+#define DIALS_ALGORITHMS_PROFILE_MODEL_GAUSSIAN_RS_PARALLEL_CALCULATOR_H
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+#include <dials/util/thread_pool.h>
+#include <dials/error.h>
+
+namespace dials {
+  namespace algorithms {
+    namespace profile_model {
+      namespace gaussian_rs {
+
+  namespace detail {
+
+    /**
+     * Apply a function to each reflection in a contiguous chunk
+     */
+    template <typename Function>
+    struct calculator_job {
+      const Function *function;
+      std::size_t first;
+      std::size_t last;
+      std::string error;
+
+      calculator_job() : function(0), first(0), last(0) {}
+
+      void operator()() {
+        try {
+          for (std::size_t i = first; i < last; ++i) {
+            (*function)(i);
+          }
+        } catch (const std::exception &e) {
+          error = e.what();
+        } catch (...) {
+          error = "Unknown error in profile model calculator";
+        }
+      }
+    };
+
+    template <typename Job>
+    struct calculator_runner {
+      Job *job;
+      calculator_runner(Job *job_) : job(job_) {}
+      void operator()() const {
+        (*job)();
+      }
+    };
+
+    /**
+     * Apply a function to the reflections 0 to n - 1. The reflections are
+     * split into chunks, several for each thread so that reflections with
+     * large shoeboxes do not leave threads idle. The function must only
+     * write the output for the reflection it is given, so that the result
+     * is the same for any number of threads. The first error is rethrown.
+     * @param function The function to call with each reflection index
+     * @param n The number of reflections
+     * @param nthreads The number of threads
+     */
+    template <typename Function>
+    void run_calculator(const Function &function, std::size_t n, std::size_t nthreads) {
+      const std::size_t min_chunk_size = 64;
+      const std::size_t chunks_per_thread = 8;
+      DIALS_ASSERT(nthreads > 0);
+      std::size_t njobs = std::min(nthreads * chunks_per_thread, n / min_chunk_size);
+      if (nthreads == 1 || njobs <= 1) {
+        for (std::size_t i = 0; i < n; ++i) {
+          function(i);
+        }
+        return;
+      }
+      typedef calculator_job<Function> job_type;
+      std::vector<job_type> jobs(njobs);
+      for (std::size_t j = 0; j < njobs; ++j) {
+        jobs[j].function = &function;
+        jobs[j].first = (j * n) / njobs;
+        jobs[j].last = ((j + 1) * n) / njobs;
+      }
+      {
+        dials::util::ThreadPool pool(std::min(nthreads, njobs));
+        for (std::size_t j = 0; j < njobs; ++j) {
+          pool.post(calculator_runner<job_type>(&jobs[j]));
+        }
+        pool.wait();
+      }
+      for (std::size_t j = 0; j < njobs; ++j) {
+        if (!jobs[j].error.empty()) {
+          throw DIALS_ERROR(jobs[j].error);
+        }
+      }
+    }
+
+  }  // namespace detail
+
+}}}}  // namespace dials::algorithms::profile_model::gaussian_rs
+
+#endif  // DIALS_ALGORITHMS_PROFILE_MODEL_GAUSSIAN_RS_PARALLEL_CALCULATOR_H
@@ -24,6 +24,7 @@
 #include <dxtbx/model/scan.h>
 #include <dials/array_family/scitbx_shared_and_versa.h>
 #include <dials/algorithms/profile_model/gaussian_rs/coordinate_system.h>
+#include <dials/algorithms/profile_model/gaussian_rs/parallel_calculator.h>
 
 namespace dials {
   namespace algorithms {
@@ -47,6 +48,26 @@ namespace dials {
   using std::ceil;
   using std::floor;
 
+  namespace detail {
+
+    /**
+     * Compute the partiality of a single reflection
+     */
+    template <typename Calculator>
+    struct partiality_function {
+      const Calculator *calculator;
+      const vec3<double> *s1;
+      const double *frame;
+      const int6 *bbox;
+      double *result;
+
+      void operator()(std::size_t i) const {
+        result[i] = calculator->single(s1[i], frame[i], bbox[i]);
+      }
+    };
+
+  }  // namespace detail
+
   /**
    * Interface for bounding box calculator.
    */
@@ -59,6 +80,27 @@ namespace dials {
     virtual af::shared<double> array(const af::const_ref<vec3<double> > &s1,
                                      const af::const_ref<double> &frame,
                                      const af::const_ref<int6> &bbox) const = 0;
+
+    /**
+     * Calculate the partiality for an array of reflections, split into
+     * chunks on multiple threads. The result is the same as that of array.
+     * @param s1 The array of diffracted beam vectors
+     * @param frame The array of frame numbers.
+     * @param bbox The array of bboxes
+     * @param nthreads The number of threads
+     */
+    af::shared<double> parallel_array(const af::const_ref<vec3<double> > &s1,
+                                      const af::const_ref<double> &frame,
+                                      const af::const_ref<int6> &bbox,
+                                      std::size_t nthreads) const {
+      DIALS_ASSERT(s1.size() == frame.size());
+      DIALS_ASSERT(s1.size() == bbox.size());
+      af::shared<double> result(s1.size(), af::init_functor_null<double>());
+      detail::partiality_function<PartialityCalculatorIface> function = {
+        this, s1.begin(), frame.begin(), bbox.begin(), result.begin()};
+      detail::run_calculator(function, s1.size(), nthreads);
+      return result;
+    }
   };
 
   /** Calculate the partiality for each reflection */
@@ -248,23 +290,44 @@ namespace dials {
      * @param s1 The array of diffracted beam vectors
      * @param frame The array of frame numbers.
      * @param bbox The array of bounding boxes
+     * @param nthreads The number of threads
      */
     af::shared<double> operator()(const af::const_ref<std::size_t> &id,
                                   const af::const_ref<vec3<double> > &s1,
                                   const af::const_ref<double> &frame,
-                                  const af::const_ref<int6> &bbox) const {
+                                  const af::const_ref<int6> &bbox,
+                                  std::size_t nthreads = 1) const {
       DIALS_ASSERT(s1.size() == id.size());
       DIALS_ASSERT(s1.size() == frame.size());
       DIALS_ASSERT(s1.size() == bbox.size());
-      af::shared<double> result(s1.size(), af::init_functor_null<double>());
-      for (std::size_t i = 0; i < s1.size(); ++i) {
+      for (std::size_t i = 0; i < id.size(); ++i) {
         DIALS_ASSERT(id[i] < size());
-        result[i] = compute_[id[i]]->single(s1[i], frame[i], bbox[i]);
       }
+      af::shared<double> result(s1.size(), af::init_functor_null<double>());
+      single_function function = {
+        this, id.begin(), s1.begin(), frame.begin(), bbox.begin(), result.begin()};
+      detail::run_calculator(function, s1.size(), nthreads);
       return result;
     }
 
   private:
+    /**
+     * Compute the partiality of a single reflection with the calculator for
+     * its experiment
+     */
+    struct single_function {
+      const PartialityMultiCalculator *calculator;
+      const std::size_t *id;
+      const vec3<double> *s1;
+      const double *frame;
+      const int6 *bbox;
+      double *result;
+
+      void operator()(std::size_t i) const {
+        result[i] = calculator->compute_[id[i]]->single(s1[i], frame[i], bbox[i]);
+      }
+    };
+
     std::vector<std::shared_ptr<PartialityCalculatorIface> > compute_;
   };
 
@@ -0,0 +1,42 @@
+/*
+ * fast_mcd.cc
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+#include <boost/python.hpp>
+#include <boost/python/def.hpp>
+#include "../outlier_detection/fast_mcd.h"
+
+using namespace boost::python;
+
+namespace dials { namespace refinement { namespace boost_python {
+
+  void export_fast_mcd() {
+    class_<FastMCD>("FastMCD", no_init)
+      .def(init<const af::const_ref<double, af::c_grid<2> > &,
+                double,
+                std::size_t,
+                std::size_t,
+                std::size_t,
+                std::size_t,
+                std::size_t,
+                std::size_t,
+                std::size_t,
+                std::size_t>((arg("data"),
+                              arg("alpha") = 0.5,
+                              arg("max_n_groups") = 5,
+                              arg("min_group_size") = 300,
+                              arg("n_trials") = 500,
+                              arg("k1") = 2,
+                              arg("k2") = 2,
+                              arg("k3") = 100,
+                              arg("seed") = 0,
+                              arg("nthreads") = 1)))
+      .def("h", &FastMCD::h)
+      .def("T", &FastMCD::T)
+      .def("S", &FastMCD::S)
+      .def("det", &FastMCD::det);
+  }
+
+}}}  // namespace dials::refinement::boost_python
@@ -27,7 +27,8 @@ namespace dials { namespace refinement { namespace boost_python {
       .def("spacing", &GaussianSmoother::spacing)
       .def("positions", &GaussianSmoother::positions)
       .def("value_weight", &GaussianSmoother::value_weight)
-      .def("multi_value_weight", &GaussianSmoother::multi_value_weight);
+      .def("multi_value_weight", &GaussianSmoother::multi_value_weight)
+      .def("weights", &GaussianSmoother::weights, (arg("x")));
 
     class_<SingleValueWeights>("SingleValueWeights", no_init)
       .def("get_value", &SingleValueWeights::get_value)
@@ -38,6 +39,18 @@ namespace dials { namespace refinement { namespace boost_python {
       .def("get_value", &MultiValueWeights::get_value)
       .def("get_weight", &MultiValueWeights::get_weight)
       .def("get_sumweight", &MultiValueWeights::get_sumweight);
+
+    class_<SmootherWeights>("SmootherWeights", no_init)
+      .def("size", &SmootherWeights::size)
+      .def("__len__", &SmootherWeights::size)
+      .def("num_values", &SmootherWeights::num_values)
+      .def("sumweight", &SmootherWeights::sumweight)
+      .def("value", &SmootherWeights::value, (arg("values")))
+      .def("weight", &SmootherWeights::weight)
+      .def("dvalue_dparam", &SmootherWeights::dvalue_dparam, (arg("first_param") = 0))
+      .def("value_weight",
+           &SmootherWeights::value_weight,
+           (arg("index"), arg("values")));
   }
 
 }}}  // namespace dials::refinement::boost_python
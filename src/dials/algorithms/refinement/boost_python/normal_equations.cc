@@ -0,0 +1,51 @@
+/*
+ * normal_equations.cc
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+#include <boost/python.hpp>
+#include <boost/python/def.hpp>
+#include "../normal_equations.h"
+
+using namespace boost::python;
+
+namespace dials { namespace refinement { namespace boost_python {
+
+  void export_normal_equations() {
+    class_<NormalEquations>("NormalEquations", no_init)
+      .def(init<std::size_t, std::size_t>(
+        (arg("n_parameters"), arg("nthreads") = 1)))
+      .def("reset", &NormalEquations::reset)
+      .def("n_parameters", &NormalEquations::n_parameters)
+      .def("n_equations", &NormalEquations::n_equations)
+      .def("nthreads", &NormalEquations::nthreads)
+      .def("set_nthreads", &NormalEquations::set_nthreads, (arg("nthreads")))
+      .def("add_residuals",
+           &NormalEquations::add_residuals,
+           (arg("residuals"), arg("weights")))
+      .def("add_equations",
+           &NormalEquations::add_equations,
+           (arg("residuals"), arg("jacobian"), arg("weights")))
+      .def("add_equations",
+           &NormalEquations::add_equations_sparse,
+           (arg("residuals"), arg("jacobian"), arg("weights")))
+      .def("objective", &NormalEquations::objective)
+      .def("chi_sq", &NormalEquations::chi_sq)
+      .def("normal_matrix_packed_u", &NormalEquations::normal_matrix_packed_u)
+      .def("normal_matrix_diagonal", &NormalEquations::normal_matrix_diagonal)
+      .def("add_constant_to_diagonal",
+           &NormalEquations::add_constant_to_diagonal,
+           (arg("mu")))
+      .def("right_hand_side", &NormalEquations::right_hand_side)
+      .def("solve", &NormalEquations::solve)
+      .def("solve_cg",
+           &NormalEquations::solve_cg,
+           (arg("max_iterations"), arg("tolerance")))
+      .def("n_cg_iterations", &NormalEquations::n_cg_iterations)
+      .def("solution", &NormalEquations::solution)
+      .def("has_cholesky_factor", &NormalEquations::has_cholesky_factor)
+      .def("cholesky_factor_packed_u", &NormalEquations::cholesky_factor_packed_u);
+  }
+
+}}}  // namespace dials::refinement::boost_python
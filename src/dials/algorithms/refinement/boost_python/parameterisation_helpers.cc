@@ -78,6 +78,27 @@ namespace dials { namespace refinement { namespace boost_python {
       .def("origin", &PanelGroupCompose::origin)
       .def("derivatives_for_panel", &PanelGroupCompose::derivatives_for_panel);
 
+    class_<MultiPanelGroupCompose>("MultiPanelGroupCompose", no_init)
+      .def(init<std::size_t>((arg("nthreads") = 1)))
+      .def("add_group",
+           &MultiPanelGroupCompose::add_group,
+           (arg("initial_d1"),
+            arg("initial_d2"),
+            arg("initial_dn"),
+            arg("initial_gp_offset"),
+            arg("offsets"),
+            arg("dir1s"),
+            arg("dir2s")))
+      .def("n_groups", &MultiPanelGroupCompose::n_groups)
+      .def("n_panels", &MultiPanelGroupCompose::n_panels)
+      .def("compose",
+           &MultiPanelGroupCompose::compose,
+           (arg("param_vals"), arg("param_axes")))
+      .def("d1", &MultiPanelGroupCompose::d1, (arg("group")))
+      .def("d2", &MultiPanelGroupCompose::d2, (arg("group")))
+      .def("origin", &MultiPanelGroupCompose::origin, (arg("group")))
+      .def("derivatives", &MultiPanelGroupCompose::derivatives, (arg("group")));
+
     def("intersection_i_seqs_unsorted",
         &intersection_i_seqs_unsorted,
         (arg("left"), arg("right")));
@@ -9,22 +9,26 @@ namespace dials { namespace refinement { namespace boost_python {
   void export_parameterisation_helpers();
   void export_gallego_yezzi();
   void export_mahalanobis();
+  void export_fast_mcd();
   void export_outlier_helpers();
   void export_calculate_cell_gradients();
   void export_rtmats();
   void export_gaussian_smoother();
   void export_gaussian_smoother_2D();
   void export_gaussian_smoother_3D();
+  void export_normal_equations();
 
   BOOST_PYTHON_MODULE(dials_refinement_helpers_ext) {
     export_parameterisation_helpers();
     export_gallego_yezzi();
     export_mahalanobis();
+    export_fast_mcd();
     export_outlier_helpers();
     export_calculate_cell_gradients();
     export_rtmats();
     export_gaussian_smoother();
     export_gaussian_smoother_2D();
     export_gaussian_smoother_3D();
+    export_normal_equations();
   }
 }}}  // namespace dials::refinement::boost_python
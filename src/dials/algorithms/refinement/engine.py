@@ -1,6 +1,7 @@
 """Contains classes for refinement engines. Refinery is the shared interface,
 LevenbergMarquardtIterations, GaussNewtonIterations, SimpleLBFGS and LBFGScurvs
-are the current concrete implementations"""
+are the current concrete implementations. Versions using sparse matrix algebra
+and native normal equations are in sparse_engine.py and native_engine.py"""
 
 from __future__ import annotations
 
@@ -39,8 +40,10 @@
   .help = "Parameters to configure the refinery"
   .expert_level = 1
 {
-  engine = SimpleLBFGS LBFGScurvs GaussNewton *LevMar SparseLevMar
-    .help = "The minimisation engine to use"
+  engine = SimpleLBFGS LBFGScurvs GaussNewton *LevMar SparseLevMar \
+           NativeGaussNewton NativeLevMar
+    .help = "The minimisation engine to use. The Native engines accumulate and"
+            "solve the normal equations in C++, using threads for nproc > 1"
     .type = choice
 
   max_iterations = None
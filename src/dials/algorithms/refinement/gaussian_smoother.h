@@ -14,6 +14,7 @@
 
 #include <cmath>      // for exp
 #include <algorithm>  // for std::min, std::max
+#include <vector>
 #include <scitbx/vec2.h>
 #include <scitbx/sparse/vector.h>
 #include <scitbx/sparse/matrix.h>
@@ -73,6 +74,176 @@ namespace dials { namespace refinement {
     }
   };
 
+  /**
+   * The weights of a Gaussian smoother at a fixed set of points. These depend
+   * only on the positions of the points and not on the parameter values, so
+   * they can be calculated once and reused each time the parameters change.
+   * Each point has a fixed number (the stride) of entries, each one the index
+   * of a smoother parameter and its weight. Points with fewer contributing
+   * parameters are padded with entries whose index is num_values() and whose
+   * weight is zero, so that all loops over the entries have the same length.
+   */
+  class SmootherWeights {
+  public:
+    /**
+     * Calculate the weights from the squared scaled distances of each point
+     * from the contributing smoother positions. The exponentials are evaluated
+     * in a single pass over contiguous memory, which compilers can vectorise.
+     * @param nvalues The number of smoother parameters
+     * @param stride The number of entries per point
+     * @param index The parameter index of each entry (nvalues for padding)
+     * @param distance_sq The squared distance of each entry (ignored for padding)
+     */
+    SmootherWeights(std::size_t nvalues,
+                    std::size_t stride,
+                    af::shared<std::size_t> index,
+                    af::shared<double> distance_sq)
+        : nvalues_(nvalues),
+          stride_(stride),
+          index_(index),
+          weight_(index.size(), af::init_functor_null<double>()) {
+      DIALS_ASSERT(stride_ > 0);
+      DIALS_ASSERT(index.size() == distance_sq.size());
+      DIALS_ASSERT(index.size() % stride_ == 0);
+      std::size_t npoints = index.size() / stride_;
+      const std::size_t *idx = index_.begin();
+      const double *d2 = distance_sq.begin();
+      double *w = weight_.begin();
+      for (std::size_t k = 0; k < weight_.size(); ++k) {
+        w[k] = std::exp(-d2[k]);
+      }
+      for (std::size_t k = 0; k < weight_.size(); ++k) {
+        DIALS_ASSERT(idx[k] <= nvalues_);
+        if (idx[k] == nvalues_) {
+          w[k] = 0.0;
+        }
+      }
+      sumweight_.resize(npoints);
+      for (std::size_t i = 0; i < npoints; ++i) {
+        double sumw = 0.0;
+        for (std::size_t k = 0; k < stride_; ++k) {
+          sumw += w[i * stride_ + k];
+        }
+        sumweight_[i] = sumw;
+      }
+    }
+
+    /** @returns The number of points */
+    std::size_t size() const {
+      return sumweight_.size();
+    }
+
+    /** @returns The number of smoother parameters */
+    std::size_t num_values() const {
+      return nvalues_;
+    }
+
+    /** @returns The sum of the weights at each point */
+    af::shared<double> sumweight() const {
+      return sumweight_;
+    }
+
+    /**
+     * Calculate the interpolated values at all points. This is the only part
+     * of the smoother calculation that depends on the parameter values.
+     * @param values The parameter values
+     * @returns The smoothed value at each point
+     */
+    af::shared<double> value(const af::const_ref<double> values) const {
+      DIALS_ASSERT(values.size() == nvalues_);
+      // Append a zero for the padding entries to refer to
+      std::vector<double> v(values.begin(), values.end());
+      v.push_back(0.0);
+      std::size_t npoints = size();
+      af::shared<double> result(npoints, af::init_functor_null<double>());
+      const std::size_t *idx = index_.begin();
+      const double *w = weight_.begin();
+      for (std::size_t i = 0; i < npoints; ++i) {
+        double sumwv = 0.0;
+        for (std::size_t k = i * stride_; k < (i + 1) * stride_; ++k) {
+          sumwv += w[k] * v[idx[k]];
+        }
+        double sumw = sumweight_[i];
+        result[i] = sumw > 0.0 ? sumwv / sumw : 0.0;
+      }
+      return result;
+    }
+
+    /**
+     * @returns The matrix of weights, with a row for each point and a column
+     * for each smoother parameter
+     */
+    matrix<double> weight() const {
+      matrix<double> result(size(), nvalues_);
+      for (std::size_t k = 0; k < index_.size(); ++k) {
+        if (index_[k] < nvalues_) {
+          result(k / stride_, index_[k]) = weight_[k];
+        }
+      }
+      return result;
+    }
+
+    /**
+     * Calculate the derivatives of the smoothed values with respect to the
+     * parameters, i.e. the weights divided by their sum at each point.
+     * Parameters with an index below first_param are excluded, so that the
+     * first column of the result corresponds to parameter first_param.
+     * @param first_param The index of the first parameter to include
+     * @returns The matrix of derivatives, with a row for each point
+     */
+    matrix<double> dvalue_dparam(std::size_t first_param = 0) const {
+      DIALS_ASSERT(first_param < nvalues_);
+      matrix<double> result(size(), nvalues_ - first_param);
+      for (std::size_t k = 0; k < index_.size(); ++k) {
+        std::size_t j = index_[k];
+        if (j < nvalues_ && j >= first_param) {
+          std::size_t i = k / stride_;
+          result(i, j - first_param) = weight_[k] * (1.0 / sumweight_[i]);
+        }
+      }
+      return result;
+    }
+
+    /**
+     * Calculate the value, weights and sum of weights at a single point
+     * @param i The index of the point
+     * @param values The parameter values
+     */
+    SingleValueWeights value_weight(std::size_t i,
+                                    const af::const_ref<double> values) const {
+      DIALS_ASSERT(i < size());
+      DIALS_ASSERT(values.size() == nvalues_);
+      vector<double> weight(nvalues_);
+      double sumwv = 0.0;
+      for (std::size_t k = i * stride_; k < (i + 1) * stride_; ++k) {
+        if (index_[k] < nvalues_) {
+          weight[index_[k]] = weight_[k];
+          sumwv += weight_[k] * values[index_[k]];
+        }
+      }
+      double sumw = sumweight_[i];
+      return SingleValueWeights(sumw > 0.0 ? sumwv / sumw : 0.0, weight, sumw);
+    }
+
+  private:
+    std::size_t nvalues_;
+    std::size_t stride_;
+    af::shared<std::size_t> index_;
+    af::shared<double> weight_;
+    af::shared<double> sumweight_;
+  };
+
+  /**
+   * @returns The largest number of parameters along one dimension that can
+   * contribute to the smoothed value at a point (see idx_range).
+   */
+  inline std::size_t max_idx_range(std::size_t nvalues, std::size_t naverage) {
+    if (nvalues <= 3) {
+      return nvalues;
+    }
+    return std::max(naverage, (std::size_t)2);
+  }
+
   // A Gaussian smoother, based largely on class SmoothedValue from Aimless.
   class GaussianSmoother {
   public:
@@ -255,6 +426,31 @@ namespace dials { namespace refinement {
       return MultiValueWeights(value, weight, sumweight);
     }
 
+    /**
+     * Calculate the weights at multiple points using the original
+     * unnormalised coordinate, for repeated evaluation of the smoothed values
+     * at those points as the parameter values change.
+     * @param x The array of points
+     */
+    SmootherWeights weights(const af::const_ref<double> x) {
+      std::size_t stride = max_idx_range(nvalues, naverage);
+      af::shared<std::size_t> index(x.size() * stride, nvalues);
+      af::shared<double> distance_sq(x.size() * stride, 0.0);
+      for (std::size_t irow = 0; irow < x.size(); ++irow) {
+        // normalised coordinate
+        double z = (x[irow] - x0) / spacing_;
+        vec2<int> irange = idx_range(z);
+        DIALS_ASSERT(irange[1] - irange[0] <= (int)stride);
+        std::size_t k = irow * stride;
+        for (int icol = irange[0]; icol < irange[1]; ++icol, ++k) {
+          double ds = (z - positions_[icol]) / sigma_;
+          index[k] = icol;
+          distance_sq[k] = ds * ds;
+        }
+      }
+      return SmootherWeights(nvalues, stride, index, distance_sq);
+    }
+
   protected:
     vec2<int> idx_range(double z) {
       int i1, i2;
@@ -334,6 +334,57 @@ namespace dials { namespace refinement {
       return MultiValueWeights(value, weight, sumweight);
     }
 
+    /**
+     * Calculate the weights at multiple points using the original
+     * unnormalised coordinates, for repeated evaluation of the smoothed values
+     * at those points as the parameter values change.
+     * @param x The array of x coordinates of the points
+     * @param y The array of y coordinates of the points
+     * @param z The array of z coordinates of the points
+     */
+    SmootherWeights weights(const af::const_ref<double> x,
+                            const af::const_ref<double> y,
+                            const af::const_ref<double> z) {
+      DIALS_ASSERT(y.size() == x.size());
+      DIALS_ASSERT(z.size() == x.size());
+      std::size_t nvalues = nxvalues * nyvalues * nzvalues;
+      std::size_t xstride = max_idx_range(nxvalues, n_x_average);
+      std::size_t ystride = max_idx_range(nyvalues, n_y_average);
+      std::size_t zstride = max_idx_range(nzvalues, n_z_average);
+      std::size_t stride = xstride * ystride * zstride;
+      af::shared<std::size_t> index(x.size() * stride, nvalues);
+      af::shared<double> distance_sq(x.size() * stride, 0.0);
+      for (std::size_t irow = 0; irow < x.size(); ++irow) {
+        // normalised coordinate
+        double z1 = (x[irow] - x0) / x_spacing_;
+        double z2 = (y[irow] - y0) / y_spacing_;
+        double z3 = (z[irow] - z0) / z_spacing_;
+
+        vec2<int> irange = idx_range(z1, nxvalues, half_nxaverage, n_x_average);
+        vec2<int> jrange = idx_range(z2, nyvalues, half_nyaverage, n_y_average);
+        vec2<int> krange = idx_range(z3, nzvalues, half_nzaverage, n_z_average);
+        DIALS_ASSERT(irange[1] - irange[0] <= (int)xstride);
+        DIALS_ASSERT(jrange[1] - jrange[0] <= (int)ystride);
+        DIALS_ASSERT(krange[1] - krange[0] <= (int)zstride);
+
+        std::size_t k = irow * stride;
+        for (int icol = irange[0]; icol < irange[1]; ++icol) {
+          for (int jcol = jrange[0]; jcol < jrange[1]; ++jcol) {
+            for (int kcol = krange[0]; kcol < krange[1]; ++kcol, ++k) {
+              double ds =
+                pow(pow(z1 - x_positions_[icol], 2) + pow(z2 - y_positions_[jcol], 2)
+                      + pow(z3 - z_positions_[kcol], 2),
+                    0.5)
+                / sigma_;
+              index[k] = icol + (jcol * nxvalues) + (kcol * nxvalues * nyvalues);
+              distance_sq[k] = ds * ds;
+            }
+          }
+        }
+      }
+      return SmootherWeights(nvalues, stride, index, distance_sq);
+    }
+
   private:
     vec2<int> idx_range(double z,
                         std::size_t nvalues,
@@ -0,0 +1,254 @@
+"""Versions of the Gauss-Newton and Levenberg-Marquardt refinement engines that
+accumulate and solve the normal equations with the NormalEquations class, rather
+than with lstbx. When nproc > 1 the gradients of the blocks of reflections are
+calculated in parallel processes, while the equations for each block are
+accumulated in parallel over chunks of rows using threads. The gradients are
+calculated for blocks of at most max_block_size reflections, each of which is
+accumulated and then discarded, so the full Jacobian is never held in memory."""
+
+from __future__ import annotations
+
+import logging
+
+import libtbx
+from libtbx import easy_mp
+from scitbx.array_family import flex
+
+from dials.algorithms.refinement.engine import AdaptLstbx as AdaptLstbxBase
+from dials.algorithms.refinement.engine import (
+    GaussNewtonIterations as GaussNewtonIterationsBase,
+)
+from dials.algorithms.refinement.engine import (
+    LevenbergMarquardtIterations as LevenbergMarquardtIterationsBase,
+)
+from dials_refinement_helpers_ext import NormalEquations
+
+logger = logging.getLogger(__name__)
+
+
+class AdaptLstbxNative(AdaptLstbxBase):
+    """Adapt the base class to use NormalEquations in place of the lstbx
+    normal equations"""
+
+    # Above this number of parameters, solve the normal equations by the
+    # preconditioned conjugate gradient method rather than by Cholesky
+    # decomposition. In that case parameter ESDs are not calculated.
+    cg_threshold = 2000
+    cg_max_iterations = 1000
+    cg_tolerance = 1.0e-10
+
+    # The maximum number of reflections for which the gradients are calculated
+    # at once
+    max_block_size = 10000
+
+    def __init__(
+        self,
+        target,
+        prediction_parameterisation,
+        constraints_manager=None,
+        log=None,
+        tracking=None,
+        max_iterations=None,
+    ):
+        AdaptLstbxBase.__init__(
+            self,
+            target,
+            prediction_parameterisation,
+            constraints_manager=constraints_manager,
+            log=log,
+            tracking=tracking,
+            max_iterations=max_iterations,
+        )
+
+        self._equations = NormalEquations(n_parameters=len(self.x))
+
+        # The Jacobian is not kept, so journal columns calculated from it are
+        # not available
+        for column in (
+            "parameter_correlation",
+            "condition_number",
+            "jacobian_structure",
+        ):
+            if column in self.history:
+                logger.warning(
+                    "Tracking of %s is not available with this engine", column
+                )
+                del self.history[column]
+
+    def set_nproc(self, nproc):
+        """The gradients are calculated in nproc processes and the normal
+        equations are accumulated using nproc threads"""
+        self._nproc = nproc
+        self._equations.set_nthreads(nproc)
+
+    def _split_matches_into_blocks(self):
+        """Split the matches into blocks as set by the target, then split each
+        of those further into blocks of at most max_block_size reflections"""
+        for block in self._target.split_matches_into_blocks(nproc=self._nproc):
+            for start in range(0, len(block), self.max_block_size):
+                yield block[start : start + self.max_block_size]
+
+    def build_up(self, objective_only=False):
+        """Accumulate the normal equations one bounded block of reflections at
+        a time. Unlike the base class, the Jacobian of the last block is not
+        kept"""
+        if objective_only:
+            return AdaptLstbxBase.build_up(self, objective_only=True)
+
+        self.prepare_for_step()
+        self.reset()
+
+        # observation terms
+        if self._nproc > 1:
+
+            def task_wrapper(block):
+                (
+                    residuals,
+                    jacobian,
+                    weights,
+                ) = self._target.compute_residuals_and_gradients(block)
+                return {
+                    "residuals": residuals,
+                    "jacobian": jacobian,
+                    "weights": weights,
+                }
+
+            def callback_wrapper(result):
+                j = result["jacobian"]
+                if self._constr_manager is not None:
+                    j = self._constr_manager.constrain_jacobian(j)
+                self.add_equations(result["residuals"], j, result["weights"])
+                # no longer need the result
+                result["residuals"] = None
+                result["jacobian"] = None
+                result["weights"] = None
+
+            easy_mp.parallel_map(
+                func=task_wrapper,
+                iterable=list(self._split_matches_into_blocks()),
+                processes=self._nproc,
+                callback=callback_wrapper,
+                method="multiprocessing",
+                preserve_exception_message=True,
+            )
+
+        else:
+            for block in self._split_matches_into_blocks():
+                (
+                    residuals,
+                    jacobian,
+                    weights,
+                ) = self._target.compute_residuals_and_gradients(block)
+                if self._constr_manager is not None:
+                    jacobian = self._constr_manager.constrain_jacobian(jacobian)
+                self.add_equations(residuals, jacobian, weights)
+                del residuals, jacobian, weights
+
+        # restraints terms
+        restraints = self._target.compute_restraints_residuals_and_gradients()
+        if restraints:
+            j = restraints[1]
+            if self._constr_manager is not None:
+                j = self._constr_manager.constrain_jacobian(j)
+            self.add_equations(restraints[0], j, restraints[2])
+
+    @property
+    def actual(self):
+        return self
+
+    @property
+    def dof(self):
+        return self._equations.n_equations() - self._equations.n_parameters()
+
+    def reset(self):
+        self._equations.reset()
+
+    def add_residuals(self, residuals, weights):
+        self._equations.add_residuals(residuals, weights)
+
+    def add_equations(self, residuals, jacobian, weights):
+        self._equations.add_equations(residuals, jacobian, weights)
+
+    def step_equations(self):
+        return self._equations
+
+    def objective(self):
+        return self._equations.objective()
+
+    def chi_sq(self):
+        return self._equations.chi_sq()
+
+    def opposite_of_gradient(self):
+        return self._equations.right_hand_side()
+
+    def normal_matrix_packed_u(self):
+        return self._equations.normal_matrix_packed_u()
+
+    def solve(self):
+        if len(self.x) > self.cg_threshold:
+            self._equations.solve_cg(
+                max_iterations=self.cg_max_iterations, tolerance=self.cg_tolerance
+            )
+            logger.debug(
+                "Conjugate gradient solution took %d iterations",
+                self._equations.n_cg_iterations(),
+            )
+        else:
+            self._equations.solve()
+
+    def step(self):
+        return self._equations.solution()
+
+    def set_cholesky_factor(self):
+        """Keep the Cholesky factor for ESD calculation, if the last solution
+        used one"""
+        if self._equations.has_cholesky_factor():
+            self.cf = self._equations.cholesky_factor_packed_u()
+        else:
+            self.cf = None
+
+
+class GaussNewtonIterations(AdaptLstbxNative, GaussNewtonIterationsBase):
+    """Refinery implementation, using Gauss Newton iterations with the native
+    normal equations"""
+
+    def __init__(
+        self,
+        target,
+        prediction_parameterisation,
+        constraints_manager=None,
+        log=None,
+        tracking=None,
+        max_iterations=20,
+        **kwds,
+    ):
+        AdaptLstbxNative.__init__(
+            self,
+            target,
+            prediction_parameterisation,
+            constraints_manager=constraints_manager,
+            log=log,
+            tracking=tracking,
+            max_iterations=max_iterations,
+        )
+
+        # add an attribute to the journal
+        self.history.add_column("reduced_chi_squared")  # flex.double()
+
+        # adopt any overrides of the defaults above
+        libtbx.adopt_optional_init_args(self, kwds)
+
+
+class LevenbergMarquardtIterations(
+    GaussNewtonIterations, LevenbergMarquardtIterationsBase
+):
+    """Levenberg Marquardt with the native normal equations"""
+
+    def setup_mu(self):
+        """Setup initial value for mu"""
+        a_diag = self._equations.normal_matrix_diagonal()
+        self.mu = self.tau * flex.max(a_diag)
+
+    def add_constant_to_diagonal(self, mu):
+        """Add the constant value mu to the diagonal of the normal matrix"""
+        self._equations.add_constant_to_diagonal(mu)
@@ -0,0 +1,573 @@
+/*
+ * normal_equations.h
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+
+#ifndef DIALS_REFINEMENT_NORMAL_EQUATIONS_H
+#define DIALS_REFINEMENT_NORMAL_EQUATIONS_H
+
+#include <cmath>
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+#include <scitbx/sparse/vector.h>
+#include <scitbx/sparse/matrix.h>
+#include <dials/array_family/scitbx_shared_and_versa.h>
+#include <dials/util/thread_pool.h>
+#include <dials/error.h>
+
+namespace dials { namespace refinement {
+
+  namespace detail {
+
+    /**
+     * The rows of a block of the Jacobian, in compressed sparse row form. Each
+     * row lists the parameters with a non-zero derivative in increasing order.
+     */
+    struct jacobian_rows {
+      std::vector<std::size_t> offset;
+      std::vector<std::size_t> param;
+      std::vector<double> value;
+
+      /**
+       * Gather the rows of a dense Jacobian, skipping zero elements
+       */
+      jacobian_rows(const af::const_ref<double, af::c_grid<2> > &jacobian) {
+        std::size_t n_rows = jacobian.accessor()[0];
+        std::size_t n_cols = jacobian.accessor()[1];
+        offset.reserve(n_rows + 1);
+        offset.push_back(0);
+        for (std::size_t i = 0; i < n_rows; ++i) {
+          for (std::size_t j = 0; j < n_cols; ++j) {
+            double v = jacobian(i, j);
+            if (v != 0.0) {
+              param.push_back(j);
+              value.push_back(v);
+            }
+          }
+          offset.push_back(param.size());
+        }
+      }
+
+      /**
+       * Transpose the columns of a sparse Jacobian into rows
+       */
+      jacobian_rows(const scitbx::sparse::matrix<double> &jacobian) {
+        typedef scitbx::sparse::matrix<double>::column_type column_type;
+        std::size_t n_rows = jacobian.n_rows();
+        std::size_t n_cols = jacobian.n_cols();
+
+        // Count the elements in each row
+        offset.assign(n_rows + 1, 0);
+        for (std::size_t j = 0; j < n_cols; ++j) {
+          const column_type &column = jacobian.col(j);
+          for (column_type::const_iterator p = column.begin(); p != column.end();
+               ++p) {
+            offset[p.index() + 1]++;
+          }
+        }
+        for (std::size_t i = 0; i < n_rows; ++i) {
+          offset[i + 1] += offset[i];
+        }
+
+        // Fill the rows. Visiting the columns in order keeps each row sorted.
+        param.resize(offset[n_rows]);
+        value.resize(offset[n_rows]);
+        std::vector<std::size_t> position(offset.begin(), offset.end() - 1);
+        for (std::size_t j = 0; j < n_cols; ++j) {
+          const column_type &column = jacobian.col(j);
+          for (column_type::const_iterator p = column.begin(); p != column.end();
+               ++p) {
+            std::size_t k = position[p.index()]++;
+            param[k] = j;
+            value[k] = *p;
+          }
+        }
+      }
+
+      std::size_t n_rows() const {
+        return offset.size() - 1;
+      }
+    };
+
+    /**
+     * Accumulate w J^T J and -w J^T r for a range of rows of the Jacobian.
+     * The first job adds directly to the normal equations; the others add to
+     * the accumulators of their thread.
+     */
+    struct normal_equations_job {
+      const jacobian_rows *rows;
+      const double *residuals;
+      const double *weights;
+      std::size_t n_parameters;
+      std::size_t first;
+      std::size_t last;
+      double *matrix;
+      double *rhs;
+      double sum_wr2;
+      std::string error;
+
+      normal_equations_job()
+          : rows(0),
+            residuals(0),
+            weights(0),
+            n_parameters(0),
+            first(0),
+            last(0),
+            matrix(0),
+            rhs(0),
+            sum_wr2(0) {}
+
+      void operator()() {
+        try {
+          const std::size_t n = n_parameters;
+          for (std::size_t i = first; i < last; ++i) {
+            double w = weights[i];
+            double wr = w * residuals[i];
+            sum_wr2 += wr * residuals[i];
+            std::size_t k0 = rows->offset[i];
+            std::size_t k1 = rows->offset[i + 1];
+            for (std::size_t k = k0; k < k1; ++k) {
+              std::size_t p = rows->param[k];
+              double wg = w * rows->value[k];
+              rhs[p] -= wr * rows->value[k];
+
+              // Row p of the packed upper triangle, indexed by column
+              double *row = matrix + p * n - p * (p + 1) / 2;
+              for (std::size_t l = k; l < k1; ++l) {
+                row[rows->param[l]] += wg * rows->value[l];
+              }
+            }
+          }
+        } catch (const std::exception &e) {
+          error = e.what();
+        } catch (...) {
+          error = "Unknown error accumulating the normal equations";
+        }
+      }
+    };
+
+    struct normal_equations_runner {
+      normal_equations_job *job;
+      normal_equations_runner(normal_equations_job *job_) : job(job_) {}
+      void operator()() const {
+        (*job)();
+      }
+    };
+
+  }  // namespace detail
+
+  /**
+   * Normal equations for non-linear least squares, accumulated directly from
+   * blocks of the Jacobian. The normal matrix w J^T J is kept in packed upper
+   * triangular form and the right hand side is -w J^T r, as for the lstbx
+   * normal equations, so that the refinement engines can use either.
+   *
+   * Each block of equations is split into chunks of rows that are accumulated
+   * in parallel, with a separate accumulator for each thread. The accumulators
+   * are kept from block to block and only summed when the normal matrix or
+   * right hand side is next needed, once all the blocks are added. The equations
+   * can be solved by Cholesky decomposition or, for problems with many
+   * parameters, by the Jacobi preconditioned conjugate gradient method.
+   */
+  class NormalEquations {
+  public:
+    /**
+     * @param n_parameters The number of parameters
+     * @param nthreads The number of threads used to accumulate the equations
+     */
+    NormalEquations(std::size_t n_parameters, std::size_t nthreads = 1)
+        : n_parameters_(n_parameters),
+          nthreads_(nthreads),
+          min_rows_per_thread_(1000),
+          matrix_(n_parameters * (n_parameters + 1) / 2, 0.0),
+          rhs_(n_parameters, 0.0),
+          pending_(false) {
+      DIALS_ASSERT(n_parameters > 0);
+      DIALS_ASSERT(nthreads > 0);
+      reset();
+    }
+
+    /**
+     * Reset to the state with no equations accumulated
+     */
+    void reset() {
+      std::fill(matrix_.begin(), matrix_.end(), 0.0);
+      std::fill(rhs_.begin(), rhs_.end(), 0.0);
+      if (pending_) {
+        clear_thread_accumulators();
+      }
+      factor_.clear();
+      solution_.clear();
+      n_equations_ = 0;
+      sum_wr2_ = 0.0;
+      n_cg_iterations_ = 0;
+    }
+
+    std::size_t n_parameters() const {
+      return n_parameters_;
+    }
+
+    std::size_t n_equations() const {
+      return n_equations_;
+    }
+
+    std::size_t nthreads() const {
+      return nthreads_;
+    }
+
+    void set_nthreads(std::size_t nthreads) {
+      DIALS_ASSERT(nthreads > 0);
+      nthreads_ = nthreads;
+    }
+
+    /**
+     * Add residuals that contribute to the objective but not to the normal
+     * matrix, as when only the objective is required
+     */
+    void add_residuals(const af::const_ref<double> &residuals,
+                       const af::const_ref<double> &weights) {
+      DIALS_ASSERT(residuals.size() == weights.size());
+      for (std::size_t i = 0; i < residuals.size(); ++i) {
+        sum_wr2_ += weights[i] * residuals[i] * residuals[i];
+      }
+      n_equations_ += residuals.size();
+    }
+
+    /**
+     * Add the equations for a block with a dense Jacobian
+     */
+    void add_equations(
+      const af::const_ref<double> &residuals,
+      const af::const_ref<double, af::c_grid<2> > &jacobian,
+      const af::const_ref<double> &weights) {
+      DIALS_ASSERT(jacobian.accessor()[0] == residuals.size());
+      DIALS_ASSERT(jacobian.accessor()[1] == n_parameters_);
+      accumulate(detail::jacobian_rows(jacobian), residuals, weights);
+    }
+
+    /**
+     * Add the equations for a block with a sparse Jacobian
+     */
+    void add_equations_sparse(const af::const_ref<double> &residuals,
+                              const scitbx::sparse::matrix<double> &jacobian,
+                              const af::const_ref<double> &weights) {
+      DIALS_ASSERT(jacobian.n_rows() == residuals.size());
+      DIALS_ASSERT(jacobian.n_cols() == n_parameters_);
+      accumulate(detail::jacobian_rows(jacobian), residuals, weights);
+    }
+
+    /**
+     * @returns Half the weighted sum of squared residuals
+     */
+    double objective() const {
+      return 0.5 * sum_wr2_;
+    }
+
+    /**
+     * @returns The weighted sum of squared residuals per degree of freedom
+     */
+    double chi_sq() const {
+      if (n_equations_ <= n_parameters_) {
+        return 0.0;
+      }
+      return sum_wr2_ / (n_equations_ - n_parameters_);
+    }
+
+    af::shared<double> normal_matrix_packed_u() {
+      reduce();
+      return af::shared<double>(matrix_.begin(), matrix_.end());
+    }
+
+    af::shared<double> normal_matrix_diagonal() {
+      reduce();
+      af::shared<double> result(n_parameters_);
+      for (std::size_t p = 0; p < n_parameters_; ++p) {
+        result[p] = matrix_[diagonal_index(p)];
+      }
+      return result;
+    }
+
+    void add_constant_to_diagonal(double mu) {
+      reduce();
+      for (std::size_t p = 0; p < n_parameters_; ++p) {
+        matrix_[diagonal_index(p)] += mu;
+      }
+    }
+
+    /**
+     * @returns The right hand side -w J^T r, which is minus the gradient of
+     * the objective
+     */
+    af::shared<double> right_hand_side() {
+      reduce();
+      return af::shared<double>(rhs_.begin(), rhs_.end());
+    }
+
+    /**
+     * Solve the normal equations by Cholesky decomposition of the normal
+     * matrix into U^T U
+     */
+    void solve() {
+      reduce();
+      const std::size_t n = n_parameters_;
+      factor_ = matrix_;
+      for (std::size_t p = 0; p < n; ++p) {
+        double *row_p = &factor_[row_start(p)];
+        double d = row_p[p];
+        for (std::size_t k = 0; k < p; ++k) {
+          double u = factor_[row_start(k) + p];
+          d -= u * u;
+        }
+        if (!(d > 0.0)) {
+          factor_.clear();
+          solution_.clear();
+          throw DIALS_ERROR("The normal matrix is not positive definite");
+        }
+        d = std::sqrt(d);
+        row_p[p] = d;
+        for (std::size_t q = p + 1; q < n; ++q) {
+          double s = row_p[q];
+          for (std::size_t k = 0; k < p; ++k) {
+            const double *row_k = &factor_[row_start(k)];
+            s -= row_k[p] * row_k[q];
+          }
+          row_p[q] = s / d;
+        }
+      }
+
+      // Forward substitution for U^T y = b, then back substitution for U x = y
+      solution_ = rhs_;
+      for (std::size_t p = 0; p < n; ++p) {
+        double s = solution_[p];
+        for (std::size_t k = 0; k < p; ++k) {
+          s -= factor_[row_start(k) + p] * solution_[k];
+        }
+        solution_[p] = s / factor_[row_start(p) + p];
+      }
+      for (std::size_t p = n; p-- > 0;) {
+        const double *row_p = &factor_[row_start(p)];
+        double s = solution_[p];
+        for (std::size_t q = p + 1; q < n; ++q) {
+          s -= row_p[q] * solution_[q];
+        }
+        solution_[p] = s / row_p[p];
+      }
+    }
+
+    /**
+     * Solve the normal equations by the conjugate gradient method, with the
+     * diagonal of the normal matrix as a preconditioner. This avoids the cubic
+     * cost of the decomposition when there are many parameters.
+     * @param max_iterations The maximum number of iterations
+     * @param tolerance Stop when the norm of the residual relative to that of
+     *                  the right hand side falls below this
+     */
+    void solve_cg(std::size_t max_iterations, double tolerance) {
+      reduce();
+      const std::size_t n = n_parameters_;
+      factor_.clear();
+
+      std::vector<double> inverse_diagonal(n);
+      for (std::size_t p = 0; p < n; ++p) {
+        double d = matrix_[diagonal_index(p)];
+        inverse_diagonal[p] = d > 0.0 ? 1.0 / d : 1.0;
+      }
+
+      solution_.assign(n, 0.0);
+      std::vector<double> r(rhs_);
+      std::vector<double> z(n), d(n), q(n);
+      double rhs_norm = std::sqrt(dot(rhs_, rhs_));
+      n_cg_iterations_ = 0;
+      if (rhs_norm == 0.0) {
+        return;
+      }
+      for (std::size_t p = 0; p < n; ++p) {
+        z[p] = inverse_diagonal[p] * r[p];
+      }
+      d = z;
+      double rz = dot(r, z);
+      while (n_cg_iterations_ < max_iterations) {
+        multiply(d, q);
+        double dq = dot(d, q);
+        if (!(dq > 0.0)) {
+          throw DIALS_ERROR("The normal matrix is not positive definite");
+        }
+        double alpha = rz / dq;
+        for (std::size_t p = 0; p < n; ++p) {
+          solution_[p] += alpha * d[p];
+          r[p] -= alpha * q[p];
+        }
+        n_cg_iterations_++;
+        if (std::sqrt(dot(r, r)) <= tolerance * rhs_norm) {
+          break;
+        }
+        for (std::size_t p = 0; p < n; ++p) {
+          z[p] = inverse_diagonal[p] * r[p];
+        }
+        double rz_new = dot(r, z);
+        double beta = rz_new / rz;
+        rz = rz_new;
+        for (std::size_t p = 0; p < n; ++p) {
+          d[p] = z[p] + beta * d[p];
+        }
+      }
+    }
+
+    std::size_t n_cg_iterations() const {
+      return n_cg_iterations_;
+    }
+
+    /**
+     * @returns The solution of the last call to solve or solve_cg
+     */
+    af::shared<double> solution() const {
+      DIALS_ASSERT(solution_.size() == n_parameters_);
+      return af::shared<double>(solution_.begin(), solution_.end());
+    }
+
+    /**
+     * @returns Whether the last solution used the Cholesky decomposition
+     */
+    bool has_cholesky_factor() const {
+      return factor_.size() == matrix_.size();
+    }
+
+    /**
+     * @returns The upper triangular Cholesky factor U in packed form
+     */
+    af::shared<double> cholesky_factor_packed_u() const {
+      DIALS_ASSERT(has_cholesky_factor());
+      return af::shared<double>(factor_.begin(), factor_.end());
+    }
+
+  private:
+    std::size_t row_start(std::size_t p) const {
+      return p * n_parameters_ - p * (p + 1) / 2;
+    }
+
+    std::size_t diagonal_index(std::size_t p) const {
+      return row_start(p) + p;
+    }
+
+    static double dot(const std::vector<double> &a, const std::vector<double> &b) {
+      double s = 0.0;
+      for (std::size_t i = 0; i < a.size(); ++i) {
+        s += a[i] * b[i];
+      }
+      return s;
+    }
+
+    /**
+     * Multiply a vector by the symmetric normal matrix
+     */
+    void multiply(const std::vector<double> &x, std::vector<double> &y) const {
+      const std::size_t n = n_parameters_;
+      std::fill(y.begin(), y.end(), 0.0);
+      for (std::size_t p = 0; p < n; ++p) {
+        const double *row_p = &matrix_[row_start(p)];
+        double s = row_p[p] * x[p];
+        for (std::size_t q = p + 1; q < n; ++q) {
+          s += row_p[q] * x[q];
+          y[q] += row_p[q] * x[p];
+        }
+        y[p] += s;
+      }
+    }
+
+    /**
+     * Add the accumulators of the threads to the normal equations
+     */
+    void reduce() {
+      if (!pending_) {
+        return;
+      }
+      for (std::size_t j = 0; j < thread_matrix_.size(); ++j) {
+        for (std::size_t k = 0; k < matrix_.size(); ++k) {
+          matrix_[k] += thread_matrix_[j][k];
+        }
+        for (std::size_t p = 0; p < n_parameters_; ++p) {
+          rhs_[p] += thread_rhs_[j][p];
+        }
+      }
+      clear_thread_accumulators();
+    }
+
+    void clear_thread_accumulators() {
+      for (std::size_t j = 0; j < thread_matrix_.size(); ++j) {
+        std::fill(thread_matrix_[j].begin(), thread_matrix_[j].end(), 0.0);
+        std::fill(thread_rhs_[j].begin(), thread_rhs_[j].end(), 0.0);
+      }
+      pending_ = false;
+    }
+
+    void accumulate(const detail::jacobian_rows &rows,
+                    const af::const_ref<double> &residuals,
+                    const af::const_ref<double> &weights) {
+      DIALS_ASSERT(weights.size() == residuals.size());
+      std::size_t n_rows = rows.n_rows();
+
+      // Each extra thread needs its own copy of the normal matrix, so only
+      // split blocks with enough rows to make that worthwhile
+      std::size_t njobs = std::max<std::size_t>(
+        1, std::min(nthreads_, n_rows / min_rows_per_thread_));
+      while (thread_matrix_.size() + 1 < njobs) {
+        thread_matrix_.push_back(std::vector<double>(matrix_.size(), 0.0));
+        thread_rhs_.push_back(std::vector<double>(n_parameters_, 0.0));
+      }
+      std::vector<detail::normal_equations_job> jobs(njobs);
+      for (std::size_t j = 0; j < njobs; ++j) {
+        jobs[j].rows = &rows;
+        jobs[j].residuals = residuals.begin();
+        jobs[j].weights = weights.begin();
+        jobs[j].n_parameters = n_parameters_;
+        jobs[j].first = (j * n_rows) / njobs;
+        jobs[j].last = ((j + 1) * n_rows) / njobs;
+        jobs[j].matrix = j == 0 ? &matrix_[0] : &thread_matrix_[j - 1][0];
+        jobs[j].rhs = j == 0 ? &rhs_[0] : &thread_rhs_[j - 1][0];
+      }
+
+      if (njobs == 1) {
+        jobs[0]();
+      } else {
+        pending_ = true;
+        dials::util::ThreadPool pool(njobs);
+        for (std::size_t j = 0; j < njobs; ++j) {
+          pool.post(detail::normal_equations_runner(&jobs[j]));
+        }
+        pool.wait();
+      }
+      for (std::size_t j = 0; j < njobs; ++j) {
+        if (!jobs[j].error.empty()) {
+          throw DIALS_ERROR(jobs[j].error);
+        }
+      }
+      for (std::size_t j = 0; j < njobs; ++j) {
+        sum_wr2_ += jobs[j].sum_wr2;
+      }
+      n_equations_ += n_rows;
+      solution_.clear();
+      factor_.clear();
+    }
+
+    std::size_t n_parameters_;
+    std::size_t nthreads_;
+    std::size_t min_rows_per_thread_;
+    std::vector<double> matrix_;
+    std::vector<double> rhs_;
+    std::vector<std::vector<double> > thread_matrix_;
+    std::vector<std::vector<double> > thread_rhs_;
+    bool pending_;
+    std::vector<double> factor_;
+    std::vector<double> solution_;
+    std::size_t n_equations_;
+    double sum_wr2_;
+    std::size_t n_cg_iterations_;
+  };
+
+}}  // namespace dials::refinement
+
+#endif  // DIALS_REFINEMENT_NORMAL_EQUATIONS_H
@@ -0,0 +1,579 @@
+
+#ifndef DIALS_REFINEMENT_FAST_MCD_H
+#define DIALS_REFINEMENT_FAST_MCD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+#include <dials/array_family/scitbx_shared_and_versa.h>
+#include <dials/algorithms/refinement/outlier_detection/mahalanobis.h>
+#include <dials/util/philox.h>
+#include <dials/util/thread_pool.h>
+#include <dials/error.h>
+
+namespace dials { namespace refinement {
+
+  namespace detail {
+
+    /**
+     * Observations stored as one contiguous array per variable
+     */
+    struct mcd_dataset {
+      std::size_t n;
+      std::size_t p;
+      std::vector<double> values;
+
+      mcd_dataset() : n(0), p(0) {}
+
+      const double *col(std::size_t j) const {
+        return &values[j * n];
+      }
+
+      /**
+       * Copy a selection of the rows of another dataset
+       */
+      mcd_dataset(const mcd_dataset &other,
+                  std::vector<std::size_t>::const_iterator first,
+                  std::vector<std::size_t>::const_iterator last)
+          : n(last - first), p(other.p), values(n * p) {
+        for (std::size_t j = 0; j < p; ++j) {
+          const double *src = other.col(j);
+          double *dst = &values[j * n];
+          for (std::vector<std::size_t>::const_iterator it = first; it != last; ++it) {
+            *dst++ = src[*it];
+          }
+        }
+      }
+    };
+
+    /**
+     * A location and scatter estimate, with the Cholesky factor of the scatter
+     * matrix used to calculate distances and the determinant
+     */
+    struct mcd_estimate {
+      double det;
+      std::vector<double> T;
+      std::vector<double> S;
+      std::vector<double> L;
+
+      mcd_estimate() : det(0) {}
+
+      mcd_estimate(std::size_t p) : det(0), T(p), S(p * p), L(p * p) {}
+    };
+
+    /**
+     * Order estimates by determinant, with singular estimates last
+     */
+    struct lower_determinant {
+      bool operator()(const mcd_estimate &a, const mcd_estimate &b) const {
+        if (!(b.det > 0.0)) {
+          return a.det > 0.0;
+        }
+        return a.det > 0.0 && a.det < b.det;
+      }
+    };
+
+    /**
+     * Set an estimate from the mean and sample covariance of a subset of rows.
+     * @returns False if the covariance matrix is singular
+     */
+    inline bool estimate_from_rows(const mcd_dataset &data,
+                                   const std::vector<std::size_t> &rows,
+                                   mcd_estimate &estimate) {
+      const std::size_t p = data.p;
+      const std::size_t m = rows.size();
+      DIALS_ASSERT(m > 1);
+      for (std::size_t j = 0; j < p; ++j) {
+        const double *x = data.col(j);
+        double sum = 0.0;
+        for (std::size_t k = 0; k < m; ++k) {
+          sum += x[rows[k]];
+        }
+        estimate.T[j] = sum / m;
+      }
+      for (std::size_t a = 0; a < p; ++a) {
+        const double *xa = data.col(a);
+        for (std::size_t b = a; b < p; ++b) {
+          const double *xb = data.col(b);
+          double sum = 0.0;
+          for (std::size_t k = 0; k < m; ++k) {
+            sum += (xa[rows[k]] - estimate.T[a]) * (xb[rows[k]] - estimate.T[b]);
+          }
+          estimate.S[a * p + b] = estimate.S[b * p + a] = sum / (m - 1);
+        }
+      }
+      if (!cholesky_lower(&estimate.S[0], p, &estimate.L[0])) {
+        estimate.det = 0.0;
+        return false;
+      }
+      estimate.det = 1.0;
+      for (std::size_t j = 0; j < p; ++j) {
+        estimate.det *= estimate.L[j * p + j] * estimate.L[j * p + j];
+      }
+      return true;
+    }
+
+    /**
+     * Workspace for the concentration steps of one thread
+     */
+    struct mcd_workspace {
+      std::vector<double> d2;
+      std::vector<std::pair<double, std::size_t> > order;
+      std::vector<std::size_t> rows;
+      std::vector<std::size_t> permutation;
+    };
+
+    /**
+     * A concentration step (Theorem 1 of Rousseeuw & van Driessen). Select the
+     * h rows closest to the current estimate and calculate a new estimate
+     * from those.
+     * @returns False if the new covariance matrix is singular
+     */
+    inline bool concentration_step(const mcd_dataset &data,
+                                   std::size_t h,
+                                   const mcd_estimate &current,
+                                   mcd_estimate &next,
+                                   mcd_workspace &work) {
+      DIALS_ASSERT(h <= data.n);
+      work.d2.resize(data.n);
+      std::vector<const double *> cols(data.p);
+      for (std::size_t j = 0; j < data.p; ++j) {
+        cols[j] = data.col(j);
+      }
+      maha_dist_sq_soa(
+        &cols[0], data.n, data.p, &current.T[0], &current.L[0], &work.d2[0]);
+
+      // Ties are broken by row so the selection is deterministic
+      work.order.resize(data.n);
+      for (std::size_t i = 0; i < data.n; ++i) {
+        work.order[i] = std::make_pair(work.d2[i], i);
+      }
+      std::nth_element(work.order.begin(), work.order.begin() + h, work.order.end());
+      work.rows.resize(h);
+      for (std::size_t i = 0; i < h; ++i) {
+        work.rows[i] = work.order[i].second;
+      }
+      std::sort(work.rows.begin(), work.rows.end());
+      return estimate_from_rows(data, work.rows, next);
+    }
+
+    /**
+     * Take up to nsteps concentration steps, stopping early once the
+     * determinant no longer changes if converge is set
+     */
+    inline void concentrate(const mcd_dataset &data,
+                            std::size_t h,
+                            std::size_t nsteps,
+                            bool converge,
+                            mcd_estimate &estimate,
+                            mcd_workspace &work) {
+      mcd_estimate next(data.p);
+      for (std::size_t step = 0; step < nsteps; ++step) {
+        // An exact fit cannot be improved
+        if (estimate.det <= 0.0) {
+          break;
+        }
+        concentration_step(data, h, estimate, next, work);
+        bool same = next.det == estimate.det;
+        std::swap(estimate, next);
+        if (converge && same) {
+          break;
+        }
+      }
+    }
+
+    /**
+     * Method 2 of subsection 3.1 of Rousseeuw & van Driessen. Draw random
+     * subsets of p + 1 rows, enlarging them until the covariance matrix is
+     * not singular, then take a concentration step to get a subset of h rows.
+     */
+    inline void initial_estimate(const mcd_dataset &data,
+                                 std::size_t h,
+                                 dials::util::Philox4x32 &rng,
+                                 mcd_estimate &estimate,
+                                 mcd_workspace &work) {
+      const std::size_t n = data.n;
+      work.permutation.resize(n);
+      std::iota(work.permutation.begin(), work.permutation.end(), 0);
+      work.rows.clear();
+      mcd_estimate start(data.p);
+      for (std::size_t i = 0; i < n; ++i) {
+        // partial Fisher-Yates shuffle, drawing one row at a time
+        std::size_t k = i + static_cast<std::size_t>(rng.random_double() * (n - i));
+        std::swap(work.permutation[i], work.permutation[k]);
+        work.rows.push_back(work.permutation[i]);
+        if (work.rows.size() > data.p && estimate_from_rows(data, work.rows, start)) {
+          break;
+        }
+      }
+      if (!(start.det > 0.0)) {
+        throw DIALS_ERROR("FastMCD: the covariance of all observations is singular");
+      }
+      concentration_step(data, h, start, estimate, work);
+    }
+
+    /**
+     * A set of trials sharing a dataset and a subset size. Each trial either
+     * starts from a random subset drawn with its own counter based stream of
+     * random numbers, or continues from a previous estimate, so the results
+     * do not depend on the number of threads.
+     */
+    struct mcd_trials {
+      const mcd_dataset *data;
+      std::size_t h;
+      std::size_t nsteps;
+      bool converge;
+      std::uint32_t seed;
+      std::uint32_t stage;
+      std::uint32_t group;
+      std::vector<mcd_estimate> estimates;
+      bool random_start;
+
+      mcd_trials()
+          : data(0),
+            h(0),
+            nsteps(0),
+            converge(false),
+            seed(0),
+            stage(0),
+            group(0),
+            random_start(false) {}
+
+      void run(std::size_t i, mcd_workspace &work) {
+        mcd_estimate &estimate = estimates[i];
+        if (random_start) {
+          dials::util::Philox4x32 rng(seed, 0, stage, group, (std::uint32_t)i);
+          estimate = mcd_estimate(data->p);
+          initial_estimate(*data, h, rng, estimate, work);
+        }
+        concentrate(*data, h, nsteps, converge, estimate, work);
+      }
+    };
+
+    struct mcd_job {
+      std::vector<mcd_trials> *sets;
+      std::size_t first;
+      std::size_t last;
+      std::string error;
+
+      mcd_job() : sets(0), first(0), last(0) {}
+
+      void operator()() {
+        try {
+          mcd_workspace work;
+          std::size_t offset = 0;
+          for (std::size_t s = 0; s < sets->size(); ++s) {
+            mcd_trials &trials = (*sets)[s];
+            std::size_t size = trials.estimates.size();
+            std::size_t i0 = std::max(first, offset);
+            std::size_t i1 = std::min(last, offset + size);
+            for (std::size_t i = i0; i < i1; ++i) {
+              trials.run(i - offset, work);
+            }
+            offset += size;
+          }
+        } catch (const std::exception &e) {
+          error = e.what();
+        } catch (...) {
+          error = "Unknown error in FastMCD";
+        }
+      }
+    };
+
+    struct mcd_runner {
+      mcd_job *job;
+      mcd_runner(mcd_job *job_) : job(job_) {}
+      void operator()() const {
+        (*job)();
+      }
+    };
+
+  }  // namespace detail
+
+  /**
+   * The FAST-MCD algorithm of Rousseeuw & van Driessen (Technometrics, 1999)
+   * for the raw Minimum Covariance Determinant estimate of location and
+   * scatter. The independent trials from random starting subsets are spread
+   * over threads. Each trial uses its own stream of random numbers derived
+   * from the seed, so the result is reproducible for any number of threads.
+   */
+  class FastMCD {
+  public:
+    /**
+     * @param data The observations, with one row per variable
+     * @param alpha The fraction of observations determining the subset size
+     * @param max_n_groups The maximum number of groups for large datasets
+     * @param min_group_size The minimum size of each group
+     * @param n_trials The number of random starting subsets
+     * @param k1 Concentration steps for each initial trial
+     * @param k2 Concentration steps for the best trials on the merged groups
+     * @param k3 Maximum concentration steps for the final trials
+     * @param seed The seed for the random starting subsets
+     * @param nthreads The number of threads
+     */
+    FastMCD(const af::const_ref<double, af::c_grid<2> > &data,
+            double alpha = 0.5,
+            std::size_t max_n_groups = 5,
+            std::size_t min_group_size = 300,
+            std::size_t n_trials = 500,
+            std::size_t k1 = 2,
+            std::size_t k2 = 2,
+            std::size_t k3 = 100,
+            std::size_t seed = 0,
+            std::size_t nthreads = 1)
+        : max_n_groups_(max_n_groups),
+          min_group_size_(min_group_size),
+          n_trials_(n_trials),
+          k1_(k1),
+          k2_(k2),
+          k3_(k3),
+          seed_((std::uint32_t)seed),
+          nthreads_(nthreads) {
+      data_.p = data.accessor()[0];
+      data_.n = data.accessor()[1];
+      data_.values.assign(data.begin(), data.end());
+      const std::size_t n = data_.n;
+      const std::size_t p = data_.p;
+      DIALS_ASSERT(p > 1);
+      DIALS_ASSERT(n > p);
+      DIALS_ASSERT(alpha > 0.0 && alpha <= 1.0);
+      DIALS_ASSERT(n_trials > 0);
+      DIALS_ASSERT(min_group_size > 0);
+      DIALS_ASSERT(max_n_groups > 0);
+      DIALS_ASSERT(nthreads > 0);
+
+      std::size_t n2 = (n + p + 1) / 2;
+      h_ = (std::size_t)std::floor(2.0 * n2 - n + 2.0 * (n - n2) * alpha);
+      DIALS_ASSERT(h_ < n);
+
+      detail::mcd_estimate best;
+      if (n < 2 * min_group_size_) {
+        best = small_dataset_estimate();
+      } else {
+        best = large_dataset_estimate();
+      }
+      if (!(best.det > 0.0)) {
+        throw DIALS_ERROR("FastMCD: all trials gave a singular covariance matrix");
+      }
+      T_ = af::shared<double>(best.T.begin(), best.T.end());
+      S_ = af::versa<double, af::c_grid<2> >(af::c_grid<2>(p, p));
+      std::copy(best.S.begin(), best.S.end(), S_.begin());
+      det_ = best.det;
+    }
+
+    std::size_t h() const {
+      return h_;
+    }
+
+    /**
+     * @returns The raw MCD location estimate
+     */
+    af::shared<double> T() const {
+      return T_;
+    }
+
+    /**
+     * @returns The raw MCD covariance matrix estimate
+     */
+    af::versa<double, af::c_grid<2> > S() const {
+      return S_;
+    }
+
+    /**
+     * @returns The determinant of the raw covariance matrix estimate
+     */
+    double det() const {
+      return det_;
+    }
+
+  private:
+    enum { initial_stage = 0, group_stage = 1, sample_stage = 2 };
+
+    /**
+     * When a dataset is small, perform the initial trials directly on the
+     * whole dataset
+     */
+    detail::mcd_estimate small_dataset_estimate() {
+      std::vector<detail::mcd_trials> sets(1);
+      setup_random_trials(sets[0], &data_, h_, n_trials_, k1_, 0);
+      run(sets);
+
+      // refine the 10 trials with the lowest determinants to convergence
+      std::vector<detail::mcd_estimate> trials = best_of(sets[0].estimates, 10);
+      setup_refinement(sets[0], &data_, h_, trials, k3_);
+      run(sets);
+      return best_of(sets[0].estimates, 1)[0];
+    }
+
+    /**
+     * When a dataset is large, construct disjoint subsets of the full data and
+     * perform initial trials within each of these, then merge
+     */
+    detail::mcd_estimate large_dataset_estimate() {
+      const std::size_t n = data_.n;
+      std::size_t ngroups = n / min_group_size_;
+      std::size_t sample_size = n;
+      if (ngroups >= max_n_groups_) {
+        ngroups = max_n_groups_;
+        sample_size = min_group_size_ * max_n_groups_;
+      }
+
+      // sample the data in random order and split into groups
+      std::vector<std::size_t> permutation(n);
+      std::iota(permutation.begin(), permutation.end(), 0);
+      dials::util::Philox4x32 rng(seed_, 0, sample_stage, 0, 0);
+      for (std::size_t i = 0; i < sample_size; ++i) {
+        std::size_t k = i + static_cast<std::size_t>(rng.random_double() * (n - i));
+        std::swap(permutation[i], permutation[k]);
+      }
+      detail::mcd_dataset sampled(
+        data_, permutation.begin(), permutation.begin() + sample_size);
+
+      std::size_t blocksize = sample_size / ngroups;
+      std::size_t rem = sample_size % ngroups;
+      std::vector<detail::mcd_dataset> groups;
+      std::vector<std::size_t> rows(sample_size);
+      std::iota(rows.begin(), rows.end(), 0);
+      std::size_t start = 0;
+      for (std::size_t g = 0; g < ngroups; ++g) {
+        std::size_t size = blocksize + (g >= ngroups - rem ? 1 : 0);
+        groups.push_back(detail::mcd_dataset(
+          sampled, rows.begin() + start, rows.begin() + start + size));
+        start += size;
+      }
+
+      // work within the groups, keeping the 10 best trials of each
+      double h_frac = (double)h_ / n;
+      std::size_t n_trials = std::max<std::size_t>(1, n_trials_ / ngroups);
+      std::vector<detail::mcd_trials> sets(ngroups);
+      for (std::size_t g = 0; g < ngroups; ++g) {
+        std::size_t h_sub = (std::size_t)(groups[g].n * h_frac);
+        setup_random_trials(sets[g], &groups[g], h_sub, n_trials, k1_, g);
+      }
+      run(sets);
+      std::vector<detail::mcd_estimate> trials;
+      for (std::size_t g = 0; g < ngroups; ++g) {
+        std::vector<detail::mcd_estimate> best = best_of(sets[g].estimates, 10);
+        trials.insert(trials.end(), best.begin(), best.end());
+      }
+
+      // take k2 steps with each of those on the merged (sampled) set
+      std::size_t h_mrgd = (std::size_t)(sample_size * h_frac);
+      sets.resize(1);
+      setup_refinement(sets[0], &sampled, h_mrgd, trials, k2_);
+      sets[0].converge = false;
+      run(sets);
+
+      // choose the number of steps to take on the whole dataset based on its
+      // size, and the number of trials based on the number of observations.
+      // Up to 200000 values take 10 steps, then one fewer for each further
+      // 100000 values, down to a single step above 1000000.
+      std::size_t size = n * data_.p;
+      std::size_t k4 = k3_;
+      if (size > 100000) {
+        k4 = size > 1000000 ? 1 : 11 - (size - 1) / 100000;
+      }
+      std::size_t n_reps = n > 5000 ? 1 : 10;
+      trials = best_of(sets[0].estimates, n_reps);
+      setup_refinement(sets[0], &data_, h_, trials, k4);
+      run(sets);
+      return best_of(sets[0].estimates, 1)[0];
+    }
+
+    void setup_random_trials(detail::mcd_trials &trials,
+                             const detail::mcd_dataset *data,
+                             std::size_t h,
+                             std::size_t n_trials,
+                             std::size_t nsteps,
+                             std::size_t group) const {
+      trials.data = data;
+      trials.h = h;
+      trials.nsteps = nsteps;
+      trials.converge = false;
+      trials.seed = seed_;
+      trials.stage = data == &data_ ? initial_stage : group_stage;
+      trials.group = (std::uint32_t)group;
+      trials.random_start = true;
+      trials.estimates.assign(n_trials, detail::mcd_estimate());
+    }
+
+    void setup_refinement(detail::mcd_trials &trials,
+                          const detail::mcd_dataset *data,
+                          std::size_t h,
+                          const std::vector<detail::mcd_estimate> &start,
+                          std::size_t nsteps) const {
+      trials.data = data;
+      trials.h = h;
+      trials.nsteps = nsteps;
+      trials.converge = true;
+      trials.random_start = false;
+      trials.estimates = start;
+    }
+
+    /**
+     * @returns Up to n estimates with the lowest determinants, in order
+     */
+    static std::vector<detail::mcd_estimate> best_of(
+      const std::vector<detail::mcd_estimate> &estimates,
+      std::size_t n) {
+      std::vector<detail::mcd_estimate> result(estimates);
+      std::stable_sort(result.begin(), result.end(), detail::lower_determinant());
+      result.resize(std::min(n, result.size()));
+      return result;
+    }
+
+    /**
+     * Run all the trials of a list of sets, split evenly between threads
+     */
+    void run(std::vector<detail::mcd_trials> &sets) const {
+      std::size_t total = 0;
+      for (std::size_t s = 0; s < sets.size(); ++s) {
+        total += sets[s].estimates.size();
+      }
+      std::size_t njobs = std::max<std::size_t>(1, std::min(nthreads_, total));
+      std::vector<detail::mcd_job> jobs(njobs);
+      for (std::size_t j = 0; j < njobs; ++j) {
+        jobs[j].sets = &sets;
+        jobs[j].first = (j * total) / njobs;
+        jobs[j].last = ((j + 1) * total) / njobs;
+      }
+      if (njobs == 1) {
+        jobs[0]();
+      } else {
+        dials::util::ThreadPool pool(njobs);
+        for (std::size_t j = 0; j < njobs; ++j) {
+          pool.post(detail::mcd_runner(&jobs[j]));
+        }
+        pool.wait();
+      }
+      for (std::size_t j = 0; j < njobs; ++j) {
+        if (!jobs[j].error.empty()) {
+          throw DIALS_ERROR(jobs[j].error);
+        }
+      }
+    }
+
+    detail::mcd_dataset data_;
+    std::size_t max_n_groups_;
+    std::size_t min_group_size_;
+    std::size_t n_trials_;
+    std::size_t k1_;
+    std::size_t k2_;
+    std::size_t k3_;
+    std::uint32_t seed_;
+    std::size_t nthreads_;
+    std::size_t h_;
+    af::shared<double> T_;
+    af::versa<double, af::c_grid<2> > S_;
+    double det_;
+  };
+
+}}  // namespace dials::refinement
+
+#endif  // DIALS_REFINEMENT_FAST_MCD_H
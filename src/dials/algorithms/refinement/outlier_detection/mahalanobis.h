@@ -2,15 +2,100 @@
 #ifndef DIALS_REFINEMENT_MAHALANOBIS_H
 #define DIALS_REFINEMENT_MAHALANOBIS_H
 
+#include <algorithm>
+#include <cmath>
+#include <vector>
 #include <dials/array_family/scitbx_shared_and_versa.h>
-#include <scitbx/array_family/versa_matrix.h>
 #include <dials/error.h>
 
 namespace dials { namespace refinement {
 
-  af::shared<double> maha_dist_sq(const af::const_ref<double, af::c_grid<2> > &obs,
-                                  const af::const_ref<double> &center,
-                                  const af::const_ref<double, af::c_grid<2> > &cov) {
+  namespace detail {
+
+    /**
+     * Cholesky decomposition S = L L^T of a symmetric positive definite matrix
+     * @param s The p x p matrix, row-major
+     * @param p The dimension
+     * @param l The lower triangular factor, row-major, with zeros above the
+     *          diagonal
+     * @returns False if the matrix is not positive definite
+     */
+    inline bool cholesky_lower(const double *s, std::size_t p, double *l) {
+      std::fill(l, l + p * p, 0.0);
+      for (std::size_t j = 0; j < p; ++j) {
+        double d = s[j * p + j];
+        for (std::size_t k = 0; k < j; ++k) {
+          d -= l[j * p + k] * l[j * p + k];
+        }
+        if (!(d > 0.0)) {
+          return false;
+        }
+        l[j * p + j] = std::sqrt(d);
+        for (std::size_t i = j + 1; i < p; ++i) {
+          double v = s[i * p + j];
+          for (std::size_t k = 0; k < j; ++k) {
+            v -= l[i * p + k] * l[j * p + k];
+          }
+          l[i * p + j] = v / l[j * p + j];
+        }
+      }
+      return true;
+    }
+
+    /**
+     * Squared Mahalanobis distances of observations stored as one array per
+     * variable. With S = L L^T the distance is |y|^2 where L y = (x - mu).
+     * The forward substitution is done for a block of observations at a time,
+     * with the innermost loops running over the observations in the block so
+     * that they can be vectorised.
+     * @param cols Pointers to the p arrays of n values
+     * @param n The number of observations
+     * @param p The number of variables
+     * @param center The location, mu
+     * @param l The Cholesky factor of the covariance matrix
+     * @param d2 The n output distances
+     */
+    inline void maha_dist_sq_soa(const double *const *cols,
+                                 std::size_t n,
+                                 std::size_t p,
+                                 const double *center,
+                                 const double *l,
+                                 double *d2) {
+      const std::size_t block = 256;
+      std::vector<double> y(p * block);
+      for (std::size_t first = 0; first < n; first += block) {
+        const std::size_t m = std::min(block, n - first);
+        double *out = d2 + first;
+        std::fill(out, out + m, 0.0);
+        for (std::size_t j = 0; j < p; ++j) {
+          const double *x = cols[j] + first;
+          double *yj = &y[j * block];
+          const double c = center[j];
+          for (std::size_t b = 0; b < m; ++b) {
+            yj[b] = x[b] - c;
+          }
+          for (std::size_t k = 0; k < j; ++k) {
+            const double *yk = &y[k * block];
+            const double ljk = l[j * p + k];
+            for (std::size_t b = 0; b < m; ++b) {
+              yj[b] -= ljk * yk[b];
+            }
+          }
+          const double inv_ljj = 1.0 / l[j * p + j];
+          for (std::size_t b = 0; b < m; ++b) {
+            yj[b] *= inv_ljj;
+            out[b] += yj[b] * yj[b];
+          }
+        }
+      }
+    }
+
+  }  // namespace detail
+
+  inline af::shared<double> maha_dist_sq(
+    const af::const_ref<double, af::c_grid<2> > &obs,
+    const af::const_ref<double> &center,
+    const af::const_ref<double, af::c_grid<2> > &cov) {
     std::size_t nobs = obs.accessor()[0];
     std::size_t nparam = obs.accessor()[1];
 
@@ -20,39 +105,30 @@ namespace dials { namespace refinement {
     DIALS_ASSERT(cov.accessor()[0] == nparam);
     DIALS_ASSERT(cov.accessor().is_square());
 
-    // invert covariance matrix
-    af::versa<double, af::c_grid<2> > covinv(cov.accessor());
-    std::copy(cov.begin(), cov.end(), covinv.begin());
-    af::matrix_inversion_in_place(covinv.ref());
-
-    // create output array
-    af::shared<double> d2(nobs);
-
-    // loop over observations
-    std::size_t k = 0;
-    for (std::size_t i = 0; i < nobs; i++) {
-      // copy row from obs and shift by means
-      af::shared<double> row(nparam);
-
-      for (std::size_t j = 0; j < nparam; j++) {
-        row[j] = obs[k] - center[j];
-        k++;
-      }
+    // Mahalanobis distance squared is defined by the matrix product
+    //
+    // (x - mu)^T [S]^-1 (x - mu)
+    //
+    // Rather than invert [S], factorise it as L L^T so that the product is
+    // the squared norm of the solution of L y = (x - mu).
+    std::vector<double> l(nparam * nparam);
+    if (!detail::cholesky_lower(cov.begin(), nparam, &l[0])) {
+      throw DIALS_ERROR("Covariance matrix is not positive definite");
+    }
 
-      // Mahalanobis distance squared is defined by the matrix product
-      //
-      // (x - mu)^T [S]^-1 (x - mu)
-      //
-      // (x - mu) is in 'row' and [S]^-1 is 'covinv'. Perform the right
-      // hand part of the product first with matrix_multiply and the
-      // second step is just a dot product.
-      af::shared<double> prod =
-        af::matrix_multiply(covinv.const_ref(), row.const_ref());
-      d2[i] = 0.0;
-      for (std::size_t j = 0; j < nparam; j++) {
-        d2[i] += row[j] * prod[j];
+    // copy the observations into one array per parameter
+    std::vector<double> values(nobs * nparam);
+    std::vector<const double *> cols(nparam);
+    for (std::size_t j = 0; j < nparam; j++) {
+      for (std::size_t i = 0; i < nobs; i++) {
+        values[j * nobs + i] = obs(i, j);
       }
+      cols[j] = &values[j * nobs];
     }
+
+    // create output array
+    af::shared<double> d2(nobs);
+    detail::maha_dist_sq_soa(&cols[0], nobs, nparam, center.begin(), &l[0], d2.begin());
     return d2;
   }
 
@@ -66,6 +66,7 @@ def _detect_outliers(self, cols):
             k1=self._k1,
             k2=self._k2,
             k3=self._k3,
+            nproc=self._nthreads,
         )
 
         # get location and MCD scatter estimate
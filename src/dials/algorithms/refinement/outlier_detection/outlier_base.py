@@ -50,6 +50,9 @@ def __init__(
 
         self.nproc = nproc
 
+        # the number of threads available to each job
+        self._nthreads = 1
+
         return
 
     def get_block_width(self, exp_id=None):
@@ -226,15 +229,19 @@ def __call__(self, reflections):
         header.extend(["Nref", "Nout", "%out"])
         rows = []
 
-        # Now loop over the lowest level of splits and run outlier detection
-        if self.nproc > 1:
+        # Now loop over the lowest level of splits and run outlier detection.
+        # A single job is kept in the main process, where it may use nproc
+        # threads instead
+        if self.nproc > 1 and len(jobs3) > 1:
+            self._nthreads = 1
             with concurrent.futures.ProcessPoolExecutor(max_workers=self.nproc) as pool:
                 outlier_detection_runs = [
                     pool.submit(self._run_job, job, i) for i, job in enumerate(jobs3)
                 ]
             outlier_detection_runs = [e.result() for e in outlier_detection_runs]
         else:
-            # For nproc=1 keep the jobs in the main process
+            # Otherwise keep the jobs in the main process
+            self._nthreads = self.nproc
             outlier_detection_runs = [
                 self._run_job(job, i) for i, job in enumerate(jobs3)
             ]
@@ -596,7 +596,7 @@ def _parameterise_crystals(options, experiments, analysis):
     return xl_ori_params, xl_uc_params
 
 
-def _parameterise_detectors(options, experiments, analysis):
+def _parameterise_detectors(options, experiments, analysis, nproc=1):
     det_params = []
     sv_det = options.scan_varying and not options.detector.force_static
     for idetector, detector in enumerate(experiments.detectors()):
@@ -678,6 +678,7 @@ def _parameterise_detectors(options, experiments, analysis):
                         detector,
                         experiment_ids=exp_ids,
                         level=options.detector.hierarchy_level,
+                        nproc=nproc,
                     )
                 except AttributeError:
                     raise DialsRefineConfigError(
@@ -789,7 +790,7 @@ def _parameterise_goniometers(options, experiments, analysis):
 
 
 def build_prediction_parameterisation(
-    options, experiments, reflection_manager, do_stills=False
+    options, experiments, reflection_manager, do_stills=False, nproc=1
 ):
     """Given a set of parameters, create a parameterisation from a set of
     experimental models.
@@ -799,6 +800,8 @@ def build_prediction_parameterisation(
         experiments: An ExperimentList object
         reflection_manager: A ReflectionManager object
         do_stills (bool)
+        nproc (int): The number of threads used to compose hierarchical
+            detector parameterisations
 
     Returns:
         A prediction equation parameterisation object
@@ -827,7 +830,7 @@ def build_prediction_parameterisation(
 
     # Parameterise each unique model
     xl_ori_params, xl_uc_params = _parameterise_crystals(options, experiments, analysis)
-    det_params = _parameterise_detectors(options, experiments, analysis)
+    det_params = _parameterise_detectors(options, experiments, analysis, nproc)
     gon_params = _parameterise_goniometers(options, experiments, analysis)
     beam_params = _parameterise_beams(options, experiments, analysis)
 
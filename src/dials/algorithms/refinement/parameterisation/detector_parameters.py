@@ -10,11 +10,11 @@
     Parameter,
 )
 from dials.algorithms.refinement.refinement_helpers import (
-    PanelGroupCompose,
     dR_from_axis_and_angle,
     get_panel_groups_at_depth,
     get_panel_ids_at_root,
 )
+from dials_refinement_helpers_ext import MultiPanelGroupCompose
 
 
 class DetectorMixin:
@@ -905,7 +905,7 @@ class DetectorParameterisationHierarchical(DetectorParameterisationMultiPanel):
     DetectorParameterisationSinglePanel).
     """
 
-    def __init__(self, detector, experiment_ids=None, level=0):
+    def __init__(self, detector, experiment_ids=None, level=0, nproc=1):
         """Initialise the DetectorParameterisationHierarchical object
 
         Args:
@@ -914,6 +914,8 @@ def __init__(self, detector, experiment_ids=None, level=0):
                 parameterisation. Defaults to None, which is replaced by [0].
             level (int): Select level of the detector hierarchy to determine panel
                 groupings that are treated as separate rigid blocks.
+            nproc (int): The number of threads used to calculate the derivatives
+                of the panel states.
         """
 
         if experiment_ids is None:
@@ -1040,6 +1042,22 @@ def __init__(self, detector, experiment_ids=None, level=0):
             p_list.extend([dist, shift1, shift2, tau1, tau2, tau3])
             self._group_ids_by_parameter.extend([igp] * 6)
 
+        # set up the helper that composes the states of all the groups. This
+        # only recalculates the derivatives for groups whose parameters changed
+        self._composer = MultiPanelGroupCompose(nthreads=nproc)
+        for state, offsets, dir1s, dir2s in zip(
+            istate, self._offsets, self._dir1s, self._dir2s
+        ):
+            self._composer.add_group(
+                state["d1"],
+                state["d2"],
+                state["dn"],
+                state["gp_offset"],
+                flex.vec3_double(offsets),
+                flex.vec3_double(dir1s),
+                flex.vec3_double(dir2s),
+            )
+
         # set up the base class
         ModelParameterisation.__init__(
             self,
@@ -1050,6 +1068,11 @@ def __init__(self, detector, experiment_ids=None, level=0):
             is_multi_state=True,
         )
 
+        # set up the lists that hold derivatives. Those for the panels of a
+        # group are only replaced when the group's parameters change
+        for i in range(len(self._model)):
+            self._multi_state_derivatives[i] = [None] * len(self._dstate_dp)
+
         # call compose to calculate all the derivatives
         self.compose()
 
@@ -1078,59 +1101,29 @@ def get_param_panel_groups(self):
         return self._group_ids_by_parameter
 
     def compose(self):
-        # reset the list that holds derivatives
-        for i in range(len(self._model)):
-            self._multi_state_derivatives[i] = [None] * len(self._dstate_dp)
+        # compose the new state of each group whose parameters changed, plus
+        # the derivatives of the d matrix of each of its panels
+        changed = self._composer.compose(
+            flex.double([p.value for p in self._param]),
+            flex.vec3_double([p.axis for p in self._param]),
+        )
 
-        # loop over groups of panels collecting derivatives of the state wrt
-        # parameters
-        param = iter(self._param)
         for igp, pnl_ids in enumerate(self._panel_ids_by_group):
-            # extract parameters from the internal list
-            dist = next(param)
-            shift1 = next(param)
-            shift2 = next(param)
-            tau1 = next(param)
-            tau2 = next(param)
-            tau3 = next(param)
-
-            param_vals = flex.double(
-                (
-                    dist.value,
-                    shift1.value,
-                    shift2.value,
-                    tau1.value,
-                    tau2.value,
-                    tau3.value,
-                )
-            )
-            param_axes = flex.vec3_double(
-                (dist.axis, shift1.axis, shift2.axis, tau1.axis, tau2.axis, tau3.axis)
-            )
-
-            offsets = self._offsets[igp]
-            dir1s = self._dir1s[igp]
-            dir2s = self._dir2s[igp]
-
-            # Get items from the initial state for the group of interest
-            initial_state = self._initial_state[igp]
-            id1 = initial_state["d1"]
-            id2 = initial_state["d2"]
-            idn = initial_state["dn"]
-            igp_offset = initial_state["gp_offset"]
-
-            # Compose the new state using the helper class for calculations
-            pgc = PanelGroupCompose(id1, id2, idn, igp_offset, param_vals, param_axes)
-
             # assign back to the group frame
-            self._groups[igp].set_frame(pgc.d1(), pgc.d2(), pgc.origin())
+            self._groups[igp].set_frame(
+                self._composer.d1(igp),
+                self._composer.d2(igp),
+                self._composer.origin(igp),
+            )
+            if not changed[igp]:
+                continue
 
-            # Loop over attached Panel matrices, using the helper class to calculate
-            # derivatives of the d matrix in each case and store them.
+            # store the derivatives for each attached Panel. These are arranged
+            # by parameter, then by panel within the group
+            derivatives = self._composer.derivatives(igp)
+            npanels = len(pnl_ids)
             i = igp * 6
-            for panel_id, offset, dir1_new_basis, dir2_new_basis in zip(
-                pnl_ids, offsets, dir1s, dir2s
-            ):
-                self._multi_state_derivatives[panel_id][i : (i + 6)] = (
-                    pgc.derivatives_for_panel(offset, dir1_new_basis, dir2_new_basis)
-                )
+            for j, panel_id in enumerate(pnl_ids):
+                self._multi_state_derivatives[panel_id][i : (i + 6)] = [
+                    matrix.sqr(derivatives[k * npanels + j]) for k in range(6)
+                ]
@@ -11,8 +11,11 @@
 #include <dials/array_family/scitbx_shared_and_versa.h>
 #include <dials/algorithms/refinement/rtmats.h>
 #include <scitbx/math/r3_rotation.h>
+#include <dials/util/thread_pool.h>
 #include <boost/python.hpp>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace dials { namespace refinement {
 
@@ -424,6 +427,8 @@ namespace dials { namespace refinement {
                                         dTau3_dtau3);
   }
 
+  class MultiPanelGroupCompose;
+
   /**
    * Helper class for the compose method of the hierarchical detector
    * parameterisation (the DetectorParameterisationHierarchical class in Python)
@@ -667,6 +672,8 @@ namespace dials { namespace refinement {
     }
 
   private:
+    friend class MultiPanelGroupCompose;
+
     // Calculate the new state for this panel group and cache the
     // intermediate derivatives required for calculating the derivatives
     // of each panel's d matrix wrt the parameters.
@@ -858,6 +865,293 @@ namespace dials { namespace refinement {
     vec3<double> ddn_dtau3;
   };
 
+  /**
+   * Compose the new states of all the panel groups of a hierarchical detector
+   * parameterisation, and the derivatives of the d matrices of all their
+   * panels. The fixed offsets and directions of the panels in the basis of
+   * their group are stored as arrays of components, and the rotation matrices
+   * and intermediate derivatives of a group are calculated once and shared by
+   * all of its panels. The panel derivatives are calculated on multiple
+   * threads, and only for groups whose parameters changed since the previous
+   * call to compose.
+   */
+  class MultiPanelGroupCompose {
+  public:
+    /**
+     * @param nthreads The number of threads to use for the panel derivatives
+     */
+    MultiPanelGroupCompose(std::size_t nthreads = 1)
+        : nthreads_(nthreads), panel_offset_(1, 0) {
+      DIALS_ASSERT(nthreads_ > 0);
+    }
+
+    /**
+     * Add a panel group, with the panels described in the basis d1, d2, dn of
+     * the group's initial frame.
+     * @param initial_d1 The initial first direction of the group
+     * @param initial_d2 The initial second direction of the group
+     * @param initial_dn The initial normal of the group
+     * @param initial_gp_offset The offset of the group origin
+     * @param offsets The offset of each panel origin
+     * @param dir1s The first direction of each panel
+     * @param dir2s The second direction of each panel
+     */
+    void add_group(const vec3<double> &initial_d1,
+                   const vec3<double> &initial_d2,
+                   const vec3<double> &initial_dn,
+                   const vec3<double> &initial_gp_offset,
+                   const af::const_ref<vec3<double> > &offsets,
+                   const af::const_ref<vec3<double> > &dir1s,
+                   const af::const_ref<vec3<double> > &dir2s) {
+      DIALS_ASSERT(offsets.size() == dir1s.size());
+      DIALS_ASSERT(offsets.size() == dir2s.size());
+      std::size_t group = n_groups();
+      vec3<double> state[4] = {initial_d1, initial_d2, initial_dn, initial_gp_offset};
+      initial_state_.insert(initial_state_.end(), state, state + 4);
+      for (std::size_t i = 0; i < offsets.size(); ++i) {
+        for (std::size_t j = 0; j < 3; ++j) {
+          offset_[j].push_back(offsets[i][j]);
+          dir1_[j].push_back(dir1s[i][j]);
+          dir2_[j].push_back(dir2s[i][j]);
+        }
+        panel_group_.push_back(group);
+      }
+      panel_offset_.push_back(panel_group_.size());
+      derivatives_.resize(6 * panel_group_.size());
+      groups_.clear();
+    }
+
+    /** @returns The number of panel groups */
+    std::size_t n_groups() const {
+      return panel_offset_.size() - 1;
+    }
+
+    /** @returns The total number of panels in all groups */
+    std::size_t n_panels() const {
+      return panel_group_.size();
+    }
+
+    /**
+     * Compose the new state of each group whose parameters changed since the
+     * last call, and the derivatives for each of its panels.
+     * @param param_vals The six parameter values of each group in turn
+     * @param param_axes The six parameter axes of each group in turn
+     * @returns A flag for each group that is true if the group was updated
+     */
+    af::shared<bool> compose(const af::const_ref<double> &param_vals,
+                             const af::const_ref<vec3<double> > &param_axes) {
+      DIALS_ASSERT(param_vals.size() == 6 * n_groups());
+      DIALS_ASSERT(param_axes.size() == 6 * n_groups());
+      bool first = groups_.empty();
+      af::shared<bool> changed(n_groups(), first);
+      for (std::size_t g = 0; g < n_groups(); ++g) {
+        for (std::size_t k = 6 * g; !changed[g] && k < 6 * (g + 1); ++k) {
+          changed[g] = param_vals[k] != param_vals_[k]
+                       || param_axes[k][0] != param_axes_[k][0]
+                       || param_axes[k][1] != param_axes_[k][1]
+                       || param_axes[k][2] != param_axes_[k][2];
+        }
+        if (!changed[g]) {
+          continue;
+        }
+        PanelGroupCompose pgc(initial_state_[4 * g],
+                              initial_state_[4 * g + 1],
+                              initial_state_[4 * g + 2],
+                              initial_state_[4 * g + 3],
+                              af::const_ref<double>(&param_vals[6 * g], 6),
+                              af::const_ref<vec3<double> >(&param_axes[6 * g], 6));
+        if (first) {
+          groups_.push_back(pgc);
+        } else {
+          groups_[g] = pgc;
+        }
+      }
+      param_vals_.assign(param_vals.begin(), param_vals.end());
+      param_axes_.assign(param_axes.begin(), param_axes.end());
+
+      // Collect the panels of the changed groups and split them between threads
+      std::vector<std::size_t> panels;
+      for (std::size_t g = 0; g < n_groups(); ++g) {
+        if (changed[g]) {
+          for (std::size_t i = panel_offset_[g]; i < panel_offset_[g + 1]; ++i) {
+            panels.push_back(i);
+          }
+        }
+      }
+      std::size_t njobs = std::max<std::size_t>(1, std::min(nthreads_, panels.size()));
+      std::vector<panel_job> jobs(njobs);
+      for (std::size_t j = 0; j < njobs; ++j) {
+        jobs[j].composer = this;
+        jobs[j].first = panels.begin() + (j * panels.size()) / njobs;
+        jobs[j].last = panels.begin() + ((j + 1) * panels.size()) / njobs;
+      }
+      if (njobs == 1) {
+        jobs[0]();
+      } else {
+        dials::util::ThreadPool pool(njobs);
+        for (std::size_t j = 0; j < njobs; ++j) {
+          pool.post(panel_runner(&jobs[j]));
+        }
+        pool.wait();
+      }
+      for (std::size_t j = 0; j < njobs; ++j) {
+        if (!jobs[j].error.empty()) {
+          throw DIALS_ERROR(jobs[j].error);
+        }
+      }
+      return changed;
+    }
+
+    /** @returns The new first direction of a group */
+    vec3<double> d1(std::size_t group) const {
+      DIALS_ASSERT(group < groups_.size());
+      return groups_[group].d1_;
+    }
+
+    /** @returns The new second direction of a group */
+    vec3<double> d2(std::size_t group) const {
+      DIALS_ASSERT(group < groups_.size());
+      return groups_[group].d2_;
+    }
+
+    /** @returns The new origin of a group */
+    vec3<double> origin(std::size_t group) const {
+      DIALS_ASSERT(group < groups_.size());
+      return groups_[group].origin_;
+    }
+
+    /**
+     * Get the derivatives of the d matrices of the panels of a group with
+     * respect to its six parameters. As for multi_panel_compose, the
+     * derivative for parameter k of panel i in the group is at element
+     * k * n + i, where n is the number of panels in the group.
+     * @param group The index of the group
+     * @returns The derivatives
+     */
+    af::shared<mat3<double> > derivatives(std::size_t group) const {
+      DIALS_ASSERT(group < groups_.size());
+      return af::shared<mat3<double> >(
+        derivatives_.begin() + 6 * panel_offset_[group],
+        derivatives_.begin() + 6 * panel_offset_[group + 1]);
+    }
+
+  private:
+    /**
+     * Calculate the derivatives for a list of panels
+     */
+    struct panel_job {
+      MultiPanelGroupCompose *composer;
+      std::vector<std::size_t>::const_iterator first;
+      std::vector<std::size_t>::const_iterator last;
+      std::string error;
+
+      void operator()() {
+        try {
+          for (std::vector<std::size_t>::const_iterator it = first; it != last; ++it) {
+            composer->panel_derivatives(*it);
+          }
+        } catch (const std::exception &e) {
+          error = e.what();
+        } catch (...) {
+          error = "Unknown error in panel group compose";
+        }
+      }
+    };
+
+    struct panel_runner {
+      panel_job *job;
+      panel_runner(panel_job *job_) : job(job_) {}
+      void operator()() const {
+        (*job)();
+      }
+    };
+
+    /**
+     * The derivative of a d matrix wrt one of the tau angles, in mrad
+     */
+    static mat3<double> tau_derivative(const vec3<double> &ddorg,
+                                       const vec3<double> &dd1,
+                                       const vec3<double> &dd2,
+                                       const vec3<double> &ddn,
+                                       const vec3<double> &offset,
+                                       const vec3<double> &dir1,
+                                       const vec3<double> &dir2) {
+      vec3<double> dorg = ddorg + offset[0] * dd1 + offset[1] * dd2 + offset[2] * ddn;
+      vec3<double> ddir1 = dir1[0] * dd1 + dir1[1] * dd2 + dir1[2] * ddn;
+      vec3<double> ddir2 = dir2[0] * dd1 + dir2[1] * dd2 + dir2[2] * ddn;
+      return mat3<double>(ddir1[0],
+                          ddir2[0],
+                          dorg[0],
+                          ddir1[1],
+                          ddir2[1],
+                          dorg[1],
+                          ddir1[2],
+                          ddir2[2],
+                          dorg[2])
+             / 1000.;
+    }
+
+    /**
+     * The derivative of a d matrix wrt one of the distance or shift parameters,
+     * which move the origin only
+     */
+    static mat3<double> shift_derivative(const vec3<double> &ddorg) {
+      return mat3<double>(0., 0., ddorg[0], 0., 0., ddorg[1], 0., 0., ddorg[2]);
+    }
+
+    /**
+     * Calculate the six derivatives for one panel using the cached
+     * intermediate derivatives of its group, as in
+     * PanelGroupCompose::derivatives_for_panel.
+     */
+    void panel_derivatives(std::size_t panel) {
+      std::size_t g = panel_group_[panel];
+      const PanelGroupCompose &pgc = groups_[g];
+      vec3<double> offset(offset_[0][panel], offset_[1][panel], offset_[2][panel]);
+      vec3<double> dir1(dir1_[0][panel], dir1_[1][panel], dir1_[2][panel]);
+      vec3<double> dir2(dir2_[0][panel], dir2_[1][panel], dir2_[2][panel]);
+      std::size_t n = panel_offset_[g + 1] - panel_offset_[g];
+      mat3<double> *result =
+        &derivatives_[6 * panel_offset_[g] + (panel - panel_offset_[g])];
+      result[0 * n] = shift_derivative(pgc.ddorg_ddist);
+      result[1 * n] = shift_derivative(pgc.ddorg_dshift1);
+      result[2 * n] = shift_derivative(pgc.ddorg_dshift2);
+      result[3 * n] = tau_derivative(pgc.ddorg_dtau1,
+                                     pgc.dd1_dtau1,
+                                     pgc.dd2_dtau1,
+                                     pgc.ddn_dtau1,
+                                     offset,
+                                     dir1,
+                                     dir2);
+      result[4 * n] = tau_derivative(pgc.ddorg_dtau2,
+                                     pgc.dd1_dtau2,
+                                     pgc.dd2_dtau2,
+                                     pgc.ddn_dtau2,
+                                     offset,
+                                     dir1,
+                                     dir2);
+      result[5 * n] = tau_derivative(pgc.ddorg_dtau3,
+                                     pgc.dd1_dtau3,
+                                     pgc.dd2_dtau3,
+                                     pgc.ddn_dtau3,
+                                     offset,
+                                     dir1,
+                                     dir2);
+    }
+
+    std::size_t nthreads_;
+    std::vector<vec3<double> > initial_state_;
+    std::vector<double> offset_[3];
+    std::vector<double> dir1_[3];
+    std::vector<double> dir2_[3];
+    std::vector<std::size_t> panel_group_;
+    std::vector<std::size_t> panel_offset_;
+    std::vector<PanelGroupCompose> groups_;
+    std::vector<double> param_vals_;
+    std::vector<vec3<double> > param_axes_;
+    std::vector<mat3<double> > derivatives_;
+  };
+
   /**
    * Given an initial orientation matrix, the values of the three orientation
    * parameters, phi1, phi2 and phi3 (in mrad), plus the axes about which these
@@ -103,8 +103,22 @@ def __str__(self):
 class GaussianSmoother(GS):
     """A Gaussian smoother for ScanVaryingModelParameterisations"""
 
+    def __init__(self, *args):
+        super().__init__(*args)
+        # The weights at a point do not depend on the parameter values, so
+        # cache them for each point at which the smoother is evaluated
+        self._weights_at = {}
+
+    def set_smoothing(self, num_average, sigma):
+        super().set_smoothing(num_average, sigma)
+        self._weights_at = {}
+
     def value_weight(self, x, param):
-        result = super().value_weight(x, flex.double(param.value))
+        weights = self._weights_at.get(x)
+        if weights is None:
+            weights = self.weights(flex.double([x]))
+            self._weights_at[x] = weights
+        result = weights.value_weight(0, flex.double(param.value))
         return (result.get_value(), result.get_weight(), result.get_sumweight())
 
     def multi_value_weight(self, x, param):
@@ -403,7 +403,11 @@ def _build_refiner(cls, params, experiments, refman, ref_predictor, do_stills):
         # Create model parameterisations
         logger.debug("Building prediction equation parameterisation")
         pred_param = build_prediction_parameterisation(
-            params.refinement.parameterisation, experiments, refman, do_stills
+            params.refinement.parameterisation,
+            experiments,
+            refman,
+            do_stills,
+            nproc=params.refinement.mp.nproc,
         )
 
         # Build a constraints manager, if requested
@@ -501,6 +505,7 @@ def _build_refiner(cls, params, experiments, refman, ref_predictor, do_stills):
     @staticmethod
     def config_sparse(params, experiments):
         """Configure whether to use sparse datatypes"""
+        native_engines = ("NativeGaussNewton", "NativeLevMar")
         # Automatic selection for sparse parameter
         if params.refinement.parameterisation.sparse == libtbx.Auto:
             if len(experiments) > 1 or params.refinement.parameterisation.scan_varying:
@@ -510,14 +515,18 @@ def config_sparse(params, experiments):
             if params.refinement.refinery.engine == "SparseLevMar":
                 params.refinement.parameterisation.sparse = True
             if params.refinement.mp.nproc > 1:
-                if params.refinement.refinery.engine != "SparseLevMar":
+                if params.refinement.refinery.engine == "SparseLevMar":
+                    pass  # but SparseLevMar requires sparse jacobian; does not implement mp
+                elif params.refinement.refinery.engine in native_engines:
+                    pass  # threads rather than processes, so sparse is allowed
+                else:
                     # sparse vectors cannot be pickled, so can't use easy_mp here
                     params.refinement.parameterisation.sparse = False
-                else:
-                    pass  # but SparseLevMar requires sparse jacobian; does not implement mp
         # Check incompatible selection
         elif (
-            params.refinement.parameterisation.sparse and params.refinement.mp.nproc > 1
+            params.refinement.parameterisation.sparse
+            and params.refinement.mp.nproc > 1
+            and params.refinement.refinery.engine not in native_engines
         ):
             logger.warning(
                 "Could not set sparse=True and nproc=%s", params.refinement.mp.nproc
@@ -631,6 +640,14 @@ def config_refinery(params, target, pred_param, constraints_manager):
             from dials.algorithms.refinement.sparse_engine import (
                 SparseLevenbergMarquardtIterations as refinery,
             )
+        elif options.engine == "NativeGaussNewton":
+            from dials.algorithms.refinement.native_engine import (
+                GaussNewtonIterations as refinery,
+            )
+        elif options.engine == "NativeLevMar":
+            from dials.algorithms.refinement.native_engine import (
+                LevenbergMarquardtIterations as refinery,
+            )
         else:
             raise RuntimeError(
                 "Refinement engine " + options.engine + " not recognised"
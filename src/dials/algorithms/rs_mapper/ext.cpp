@@ -1,8 +1,18 @@
 #include <boost/python.hpp>
 #include <scitbx/array_family/shared.h>
 #include <scitbx/array_family/flex_types.h>
+#include <algorithm>
 #include <cctype>
+#include <cmath>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+#include <scitbx/vec2.h>
+#include <scitbx/vec3.h>
 #include <dxtbx/model/panel.h>
+#include <dials/util/thread_pool.h>
+#include <dials/error.h>
 #include <iostream>
 
 namespace recviewer { namespace ext {
@@ -66,11 +76,386 @@ namespace recviewer { namespace ext {
     }
   }
 
+  static void normalize_weighted_voxels(af::flex_double &grid,
+                                        const af::flex_double &weights) {
+    DIALS_ASSERT(grid.size() == weights.size());
+    for (std::size_t i = 0; i < grid.size(); ++i) {
+      if (weights[i] != 0) {
+        grid[i] /= weights[i];
+      }
+    }
+  }
+
+  /**
+   * A cubic grid of voxels which is divided into blocks which are only
+   * allocated when a voxel in them is first written. Each thread
+   * accumulates into its own grid and the grids are merged at the end.
+   */
+  class BlockedGrid {
+  public:
+    static const int block_size = 8;
+    static const int block_volume = block_size * block_size * block_size;
+
+    struct block {
+      double value[block_volume];
+      double weight[block_volume];
+      block() {
+        std::fill(value, value + block_volume, 0.0);
+        std::fill(weight, weight + block_volume, 0.0);
+      }
+    };
+
+    BlockedGrid(int npoints)
+        : npoints_(npoints),
+          nblocks_((npoints + block_size - 1) / block_size),
+          blocks_(nblocks_ * nblocks_ * nblocks_) {}
+
+    void add(unsigned int x,
+             unsigned int y,
+             unsigned int z,
+             double value,
+             double weight) {
+      const unsigned int n = block_size;
+      std::unique_ptr<block> &b =
+        blocks_[((x / n) * nblocks_ + (y / n)) * nblocks_ + (z / n)];
+      if (!b) {
+        b.reset(new block());
+      }
+      unsigned int k = ((x % n) * n + (y % n)) * n + (z % n);
+      b->value[k] += value;
+      b->weight[k] += weight;
+    }
+
+    /**
+     * Add the other grid to this one. Blocks which are only in the other
+     * grid are moved rather than copied.
+     */
+    void merge(BlockedGrid &other) {
+      DIALS_ASSERT(other.npoints_ == npoints_);
+      for (std::size_t i = 0; i < blocks_.size(); ++i) {
+        if (!other.blocks_[i]) {
+          continue;
+        }
+        if (!blocks_[i]) {
+          blocks_[i].swap(other.blocks_[i]);
+        } else {
+          block &a = *blocks_[i];
+          const block &b = *other.blocks_[i];
+          for (int k = 0; k < block_volume; ++k) {
+            a.value[k] += b.value[k];
+            a.weight[k] += b.weight[k];
+          }
+          other.blocks_[i].reset();
+        }
+      }
+    }
+
+    /**
+     * Add the voxels to the dense grid of values and weights
+     */
+    void add_to(af::ref<double> value, af::ref<double> weight) const {
+      std::size_t n = npoints_;
+      DIALS_ASSERT(value.size() == n * n * n);
+      DIALS_ASSERT(weight.size() == n * n * n);
+      for (std::size_t i = 0; i < blocks_.size(); ++i) {
+        if (!blocks_[i]) {
+          continue;
+        }
+        int bx = (i / nblocks_) / nblocks_;
+        int by = (i / nblocks_) % nblocks_;
+        int bz = i % nblocks_;
+        for (int k = 0; k < block_volume; ++k) {
+          int x = bx * block_size + k / (block_size * block_size);
+          int y = by * block_size + (k / block_size) % block_size;
+          int z = bz * block_size + k % block_size;
+          if (x < npoints_ && y < npoints_ && z < npoints_) {
+            std::size_t j = (x * n + y) * n + z;
+            value[j] += blocks_[i]->value[k];
+            weight[j] += blocks_[i]->weight[k];
+          }
+        }
+      }
+    }
+
+  private:
+    int npoints_;
+    int nblocks_;
+    std::vector<std::unique_ptr<block> > blocks_;
+  };
+
+  /**
+   * Map the pixels of a sequence of rotation images into a grid of voxels in
+   * reciprocal space. The images are added one at a time so they do not all
+   * need to be held in memory. Each image is copied into one of a number of
+   * slots and scattered into that slot's private grid on a thread pool while
+   * the next images are read; when all the slots are in use the mapper
+   * waits for them to finish. The private grids are merged with a tree
+   * reduction when the mapping is finished.
+   *
+   * Each pixel is either added to the nearest voxel or, with trilinear
+   * splatting, spread over the 8 surrounding voxels with trilinear weights.
+   */
+  class VoxelMapper {
+  public:
+    /**
+     * @param npoints The number of voxels along each side of the grid
+     * @param rec_range The reciprocal space range of the grid
+     * @param S The diffraction vectors of the pixels
+     * @param xy The pixel coordinates
+     * @param axis The rotation axis
+     * @param trilinear Use trilinear splatting
+     * @param nthreads The number of threads
+     */
+    VoxelMapper(int npoints,
+                double rec_range,
+                const flex_vec3_double &S,
+                const flex_vec2_double &xy,
+                vec3<double> axis,
+                bool trilinear,
+                std::size_t nthreads)
+        : npoints_(npoints),
+          step_(2 * rec_range / npoints),
+          S_(S.begin(), S.end()),
+          axis_(axis.normalize()),
+          trilinear_(trilinear),
+          finished_(false),
+          next_(0) {
+      DIALS_ASSERT(npoints > 0);
+      DIALS_ASSERT(rec_range > 0);
+      DIALS_ASSERT(nthreads > 0);
+      DIALS_ASSERT(S.size() == xy.size());
+      pixel_.reserve(xy.size());
+      for (std::size_t i = 0; i < xy.size(); ++i) {
+        pixel_.push_back(vec2<int>((int)xy[i][0], (int)xy[i][1]));
+      }
+      for (std::size_t i = 0; i < nthreads; ++i) {
+        slots_.push_back(slot(npoints));
+      }
+      if (nthreads > 1) {
+        pool_.reset(new dials::util::ThreadPool(nthreads));
+      }
+    }
+
+    /**
+     * Add an image
+     * @param image The image data
+     * @param angle The angle by which to rotate the diffraction vectors
+     */
+    template <typename T>
+    void add(const af::versa<T, af::flex_grid<> > &image, double angle) {
+      DIALS_ASSERT(!finished_);
+      DIALS_ASSERT(image.accessor().nd() == 2);
+      if (next_ == slots_.size()) {
+        wait();
+      }
+      slot &s = slots_[next_++];
+      s.image_size = vec2<int>(image.accessor().all()[1], image.accessor().all()[0]);
+      s.image.assign(image.begin(), image.end());
+      s.angle = angle;
+      if (pool_) {
+        pool_->post(slot_runner(this, &s));
+      } else {
+        slot_runner(this, &s)();
+      }
+    }
+
+    /**
+     * Wait for the images to be mapped and merge the grids
+     */
+    void finish() {
+      if (finished_) {
+        return;
+      }
+      wait();
+      for (std::size_t stride = 1; stride < slots_.size(); stride *= 2) {
+        std::vector<merge_job> jobs;
+        for (std::size_t i = 0; i + stride < slots_.size(); i += 2 * stride) {
+          jobs.push_back(merge_job(&slots_[i].grid, &slots_[i + stride].grid));
+        }
+        if (pool_ && jobs.size() > 1) {
+          for (std::size_t i = 0; i < jobs.size(); ++i) {
+            pool_->post(jobs[i]);
+          }
+          pool_->wait();
+        } else {
+          for (std::size_t i = 0; i < jobs.size(); ++i) {
+            jobs[i]();
+          }
+        }
+      }
+      std::size_t n = npoints_;
+      value_ = af::flex_double(af::flex_grid<>(n, n, n), 0);
+      weight_ = af::flex_double(af::flex_grid<>(n, n, n), 0);
+      slots_[0].grid.add_to(value_.ref().as_1d(), weight_.ref().as_1d());
+      slots_.clear();
+      finished_ = true;
+    }
+
+    /**
+     * @returns The sum of the weighted pixel values in each voxel
+     */
+    af::flex_double grid() {
+      finish();
+      return value_;
+    }
+
+    /**
+     * @returns The sum of the pixel weights in each voxel. Without
+     * trilinear splatting this is the number of pixels.
+     */
+    af::flex_double counts() {
+      finish();
+      return weight_;
+    }
+
+  private:
+    struct slot {
+      BlockedGrid grid;
+      std::vector<double> image;
+      vec2<int> image_size;
+      double angle;
+      std::string error;
+      slot(int npoints) : grid(npoints), angle(0) {}
+    };
+
+    struct slot_runner {
+      const VoxelMapper *mapper;
+      slot *s;
+      slot_runner(const VoxelMapper *mapper_, slot *s_) : mapper(mapper_), s(s_) {}
+      void operator()() const {
+        try {
+          mapper->map_image(*s);
+        } catch (const std::exception &e) {
+          s->error = e.what();
+        } catch (...) {
+          s->error = "Unknown error mapping voxels";
+        }
+      }
+    };
+
+    struct merge_job {
+      BlockedGrid *a;
+      BlockedGrid *b;
+      merge_job(BlockedGrid *a_, BlockedGrid *b_) : a(a_), b(b_) {}
+      void operator()() const {
+        a->merge(*b);
+      }
+    };
+
+    /**
+     * Wait for the images in the slots to be mapped
+     */
+    void wait() {
+      if (pool_) {
+        pool_->wait();
+      }
+      for (std::size_t i = 0; i < next_; ++i) {
+        if (!slots_[i].error.empty()) {
+          throw DIALS_ERROR(slots_[i].error);
+        }
+        std::vector<double>().swap(slots_[i].image);
+      }
+      next_ = 0;
+    }
+
+    /**
+     * Scatter the pixels of the image in the slot into its grid
+     */
+    void map_image(slot &s) const {
+      double centre = npoints_ / 2;
+      for (std::size_t i = 0; i < S_.size(); ++i) {
+        int x = pixel_[i][0];
+        int y = pixel_[i][1];
+        DIALS_ASSERT(x >= 0 && x < s.image_size[0]);
+        DIALS_ASSERT(y >= 0 && y < s.image_size[1]);
+        double value = s.image[x + y * s.image_size[0]];
+        vec3<double> p = S_[i].unit_rotate_around_origin(axis_, s.angle);
+        double px = p[0] / step_ + centre;
+        double py = p[1] / step_ + centre;
+        double pz = p[2] / step_ + centre;
+        if (trilinear_) {
+          splat(s.grid, px, py, pz, value);
+        } else {
+          int ix = (int)std::floor(px + 0.5);
+          int iy = (int)std::floor(py + 0.5);
+          int iz = (int)std::floor(pz + 0.5);
+          if (inside(ix) && inside(iy) && inside(iz)) {
+            s.grid.add(ix, iy, iz, value, 1.0);
+          }
+        }
+      }
+    }
+
+    /**
+     * Spread the value over the 8 voxels around the point
+     */
+    void splat(BlockedGrid &grid, double px, double py, double pz, double value)
+      const {
+      int x0 = (int)std::floor(px);
+      int y0 = (int)std::floor(py);
+      int z0 = (int)std::floor(pz);
+      double fx = px - x0;
+      double fy = py - y0;
+      double fz = pz - z0;
+      for (int i = 0; i < 2; ++i) {
+        if (!inside(x0 + i)) continue;
+        double wx = i ? fx : 1 - fx;
+        for (int j = 0; j < 2; ++j) {
+          if (!inside(y0 + j)) continue;
+          double wy = j ? fy : 1 - fy;
+          for (int k = 0; k < 2; ++k) {
+            if (!inside(z0 + k)) continue;
+            double w = wx * wy * (k ? fz : 1 - fz);
+            grid.add(x0 + i, y0 + j, z0 + k, w * value, w);
+          }
+        }
+      }
+    }
+
+    bool inside(int index) const {
+      return index >= 0 && index < npoints_;
+    }
+
+    int npoints_;
+    double step_;
+    std::vector<vec3<double> > S_;
+    std::vector<vec2<int> > pixel_;
+    vec3<double> axis_;
+    bool trilinear_;
+    bool finished_;
+    std::vector<slot> slots_;
+    std::size_t next_;
+    std::unique_ptr<dials::util::ThreadPool> pool_;
+    af::flex_double value_;
+    af::flex_double weight_;
+  };
+
   void init_module() {
     using namespace boost::python;
     def("get_target_pixels", get_target_pixels);
     def("fill_voxels", fill_voxels);
     def("normalize_voxels", normalize_voxels);
+    def("normalize_voxels", normalize_weighted_voxels);
+
+    class_<VoxelMapper, boost::noncopyable>("VoxelMapper", no_init)
+      .def(init<int,
+                double,
+                const flex_vec3_double &,
+                const flex_vec2_double &,
+                vec3<double>,
+                bool,
+                std::size_t>((arg("npoints"),
+                              arg("rec_range"),
+                              arg("S"),
+                              arg("xy"),
+                              arg("axis"),
+                              arg("trilinear") = false,
+                              arg("nthreads") = 1)))
+      .def("add", &VoxelMapper::add<int>, (arg("image"), arg("angle")))
+      .def("add", &VoxelMapper::add<double>, (arg("image"), arg("angle")))
+      .def("finish", &VoxelMapper::finish)
+      .def("grid", &VoxelMapper::grid)
+      .def("counts", &VoxelMapper::counts);
   }
 
 }}  // namespace recviewer::ext
@@ -10,7 +10,7 @@
 import numpy as np
 import pandas as pd
 from orderedset import OrderedSet
-from scipy.sparse import csc_matrix
+from scipy.sparse import csc_matrix, issparse
 
 from cctbx import crystal, miller, sgtbx, uctbx
 from dxtbx import flumpy
@@ -18,6 +18,7 @@
 
 from dials.algorithms.scaling.error_model.error_model import BasicErrorModel
 from dials.array_family import flex
+from dials_scaling_ext import IhTableCore, ScalingJacobianCalculator
 
 
 def map_indices_to_asu(miller_indices, space_group, anomalous=False):
@@ -321,6 +322,7 @@ def _create_empty_Ih_table_blocks(self) -> None:
                     n_groups=n_groups_in_block,
                     n_refl=n_refl_in_block,
                     n_datasets=self.n_datasets,
+                    nthreads=self.n_work_blocks,
                 )
             )
 
@@ -510,9 +512,15 @@ class IhTableBlock:
             array of values for symmetry groups into an array of size n_refl.
         derivatives: A matrix of derivatives of the reflections wrt the model
             parameters.
+        nthreads: The number of threads used to calculate the Ih values, the
+            gradients and the Jacobian for this block.
+        core: An IhTableCore holding the group of each reflection, used to
+            calculate the Ih values and the gradients.
     """
 
-    def __init__(self, n_groups: int, n_refl: int, n_datasets: int = 1):
+    def __init__(
+        self, n_groups: int, n_refl: int, n_datasets: int = 1, nthreads: int = 1
+    ):
         """Create empty datastructures to which data can later be added."""
         self.Ih_table = pd.DataFrame()
         self.block_selections = [None] * n_datasets
@@ -528,6 +536,9 @@ def __init__(self, n_groups: int, n_refl: int, n_datasets: int = 1):
         self._csc_h_index_matrix = None
         self._csc_h_expand_matrix = None
         self._hkl = flex.miller_index([])
+        self.nthreads = nthreads
+        self.core = None
+        self._jacobian_calculator = None
 
     def add_data(
         self,
@@ -590,6 +601,11 @@ def _complete_setup(self) -> None:
         data = np.full(self._csc_cols.size, 1.0)
         self._csc_h_index_matrix = csc_matrix((data, (self._csc_rows, self._csc_cols)))
         self._csc_h_expand_matrix = self._csc_h_index_matrix.transpose()
+        self.core = IhTableCore(
+            flumpy.from_numpy(self._csc_cols.astype(np.uint64)),
+            self.h_index_matrix.n_cols,
+            self.nthreads,
+        )
         self.weights = 1.0 / self.variances
         self._setup_info["setup_complete"] = True
 
@@ -599,6 +615,10 @@ def group_multiplicities(self, output: str = "per_group") -> np.array:
 
     def select(self, sel: np.array) -> IhTableBlock:
         """Select a subset of the data, returning a new IhTableBlock object."""
+        return self._select(sel, self.core.select(flumpy.from_numpy(sel)))
+
+    def _select(self, sel: np.array, core: IhTableCore) -> IhTableBlock:
+        """Select a subset of the data, with the core of the selected data."""
         Ih_table = self.Ih_table[sel]
         Ih_table.reset_index(drop=True, inplace=True)
         h_idx_sel = self.h_expand_matrix.select_columns(
@@ -612,13 +632,16 @@ def select(self, sel: np.array) -> IhTableBlock:
         csc_h_idx_sel = self._csc_h_expand_matrix[:, sel]
         csc_h_index_matrix = csc_h_idx_sel.transpose()[:, flumpy.to_numpy(nz_col_sel)]
         csc_h_expand_matrix = csc_h_index_matrix.transpose()
-        newtable = IhTableBlock(n_groups=0, n_refl=0, n_datasets=self.n_datasets)
+        newtable = IhTableBlock(
+            n_groups=0, n_refl=0, n_datasets=self.n_datasets, nthreads=self.nthreads
+        )
         newtable.Ih_table = Ih_table
         newtable._hkl = self._hkl.select(flumpy.from_numpy(sel))
         newtable.h_expand_matrix = h_expand
         newtable.h_index_matrix = h_index_matrix
         newtable._csc_h_index_matrix = csc_h_index_matrix
         newtable._csc_h_expand_matrix = csc_h_expand_matrix
+        newtable.core = core
         newtable.block_selections = []
         offset = 0
         for i in range(newtable.n_datasets):
@@ -634,18 +657,20 @@ def select(self, sel: np.array) -> IhTableBlock:
 
     def select_on_groups(self, sel: np.array) -> IhTableBlock:
         """Select a subset of the unique groups, returning a new IhTableBlock."""
-        reduced_h_idx = self._csc_h_index_matrix[:, sel]
-        unity = np.full(reduced_h_idx.shape[1], 1.0)
-        nz_row_sel = (unity * reduced_h_idx.transpose()) > 0
-        return self.select(nz_row_sel)
+        group_sel = np.full(self.n_groups, False)
+        group_sel[sel] = True
+        core = self.core.select_on_groups(flumpy.from_numpy(group_sel))
+        group_index = flumpy.to_numpy(self.core.group_index()).astype(np.int64)
+        return self._select(group_sel[group_index], core)
 
     def calc_Ih(self) -> None:
         """Calculate the current best estimate for Ih for each reflection group."""
-        scale_factors = self.inverse_scale_factors
-        sumgsq = self.sum_in_groups(np.square(scale_factors) * self.weights)
-        sumgI = self.sum_in_groups(scale_factors * self.intensities * self.weights)
-        Ih = sumgI / sumgsq
-        self.Ih_table.loc[:, "Ih_values"] = Ih @ self._csc_h_expand_matrix
+        Ih = self.core.calc_Ih(
+            flumpy.from_numpy(self.intensities),
+            flumpy.from_numpy(self.inverse_scale_factors),
+            flumpy.from_numpy(self.weights),
+        )
+        self.Ih_table.loc[:, "Ih_values"] = flumpy.to_numpy(Ih)
 
     def update_weights(
         self,
@@ -713,6 +738,7 @@ def match_Ih_values_to_target(self, target_Ih_table: IhTable) -> None:
         self.block_selections = new_table.block_selections
         self._csc_h_expand_matrix = new_table._csc_h_expand_matrix
         self._csc_h_index_matrix = new_table._csc_h_index_matrix
+        self.core = new_table.core
 
     @property
     def inverse_scale_factors(self) -> np.array:
@@ -774,6 +800,25 @@ def n_groups(self) -> int:
         """Return the length of the stored Ih_table (a reflection table)."""
         return self._csc_h_index_matrix.shape[1]
 
+    @property
+    def jacobian_calculator(self) -> ScalingJacobianCalculator:
+        """
+        A calculator of dIh/dp and the Jacobian for the current groups.
+
+        The calculator caches the sparsity patterns of its results between
+        iterations of the minimisation, so is only recreated when the
+        h_index_matrix is replaced.
+        """
+        if (
+            self._jacobian_calculator is None
+            or self._jacobian_calculator[0] is not self.h_index_matrix
+        ):
+            self._jacobian_calculator = (
+                self.h_index_matrix,
+                ScalingJacobianCalculator(self.h_index_matrix, self.nthreads),
+            )
+        return self._jacobian_calculator[1]
+
     @property
     def asu_miller_index(self) -> flex.miller_index:
         """Return the miller indices in the asymmetric unit."""
@@ -813,16 +858,24 @@ def sum_in_groups(
         """
         Sums an array object over the symmetry equivalent groups.
         The array's final dimension must equal the size of the Ih_table.
+        One dimensional arrays are summed by the core, in group order.
         """
-        if output == "per_group":
-            return array @ self._csc_h_index_matrix
-        elif output == "per_refl":  # return the summed quantity per reflection
-            return (array @ self._csc_h_index_matrix) @ self._csc_h_expand_matrix
-        else:
+        if output not in ("per_group", "per_refl"):
             raise ValueError(
                 f"""Bad value for output= parameter
 (value={output}, allowed values: per_group, per_refl)"""
             )
+        if issparse(array) or np.ndim(array) != 1:
+            if output == "per_group":
+                return array @ self._csc_h_index_matrix
+            # return the summed quantity per reflection
+            return (array @ self._csc_h_index_matrix) @ self._csc_h_expand_matrix
+        values = np.ascontiguousarray(array, dtype=np.float64)
+        summed = flumpy.to_numpy(self.core.sum_in_groups(flumpy.from_numpy(values)))
+        if output == "per_refl":
+            group_index = flumpy.to_numpy(self.core.group_index()).astype(np.int64)
+            return summed[group_index]
+        return summed
 
     def as_reflection_table(self) -> flex.reflection_table:
         """Return the data in flex reflection table format"""
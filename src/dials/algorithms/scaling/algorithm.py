@@ -326,6 +326,7 @@ def calculate_merging_stats(self):
                 self.params.output.merging.nbins,
                 self.params.output.use_internal_variance,
                 additional_stats=self.params.output.additional_stats,
+                nproc=self.params.scaling_options.nproc,
             )
         except DialsMergingStatisticsError as e:
             logger.warning(e, exc_info=True)
@@ -0,0 +1,35 @@
+#include <boost/python.hpp>
+#include <boost/python/def.hpp>
+#include <dials/algorithms/scaling/ih_table.h>
+
+namespace dials_scaling { namespace boost_python {
+
+  using namespace boost::python;
+
+  void export_ih_table_core() {
+    class_<IhTableCore>("IhTableCore", no_init)
+      .def(init<const scitbx::af::const_ref<std::size_t>&, std::size_t, std::size_t>(
+        (arg("group_index"), arg("n_groups"), arg("nthreads") = 1)))
+      .def("size", &IhTableCore::size)
+      .def("n_groups", &IhTableCore::n_groups)
+      .def("nthreads", &IhTableCore::nthreads)
+      .def("group_index", &IhTableCore::group_index)
+      .def("group_offset", &IhTableCore::group_offset)
+      .def("order", &IhTableCore::order)
+      .def("sum_in_groups", &IhTableCore::sum_in_groups, (arg("values")))
+      .def("calc_Ih",
+           &IhTableCore::calc_Ih,
+           (arg("intensities"), arg("scales"), arg("weights")))
+      .def("gradients",
+           &IhTableCore::gradients,
+           (arg("intensities"),
+            arg("scales"),
+            arg("Ih"),
+            arg("weights"),
+            arg("derivatives")))
+      .def("select", &IhTableCore::select, (arg("selection")))
+      .def("select_on_groups", &IhTableCore::select_on_groups, (arg("selection")))
+      .def("__len__", &IhTableCore::size);
+  }
+
+}}  // namespace dials_scaling::boost_python
@@ -14,12 +14,14 @@ namespace dials_scaling { namespace boost_python {
   void export_determine_outlier_indices();
   void export_calc_dIh_by_dpi();
   void export_calc_jacobian();
+  void export_scaling_jacobian_calculator();
   void export_calculate_harmonic_tables_from_selections();
   void export_calc_lookup_index();
   void export_create_sph_harm_lookup_table();
   void export_gaussian_smoother_first_fixed();
   void export_limit_outlier_weights();
   void export_split_unmerged();
+  void export_ih_table_core();
 
   BOOST_PYTHON_MODULE(dials_scaling_ext) {
     export_elementwise_square();
@@ -31,12 +33,14 @@ namespace dials_scaling { namespace boost_python {
     export_determine_outlier_indices();
     export_calc_dIh_by_dpi();
     export_calc_jacobian();
+    export_scaling_jacobian_calculator();
     export_calculate_harmonic_tables_from_selections();
     export_calc_lookup_index();
     export_create_sph_harm_lookup_table();
     export_gaussian_smoother_first_fixed();
     export_limit_outlier_weights();
     export_split_unmerged();
+    export_ih_table_core();
   }
 
 }}  // namespace dials_scaling::boost_python
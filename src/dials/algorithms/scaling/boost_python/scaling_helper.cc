@@ -37,6 +37,22 @@ namespace dials_scaling { namespace boost_python {
          arg("sumgsq")));
   }
 
+  void export_scaling_jacobian_calculator() {
+    class_<ScalingJacobianCalculator>("ScalingJacobianCalculator", no_init)
+      .def(init<matrix<double>, std::size_t>(
+        (arg("h_index_mat"), arg("nthreads") = 1)))
+      .def("dIh_by_dpi",
+           &ScalingJacobianCalculator::dIh_by_dpi,
+           (arg("dIh"), arg("sumgsq"), arg("derivatives")))
+      .def("dIh_by_dpi_transpose",
+           &ScalingJacobianCalculator::dIh_by_dpi_transpose,
+           (arg("dIh"), arg("sumgsq"), arg("derivatives")))
+      .def("jacobian",
+           &ScalingJacobianCalculator::jacobian,
+           (arg("derivatives"), arg("Ih"), arg("g"), arg("dIh"), arg("sumgsq")))
+      .def("nthreads", &ScalingJacobianCalculator::nthreads);
+  }
+
   void export_sph_harm_table() {
     def("create_sph_harm_table",
         &create_sph_harm_table,
@@ -58,7 +74,7 @@ namespace dials_scaling { namespace boost_python {
   }
 
   void export_row_multiply() {
-    def("row_multiply", &row_multiply, (arg("m"), arg("v")));
+    def("row_multiply", &row_multiply, (arg("m"), arg("v"), arg("nthreads") = 1));
   }
 
   void export_limit_outlier_weights() {
@@ -100,7 +116,8 @@ namespace dials_scaling { namespace boost_python {
            &GaussianSmootherFirstFixed::value_weight_first_fixed)
       .def("multi_value_weight", &GaussianSmootherFirstFixed::multi_value_weight)
       .def("multi_value_weight_first_fixed",
-           &GaussianSmootherFirstFixed::multi_value_weight_first_fixed);
+           &GaussianSmootherFirstFixed::multi_value_weight_first_fixed)
+      .def("weights", &GaussianSmootherFirstFixed::weights, (arg("x")));
   }
 
   void export_split_unmerged() {
@@ -109,11 +126,13 @@ namespace dials_scaling { namespace boost_python {
                 scitbx::af::const_ref<double> const&,
                 scitbx::af::const_ref<double> const&,
                 bool,
-                unsigned>((arg("unmerged_indices"),
-                           arg("unmerged_data"),
-                           arg("unmerged_sigmas"),
-                           arg("weighted") = true,
-                           arg("seed") = 0)))
+                unsigned,
+                std::size_t>((arg("unmerged_indices"),
+                              arg("unmerged_data"),
+                              arg("unmerged_sigmas"),
+                              arg("weighted") = true,
+                              arg("seed") = 0,
+                              arg("nthreads") = 1)))
       .def("data1", &split_unmerged::data1)
       .def("data2", &split_unmerged::data2)
       .def("sigma1", &split_unmerged::sigma1)
@@ -0,0 +1,459 @@
+#ifndef DIALS_SCALING_IH_TABLE_H
+#define DIALS_SCALING_IH_TABLE_H
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+#include <scitbx/sparse/matrix.h>
+#include <dials/array_family/scitbx_shared_and_versa.h>
+#include <dials/util/thread_pool.h>
+#include <dials/error.h>
+
+namespace dials_scaling {
+
+/**
+ * The group structure of a block of an Ih table, with kernels to sum values
+ * over the groups and to calculate Ih and the gradients of the target function.
+ *
+ * The reflections are given in the order of the Ih table and each is
+ * assigned to a group of symmetry equivalent reflections. The reflections of
+ * each group are stored contiguously, in increasing order, with the offset of
+ * each group's reflections in a separate array. The inputs to the kernels
+ * are gathered into this group sorted order so that each group is processed
+ * from contiguous memory, and ranges of groups are processed on separate
+ * threads.
+ *
+ * The target function is sum_r w_r (I_r - g_r Ih_h)^2 where Ih_h is the
+ * weighted mean scaled intensity of the group h to which reflection r
+ * belongs, Ih_h = sum_r w_r g_r I_r / sum_r w_r g_r^2.
+ */
+class IhTableCore {
+public:
+  /**
+   * @param group_index The group of each reflection
+   * @param n_groups The number of groups
+   * @param nthreads The number of threads
+   */
+  IhTableCore(const scitbx::af::const_ref<std::size_t> &group_index,
+              std::size_t n_groups,
+              std::size_t nthreads = 1)
+      : group_index_(group_index.begin(), group_index.end()),
+        group_offset_(n_groups + 1, 0),
+        order_(group_index.size()),
+        nthreads_(nthreads) {
+    DIALS_ASSERT(nthreads > 0);
+    for (std::size_t r = 0; r < group_index_.size(); ++r) {
+      DIALS_ASSERT(group_index_[r] < n_groups);
+      group_offset_[group_index_[r] + 1]++;
+    }
+    for (std::size_t i = 0; i < n_groups; ++i) {
+      group_offset_[i + 1] += group_offset_[i];
+    }
+    std::vector<std::size_t> next(group_offset_.begin(), group_offset_.end() - 1);
+    for (std::size_t r = 0; r < group_index_.size(); ++r) {
+      order_[next[group_index_[r]]++] = r;
+    }
+  }
+
+  std::size_t size() const {
+    return group_index_.size();
+  }
+
+  std::size_t n_groups() const {
+    return group_offset_.size() - 1;
+  }
+
+  std::size_t nthreads() const {
+    return nthreads_;
+  }
+
+  /**
+   * @returns The group of each reflection
+   */
+  scitbx::af::shared<std::size_t> group_index() const {
+    return scitbx::af::shared<std::size_t>(group_index_.begin(), group_index_.end());
+  }
+
+  /**
+   * @returns The offset of the reflections of each group in order()
+   */
+  scitbx::af::shared<std::size_t> group_offset() const {
+    return scitbx::af::shared<std::size_t>(group_offset_.begin(),
+                                           group_offset_.end());
+  }
+
+  /**
+   * @returns The reflections sorted by group
+   */
+  scitbx::af::shared<std::size_t> order() const {
+    return scitbx::af::shared<std::size_t>(order_.begin(), order_.end());
+  }
+
+  /**
+   * @returns The sum of the values of the reflections in each group
+   */
+  scitbx::af::shared<double> sum_in_groups(
+    const scitbx::af::const_ref<double> &values) const {
+    DIALS_ASSERT(values.size() == size());
+    scitbx::af::shared<double> result(n_groups(), 0.0);
+    sum_job job(this, values, result.ref());
+    run(job);
+    return result;
+  }
+
+  /**
+   * Calculate the weighted mean scaled intensity of each group
+   * @param intensities The intensity of each reflection
+   * @param scales The inverse scale factor of each reflection
+   * @param weights The weight of each reflection
+   * @returns The Ih value of the group of each reflection
+   */
+  scitbx::af::shared<double> calc_Ih(
+    const scitbx::af::const_ref<double> &intensities,
+    const scitbx::af::const_ref<double> &scales,
+    const scitbx::af::const_ref<double> &weights) const {
+    data d(this, intensities, scales, weights);
+    scitbx::af::shared<double> Ih(size(), 0.0);
+    Ih_job job(&d, Ih.ref());
+    run(job);
+    return Ih;
+  }
+
+  /**
+   * Calculate the gradients of the target function. The contributions of
+   * each reflection through its own scale and through the Ih of its group
+   * are combined into a single coefficient per reflection, so the gradient
+   * is a single product with the derivatives.
+   * @param intensities The intensity of each reflection
+   * @param scales The inverse scale factor of each reflection
+   * @param Ih The Ih value of the group of each reflection
+   * @param weights The weight of each reflection
+   * @param derivatives The n_refl x n_params derivatives of the scales
+   * @returns The gradient with respect to each parameter
+   */
+  scitbx::af::shared<double> gradients(
+    const scitbx::af::const_ref<double> &intensities,
+    const scitbx::af::const_ref<double> &scales,
+    const scitbx::af::const_ref<double> &Ih,
+    const scitbx::af::const_ref<double> &weights,
+    scitbx::sparse::matrix<double> derivatives) const {
+    DIALS_ASSERT(Ih.size() == size());
+    DIALS_ASSERT(derivatives.n_rows() == size());
+    data d(this, intensities, scales, weights);
+    std::vector<double> coefficient(size());
+    coefficient_job job(&d, Ih, &coefficient);
+    run(job);
+
+    // The gradient of each parameter is the product of the coefficients
+    // with its column of the derivatives
+    derivatives.compact();
+    scitbx::af::shared<double> result(derivatives.n_cols(), 0.0);
+    column_job column(&derivatives, &coefficient, result.ref());
+    run(column, derivatives.n_cols());
+    return result;
+  }
+
+  /**
+   * Select a subset of the reflections. Groups with no selected reflections
+   * are removed and the remaining groups keep their order.
+   * @param selection The reflections to select
+   * @returns The group structure of the selected reflections
+   */
+  IhTableCore select(const scitbx::af::const_ref<bool> &selection) const {
+    DIALS_ASSERT(selection.size() == size());
+    std::vector<std::size_t> new_group(n_groups(), n_groups());
+    for (std::size_t r = 0; r < size(); ++r) {
+      if (selection[r]) {
+        new_group[group_index_[r]] = 0;
+      }
+    }
+    std::size_t n_selected_groups = 0;
+    for (std::size_t i = 0; i < n_groups(); ++i) {
+      if (new_group[i] == 0) {
+        new_group[i] = n_selected_groups++;
+      }
+    }
+    scitbx::af::shared<std::size_t> group_index;
+    for (std::size_t r = 0; r < size(); ++r) {
+      if (selection[r]) {
+        group_index.push_back(new_group[group_index_[r]]);
+      }
+    }
+    return IhTableCore(group_index.const_ref(), n_selected_groups, nthreads_);
+  }
+
+  /**
+   * Select the reflections of a subset of the groups
+   * @param selection The groups to select
+   * @returns The group structure of the selected reflections
+   */
+  IhTableCore select_on_groups(const scitbx::af::const_ref<bool> &selection) const {
+    DIALS_ASSERT(selection.size() == n_groups());
+    scitbx::af::shared<bool> reflections(size());
+    for (std::size_t r = 0; r < size(); ++r) {
+      reflections[r] = selection[group_index_[r]];
+    }
+    return select(reflections.const_ref());
+  }
+
+private:
+  /**
+   * The intensities, scales and weights gathered into group sorted order,
+   * with the sums over each group needed to calculate Ih
+   */
+  struct data {
+    const IhTableCore *table;
+    std::vector<double> intensity;
+    std::vector<double> scale;
+    std::vector<double> weight;
+    std::vector<double> sumgsq;
+    std::vector<double> sumgI;
+
+    data(const IhTableCore *table_,
+         const scitbx::af::const_ref<double> &intensities,
+         const scitbx::af::const_ref<double> &scales,
+         const scitbx::af::const_ref<double> &weights)
+        : table(table_),
+          intensity(table_->size()),
+          scale(table_->size()),
+          weight(table_->size()),
+          sumgsq(table_->n_groups()),
+          sumgI(table_->n_groups()) {
+      DIALS_ASSERT(intensities.size() == table->size());
+      DIALS_ASSERT(scales.size() == table->size());
+      DIALS_ASSERT(weights.size() == table->size());
+      const std::vector<std::size_t> &order = table->order_;
+      for (std::size_t k = 0; k < order.size(); ++k) {
+        intensity[k] = intensities[order[k]];
+        scale[k] = scales[order[k]];
+        weight[k] = weights[order[k]];
+      }
+      sums_job job(this);
+      table->run(job);
+    }
+  };
+
+  struct sums_job {
+    data *d;
+    sums_job(data *d_) : d(d_) {}
+    void operator()(std::size_t first, std::size_t last) const {
+      const std::vector<std::size_t> &offset = d->table->group_offset_;
+      for (std::size_t i = first; i < last; ++i) {
+        double sumgsq = 0.0;
+        double sumgI = 0.0;
+        for (std::size_t k = offset[i]; k < offset[i + 1]; ++k) {
+          double gw = d->scale[k] * d->weight[k];
+          sumgsq += gw * d->scale[k];
+          sumgI += gw * d->intensity[k];
+        }
+        d->sumgsq[i] = sumgsq;
+        d->sumgI[i] = sumgI;
+      }
+    }
+  };
+
+  struct sum_job {
+    const IhTableCore *table;
+    scitbx::af::const_ref<double> values;
+    scitbx::af::ref<double> result;
+    sum_job(const IhTableCore *table_,
+            const scitbx::af::const_ref<double> &values_,
+            scitbx::af::ref<double> result_)
+        : table(table_), values(values_), result(result_) {}
+    void operator()(std::size_t first, std::size_t last) const {
+      for (std::size_t i = first; i < last; ++i) {
+        double sum = 0.0;
+        for (std::size_t k = table->group_offset_[i]; k < table->group_offset_[i + 1];
+             ++k) {
+          sum += values[table->order_[k]];
+        }
+        result[i] = sum;
+      }
+    }
+  };
+
+  struct Ih_job {
+    const data *d;
+    scitbx::af::ref<double> Ih;
+    Ih_job(const data *d_, scitbx::af::ref<double> Ih_) : d(d_), Ih(Ih_) {}
+    void operator()(std::size_t first, std::size_t last) const {
+      const std::vector<std::size_t> &offset = d->table->group_offset_;
+      const std::vector<std::size_t> &order = d->table->order_;
+      for (std::size_t i = first; i < last; ++i) {
+        double value = d->sumgI[i] / d->sumgsq[i];
+        for (std::size_t k = offset[i]; k < offset[i + 1]; ++k) {
+          Ih[order[k]] = value;
+        }
+      }
+    }
+  };
+
+  /**
+   * Calculate the coefficient of the derivatives of each reflection in the
+   * gradient. With the prefactor a_r = -2 w_r (I_r - g_r Ih_r), the gradient
+   * is sum_r a_r Ih_r dg_r/dp + sum_h (sum_r a_r g_r) dIh_h/dp, where
+   * dIh_h/dp = sum_r w_r (I_r - 2 g_r Ih_r) dg_r/dp / sum_r w_r g_r^2.
+   */
+  struct coefficient_job {
+    const data *d;
+    scitbx::af::const_ref<double> Ih;
+    std::vector<double> *coefficient;
+    coefficient_job(const data *d_,
+                    const scitbx::af::const_ref<double> &Ih_,
+                    std::vector<double> *coefficient_)
+        : d(d_), Ih(Ih_), coefficient(coefficient_) {}
+    void operator()(std::size_t first, std::size_t last) const {
+      const std::vector<std::size_t> &offset = d->table->group_offset_;
+      const std::vector<std::size_t> &order = d->table->order_;
+      for (std::size_t i = first; i < last; ++i) {
+        double sumag = 0.0;
+        for (std::size_t k = offset[i]; k < offset[i + 1]; ++k) {
+          double Ih_r = Ih[order[k]];
+          double a = -2.0 * d->weight[k] * (d->intensity[k] - d->scale[k] * Ih_r);
+          sumag += a * d->scale[k];
+        }
+        double factor = sumag / d->sumgsq[i];
+        for (std::size_t k = offset[i]; k < offset[i + 1]; ++k) {
+          double Ih_r = Ih[order[k]];
+          double a = -2.0 * d->weight[k] * (d->intensity[k] - d->scale[k] * Ih_r);
+          double dIh = (d->intensity[k] - 2.0 * d->scale[k] * Ih_r) * d->weight[k];
+          (*coefficient)[order[k]] = a * Ih_r + factor * dIh;
+        }
+      }
+    }
+  };
+
+  struct column_job {
+    const scitbx::sparse::matrix<double> *derivatives;
+    const std::vector<double> *coefficient;
+    scitbx::af::ref<double> result;
+    column_job(const scitbx::sparse::matrix<double> *derivatives_,
+               const std::vector<double> *coefficient_,
+               scitbx::af::ref<double> result_)
+        : derivatives(derivatives_), coefficient(coefficient_), result(result_) {}
+    void operator()(std::size_t first, std::size_t last) const {
+      typedef scitbx::sparse::matrix<double>::column_type column_type;
+      for (std::size_t j = first; j < last; ++j) {
+        const column_type &column = derivatives->col(j);
+        double sum = 0.0;
+        for (column_type::const_iterator it = column.begin(); it != column.end();
+             ++it) {
+          sum += (*coefficient)[it.index()] * *it;
+        }
+        result[j] = sum;
+      }
+    }
+  };
+
+  /**
+   * A range of groups processed by one thread
+   */
+  template <typename Job>
+  struct range_job {
+    Job *job;
+    std::size_t first;
+    std::size_t last;
+    std::string error;
+
+    void operator()() {
+      try {
+        (*job)(first, last);
+      } catch (const std::exception &e) {
+        error = e.what();
+      } catch (...) {
+        error = "Unknown error in Ih table calculation";
+      }
+    }
+  };
+
+  template <typename Job>
+  struct range_runner {
+    range_job<Job> *job;
+    range_runner(range_job<Job> *job_) : job(job_) {}
+    void operator()() const {
+      (*job)();
+    }
+  };
+
+  std::size_t number_of_jobs(std::size_t n) const {
+    return std::max<std::size_t>(1, std::min(nthreads_, n));
+  }
+
+  /**
+   * Process the groups with a copy of the job for each thread. The groups
+   * are split so that each thread has a similar number of reflections.
+   */
+  template <typename Job>
+  void run(std::vector<Job> &jobs) const {
+    std::size_t njobs = jobs.size();
+    std::vector<range_job<Job> > ranges(njobs);
+    std::size_t first = 0;
+    for (std::size_t j = 0; j < njobs; ++j) {
+      std::size_t target = ((j + 1) * size()) / njobs;
+      std::size_t last =
+        j + 1 == njobs ? n_groups()
+                       : std::lower_bound(group_offset_.begin() + first,
+                                          group_offset_.end() - 1,
+                                          target)
+                           - group_offset_.begin();
+      ranges[j].job = &jobs[j];
+      ranges[j].first = first;
+      ranges[j].last = last;
+      first = last;
+    }
+    execute(ranges);
+  }
+
+  /**
+   * Process all the groups
+   */
+  template <typename Job>
+  void run(const Job &job) const {
+    std::vector<Job> jobs(number_of_jobs(n_groups()), job);
+    run(jobs);
+  }
+
+  /**
+   * Process the items in the range [0, n) in equal sized ranges
+   */
+  template <typename Job>
+  void run(const Job &job, std::size_t n) const {
+    std::size_t njobs = number_of_jobs(n);
+    std::vector<Job> jobs(njobs, job);
+    std::vector<range_job<Job> > ranges(njobs);
+    for (std::size_t j = 0; j < njobs; ++j) {
+      ranges[j].job = &jobs[j];
+      ranges[j].first = (j * n) / njobs;
+      ranges[j].last = ((j + 1) * n) / njobs;
+    }
+    execute(ranges);
+  }
+
+  template <typename Job>
+  void execute(std::vector<range_job<Job> > &ranges) const {
+    if (ranges.size() == 1) {
+      ranges[0]();
+    } else {
+      dials::util::ThreadPool pool(ranges.size());
+      for (std::size_t j = 0; j < ranges.size(); ++j) {
+        pool.post(range_runner<Job>(&ranges[j]));
+      }
+      pool.wait();
+    }
+    for (std::size_t j = 0; j < ranges.size(); ++j) {
+      if (!ranges[j].error.empty()) {
+        throw DIALS_ERROR(ranges[j].error);
+      }
+    }
+  }
+
+  std::vector<std::size_t> group_index_;
+  std::vector<std::size_t> group_offset_;
+  std::vector<std::size_t> order_;
+  std::size_t nthreads_;
+};
+
+}  // namespace dials_scaling
+
+#endif  // DIALS_SCALING_IH_TABLE_H
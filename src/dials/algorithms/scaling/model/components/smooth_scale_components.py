@@ -25,7 +25,33 @@
 # consistent with that used in dials.refinement.
 
 
-class GaussianSmoother1D(GS1D):
+class CachedWeightsMixin:
+    """Mixin class to cache the smoother weights at sets of points.
+
+    The weights depend only on the coordinates of the points and the smoothing
+    settings, so are calculated once for each set of coordinate arrays and
+    reused as the parameter values change during minimisation."""
+
+    def __init__(self, *args):
+        super().__init__(*args)
+        self._weights_cache = {}
+
+    def set_smoothing(self, num_average, sigma):
+        """Set the smoothing parameters, invalidating any cached weights."""
+        super().set_smoothing(num_average, sigma)
+        self._weights_cache = {}
+
+    def cached_weights(self, *coords):
+        """Return the smoother weights at the points given by the coordinate
+        arrays, calculating them only on first use of these arrays."""
+        key = tuple(id(c) for c in coords)
+        if key not in self._weights_cache:
+            # Keep a reference to the arrays, so that the ids stay unique.
+            self._weights_cache[key] = (coords, self.weights(*coords))
+        return self._weights_cache[key][1]
+
+
+class GaussianSmoother1D(CachedWeightsMixin, GS1D):
     """A 1D Gaussian smoother."""
 
     def value_weight(self, x, value):
@@ -53,7 +79,7 @@ def positions(self):
         return list(super().positions())
 
 
-class GaussianSmoother2D(GS2D):
+class GaussianSmoother2D(CachedWeightsMixin, GS2D):
     """A 2D Gaussian smoother."""
 
     def value_weight(self, x, y, value):
@@ -75,7 +101,7 @@ def y_positions(self):
         return list(super().y_positions())
 
 
-class GaussianSmoother3D(GS3D):
+class GaussianSmoother3D(CachedWeightsMixin, GS3D):
     """A 3D Gaussian smoother."""
 
     def value_weight(self, x, y, z, value):
@@ -232,53 +258,20 @@ def update_reflection_data(self, selection=None, block_selections=None):
             self._n_refl.append(normalised_values.size())
 
     def calculate_scales_and_derivatives(self, block_id=0):
-        if self._n_refl[block_id] > 1:
-            if self._fixed_initial:
-                (
-                    value,
-                    weight,
-                    sumweight,
-                ) = self._smoother.multi_value_weight_first_fixed(
-                    self._normalised_values[block_id], self.value
-                )
-            else:
-                value, weight, sumweight = self._smoother.multi_value_weight(
-                    self._normalised_values[block_id], self.value
-                )
-            inv_sw = 1.0 / sumweight
-            dv_dp = row_multiply(weight, inv_sw)
-        elif self._n_refl[block_id] == 1:
-            if self._fixed_initial:
-                value, weight, sumweight = self._smoother.value_weight_first_fixed(
-                    self._normalised_values[block_id][0], self.value
-                )
-            else:
-                value, weight, sumweight = self._smoother.value_weight(
-                    self._normalised_values[block_id][0], self.value
-                )
-            dv_dp = sparse.matrix(1, weight.size)
-            b = flex.double(weight.as_dense_vector() / sumweight)
-            b.reshape(flex.grid(1, b.size()))
-            dv_dp.assign_block(b, 0, 0)
-            value = flex.double(1, value)
-        else:
+        if self._n_refl[block_id] == 0:
             return flex.double([]), sparse.matrix(0, 0)
+        weights = self._smoother.cached_weights(self._normalised_values[block_id])
+        value = weights.value(self.value)
+        # If fixing the first parameter, the derivatives start at the second.
+        dv_dp = weights.dvalue_dparam(first_param=int(self._fixed_initial))
         return value, dv_dp
 
     def calculate_scales(self, block_id=0):
         """ "Only calculate the scales if needed, for performance."""
-        if self._n_refl[block_id] > 1:
-            value, _, __ = self._smoother.multi_value_weight(
-                self._normalised_values[block_id], self.value
-            )
-        elif self._n_refl[block_id] == 1:
-            value, _, __ = self._smoother.value_weight(
-                self._normalised_values[block_id][0], self.value
-            )
-            value = flex.double(1, value)
-        else:
-            value = flex.double([])
-        return value
+        if self._n_refl[block_id] == 0:
+            return flex.double([])
+        weights = self._smoother.cached_weights(self._normalised_values[block_id])
+        return weights.value(self.value)
 
 
 class SmoothBScaleComponent1D(SmoothScaleComponent1D):
@@ -431,47 +424,21 @@ def update_reflection_data(self, selection=None, block_selections=None):
             self._n_refl.append(normalised_x_values.size())
 
     def calculate_scales_and_derivatives(self, block_id=0):
-        if self._n_refl[block_id] > 1:
-            value, weight, sumweight = self._smoother.multi_value_weight(
-                self._normalised_x_values[block_id],
-                self._normalised_y_values[block_id],
-                self.value,
-            )
-            inv_sw = 1.0 / sumweight
-            dv_dp = row_multiply(weight, inv_sw)
-        elif self._n_refl[block_id] == 1:
-            value, weight, sumweight = self._smoother.value_weight(
-                self._normalised_x_values[block_id][0],
-                self._normalised_y_values[block_id][0],
-                self.value,
-            )
-            dv_dp = sparse.matrix(1, weight.size)
-            b = flex.double(weight.as_dense_vector() / sumweight)
-            b.reshape(flex.grid(1, b.size()))
-            dv_dp.assign_block(b, 0, 0)
-            value = flex.double(1, value)
-        else:
+        if self._n_refl[block_id] == 0:
             return flex.double([]), sparse.matrix(0, 0)
-        return value, dv_dp
+        weights = self._smoother.cached_weights(
+            self._normalised_x_values[block_id], self._normalised_y_values[block_id]
+        )
+        return weights.value(self.value), weights.dvalue_dparam()
 
     def calculate_scales(self, block_id=0):
         """Only calculate the scales if needed, for performance."""
-        if self._n_refl[block_id] > 1:
-            value, _, __ = self._smoother.multi_value_weight(
-                self._normalised_x_values[block_id],
-                self._normalised_y_values[block_id],
-                self.value,
-            )
-        elif self._n_refl[block_id] == 1:
-            value, _, __ = self._smoother.value_weight(
-                self._normalised_x_values[block_id][0],
-                self._normalised_y_values[block_id][0],
-                self.value,
-            )
-            value = flex.double(1, value)
-        else:
-            value = flex.double([])
-        return value
+        if self._n_refl[block_id] == 0:
+            return flex.double([])
+        weights = self._smoother.cached_weights(
+            self._normalised_x_values[block_id], self._normalised_y_values[block_id]
+        )
+        return weights.value(self.value)
 
 
 class SmoothScaleComponent3D(ScaleComponentBase, SmoothMixin):
@@ -592,48 +559,22 @@ def update_reflection_data(self, selection=None, block_selections=None):
             self._n_refl.append(normalised_x_values.size())
 
     def calculate_scales_and_derivatives(self, block_id=0):
-        if self._n_refl[block_id] > 1:
-            value, weight, sumweight = self._smoother.multi_value_weight(
-                self._normalised_x_values[block_id],
-                self._normalised_y_values[block_id],
-                self._normalised_z_values[block_id],
-                self.value,
-            )
-            inv_sw = 1.0 / sumweight
-            dv_dp = row_multiply(weight, inv_sw)
-        elif self._n_refl[block_id] == 1:
-            value, weight, sumweight = self._smoother.value_weight(
-                self._normalised_x_values[block_id][0],
-                self._normalised_y_values[block_id][0],
-                self._normalised_z_values[block_id][0],
-                self.value,
-            )
-            dv_dp = sparse.matrix(1, weight.size)
-            b = flex.double(weight.as_dense_vector() / sumweight)
-            b.reshape(flex.grid(1, b.size()))
-            dv_dp.assign_block(b, 0, 0)
-            value = flex.double(1, value)
-        else:
+        if self._n_refl[block_id] == 0:
             return flex.double([]), sparse.matrix(0, 0)
-        return value, dv_dp
+        weights = self._smoother.cached_weights(
+            self._normalised_x_values[block_id],
+            self._normalised_y_values[block_id],
+            self._normalised_z_values[block_id],
+        )
+        return weights.value(self.value), weights.dvalue_dparam()
 
     def calculate_scales(self, block_id=0):
         """ "Only calculate the scales if needed, for performance."""
-        if self._n_refl[block_id] > 1:
-            value, _, __ = self._smoother.multi_value_weight(
-                self._normalised_x_values[block_id],
-                self._normalised_y_values[block_id],
-                self._normalised_z_values[block_id],
-                self.value,
-            )
-        elif self._n_refl[block_id] == 1:
-            value, _, __ = self._smoother.value_weight(
-                self._normalised_x_values[block_id][0],
-                self._normalised_y_values[block_id][0],
-                self._normalised_z_values[block_id][0],
-                self.value,
-            )
-            value = flex.double(1, value)
-        else:
-            value = flex.double([])
-        return value
+        if self._n_refl[block_id] == 0:
+            return flex.double([])
+        weights = self._smoother.cached_weights(
+            self._normalised_x_values[block_id],
+            self._normalised_y_values[block_id],
+            self._normalised_z_values[block_id],
+        )
+        return weights.value(self.value)
@@ -170,6 +170,7 @@ def print_scaling_summary(script):
                         script.params.output.merging.nbins,
                         script.params.output.use_internal_variance,
                         additional_stats=script.params.output.additional_stats,
+                        nproc=script.params.scaling_options.nproc,
                     )
                 except DialsMergingStatisticsError:
                     pass
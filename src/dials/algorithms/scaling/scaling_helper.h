@@ -1,11 +1,17 @@
 #ifndef DIALS_SCALING_SCALING_HELPER_H
 #define DIALS_SCALING_SCALING_HELPER_H
 
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
 #include <dials/array_family/scitbx_shared_and_versa.h>
 #include <scitbx/sparse/matrix.h>
 #include <scitbx/math/zernike.h>
 #include <scitbx/math/basic_statistics.h>
 #include <dials/error.h>
+#include <dials/util/philox.h>
+#include <dials/util/thread_pool.h>
 #include <math.h>
 #include <dials/algorithms/refinement/gaussian_smoother.h>
 #include <scitbx/random.h>
@@ -104,23 +110,108 @@ public:
   }
 };
 
+namespace detail {
+
+  /**
+   * Sets each element of a range of columns of a result matrix to a function
+   * of the row index and value of the element in a compacted matrix
+   */
+  template <typename Function>
+  struct transform_columns_job {
+    const scitbx::sparse::matrix<double> *m;
+    scitbx::sparse::matrix<double> *result;
+    Function function;
+    std::size_t first;
+    std::size_t last;
+    std::string error;
+
+    transform_columns_job() : m(0), result(0), first(0), last(0) {}
+
+    void operator()() {
+      try {
+        for (std::size_t j = first; j < last; ++j) {
+          const col_type column = m->col(j);
+          for (col_type::const_iterator p = column.begin(); p != column.end(); ++p) {
+            (*result)(p.index(), j) = function(p.index(), *p);
+          }
+        }
+      } catch (const std::exception &e) {
+        error = e.what();
+      } catch (...) {
+        error = "Unknown error in sparse matrix transform";
+      }
+    }
+  };
+
+  template <typename Function>
+  struct transform_columns_runner {
+    transform_columns_job<Function> *job;
+    transform_columns_runner(transform_columns_job<Function> *job_) : job(job_) {}
+    void operator()() const {
+      (*job)();
+    }
+  };
+
+  /**
+   * Apply a function to each element of a matrix, with the columns split
+   * between threads
+   */
+  template <typename Function>
+  scitbx::sparse::matrix<double> transform_columns(scitbx::sparse::matrix<double> m,
+                                                   Function function,
+                                                   std::size_t nthreads) {
+    DIALS_ASSERT(nthreads > 0);
+
+    // call compact to ensure that each elt of the matrix is only defined once
+    m.compact();
+
+    scitbx::sparse::matrix<double> result(m.n_rows(), m.n_cols());
+    std::size_t njobs = std::max<std::size_t>(1, std::min(nthreads, m.n_cols()));
+    std::vector<transform_columns_job<Function> > jobs(njobs);
+    for (std::size_t j = 0; j < njobs; ++j) {
+      jobs[j].m = &m;
+      jobs[j].result = &result;
+      jobs[j].function = function;
+      jobs[j].first = (j * m.n_cols()) / njobs;
+      jobs[j].last = ((j + 1) * m.n_cols()) / njobs;
+    }
+    if (njobs == 1) {
+      jobs[0]();
+    } else {
+      dials::util::ThreadPool pool(njobs);
+      for (std::size_t j = 0; j < njobs; ++j) {
+        pool.post(transform_columns_runner<Function>(&jobs[j]));
+      }
+      pool.wait();
+    }
+    for (std::size_t j = 0; j < njobs; ++j) {
+      if (!jobs[j].error.empty()) {
+        throw DIALS_ERROR(jobs[j].error);
+      }
+    }
+    return result;
+  }
+
+  struct square_value {
+    double operator()(std::size_t, double x) const {
+      return x * x;
+    }
+  };
+
+  struct multiply_row {
+    scitbx::af::const_ref<double> v;
+    double operator()(std::size_t i, double x) const {
+      return x * v[i];
+    }
+  };
+
+}  // namespace detail
+
 /**
  * Elementwise squaring of a matrix
  */
 scitbx::sparse::matrix<double> elementwise_square(scitbx::sparse::matrix<double> m) {
-  scitbx::sparse::matrix<double> result(m.n_rows(), m.n_cols());
-
-  // outer loop iterate over the columns
-  for (std::size_t j = 0; j < m.n_cols(); j++) {
-    // inner loop iterate over the non-zero elements of the column
-    for (scitbx::sparse::matrix<double>::row_iterator p = m.col(j).begin();
-         p != m.col(j).end();
-         ++p) {
-      std::size_t i = p.index();
-      result(i, j) = *p * *p;
-    }
-  }
-  return result;
+  return detail::transform_columns(m, detail::square_value(), 1);
 }
 
 scitbx::af::shared<double> limit_outlier_weights(
@@ -147,35 +238,487 @@ scitbx::af::shared<double> limit_outlier_weights(
   return weights;
 }
 
+/**
+ * Calculates dIh/dp and the Jacobian of the scaling residuals for a block of
+ * the Ih table. The sparsity patterns of the results depend only on the
+ * grouping of the reflections in the h_index_mat and on the sparsity pattern
+ * of the derivatives, neither of which change between iterations of the
+ * minimisation, so the patterns are built once and only the values are
+ * recalculated. The derivative pattern is checked on every call and the
+ * patterns are rebuilt if it has changed.
+ *
+ * The values are calculated for ranges of groups on separate threads and the
+ * result matrices are filled a range of columns per thread.
+ */
+class ScalingJacobianCalculator {
+public:
+  /**
+   * @param h_index_mat The n_refl x n_groups matrix of group membership
+   * @param nthreads The number of threads
+   */
+  ScalingJacobianCalculator(scitbx::sparse::matrix<double> h_index_mat,
+                            std::size_t nthreads = 1)
+      : n_refl_(h_index_mat.n_rows()),
+        n_groups_(h_index_mat.n_cols()),
+        n_params_(0),
+        nthreads_(nthreads),
+        group_offset_(1, 0),
+        refl_group_(n_refl_, n_groups_),
+        deriv_offset_(n_refl_ + 1, 0) {
+    DIALS_ASSERT(nthreads > 0);
+    h_index_mat.compact();
+    for (std::size_t i = 0; i < n_groups_; ++i) {
+      const col_type column = h_index_mat.col(i);
+      for (col_type::const_iterator it = column.begin(); it != column.end(); ++it) {
+        DIALS_ASSERT(refl_group_[it.index()] == n_groups_);
+        refl_group_[it.index()] = i;
+        group_refl_.push_back(it.index());
+      }
+      group_offset_.push_back(group_refl_.size());
+    }
+    build_patterns();
+  }
+
+  std::size_t nthreads() const {
+    return nthreads_;
+  }
+
+  /**
+   * @param dIh The derivative prefactor of each reflection
+   * @param sumgsq The weighted sum of squared scales of each group
+   * @param derivatives The n_params x n_refl matrix of scale derivatives
+   * @returns The n_groups x n_params matrix of dIh/dp
+   */
+  scitbx::sparse::matrix<double> dIh_by_dpi(
+    const scitbx::af::const_ref<double> &dIh,
+    const scitbx::af::const_ref<double> &sumgsq,
+    scitbx::sparse::matrix<double> derivatives) {
+    update(derivatives, dIh, sumgsq);
+    value_job job(this, dIh, sumgsq);
+    run(job, n_groups_, group_offset_);
+    scitbx::sparse::matrix<double> result(n_groups_, n_params_);
+    fill_job fill(
+      &result, &param_offset_, &param_group_, &param_position_, &group_value_);
+    run(fill, n_params_, param_offset_);
+    return result;
+  }
+
+  /**
+   * @returns The n_params x n_groups matrix of dIh/dp
+   */
+  scitbx::sparse::matrix<double> dIh_by_dpi_transpose(
+    const scitbx::af::const_ref<double> &dIh,
+    const scitbx::af::const_ref<double> &sumgsq,
+    scitbx::sparse::matrix<double> derivatives) {
+    update(derivatives, dIh, sumgsq);
+    value_job job(this, dIh, sumgsq);
+    run(job, n_groups_, group_offset_);
+    scitbx::sparse::matrix<double> result(n_params_, n_groups_);
+    fill_job fill(&result, &group_param_offset_, &group_param_, 0, &group_value_);
+    run(fill, n_groups_, group_param_offset_);
+    return result;
+  }
+
+  /**
+   * @param derivatives The n_params x n_refl matrix of scale derivatives
+   * @param Ih The Ih value of each reflection
+   * @param g The inverse scale factor of each reflection
+   * @param dIh The derivative prefactor of each reflection
+   * @param sumgsq The weighted sum of squared scales of each group
+   * @returns The n_refl x n_params Jacobian
+   */
+  scitbx::sparse::matrix<double> jacobian(scitbx::sparse::matrix<double> derivatives,
+                                          const scitbx::af::const_ref<double> &Ih,
+                                          const scitbx::af::const_ref<double> &g,
+                                          const scitbx::af::const_ref<double> &dIh,
+                                          const scitbx::af::const_ref<double> &sumgsq) {
+    DIALS_ASSERT(Ih.size() == n_refl_);
+    DIALS_ASSERT(g.size() == n_refl_);
+    update(derivatives, dIh, sumgsq);
+    if (jacobian_offset_.empty()) {
+      build_jacobian_pattern();
+    }
+    value_job job(this, dIh, sumgsq, Ih, g);
+    run(job, n_groups_, group_offset_);
+    scitbx::sparse::matrix<double> result(n_refl_, n_params_);
+    fill_job fill(&result,
+                  &jacobian_param_offset_,
+                  &jacobian_refl_,
+                  &jacobian_position_,
+                  &jacobian_value_);
+    run(fill, n_params_, jacobian_param_offset_);
+    return result;
+  }
+
+private:
+  /**
+   * Calculates dIh/dp for a range of groups and, if Ih and g are given, the
+   * Jacobian rows of the reflections in those groups
+   */
+  struct value_job {
+    ScalingJacobianCalculator *calculator;
+    scitbx::af::const_ref<double> dIh;
+    scitbx::af::const_ref<double> sumgsq;
+    scitbx::af::const_ref<double> Ih;
+    scitbx::af::const_ref<double> g;
+    bool jacobian;
+
+    value_job(ScalingJacobianCalculator *calculator_,
+              const scitbx::af::const_ref<double> &dIh_,
+              const scitbx::af::const_ref<double> &sumgsq_)
+        : calculator(calculator_), dIh(dIh_), sumgsq(sumgsq_), jacobian(false) {}
+
+    value_job(ScalingJacobianCalculator *calculator_,
+              const scitbx::af::const_ref<double> &dIh_,
+              const scitbx::af::const_ref<double> &sumgsq_,
+              const scitbx::af::const_ref<double> &Ih_,
+              const scitbx::af::const_ref<double> &g_)
+        : calculator(calculator_),
+          dIh(dIh_),
+          sumgsq(sumgsq_),
+          Ih(Ih_),
+          g(g_),
+          jacobian(true) {}
+
+    void operator()(std::size_t first, std::size_t last) const {
+      for (std::size_t i = first; i < last; ++i) {
+        calculator->group_values(i, *this);
+      }
+    }
+  };
+
+  /**
+   * Fills a range of columns of a result matrix from the values at the
+   * given positions, with the rows of each column in increasing order
+   */
+  struct fill_job {
+    scitbx::sparse::matrix<double> *result;
+    const std::vector<std::size_t> *offset;
+    const std::vector<std::size_t> *row;
+    const std::vector<std::size_t> *position;
+    const std::vector<double> *value;
+
+    fill_job(scitbx::sparse::matrix<double> *result_,
+             const std::vector<std::size_t> *offset_,
+             const std::vector<std::size_t> *row_,
+             const std::vector<std::size_t> *position_,
+             const std::vector<double> *value_)
+        : result(result_),
+          offset(offset_),
+          row(row_),
+          position(position_),
+          value(value_) {}
+
+    void operator()(std::size_t first, std::size_t last) const {
+      for (std::size_t j = first; j < last; ++j) {
+        for (std::size_t k = (*offset)[j]; k < (*offset)[j + 1]; ++k) {
+          std::size_t p = position == 0 ? k : (*position)[k];
+          (*result)((*row)[k], j) = (*value)[p];
+        }
+        result->col(j).compact();
+      }
+    }
+  };
+
+  /**
+   * A range of items processed by one thread
+   */
+  template <typename Job>
+  struct range_job {
+    const Job *job;
+    std::size_t first;
+    std::size_t last;
+    std::string error;
+
+    void operator()() {
+      try {
+        (*job)(first, last);
+      } catch (const std::exception &e) {
+        error = e.what();
+      } catch (...) {
+        error = "Unknown error in scaling Jacobian calculation";
+      }
+    }
+  };
+
+  template <typename Job>
+  struct range_runner {
+    range_job<Job> *job;
+    range_runner(range_job<Job> *job_) : job(job_) {}
+    void operator()() const {
+      (*job)();
+    }
+  };
+
+  /**
+   * Split the items between threads so that each has a similar amount of
+   * work, as given by the offset of the entries of each item
+   */
+  template <typename Job>
+  void run(const Job &job, std::size_t n, const std::vector<std::size_t> &offset) {
+    DIALS_ASSERT(offset.size() == n + 1);
+    std::size_t njobs = std::max<std::size_t>(1, std::min(nthreads_, n));
+    std::vector<range_job<Job> > jobs(njobs);
+    std::size_t first = 0;
+    for (std::size_t j = 0; j < njobs; ++j) {
+      std::size_t target = offset[0] + ((j + 1) * (offset[n] - offset[0])) / njobs;
+      std::size_t last =
+        j + 1 == njobs
+          ? n
+          : std::lower_bound(offset.begin() + first, offset.end() - 1, target)
+              - offset.begin();
+      jobs[j].job = &job;
+      jobs[j].first = first;
+      jobs[j].last = last;
+      first = last;
+    }
+    if (njobs == 1) {
+      jobs[0]();
+    } else {
+      dials::util::ThreadPool pool(njobs);
+      for (std::size_t j = 0; j < njobs; ++j) {
+        pool.post(range_runner<Job>(&jobs[j]));
+      }
+      pool.wait();
+    }
+    for (std::size_t j = 0; j < njobs; ++j) {
+      if (!jobs[j].error.empty()) {
+        throw DIALS_ERROR(jobs[j].error);
+      }
+    }
+  }
+
+  /**
+   * Read the values of the derivatives and rebuild the patterns if the
+   * pattern of the derivatives has changed
+   */
+  void update(scitbx::sparse::matrix<double> &derivatives,
+              const scitbx::af::const_ref<double> &dIh,
+              const scitbx::af::const_ref<double> &sumgsq) {
+    DIALS_ASSERT(derivatives.n_cols() == n_refl_);
+    DIALS_ASSERT(dIh.size() == n_refl_);
+    DIALS_ASSERT(sumgsq.size() == n_groups_);
+    derivatives.compact();
+    bool same = derivatives.n_rows() == n_params_;
+    std::size_t k = 0;
+    for (std::size_t r = 0; r < n_refl_; ++r) {
+      const col_type column = derivatives.col(r);
+      for (col_type::const_iterator it = column.begin(); it != column.end(); ++it) {
+        if (same
+            && (k >= deriv_offset_[r + 1] || deriv_param_[k] != it.index())) {
+          same = false;
+        }
+        if (!same) {
+          break;
+        }
+        deriv_value_[k++] = *it;
+      }
+      if (same && k != deriv_offset_[r + 1]) {
+        same = false;
+      }
+      if (!same) {
+        break;
+      }
+    }
+    if (same) {
+      return;
+    }
+
+    // The pattern has changed so read it again
+    n_params_ = derivatives.n_rows();
+    deriv_param_.clear();
+    deriv_value_.clear();
+    for (std::size_t r = 0; r < n_refl_; ++r) {
+      const col_type column = derivatives.col(r);
+      for (col_type::const_iterator it = column.begin(); it != column.end(); ++it) {
+        deriv_param_.push_back(it.index());
+        deriv_value_.push_back(*it);
+      }
+      deriv_offset_[r + 1] = deriv_param_.size();
+    }
+    build_patterns();
+  }
+
+  /**
+   * Build the pattern of dIh/dp, whose row for each group has an entry for
+   * every parameter with a derivative for any reflection in the group
+   */
+  void build_patterns() {
+    std::vector<std::size_t> last_group(n_params_, n_groups_);
+    group_param_offset_.assign(1, 0);
+    group_param_.clear();
+    deriv_position_.resize(deriv_param_.size());
+    for (std::size_t i = 0; i < n_groups_; ++i) {
+      std::size_t first = group_param_.size();
+      for (std::size_t k = group_offset_[i]; k < group_offset_[i + 1]; ++k) {
+        std::size_t r = group_refl_[k];
+        for (std::size_t d = deriv_offset_[r]; d < deriv_offset_[r + 1]; ++d) {
+          if (last_group[deriv_param_[d]] != i) {
+            last_group[deriv_param_[d]] = i;
+            group_param_.push_back(deriv_param_[d]);
+          }
+        }
+      }
+      std::sort(group_param_.begin() + first, group_param_.end());
+      group_param_offset_.push_back(group_param_.size());
+
+      // The position of each derivative in the row of its group
+      for (std::size_t k = group_offset_[i]; k < group_offset_[i + 1]; ++k) {
+        std::size_t r = group_refl_[k];
+        for (std::size_t d = deriv_offset_[r]; d < deriv_offset_[r + 1]; ++d) {
+          deriv_position_[d] = std::lower_bound(group_param_.begin() + first,
+                                                group_param_.end(),
+                                                deriv_param_[d])
+                               - group_param_.begin();
+        }
+      }
+    }
+    group_value_.resize(group_param_.size());
+
+    // The columns of dIh/dp, with the groups of each parameter in order
+    param_offset_.assign(n_params_ + 1, 0);
+    for (std::size_t k = 0; k < group_param_.size(); ++k) {
+      param_offset_[group_param_[k] + 1]++;
+    }
+    for (std::size_t p = 0; p < n_params_; ++p) {
+      param_offset_[p + 1] += param_offset_[p];
+    }
+    param_group_.resize(group_param_.size());
+    param_position_.resize(group_param_.size());
+    std::vector<std::size_t> next(param_offset_.begin(), param_offset_.end() - 1);
+    for (std::size_t i = 0; i < n_groups_; ++i) {
+      for (std::size_t k = group_param_offset_[i]; k < group_param_offset_[i + 1];
+           ++k) {
+        std::size_t n = next[group_param_[k]]++;
+        param_group_[n] = i;
+        param_position_[n] = k;
+      }
+    }
+
+    // The Jacobian pattern is built when it is first needed
+    jacobian_offset_.clear();
+  }
+
+  /**
+   * Build the pattern of the Jacobian. The row of each reflection has the
+   * same pattern as the row of dIh/dp of its group.
+   */
+  void build_jacobian_pattern() {
+    jacobian_offset_.assign(n_refl_ + 1, 0);
+    for (std::size_t r = 0; r < n_refl_; ++r) {
+      std::size_t i = refl_group_[r];
+      std::size_t n = 0;
+      if (i < n_groups_) {
+        n = group_param_offset_[i + 1] - group_param_offset_[i];
+      }
+      jacobian_offset_[r + 1] = jacobian_offset_[r] + n;
+    }
+    jacobian_value_.resize(jacobian_offset_.back());
+
+    // The columns, with the reflections of each parameter in order
+    jacobian_param_offset_.assign(n_params_ + 1, 0);
+    for (std::size_t r = 0; r < n_refl_; ++r) {
+      std::size_t i = refl_group_[r];
+      if (i < n_groups_) {
+        for (std::size_t k = group_param_offset_[i]; k < group_param_offset_[i + 1];
+             ++k) {
+          jacobian_param_offset_[group_param_[k] + 1]++;
+        }
+      }
+    }
+    for (std::size_t p = 0; p < n_params_; ++p) {
+      jacobian_param_offset_[p + 1] += jacobian_param_offset_[p];
+    }
+    jacobian_refl_.resize(jacobian_value_.size());
+    jacobian_position_.resize(jacobian_value_.size());
+    std::vector<std::size_t> next(jacobian_param_offset_.begin(),
+                                  jacobian_param_offset_.end() - 1);
+    for (std::size_t r = 0; r < n_refl_; ++r) {
+      std::size_t i = refl_group_[r];
+      if (i < n_groups_) {
+        std::size_t k0 = group_param_offset_[i];
+        for (std::size_t k = k0; k < group_param_offset_[i + 1]; ++k) {
+          std::size_t n = next[group_param_[k]]++;
+          jacobian_refl_[n] = r;
+          jacobian_position_[n] = jacobian_offset_[r] + (k - k0);
+        }
+      }
+    }
+  }
+
+  /**
+   * Calculate the values of dIh/dp for a group and the Jacobian rows of its
+   * reflections
+   */
+  void group_values(std::size_t i, const value_job &job) {
+    std::size_t k0 = group_param_offset_[i];
+    std::size_t k1 = group_param_offset_[i + 1];
+    std::fill(group_value_.begin() + k0, group_value_.begin() + k1, 0.0);
+    for (std::size_t k = group_offset_[i]; k < group_offset_[i + 1]; ++k) {
+      std::size_t r = group_refl_[k];
+      for (std::size_t d = deriv_offset_[r]; d < deriv_offset_[r + 1]; ++d) {
+        group_value_[deriv_position_[d]] +=
+          (job.dIh[r] * deriv_value_[d] / job.sumgsq[i]);
+      }
+    }
+    if (!job.jacobian) {
+      return;
+    }
+    for (std::size_t k = group_offset_[i]; k < group_offset_[i + 1]; ++k) {
+      std::size_t r = group_refl_[k];
+      double *row = &jacobian_value_[0] + jacobian_offset_[r];
+      for (std::size_t j = 0; j < k1 - k0; ++j) {
+        row[j] = 0.0;
+      }
+      for (std::size_t d = deriv_offset_[r]; d < deriv_offset_[r + 1]; ++d) {
+        row[deriv_position_[d] - k0] -= deriv_value_[d] * job.Ih[r];
+      }
+      for (std::size_t j = 0; j < k1 - k0; ++j) {
+        row[j] -= job.g[r] * group_value_[k0 + j];
+      }
+    }
+  }
+
+  std::size_t n_refl_;
+  std::size_t n_groups_;
+  std::size_t n_params_;
+  std::size_t nthreads_;
+
+  // The reflections of each group
+  std::vector<std::size_t> group_offset_;
+  std::vector<std::size_t> group_refl_;
+  std::vector<std::size_t> refl_group_;
+
+  // The derivatives of each reflection and their positions in dIh/dp
+  std::vector<std::size_t> deriv_offset_;
+  std::vector<std::size_t> deriv_param_;
+  std::vector<std::size_t> deriv_position_;
+  std::vector<double> deriv_value_;
+
+  // dIh/dp by group and the position of each value by parameter
+  std::vector<std::size_t> group_param_offset_;
+  std::vector<std::size_t> group_param_;
+  std::vector<double> group_value_;
+  std::vector<std::size_t> param_offset_;
+  std::vector<std::size_t> param_group_;
+  std::vector<std::size_t> param_position_;
+
+  // The Jacobian by reflection and the position of each value by parameter
+  std::vector<std::size_t> jacobian_offset_;
+  std::vector<double> jacobian_value_;
+  std::vector<std::size_t> jacobian_param_offset_;
+  std::vector<std::size_t> jacobian_refl_;
+  std::vector<std::size_t> jacobian_position_;
+};
+
 scitbx::sparse::matrix<double> calculate_dIh_by_dpi(
   scitbx::af::shared<double> dIh,
   scitbx::af::shared<double> sumgsq,
   scitbx::sparse::matrix<double> h_index_mat,
   scitbx::sparse::matrix<double> derivatives) {
   // derivatives is a matrix where rows are params and cols are reflections
-  int n_params = derivatives.n_rows();
-  int n_groups = h_index_mat.n_cols();
-  scitbx::sparse::matrix<double> dIh_by_dpi(n_groups, n_params);
-
-  for (int i = 0; i < h_index_mat.n_cols(); ++i) {
-    const col_type column = h_index_mat.col(i);
-    // loop over reflection groups
-    column.compact();
-    for (col_type::const_iterator it = column.begin(); it != column.end(); ++it) {
-      // so it.index gives index of a refl from group i
-      int refl_idx = it.index();
-      const col_type dgidx_by_dpi = derivatives.col(refl_idx);
-      // deriv of one refl wrt all params
-      for (col_type::const_iterator dgit = dgidx_by_dpi.begin();
-           dgit != dgidx_by_dpi.end();
-           ++dgit) {
-        // dgit.index indicates which params have nonzero derivs
-        dIh_by_dpi(i, dgit.index()) += (dIh[refl_idx] * *dgit / sumgsq[i]);
-      }
-    }
-  }
-  dIh_by_dpi.compact();
-  return dIh_by_dpi;
+  return ScalingJacobianCalculator(h_index_mat)
+    .dIh_by_dpi(dIh.const_ref(), sumgsq.const_ref(), derivatives);
 }
 
 scitbx::sparse::matrix<double> calculate_dIh_by_dpi_transpose(
@@ -184,30 +727,8 @@ scitbx::sparse::matrix<double> calculate_dIh_by_dpi_transpose(
   scitbx::sparse::matrix<double> h_index_mat,
   scitbx::sparse::matrix<double> derivatives) {
   // derivatives is a matrix where rows are params and cols are reflections
-  int n_params = derivatives.n_rows();
-  int n_groups = h_index_mat.n_cols();
-  scitbx::sparse::matrix<double> dIh_by_dpi(n_params, n_groups);
-
-  for (int i = 0; i < h_index_mat.n_cols(); ++i) {
-    const col_type column = h_index_mat.col(i);
-    // first loop over h_idx to get indices for a reflection group
-    column.compact();
-    scitbx::sparse::vector<double> deriv_of_group_by_params(n_params);
-    for (col_type::const_iterator it = column.begin(); it != column.end(); ++it) {
-      // it.index gives index of a refl from group i
-      int refl_idx = it.index();
-      const col_type dgidx_by_dpi = derivatives.col(refl_idx);
-      // deriv of one refl wrt all params
-      for (col_type::const_iterator dgit = dgidx_by_dpi.begin();
-           dgit != dgidx_by_dpi.end();
-           ++dgit) {
-        // dgit.index indicates which params have nonzero derivs
-        dIh_by_dpi(dgit.index(), i) += (dIh[refl_idx] * *dgit / sumgsq[i]);
-      }
-    }
-  }
-  dIh_by_dpi.compact();
-  return dIh_by_dpi;
+  return ScalingJacobianCalculator(h_index_mat)
+    .dIh_by_dpi_transpose(dIh.const_ref(), sumgsq.const_ref(), derivatives);
 }
 
 scitbx::sparse::matrix<double> calc_jacobian(scitbx::sparse::matrix<double> derivatives,
@@ -217,64 +738,21 @@ scitbx::sparse::matrix<double> calc_jacobian(scitbx::sparse::matrix<double> deri
                                              scitbx::af::shared<double> dIh,
                                              scitbx::af::shared<double> sumgsq) {
   // derivatives is a matrix where rows are params and cols are reflections
-  int n_params = derivatives.n_rows();
-  int n_refl = derivatives.n_cols();
-
-  scitbx::sparse::matrix<double> dIhbydpiT =
-    calculate_dIh_by_dpi_transpose(dIh, sumgsq, h_index_mat, derivatives);
-  scitbx::sparse::matrix<double> Jacobian(n_refl, n_params);
-
-  for (int i = 0; i < h_index_mat.n_cols(); ++i) {
-    const col_type column = h_index_mat.col(i);
-    // first loop over h_idx to get indices for a reflection group
-    column.compact();
-    for (col_type::const_iterator it = column.begin(); it != column.end(); ++it) {
-      // it.index gives index of a refl from group i
-      int refl_idx = it.index();
-      const col_type dgidx_by_dpi = derivatives.col(refl_idx);
-      // deriv of one refl wrt all params
-      dgidx_by_dpi.compact();
-      // loop over nonzero elements of dgidx by dpi
-      for (col_type::const_iterator dgit = dgidx_by_dpi.begin();
-           dgit != dgidx_by_dpi.end();
-           ++dgit) {
-        // dgit.index indicates which params have nonzero derivs
-        Jacobian(refl_idx, dgit.index()) -= *dgit * Ih[refl_idx];
-      }
-      // now loop over nonzero elements of dIhbydpi
-      // get col corresponding to group
-      const col_type dIh_col = dIhbydpiT.col(i);
-      // now loop over nonzero params
-      for (col_type::const_iterator dIit = dIh_col.begin(); dIit != dIh_col.end();
-           ++dIit) {
-        Jacobian(refl_idx, dIit.index()) -= g[refl_idx] * *dIit;
-      }
-    }
-  }
-  Jacobian.compact();
-  return Jacobian;
+  return ScalingJacobianCalculator(h_index_mat)
+    .jacobian(derivatives,
+              Ih.const_ref(),
+              g.const_ref(),
+              dIh.const_ref(),
+              sumgsq.const_ref());
 }
 
 scitbx::sparse::matrix<double> row_multiply(scitbx::sparse::matrix<double> m,
-                                            scitbx::af::const_ref<double> v) {
+                                            scitbx::af::const_ref<double> v,
+                                            std::size_t nthreads = 1) {
   DIALS_ASSERT(m.n_rows() == v.size());
-
-  // call compact to ensure that each elt of the matrix is only defined once
-  m.compact();
-
-  scitbx::sparse::matrix<double> result(m.n_rows(), m.n_cols());
-
-  // outer loop iterate over the columns
-  for (std::size_t j = 0; j < m.n_cols(); j++) {
-    // inner loop iterate over the non-zero elements of the column
-    for (scitbx::sparse::matrix<double>::row_iterator p = m.col(j).begin();
-         p != m.col(j).end();
-         ++p) {
-      std::size_t i = p.index();
-      result(i, j) = *p * v[i];
-    }
-  }
-  return result;
+  detail::multiply_row function;
+  function.v = v;
+  return detail::transform_columns(m, function, nthreads);
 }
 
 scitbx::af::shared<scitbx::vec2<double> > calc_theta_phi(
@@ -536,35 +1014,96 @@ boost::python::list create_sph_harm_lookup_table(int lmax, int points_per_degree
 }
 
 // adaptation of cctbx/miller/merge_equivalents.h
+/**
+ * A random split of unmerged data into half datasets, as used to calculate
+ * CC1/2. The observations of each miller index must be contiguous. For each
+ * miller index with at least two observations, the observations are split at
+ * random into two halves and the weighted mean of each half is calculated.
+ *
+ * The groups of observations are found in a first pass so the outputs can be
+ * allocated up front, then ranges of groups are split on separate threads.
+ * The random numbers for each group are drawn from a Philox stream with the
+ * seed as the key and the miller index as the counter, so the split is
+ * independent of the number of threads and of the other miller indices in the
+ * data.
+ */
 class split_unmerged {
 public:
+  /**
+   * @param unmerged_indices The miller index of each observation
+   * @param unmerged_data The intensity of each observation
+   * @param unmerged_sigmas The sigma of each observation
+   * @param weighted Weight the means by the inverse variances
+   * @param seed The random seed
+   * @param nthreads The number of threads
+   */
   split_unmerged(scitbx::af::const_ref<cctbx::miller::index<> > const& unmerged_indices,
                  scitbx::af::const_ref<double> const& unmerged_data,
                  scitbx::af::const_ref<double> const& unmerged_sigmas,
                  bool weighted = true,
-                 unsigned seed = 0) {
-    if (unmerged_indices.size() == 0) return;
-    if (seed != 0) gen.seed(seed);
-    CCTBX_ASSERT(unmerged_sigmas.all_gt(0.0));
+                 unsigned seed = 0,
+                 std::size_t nthreads = 1)
+      : weighted_(weighted), seed_(seed) {
+    DIALS_ASSERT(nthreads > 0);
+    DIALS_ASSERT(unmerged_data.size() == unmerged_indices.size());
+    DIALS_ASSERT(unmerged_sigmas.size() == unmerged_indices.size());
+    if (unmerged_indices.size() > 0) {
+      CCTBX_ASSERT(unmerged_sigmas.all_gt(0.0));
+    }
+
+    // Find the groups with at least two observations
     std::size_t group_begin = 0;
-    std::size_t group_end = 1;
-    for (; group_end < unmerged_indices.size(); group_end++) {
-      if (unmerged_indices[group_end] != unmerged_indices[group_begin]) {
-        process_group(group_begin,
-                      group_end,
-                      unmerged_indices[group_begin],
-                      unmerged_data,
-                      unmerged_sigmas,
-                      weighted);
-        group_begin = group_end;
-      }
-    }
-    process_group(group_begin,
-                  group_end,
-                  unmerged_indices[group_begin],
-                  unmerged_data,
-                  unmerged_sigmas,
-                  weighted);
+    for (std::size_t i = 1; i <= unmerged_indices.size(); ++i) {
+      if (i == unmerged_indices.size()
+          || unmerged_indices[i] != unmerged_indices[group_begin]) {
+        if (i - group_begin > 1) {
+          begin_.push_back(group_begin);
+          end_.push_back(i);
+          indices_.push_back(unmerged_indices[group_begin]);
+        }
+        group_begin = i;
+      }
+    }
+
+    // Split the groups in ranges with a similar number of observations
+    std::size_t n_groups = begin_.size();
+    data_1.resize(n_groups);
+    data_2.resize(n_groups);
+    sigma_1.resize(n_groups);
+    sigma_2.resize(n_groups);
+    n_1.resize(n_groups);
+    n_2.resize(n_groups);
+    std::size_t njobs = std::max<std::size_t>(1, std::min(nthreads, n_groups));
+    std::vector<split_job> jobs(njobs);
+    std::size_t first = 0;
+    std::size_t n_obs = n_groups > 0 ? end_.back() - begin_.front() : 0;
+    for (std::size_t j = 0; j < njobs; ++j) {
+      std::size_t last = first;
+      std::size_t target = ((j + 1) * n_obs) / njobs;
+      while (last < n_groups && (j + 1 == njobs || end_[last] - begin_[0] <= target)) {
+        ++last;
+      }
+      jobs[j].splitter = this;
+      jobs[j].data = unmerged_data;
+      jobs[j].sigmas = unmerged_sigmas;
+      jobs[j].first = first;
+      jobs[j].last = last;
+      first = last;
+    }
+    if (njobs == 1) {
+      jobs[0]();
+    } else {
+      dials::util::ThreadPool pool(njobs);
+      for (std::size_t j = 0; j < njobs; ++j) {
+        pool.post(split_runner(&jobs[j]));
+      }
+      pool.wait();
+    }
+    for (std::size_t j = 0; j < njobs; ++j) {
+      if (!jobs[j].error.empty()) {
+        throw DIALS_ERROR(jobs[j].error);
+      }
+    }
   }
 
   scitbx::af::shared<double> data1() const {
@@ -591,11 +1130,103 @@ public:
     return n_2;
   }
 
+  /**
+   * @returns The miller indices with at least two observations
+   */
   scitbx::af::shared<cctbx::miller::index<> > indices() const {
     return indices_;
   }
 
-protected:
+private:
+  /**
+   * Splits a range of groups
+   */
+  struct split_job {
+    split_unmerged* splitter;
+    scitbx::af::const_ref<double> data;
+    scitbx::af::const_ref<double> sigmas;
+    std::size_t first;
+    std::size_t last;
+    std::string error;
+
+    split_job() : splitter(0), first(0), last(0) {}
+
+    void operator()() {
+      try {
+        std::vector<double> temp, temp_w;
+        for (std::size_t g = first; g < last; ++g) {
+          splitter->process_group(g, data, sigmas, temp, temp_w);
+        }
+      } catch (const std::exception& e) {
+        error = e.what();
+      } catch (...) {
+        error = "Unknown error in split_unmerged";
+      }
+    }
+  };
+
+  struct split_runner {
+    split_job* job;
+    split_runner(split_job* job_) : job(job_) {}
+    void operator()() const {
+      (*job)();
+    }
+  };
+
+  void process_group(std::size_t group,
+                     scitbx::af::const_ref<double> const& unmerged_data,
+                     scitbx::af::const_ref<double> const& unmerged_sigmas,
+                     std::vector<double>& temp,
+                     std::vector<double>& temp_w) {
+    const std::size_t group_begin = begin_[group];
+    const std::size_t n = end_[group] - group_begin;
+    const cctbx::miller::index<>& h = indices_[group];
+    dials::util::Philox4x32 gen(
+      seed_, 0, (std::uint32_t)h[0], (std::uint32_t)h[1], (std::uint32_t)h[2]);
+
+    // temp is a copy of the array of intensites of each observation
+    temp.resize(n);
+    temp_w.resize(n);
+    for (std::size_t i = 0; i < n; i++) {
+      temp[i] = unmerged_data[group_begin + i];
+      if (weighted_) {
+        temp_w[i] =
+          1.0 / (unmerged_sigmas[group_begin + i] * unmerged_sigmas[group_begin + i]);
+      } else {
+        temp_w[i] = 1.0;
+      }
+    }
+    std::size_t nsum = n / 2;
+    // actually I (Kay) don't think it matters, and we
+    // don't do it in picknofm, but it's like that in the Science paper:
+    if (2 * nsum != n && gen.random_double() < 0.5) nsum += 1;
+    double i_obs[2] = {0.0, 0.0};
+    double sum_w[2] = {0.0, 0.0};
+    for (std::size_t i = 0; i < nsum; i++) {
+      // choose a random index ind from 0 to n-i-1
+      const std::size_t ind =
+        i + std::min(n - i - 1, std::size_t(gen.random_double() * (n - i)));
+      i_obs[0] += temp[ind] * temp_w[ind];
+      sum_w[0] += temp_w[ind];
+      temp[ind] = temp[i];
+      temp_w[ind] = temp_w[i];
+    }
+    for (std::size_t i = nsum; i < n; i++) {
+      i_obs[1] += temp[i] * temp_w[i];
+      sum_w[1] += temp_w[i];
+    }
+    data_1[group] = i_obs[0] / sum_w[0];
+    data_2[group] = i_obs[1] / sum_w[1];
+    sigma_1[group] = std::sqrt(1.0 / sum_w[0]);
+    sigma_2[group] = std::sqrt(1.0 / sum_w[1]);
+    n_1[group] = nsum;
+    n_2[group] = n - nsum;
+  }
+
+  bool weighted_;
+  unsigned seed_;
+  std::vector<std::size_t> begin_;
+  std::vector<std::size_t> end_;
   scitbx::af::shared<double> data_1;
   scitbx::af::shared<double> data_2;
   scitbx::af::shared<double> sigma_1;
@@ -603,61 +1234,6 @@ protected:
   scitbx::af::shared<int> n_1;
   scitbx::af::shared<int> n_2;
   scitbx::af::shared<cctbx::miller::index<> > indices_;
-  void process_group(std::size_t group_begin,
-                     std::size_t group_end,
-                     cctbx::miller::index<> const& current_index,
-                     scitbx::af::const_ref<double> const& unmerged_data,
-                     scitbx::af::const_ref<double> const& unmerged_sigmas,
-                     bool weighted) {
-    const std::size_t n = group_end - group_begin;
-    if (n < 2) {
-      return;
-    } else {
-      // temp is a copy of the array of intensites of each observation
-      std::vector<double> temp(n), temp_w(n);
-      for (std::size_t i = 0; i < n; i++) {
-        temp[i] = unmerged_data[group_begin + i];
-        if (weighted) {
-          temp_w[i] =
-            1.0 / (unmerged_sigmas[group_begin + i] * unmerged_sigmas[group_begin + i]);
-        } else {
-          temp_w[i] = 1.0;
-        }
-      }
-      std::size_t nsum = n / 2;
-      // actually I (Kay) don't think it matters, and we
-      // don't do it in picknofm, but it's like that in the Science paper:
-      if (2 * nsum != n && gen.random_double() < 0.5) nsum += 1;
-      std::vector<double> i_obs(2, 0.), sum_w(2, 0.), sum_wx2(2, 0.), v2(2, 0);
-      std::vector<int> n_obs(2, 0);
-      n_obs[0] = nsum;
-      n_obs[1] = n - nsum;
-      for (std::size_t i = 0; i < nsum; i++) {
-        // choose a random index ind from 0 to n-i-1
-        const std::size_t ind =
-          i + std::min(n - i - 1, std::size_t(gen.random_double() * (n - i)));
-        i_obs[0] += temp[ind] * temp_w[ind];
-        sum_w[0] += temp_w[ind];
-        temp[ind] = temp[i];
-        temp_w[ind] = temp_w[i];
-      }
-      for (std::size_t i = nsum; i < n; i++) {
-        i_obs[1] += temp[i] * temp_w[i];
-        sum_w[1] += temp_w[i];
-      }
-      float mu_0 = i_obs[0] / sum_w[0];
-      float mu_1 = i_obs[1] / sum_w[1];
-      data_1.push_back(mu_0);
-      data_2.push_back(mu_1);
-      sigma_1.push_back(std::sqrt(1.0 / sum_w[0]));
-      sigma_2.push_back(std::sqrt(1.0 / sum_w[1]));
-      n_1.push_back(n_obs[0]);
-      n_2.push_back(n_obs[1]);
-      indices_.push_back(current_index);
-    }
-  }
-
-  scitbx::random::mersenne_twister gen;
 };
 }  // namespace dials_scaling
 
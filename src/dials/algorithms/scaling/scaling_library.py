@@ -382,7 +382,7 @@ class MergedHalfDatasets:
 class ExtendedDatasetStatistics(iotbx.merging_statistics.dataset_statistics):
     """A class to extend iotbx merging statistics."""
 
-    def __init__(self, *args, additional_stats=False, seed=0, **kwargs):
+    def __init__(self, *args, additional_stats=False, seed=0, nproc=1, **kwargs):
         super().__init__(*args, **kwargs)
         self.r_split = None
         self.r_split_binned = None
@@ -404,6 +404,7 @@ def __init__(self, *args, additional_stats=False, seed=0, **kwargs):
             unmerged_data=i_obs.data(),
             unmerged_sigmas=i_obs.sigmas(),
             seed=seed,
+            nthreads=nproc,
         )
         indices = split.indices()
         m1 = miller.array(
@@ -545,6 +546,7 @@ def merging_stats_from_scaled_array(
     anomalous=True,
     additional_stats=False,
     cc_one_half_significance_level=0.01,
+    nproc=1,
 ):
     """Calculate the normal and anomalous merging statistics."""
 
@@ -563,6 +565,7 @@ def merging_stats_from_scaled_array(
             use_internal_variance=use_internal_variance,
             cc_one_half_significance_level=cc_one_half_significance_level,
             additional_stats=additional_stats,
+            nproc=nproc,
         )
     except (RuntimeError, Sorry) as e:
         raise DialsMergingStatisticsError(
@@ -592,6 +595,7 @@ def merging_stats_from_scaled_array(
                     eliminate_sys_absent=False,
                     use_internal_variance=use_internal_variance,
                     additional_stats=additional_stats,
+                    nproc=nproc,
                 )
             except (RuntimeError, Sorry) as e:
                 logger.warning(
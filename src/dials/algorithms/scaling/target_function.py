@@ -14,7 +14,7 @@
 
 from dials.algorithms.scaling.scaling_restraints import ScalingRestraintsCalculator
 from dials.array_family import flex
-from dials_scaling_ext import calc_dIh_by_dpi, calc_jacobian, row_multiply
+from dials_scaling_ext import row_multiply
 
 
 class ScalingTarget:
@@ -66,36 +66,13 @@ def calculate_residuals(Ih_table):
     @staticmethod
     def calculate_gradients(Ih_table):
         """Return a gradient vector on length len(self.apm.x)."""
-        gsq = np.square(Ih_table.inverse_scale_factors) * Ih_table.weights
-        sumgsq = flumpy.from_numpy(Ih_table.sum_in_groups(gsq))
-        prefactor = (
-            -2.0
-            * Ih_table.weights
-            * (
-                Ih_table.intensities
-                - (Ih_table.Ih_values * Ih_table.inverse_scale_factors)
-            )
-        )
-        dIh = flumpy.from_numpy(
-            (
-                Ih_table.intensities
-                - (Ih_table.Ih_values * 2.0 * Ih_table.inverse_scale_factors)
-            )
-            * Ih_table.weights
-        )
-        dIh_by_dpi = calc_dIh_by_dpi(
-            dIh, sumgsq, Ih_table.h_index_matrix, Ih_table.derivatives.transpose()
-        )
-        term_1 = (
-            flumpy.from_numpy(prefactor * Ih_table.Ih_values) * Ih_table.derivatives
-        )
-        term_2 = (
-            flumpy.from_numpy(
-                Ih_table.sum_in_groups(prefactor * Ih_table.inverse_scale_factors)
-            )
-            * dIh_by_dpi
+        gradient = Ih_table.core.gradients(
+            flumpy.from_numpy(Ih_table.intensities),
+            flumpy.from_numpy(Ih_table.inverse_scale_factors),
+            flumpy.from_numpy(Ih_table.Ih_values),
+            flumpy.from_numpy(Ih_table.weights),
+            Ih_table.derivatives,
         )
-        gradient = term_1 + term_2
         return gradient
 
     @staticmethod
@@ -107,9 +84,8 @@ def calculate_jacobian(Ih_table):
             Ih_table.intensities
             - (Ih_table.Ih_values * 2.0 * Ih_table.inverse_scale_factors)
         ) * Ih_table.weights
-        jacobian = calc_jacobian(
+        jacobian = Ih_table.jacobian_calculator.jacobian(
             Ih_table.derivatives.transpose(),
-            Ih_table.h_index_matrix,
             flumpy.from_numpy(Ih_table.Ih_values),
             flumpy.from_numpy(Ih_table.inverse_scale_factors),
             flumpy.from_numpy(dIh),
@@ -188,6 +164,8 @@ def calculate_gradients(Ih_table):
     def calculate_jacobian(Ih_table):
         """Calculate the jacobian matrix, size Ih_table.size by len(self.apm.x)."""
         jacobian = row_multiply(
-            Ih_table.derivatives, flumpy.from_numpy(-1.0 * Ih_table.Ih_values)
+            Ih_table.derivatives,
+            flumpy.from_numpy(-1.0 * Ih_table.Ih_values),
+            nthreads=Ih_table.nthreads,
         )
         return jacobian
@@ -22,14 +22,18 @@ namespace dials_scaling { namespace boost_python {
     void (*extract_shoeboxes1)(dials::af::reflection_table &,
                                dxtbx::model::Experiment &,
                                dxtbx::ImageSequence &,
-                               bool) = &tof_extract_shoeboxes_to_reflection_table;
+                               bool,
+                               std::size_t) =
+      &tof_extract_shoeboxes_to_reflection_table;
     void (*extract_shoeboxes2)(dials::af::reflection_table &,
                                dxtbx::model::Experiment &,
                                dxtbx::ImageSequence &,
                                dxtbx::ImageSequence &,
                                dxtbx::ImageSequence &,
                                TOFCorrectionsData &,
-                               bool) = &tof_extract_shoeboxes_to_reflection_table;
+                               bool,
+                               std::size_t) =
+      &tof_extract_shoeboxes_to_reflection_table;
     void (*extract_shoeboxes3)(dials::af::reflection_table &,
                                dxtbx::model::Experiment &,
                                dxtbx::ImageSequence &,
@@ -38,11 +42,39 @@ namespace dials_scaling { namespace boost_python {
                                double,
                                double,
                                double,
-                               bool) = &tof_extract_shoeboxes_to_reflection_table;
+                               bool,
+                               std::size_t) =
+      &tof_extract_shoeboxes_to_reflection_table;
 
-    def("tof_extract_shoeboxes_to_reflection_table", extract_shoeboxes1);
-    def("tof_extract_shoeboxes_to_reflection_table", extract_shoeboxes2);
-    def("tof_extract_shoeboxes_to_reflection_table", extract_shoeboxes3);
+    def("tof_extract_shoeboxes_to_reflection_table",
+        extract_shoeboxes1,
+        (arg("reflection_table"),
+         arg("experiment"),
+         arg("data"),
+         arg("apply_lorentz_correction"),
+         arg("nthreads") = 1));
+    def("tof_extract_shoeboxes_to_reflection_table",
+        extract_shoeboxes2,
+        (arg("reflection_table"),
+         arg("experiment"),
+         arg("data"),
+         arg("incident_data"),
+         arg("empty_data"),
+         arg("corrections_data"),
+         arg("apply_lorentz_correction"),
+         arg("nthreads") = 1));
+    def("tof_extract_shoeboxes_to_reflection_table",
+        extract_shoeboxes3,
+        (arg("reflection_table"),
+         arg("experiment"),
+         arg("data"),
+         arg("incident_data"),
+         arg("empty_data"),
+         arg("sample_proton_charge"),
+         arg("incident_proton_charge"),
+         arg("empty_proton_charge"),
+         arg("apply_lorentz_correction"),
+         arg("nthreads") = 1));
   }
 
 }}  // namespace dials_scaling::boost_python
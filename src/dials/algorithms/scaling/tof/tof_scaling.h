@@ -2,6 +2,12 @@
 #ifndef DIALS_ALGORITHMS_SCALING_TOF_SCALING_H
 #define DIALS_ALGORITHMS_SCALING_TOF_SCALING_H
 
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
 #include <dxtbx/imageset.h>
 #include <dxtbx/format/image.h>
 #include <dxtbx/array_family/flex_table.h>
@@ -11,7 +17,10 @@
 #include <dxtbx/model/scan.h>
 #include <dxtbx/model/goniometer.h>
 #include <dials/array_family/scitbx_shared_and_versa.h>
-#include <dials/algorithms/integration/processor.h>
+#include <dials/array_family/reflection_table.h>
+#include <dials/model/data/mask_code.h>
+#include <dials/util/thread_pool.h>
+#include <dials/error.h>
 #include <scitbx/vec2.h>
 #include <scitbx/vec3.h>
 #include <scitbx/constants.h>
@@ -19,7 +28,6 @@
 namespace dials_scaling {
 
 using dials::algorithms::Shoebox;
-using dials::algorithms::ShoeboxProcessor;
 using dxtbx::ImageSequence;
 using dxtbx::af::flex_table;
 using dxtbx::model::Detector;
@@ -196,10 +204,16 @@ const double pc[8][19] = {{-6.4910e-07,
                            0.0000e+00,
                            0.0000e+00}};
 
-double tof_pixel_spherical_absorption_correction(double pixel_data,
-                                                 double muR,
-                                                 double two_theta,
-                                                 int two_theta_idx) {
+/*
+ * The spherical absorption correction for a pixel, given the squared sine of
+ * half its two theta angle and the squared sines at the grid points either
+ * side of it, so that these can be computed ahead of time
+ */
+double tof_spherical_absorption_correction(double muR,
+                                           double sin_sq_half_two_theta,
+                                           int two_theta_idx,
+                                           double sin_theta_1,
+                                           double sin_theta_2) {
   double ln_t1 = 0;
   double ln_t2 = 0;
   for (std::size_t k = 0; k < 8; ++k) {
@@ -208,14 +222,22 @@ double tof_pixel_spherical_absorption_correction(double pixel_data,
   }
   const double t1 = exp(ln_t1);
   const double t2 = exp(ln_t2);
-  const double sin_theta_1 = pow(sin(deg_as_rad(two_theta_idx * 5.0)), 2);
-  const double sin_theta_2 = pow(sin(deg_as_rad((two_theta_idx + 1) * 5.0)), 2);
   const double l1 = (t1 - t2) / (sin_theta_1 - sin_theta_2);
   const double l0 = t1 - l1 * sin_theta_1;
-  const double correction = 1 / (l0 + l1 * pow(sin(two_theta * .5), 2));
+  const double correction = 1 / (l0 + l1 * sin_sq_half_two_theta);
   return correction;
 }
 
+double tof_pixel_spherical_absorption_correction(double pixel_data,
+                                                 double muR,
+                                                 double two_theta,
+                                                 int two_theta_idx) {
+  const double sin_theta_1 = pow(sin(deg_as_rad(two_theta_idx * 5.0)), 2);
+  const double sin_theta_2 = pow(sin(deg_as_rad((two_theta_idx + 1) * 5.0)), 2);
+  return tof_spherical_absorption_correction(
+    muR, pow(sin(two_theta * .5), 2), two_theta_idx, sin_theta_1, sin_theta_2);
+}
+
 /*
  * Holds constants required for correcting time-of-flight data
  */
@@ -268,281 +290,537 @@ struct TOFCorrectionsData {
 };
 
 /*
- * Extracts shoeboxes to reflection_table with each pixel corrected
- * optionally for the Lorentz correction
+ * Extracts the shoeboxes of a time-of-flight experiment and corrects each
+ * pixel as it is extracted. The flight path and scattering angle of every
+ * pixel are computed once for each panel, the sample, incident and empty runs
+ * are read together in a single pass over the frames, and the shoeboxes
+ * recorded on each frame are corrected on separate threads.
  */
-void tof_extract_shoeboxes_to_reflection_table(
-  dials::af::reflection_table &reflection_table,
-  Experiment &experiment,
-  ImageSequence &data,
-  bool apply_lorentz_correction) {
-  Detector detector = *experiment.get_detector();
-  Scan scan = *experiment.get_scan();
-
-  // Required beam params
-  std::shared_ptr<dxtbx::model::BeamBase> beam_ptr = experiment.get_beam();
-  std::shared_ptr<PolychromaticBeam> beam =
-    std::dynamic_pointer_cast<PolychromaticBeam>(beam_ptr);
-  DIALS_ASSERT(beam != nullptr);
-  vec3<double> unit_s0 = beam->get_unit_s0();
-  double sample_to_source_distance = beam->get_sample_to_source_distance();
-
-  // Required scan params
-  scitbx::af::shared<double> img_tof = scan.get_property<double>("time_of_flight");
-
-  // Required detector params
-  int n_panels = detector.size();
-  int num_images = data.size();
-  vec2<std::size_t> image_size = detector[0].get_image_size();
-  DIALS_ASSERT(num_images == img_tof.size());
-
-  // Processor to get the image data into shoeboxes
-  ShoeboxProcessor shoebox_processor(reflection_table, n_panels, 0, num_images, false);
-
-  // Get shoeboxes for image data
-  for (std::size_t img_num = 0; img_num < num_images; ++img_num) {
-    dxtbx::format::Image<double> img = data.get_corrected_data(img_num);
-    dxtbx::format::Image<bool> mask = data.get_mask(img_num);
-
-    dials::af::shared<scitbx::af::versa<double, scitbx::af::c_grid<2> > > output_data(
-      n_panels);
-    dials::af::shared<scitbx::af::versa<bool, scitbx::af::c_grid<2> > > output_mask(
-      n_panels);
-
-    for (std::size_t i = 0; i < output_data.size(); ++i) {
-      output_data[i] = img.tile(i).data();
-      output_mask[i] = mask.tile(i).data();
+class TOFShoeboxCorrector {
+public:
+  typedef Shoebox<>::float_type float_type;
+
+  /**
+   * @param experiment The experiment
+   * @param apply_lorentz_correction Apply the Lorentz correction
+   * @param nthreads The number of threads
+   */
+  TOFShoeboxCorrector(Experiment &experiment,
+                      bool apply_lorentz_correction,
+                      std::size_t nthreads)
+      : lorentz_(apply_lorentz_correction),
+        normalise_(false),
+        absorption_(false),
+        nthreads_(nthreads) {
+    DIALS_ASSERT(nthreads > 0);
+    Detector detector = *experiment.get_detector();
+    Scan scan = *experiment.get_scan();
+
+    // Required beam params
+    std::shared_ptr<dxtbx::model::BeamBase> beam_ptr = experiment.get_beam();
+    std::shared_ptr<PolychromaticBeam> beam =
+      std::dynamic_pointer_cast<PolychromaticBeam>(beam_ptr);
+    DIALS_ASSERT(beam != nullptr);
+    vec3<double> unit_s0 = beam->get_unit_s0();
+    double sample_to_source_distance = beam->get_sample_to_source_distance();
+
+    // Planck's constant times the time of flight of each frame
+    scitbx::af::shared<double> img_tof = scan.get_property<double>("time_of_flight");
+    h_tof_.resize(img_tof.size());
+    for (std::size_t i = 0; i < img_tof.size(); ++i) {
+      h_tof_[i] = Planck * (img_tof[i] * std::pow(10, -6));  // (s)
     }
-    shoebox_processor.next_data_only(
-      dials::model::Image<double>(output_data.const_ref(), output_mask.const_ref()));
-  }
 
-  // Now correct each pixel for each shoebox
-  dials::af::shared<Shoebox<> > shoeboxes = reflection_table["shoebox"];
-  dials::af::const_ref<int6> bboxes = reflection_table["bbox"];
+    // The squared sines at the two theta grid points of the absorption table
+    for (std::size_t i = 0; i < 20; ++i) {
+      grid_sin_sq_[i] = pow(sin(deg_as_rad(i * 5.0)), 2);
+    }
 
-  for (std::size_t i = 0; i < reflection_table.size(); ++i) {
-    Shoebox<> shoebox = shoeboxes[i];
-    int6 bbox = bboxes[i];
-    int panel = shoebox.panel;
+    // The geometry of each pixel, at the same pixel coordinates as the
+    // shoebox pixels are corrected at
+    geometry_.resize(detector.size());
+    for (std::size_t p = 0; p < detector.size(); ++p) {
+      vec2<std::size_t> image_size = detector[p].get_image_size();
+      panel_geometry &g = geometry_[p];
+      g.xsize = image_size[0];
+      g.ysize = image_size[1];
+      std::size_t n = g.xsize * g.ysize;
+      g.flight_path.resize(n);
+      g.sin_sq.resize(n);
+      g.two_theta_idx.resize(n);
+      for (std::size_t y = 0, k = 0; y < g.ysize; ++y) {
+        for (std::size_t x = 0; x < g.xsize; ++x, ++k) {
+          vec2<double> xy(x, y);
+          double distance =
+            detector[p].get_pixel_lab_coord(xy).length() + sample_to_source_distance;
+          distance *= std::pow(10, -3);  // (m)
+          double two_theta = detector[p].get_two_theta_at_pixel(unit_s0, xy);
+          double two_theta_deg = two_theta * (180 / pi);
+          g.flight_path[k] = m_n * distance;
+          g.sin_sq[k] = std::pow(sin(two_theta * .5), 2);
+          g.two_theta_idx[k] = static_cast<int>(two_theta_deg / 10);
+        }
+      }
+    }
+  }
 
-    // Shoebox data are ordered (z, y, x)
-    for (std::size_t z = 0; z < shoebox.zsize(); ++z) {
-      int frame_z = bbox[4] + z;
-      double tof = img_tof[frame_z] * std::pow(10, -6);  // (s)
+  /**
+   * Normalise the sample and incident runs by proton charge and subtract the
+   * empty run from both before dividing the sample by the incident run
+   */
+  void set_normalisation(double sample_proton_charge,
+                         double incident_proton_charge,
+                         double empty_proton_charge) {
+    normalise_ = true;
+    sample_proton_charge_ = sample_proton_charge;
+    incident_proton_charge_ = incident_proton_charge;
+    empty_proton_charge_ = empty_proton_charge;
+  }
 
-      for (std::size_t y = 0; y < shoebox.ysize(); ++y) {
-        int panel_y = bbox[2] + y;
-        if (panel_y > image_size[1] || panel_y < 0) {
-          continue;
-        }
-        for (std::size_t x = 0; x < shoebox.xsize(); ++x) {
-          int panel_x = bbox[0] + x;
-          if (panel_x > image_size[0] || panel_x < 0) {
-            continue;
-          }
+  /**
+   * Normalise as in set_normalisation and apply a spherical absorption
+   * correction to the sample and incident runs
+   */
+  void set_absorption(const TOFCorrectionsData &corrections_data) {
+    set_normalisation(corrections_data.sample_proton_charge,
+                      corrections_data.incident_proton_charge,
+                      corrections_data.empty_proton_charge);
+    absorption_ = true;
+    sample_muR_ = vec3<double>(corrections_data.sample_linear_scattering_c,
+                               corrections_data.sample_linear_absorption_c / 1.8,
+                               corrections_data.sample_radius);
+    incident_muR_ = vec3<double>(corrections_data.incident_linear_scattering_c,
+                                 corrections_data.incident_linear_absorption_c / 1.8,
+                                 corrections_data.incident_radius);
+  }
 
-          double pixel_data = shoebox.data(z, y, x);
+  /**
+   * Extract and correct the shoeboxes from the sample run
+   */
+  void extract(dials::af::reflection_table &reflection_table, ImageSequence &data) {
+    DIALS_ASSERT(!normalise_);
+    extract(reflection_table, data, NULL, NULL);
+  }
 
-          scitbx::vec3<double> s1 =
-            detector[panel].get_pixel_lab_coord(scitbx::vec2<double>(panel_x, panel_y));
-          double distance = s1.length() + sample_to_source_distance;
-          distance *= std::pow(10, -3);  // (m)
-          double wl = ((Planck * tof) / (m_n * (distance))) * std::pow(10, 10);
-
-          // Lorentz correction
-          if (apply_lorentz_correction) {
-            double two_theta = detector[panel].get_two_theta_at_pixel(
-              unit_s0, scitbx::vec2<double>(panel_x, panel_y));
-            double two_theta_deg = two_theta * (180 / pi);
-            double sin_two_theta_sq = std::pow(sin(two_theta * .5), 2);
-            double lorentz_correction = sin_two_theta_sq / std::pow(wl, 4);
-            pixel_data *= lorentz_correction;
-          }
-
-          shoebox.data(z, y, x) = double(pixel_data);
+  /**
+   * Extract and correct the shoeboxes from the sample run w.r.t the incident
+   * and empty runs
+   */
+  void extract(dials::af::reflection_table &reflection_table,
+               ImageSequence &data,
+               ImageSequence &incident_data,
+               ImageSequence &empty_data) {
+    DIALS_ASSERT(normalise_);
+    extract(reflection_table, data, &incident_data, &empty_data);
+  }
+
+private:
+  /**
+   * The per-pixel quantities of a panel which do not depend on the frame
+   */
+  struct panel_geometry {
+    std::size_t xsize;
+    std::size_t ysize;
+    std::vector<double> flight_path;  // m_n times the flight path (m)
+    std::vector<double> sin_sq;       // sin^2(two_theta / 2)
+    std::vector<int> two_theta_idx;   // two theta grid point (10 degree steps)
+  };
+
+  /**
+   * The images of each panel on a frame
+   */
+  struct frame_data {
+    int index;
+    double h_tof;
+    std::vector<scitbx::af::versa<double, scitbx::af::c_grid<2> > > sample;
+    std::vector<scitbx::af::versa<double, scitbx::af::c_grid<2> > > incident;
+    std::vector<scitbx::af::versa<double, scitbx::af::c_grid<2> > > empty;
+    std::vector<scitbx::af::versa<bool, scitbx::af::c_grid<2> > > mask;
+  };
+
+  /**
+   * The shoeboxes on a frame corrected by one thread
+   */
+  struct correction_job {
+    const TOFShoeboxCorrector *corrector;
+    const frame_data *frame;
+    Shoebox<> *shoeboxes;
+    const std::size_t *first;
+    const std::size_t *last;
+    std::string error;
+
+    void operator()() {
+      try {
+        for (const std::size_t *i = first; i != last; ++i) {
+          corrector->correct(shoeboxes[*i], *frame);
         }
+      } catch (const std::exception &e) {
+        error = e.what();
+      } catch (...) {
+        error = "Unknown error in TOF shoebox correction";
       }
     }
-  }
-}
+  };
 
-/*
- * Extracts shoeboxes to reflection_table with each pixel corrected w.r.t
- * an incident run, an empty run, and optionally the Lorentz correction
- */
-void tof_extract_shoeboxes_to_reflection_table(
-  dials::af::reflection_table &reflection_table,
-  Experiment &experiment,
-  ImageSequence &data,
-  ImageSequence &incident_data,
-  ImageSequence &empty_data,
-  double sample_proton_charge,
-  double incident_proton_charge,
-  double empty_proton_charge,
-  bool apply_lorentz_correction) {
-  Detector detector = *experiment.get_detector();
-  Scan scan = *experiment.get_scan();
-
-  // Required beam params
-  std::shared_ptr<dxtbx::model::BeamBase> beam_ptr = experiment.get_beam();
-  std::shared_ptr<PolychromaticBeam> beam =
-    std::dynamic_pointer_cast<PolychromaticBeam>(beam_ptr);
-  DIALS_ASSERT(beam != nullptr);
-  vec3<double> unit_s0 = beam->get_unit_s0();
-  double sample_to_source_distance = beam->get_sample_to_source_distance();
-
-  // Required scan params
-  scitbx::af::shared<double> img_tof = scan.get_property<double>("time_of_flight");
-
-  // Required detector params
-  int n_panels = detector.size();
-  int num_images = data.size();
-  vec2<std::size_t> image_size = detector[0].get_image_size();
-  DIALS_ASSERT(num_images == img_tof.size());
-
-  // Copy reflections for incident and empty runs
-  boost::python::dict d;
-  dials::af::reflection_table i_reflection_table =
-    dxtbx::af::flex_table_suite::deepcopy(reflection_table, d);
-  dials::af::reflection_table e_reflection_table =
-    dxtbx::af::flex_table_suite::deepcopy(reflection_table, d);
-
-  // Processors to get the image data into shoeboxes
-  ShoeboxProcessor shoebox_processor(reflection_table, n_panels, 0, num_images, false);
-
-  ShoeboxProcessor incident_shoebox_processor(
-    i_reflection_table, n_panels, 0, num_images, false);
-
-  ShoeboxProcessor empty_shoebox_processor(
-    e_reflection_table, n_panels, 0, num_images, false);
-
-  // Get shoeboxes for image data
-  for (std::size_t img_num = 0; img_num < num_images; ++img_num) {
-    dxtbx::format::Image<double> img = data.get_corrected_data(img_num);
-    dxtbx::format::Image<bool> mask = data.get_mask(img_num);
-
-    dials::af::shared<scitbx::af::versa<double, scitbx::af::c_grid<2> > > output_data(
-      n_panels);
-    dials::af::shared<scitbx::af::versa<bool, scitbx::af::c_grid<2> > > output_mask(
-      n_panels);
-
-    for (std::size_t i = 0; i < output_data.size(); ++i) {
-      output_data[i] = img.tile(i).data();
-      output_mask[i] = mask.tile(i).data();
+  struct job_runner {
+    correction_job *job;
+    job_runner(correction_job *job_) : job(job_) {}
+    void operator()() const {
+      (*job)();
     }
-    shoebox_processor.next_data_only(
-      dials::model::Image<double>(output_data.const_ref(), output_mask.const_ref()));
+  };
+
+  /**
+   * @returns muR = (a + b * wavelength) * radius for the terms (a, b, radius)
+   */
+  static double absorption_muR(const vec3<double> &terms, double wl) {
+    return (terms[0] + terms[1] * wl) * terms[2];
   }
 
-  // Get shoeboxes for incident data
-  for (std::size_t img_num = 0; img_num < num_images; ++img_num) {
-    dxtbx::format::Image<double> img = incident_data.get_corrected_data(img_num);
-    dxtbx::format::Image<bool> mask = incident_data.get_mask(img_num);
+  static double wavelength(double h_tof, double flight_path) {
+    return (h_tof / flight_path) * std::pow(10, 10);
+  }
 
-    dials::af::shared<scitbx::af::versa<double, scitbx::af::c_grid<2> > > output_data(
-      n_panels);
-    dials::af::shared<scitbx::af::versa<bool, scitbx::af::c_grid<2> > > output_mask(
-      n_panels);
+  static double lorentz_correction(double sin_sq, double wl) {
+    return sin_sq / std::pow(wl, 4);
+  }
 
-    for (std::size_t i = 0; i < output_data.size(); ++i) {
-      output_data[i] = img.tile(i).data();
-      output_mask[i] = mask.tile(i).data();
+  void extract(dials::af::reflection_table &reflection_table,
+               ImageSequence &data,
+               ImageSequence *incident_data,
+               ImageSequence *empty_data) const {
+    std::size_t n_panels = geometry_.size();
+    std::size_t num_images = data.size();
+    DIALS_ASSERT(num_images == h_tof_.size());
+    if (normalise_) {
+      DIALS_ASSERT(incident_data->size() == num_images);
+      DIALS_ASSERT(empty_data->size() == num_images);
+    }
+    DIALS_ASSERT(reflection_table.is_consistent());
+    DIALS_ASSERT(reflection_table.contains("shoebox"));
+    DIALS_ASSERT(reflection_table.size() > 0);
+    dials::af::ref<Shoebox<> > shoeboxes = reflection_table["shoebox"];
+
+    // Sort the reflections by the frames they are recorded on
+    std::vector<std::size_t> offset(num_images + 1, 0);
+    for (std::size_t i = 0; i < shoeboxes.size(); ++i) {
+      const Shoebox<> &sbox = shoeboxes[i];
+      DIALS_ASSERT(sbox.flat == false);
+      DIALS_ASSERT(sbox.is_allocated() == false);
+      DIALS_ASSERT(sbox.panel < n_panels);
+      DIALS_ASSERT(sbox.bbox[1] > sbox.bbox[0]);
+      DIALS_ASSERT(sbox.bbox[3] > sbox.bbox[2]);
+      DIALS_ASSERT(sbox.bbox[5] > sbox.bbox[4]);
+      DIALS_ASSERT(sbox.bbox[4] >= 0 && sbox.bbox[5] <= (int)num_images);
+      for (int z = sbox.bbox[4]; z < sbox.bbox[5]; ++z) {
+        offset[z + 1]++;
+      }
+    }
+    for (std::size_t f = 0; f < num_images; ++f) {
+      offset[f + 1] += offset[f];
+    }
+    std::vector<std::size_t> indices(offset.back());
+    std::vector<std::size_t> position(offset.begin(), offset.end() - 1);
+    for (std::size_t i = 0; i < shoeboxes.size(); ++i) {
+      for (int z = shoeboxes[i].bbox[4]; z < shoeboxes[i].bbox[5]; ++z) {
+        indices[position[z]++] = i;
+      }
     }
-    incident_shoebox_processor.next_data_only(
-      dials::model::Image<double>(output_data.const_ref(), output_mask.const_ref()));
-  }
 
-  // Get shoeboxes for empty data
-  for (std::size_t img_num = 0; img_num < num_images; ++img_num) {
-    dxtbx::format::Image<double> img = empty_data.get_corrected_data(img_num);
-    dxtbx::format::Image<bool> mask = empty_data.get_mask(img_num);
+    // Read the runs one frame at a time and correct the shoeboxes on each
+    std::unique_ptr<dials::util::ThreadPool> pool;
+    if (nthreads_ > 1) {
+      pool.reset(new dials::util::ThreadPool(nthreads_));
+    }
+    frame_data frame;
+    std::vector<correction_job> jobs(nthreads_);
+    for (std::size_t f = 0; f < num_images; ++f) {
+      std::size_t first = offset[f];
+      std::size_t last = offset[f + 1];
+      if (first == last) {
+        continue;
+      }
+      frame.index = f;
+      frame.h_tof = h_tof_[f];
+      read_frame(data, f, frame.sample, &frame.mask);
+      if (normalise_) {
+        read_frame(*incident_data, f, frame.incident, NULL);
+        read_frame(*empty_data, f, frame.empty, NULL);
+      }
 
-    dials::af::shared<scitbx::af::versa<double, scitbx::af::c_grid<2> > > output_data(
-      n_panels);
-    dials::af::shared<scitbx::af::versa<bool, scitbx::af::c_grid<2> > > output_mask(
-      n_panels);
+      std::size_t njobs = std::min(nthreads_, last - first);
+      for (std::size_t j = 0; j < njobs; ++j) {
+        jobs[j].corrector = this;
+        jobs[j].frame = &frame;
+        jobs[j].shoeboxes = shoeboxes.begin();
+        jobs[j].first = &indices[0] + first + (j * (last - first)) / njobs;
+        jobs[j].last = &indices[0] + first + ((j + 1) * (last - first)) / njobs;
+      }
+      if (njobs == 1) {
+        jobs[0]();
+      } else {
+        for (std::size_t j = 0; j < njobs; ++j) {
+          pool->post(job_runner(&jobs[j]));
+        }
+        pool->wait();
+      }
+      for (std::size_t j = 0; j < njobs; ++j) {
+        if (!jobs[j].error.empty()) {
+          throw DIALS_ERROR(jobs[j].error);
+        }
+      }
+    }
+  }
 
-    for (std::size_t i = 0; i < output_data.size(); ++i) {
-      output_data[i] = img.tile(i).data();
-      output_mask[i] = mask.tile(i).data();
+  /**
+   * Read the images of each panel on a frame
+   */
+  void read_frame(
+    ImageSequence &data,
+    std::size_t index,
+    std::vector<scitbx::af::versa<double, scitbx::af::c_grid<2> > > &image,
+    std::vector<scitbx::af::versa<bool, scitbx::af::c_grid<2> > > *mask) const {
+    std::size_t n_panels = geometry_.size();
+    dxtbx::format::Image<double> img = data.get_corrected_data(index);
+    DIALS_ASSERT(img.n_tiles() == n_panels);
+    image.resize(n_panels);
+    for (std::size_t p = 0; p < n_panels; ++p) {
+      image[p] = img.tile(p).data();
+      DIALS_ASSERT(image[p].accessor()[0] == geometry_[p].ysize);
+      DIALS_ASSERT(image[p].accessor()[1] == geometry_[p].xsize);
+    }
+    if (mask != NULL) {
+      dxtbx::format::Image<bool> img_mask = data.get_mask(index);
+      DIALS_ASSERT(img_mask.n_tiles() == n_panels);
+      mask->resize(n_panels);
+      for (std::size_t p = 0; p < n_panels; ++p) {
+        (*mask)[p] = img_mask.tile(p).data();
+        DIALS_ASSERT((*mask)[p].accessor().all_eq(image[p].accessor()));
+      }
     }
-    empty_shoebox_processor.next_data_only(
-      dials::model::Image<double>(output_data.const_ref(), output_mask.const_ref()));
   }
 
-  // Now correct each pixel for each shoebox
-  dials::af::shared<Shoebox<> > shoeboxes = reflection_table["shoebox"];
-  dials::af::shared<Shoebox<> > e_shoeboxes = i_reflection_table["shoebox"];
-  dials::af::shared<Shoebox<> > i_shoeboxes = e_reflection_table["shoebox"];
-  dials::af::const_ref<int6> bboxes = reflection_table["bbox"];
-
-  for (std::size_t i = 0; i < reflection_table.size(); ++i) {
-    Shoebox<> shoebox = shoeboxes[i];
-    Shoebox<> i_shoebox = e_shoeboxes[i];
-    Shoebox<> e_shoebox = i_shoeboxes[i];
-    int6 bbox = bboxes[i];
-    int panel = shoebox.panel;
-
-    // Shoebox data are ordered (z, y, x)
-    for (std::size_t z = 0; z < shoebox.zsize(); ++z) {
-      int frame_z = bbox[4] + z;
-      double tof = img_tof[frame_z] * std::pow(10, -6);  // (s)
-
-      for (std::size_t y = 0; y < shoebox.ysize(); ++y) {
-        int panel_y = bbox[2] + y;
-        if (panel_y > image_size[1] || panel_y < 0) {
-          continue;
+  /**
+   * Extract and correct the pixels of a shoebox on a frame. Pixels outside
+   * the panel are left at zero.
+   */
+  void correct(Shoebox<> &sbox, const frame_data &frame) const {
+    int6 b = sbox.bbox;
+    DIALS_ASSERT(frame.index >= b[4] && frame.index < b[5]);
+    if (frame.index == b[4]) {
+      DIALS_ASSERT(sbox.is_allocated() == false);
+      sbox.allocate();
+    }
+    DIALS_ASSERT(sbox.is_consistent());
+    std::size_t panel = sbox.panel;
+    const panel_geometry &g = geometry_[panel];
+    int xi = (int)g.xsize;
+    int yi = (int)g.ysize;
+    int x0 = std::max(b[0], 0);
+    int x1 = std::min(b[1], xi);
+    int y0 = std::max(b[2], 0);
+    int y1 = std::min(b[3], yi);
+    if (x0 >= x1 || y0 >= y1) {
+      return;
+    }
+    std::size_t z = frame.index - b[4];
+    std::size_t n = x1 - x0;
+    scitbx::af::ref<float_type, scitbx::af::c_grid<3> > sdata = sbox.data.ref();
+    scitbx::af::ref<int, scitbx::af::c_grid<3> > smask = sbox.mask.ref();
+    const double *sample = frame.sample[panel].begin();
+    const bool *mask = frame.mask[panel].begin();
+    for (int y = y0; y < y1; ++y) {
+      std::size_t k = y * g.xsize + x0;
+      float_type *out = &sdata(z, y - b[2], x0 - b[0]);
+      int *out_mask = &smask(z, y - b[2], x0 - b[0]);
+      for (std::size_t x = 0; x < n; ++x) {
+        out_mask[x] = mask[k + x] ? dials::model::Valid : 0;
+      }
+      const double *incident = NULL;
+      const double *empty = NULL;
+      if (normalise_) {
+        incident = frame.incident[panel].begin() + k;
+        empty = frame.empty[panel].begin() + k;
+      }
+      const double *flight_path = &g.flight_path[k];
+      const double *sin_sq = &g.sin_sq[k];
+      const int *two_theta_idx = &g.two_theta_idx[k];
+      if (absorption_) {
+        if (lorentz_) {
+          correct_absorption<true>(n, sample + k, incident, empty, flight_path,
+                                   sin_sq, two_theta_idx, frame.h_tof, out);
+        } else {
+          correct_absorption<false>(n, sample + k, incident, empty, flight_path,
+                                    sin_sq, two_theta_idx, frame.h_tof, out);
         }
-        for (std::size_t x = 0; x < shoebox.xsize(); ++x) {
-          int panel_x = bbox[0] + x;
-          if (panel_x > image_size[0] || panel_x < 0) {
-            continue;
-          }
-
-          double incident_pixel_data = i_shoebox.data(z, y, x);
-          double empty_pixel_data = e_shoebox.data(z, y, x);
-          double pixel_data = shoebox.data(z, y, x);
-
-          // Normalise w.r.t proton charge
-          pixel_data /= sample_proton_charge;
-          incident_pixel_data /= incident_proton_charge;
-          empty_pixel_data /= empty_proton_charge;
-
-          // Subtract empty from incident and sample
-          pixel_data -= empty_pixel_data;
-          incident_pixel_data -= empty_pixel_data;
-
-          scitbx::vec3<double> s1 =
-            detector[panel].get_pixel_lab_coord(scitbx::vec2<double>(panel_x, panel_y));
-          double distance = s1.length() + sample_to_source_distance;
-          distance *= std::pow(10, -3);  // (m)
-          double wl = ((Planck * tof) / (m_n * (distance))) * std::pow(10, 10);
-
-          // Pixel data will be divided by incident run
-          // Infinities are set to zero
-          if (incident_pixel_data < 1e-5) {
-            shoebox.data(z, y, x) = 0;
-            continue;
-          }
-
-          pixel_data /= incident_pixel_data;
-
-          // Lorentz correction
-          if (apply_lorentz_correction) {
-            double two_theta = detector[panel].get_two_theta_at_pixel(
-              unit_s0, scitbx::vec2<double>(panel_x, panel_y));
-            double two_theta_deg = two_theta * (180 / pi);
-            double sin_two_theta_sq = std::pow(sin(two_theta * .5), 2);
-            double lorentz_correction = sin_two_theta_sq / std::pow(wl, 4);
-            pixel_data *= lorentz_correction;
-          }
-
-          shoebox.data(z, y, x) = double(pixel_data);
+      } else if (normalise_) {
+        if (lorentz_) {
+          correct_normalised<true>(
+            n, sample + k, incident, empty, flight_path, sin_sq, frame.h_tof, out);
+        } else {
+          correct_normalised<false>(
+            n, sample + k, incident, empty, flight_path, sin_sq, frame.h_tof, out);
         }
+      } else {
+        if (lorentz_) {
+          correct_sample<true>(n, sample + k, flight_path, sin_sq, frame.h_tof, out);
+        } else {
+          correct_sample<false>(n, sample + k, flight_path, sin_sq, frame.h_tof, out);
+        }
+      }
+    }
+  }
+
+  /*
+   * The kernels below correct a run of pixels in a row. The input pixels are
+   * first rounded to the precision of the shoebox. Apart from the absorption
+   * correction they have no branches so the compiler can vectorise them.
+   */
+
+  template <bool Lorentz>
+  static void correct_sample(std::size_t n,
+                             const double *sample,
+                             const double *flight_path,
+                             const double *sin_sq,
+                             double h_tof,
+                             float_type *out) {
+    for (std::size_t x = 0; x < n; ++x) {
+      double pixel_data = (float_type)sample[x];
+      if (Lorentz) {
+        double wl = wavelength(h_tof, flight_path[x]);
+        pixel_data *= lorentz_correction(sin_sq[x], wl);
+      }
+      out[x] = pixel_data;
+    }
+  }
+
+  template <bool Lorentz>
+  void correct_normalised(std::size_t n,
+                          const double *sample,
+                          const double *incident,
+                          const double *empty,
+                          const double *flight_path,
+                          const double *sin_sq,
+                          double h_tof,
+                          float_type *out) const {
+    for (std::size_t x = 0; x < n; ++x) {
+      double pixel_data = (float_type)sample[x] / sample_proton_charge_;
+      double incident_pixel_data = (float_type)incident[x] / incident_proton_charge_;
+      double empty_pixel_data = (float_type)empty[x] / empty_proton_charge_;
+      pixel_data -= empty_pixel_data;
+      incident_pixel_data -= empty_pixel_data;
+      pixel_data /= incident_pixel_data;
+      if (Lorentz) {
+        double wl = wavelength(h_tof, flight_path[x]);
+        pixel_data *= lorentz_correction(sin_sq[x], wl);
+      }
+
+      // Infinities are set to zero
+      out[x] = incident_pixel_data < 1e-5 ? 0 : pixel_data;
+    }
+  }
+
+  template <bool Lorentz>
+  void correct_absorption(std::size_t n,
+                          const double *sample,
+                          const double *incident,
+                          const double *empty,
+                          const double *flight_path,
+                          const double *sin_sq,
+                          const int *two_theta_idx,
+                          double h_tof,
+                          float_type *out) const {
+    for (std::size_t x = 0; x < n; ++x) {
+      double pixel_data = (float_type)sample[x] / sample_proton_charge_;
+      double incident_pixel_data = (float_type)incident[x] / incident_proton_charge_;
+      double empty_pixel_data = (float_type)empty[x] / empty_proton_charge_;
+      pixel_data -= empty_pixel_data;
+      incident_pixel_data -= empty_pixel_data;
+
+      double wl = wavelength(h_tof, flight_path[x]);
+      int idx = two_theta_idx[x];
+
+      // Pixel data will be divided by the absorption corrections and the
+      // incident run. Infinities are set to zero
+      out[x] = 0;
+      double sample_absorption_correction = tof_spherical_absorption_correction(
+        absorption_muR(sample_muR_, wl),
+        sin_sq[x],
+        idx,
+        grid_sin_sq_[idx],
+        grid_sin_sq_[idx + 1]);
+      if (sample_absorption_correction < 1e-5) {
+        continue;
+      }
+      double incident_absorption_correction = tof_spherical_absorption_correction(
+        absorption_muR(incident_muR_, wl),
+        sin_sq[x],
+        idx,
+        grid_sin_sq_[idx],
+        grid_sin_sq_[idx + 1]);
+      if (incident_absorption_correction < 1e-5) {
+        continue;
+      }
+      incident_pixel_data /= incident_absorption_correction;
+      if (incident_pixel_data < 1e-5) {
+        continue;
       }
+      pixel_data /= incident_pixel_data;
+      pixel_data /= sample_absorption_correction;
+      if (Lorentz) {
+        pixel_data *= lorentz_correction(sin_sq[x], wl);
+      }
+      out[x] = pixel_data;
     }
   }
+
+  bool lorentz_;
+  bool normalise_;
+  bool absorption_;
+  std::size_t nthreads_;
+  double sample_proton_charge_;
+  double incident_proton_charge_;
+  double empty_proton_charge_;
+  vec3<double> sample_muR_;
+  vec3<double> incident_muR_;
+  double grid_sin_sq_[20];
+  std::vector<double> h_tof_;
+  std::vector<panel_geometry> geometry_;
+};
+
+/*
+ * Extracts shoeboxes to reflection_table with each pixel corrected
+ * optionally for the Lorentz correction
+ */
+void tof_extract_shoeboxes_to_reflection_table(
+  dials::af::reflection_table &reflection_table,
+  Experiment &experiment,
+  ImageSequence &data,
+  bool apply_lorentz_correction,
+  std::size_t nthreads = 1) {
+  TOFShoeboxCorrector corrector(experiment, apply_lorentz_correction, nthreads);
+  corrector.extract(reflection_table, data);
+}
+
+/*
+ * Extracts shoeboxes to reflection_table with each pixel corrected w.r.t
+ * an incident run, an empty run, and optionally the Lorentz correction
+ */
+void tof_extract_shoeboxes_to_reflection_table(
+  dials::af::reflection_table &reflection_table,
+  Experiment &experiment,
+  ImageSequence &data,
+  ImageSequence &incident_data,
+  ImageSequence &empty_data,
+  double sample_proton_charge,
+  double incident_proton_charge,
+  double empty_proton_charge,
+  bool apply_lorentz_correction,
+  std::size_t nthreads = 1) {
+  TOFShoeboxCorrector corrector(experiment, apply_lorentz_correction, nthreads);
+  corrector.set_normalisation(
+    sample_proton_charge, incident_proton_charge, empty_proton_charge);
+  corrector.extract(reflection_table, data, incident_data, empty_data);
 }
 
 /*
@@ -557,205 +835,11 @@ void tof_extract_shoeboxes_to_reflection_table(
   ImageSequence &incident_data,
   ImageSequence &empty_data,
   TOFCorrectionsData &corrections_data,
-  bool apply_lorentz_correction) {
-  Detector detector = *experiment.get_detector();
-  Scan scan = *experiment.get_scan();
-
-  // Required beam params
-  std::shared_ptr<dxtbx::model::BeamBase> beam_ptr = experiment.get_beam();
-  std::shared_ptr<PolychromaticBeam> beam =
-    std::dynamic_pointer_cast<PolychromaticBeam>(beam_ptr);
-  DIALS_ASSERT(beam != nullptr);
-  vec3<double> unit_s0 = beam->get_unit_s0();
-  double sample_to_source_distance = beam->get_sample_to_source_distance();
-
-  // Required scan params
-  scitbx::af::shared<double> img_tof = scan.get_property<double>("time_of_flight");
-
-  // Required detector params
-  int n_panels = detector.size();
-  int num_images = data.size();
-  vec2<std::size_t> image_size = detector[0].get_image_size();
-  DIALS_ASSERT(num_images == img_tof.size());
-
-  // Copy reflections for incident and empty runs
-  boost::python::dict d;
-  dials::af::reflection_table i_reflection_table =
-    dxtbx::af::flex_table_suite::deepcopy(reflection_table, d);
-  dials::af::reflection_table e_reflection_table =
-    dxtbx::af::flex_table_suite::deepcopy(reflection_table, d);
-
-  // Processors to get the image data into shoeboxes
-  ShoeboxProcessor shoebox_processor(reflection_table, n_panels, 0, num_images, false);
-
-  ShoeboxProcessor incident_shoebox_processor(
-    i_reflection_table, n_panels, 0, num_images, false);
-
-  ShoeboxProcessor empty_shoebox_processor(
-    e_reflection_table, n_panels, 0, num_images, false);
-
-  // Get shoeboxes for image data
-  for (std::size_t img_num = 0; img_num < num_images; ++img_num) {
-    dxtbx::format::Image<double> img = data.get_corrected_data(img_num);
-    dxtbx::format::Image<bool> mask = data.get_mask(img_num);
-
-    dials::af::shared<scitbx::af::versa<double, scitbx::af::c_grid<2> > > output_data(
-      n_panels);
-    dials::af::shared<scitbx::af::versa<bool, scitbx::af::c_grid<2> > > output_mask(
-      n_panels);
-
-    for (std::size_t i = 0; i < output_data.size(); ++i) {
-      output_data[i] = img.tile(i).data();
-      output_mask[i] = mask.tile(i).data();
-    }
-    shoebox_processor.next_data_only(
-      dials::model::Image<double>(output_data.const_ref(), output_mask.const_ref()));
-  }
-
-  // Get shoeboxes for incident data
-  for (std::size_t img_num = 0; img_num < num_images; ++img_num) {
-    dxtbx::format::Image<double> img = incident_data.get_corrected_data(img_num);
-    dxtbx::format::Image<bool> mask = incident_data.get_mask(img_num);
-
-    dials::af::shared<scitbx::af::versa<double, scitbx::af::c_grid<2> > > output_data(
-      n_panels);
-    dials::af::shared<scitbx::af::versa<bool, scitbx::af::c_grid<2> > > output_mask(
-      n_panels);
-
-    for (std::size_t i = 0; i < output_data.size(); ++i) {
-      output_data[i] = img.tile(i).data();
-      output_mask[i] = mask.tile(i).data();
-    }
-    incident_shoebox_processor.next_data_only(
-      dials::model::Image<double>(output_data.const_ref(), output_mask.const_ref()));
-  }
-
-  // Get shoeboxes for empty data
-  for (std::size_t img_num = 0; img_num < num_images; ++img_num) {
-    dxtbx::format::Image<double> img = empty_data.get_corrected_data(img_num);
-    dxtbx::format::Image<bool> mask = empty_data.get_mask(img_num);
-
-    dials::af::shared<scitbx::af::versa<double, scitbx::af::c_grid<2> > > output_data(
-      n_panels);
-    dials::af::shared<scitbx::af::versa<bool, scitbx::af::c_grid<2> > > output_mask(
-      n_panels);
-
-    for (std::size_t i = 0; i < output_data.size(); ++i) {
-      output_data[i] = img.tile(i).data();
-      output_mask[i] = mask.tile(i).data();
-    }
-    empty_shoebox_processor.next_data_only(
-      dials::model::Image<double>(output_data.const_ref(), output_mask.const_ref()));
-  }
-
-  // Now correct each pixel for each shoebox
-  dials::af::shared<Shoebox<> > shoeboxes = reflection_table["shoebox"];
-  dials::af::shared<Shoebox<> > e_shoeboxes = i_reflection_table["shoebox"];
-  dials::af::shared<Shoebox<> > i_shoeboxes = e_reflection_table["shoebox"];
-  dials::af::const_ref<int6> bboxes = reflection_table["bbox"];
-
-  for (std::size_t i = 0; i < reflection_table.size(); ++i) {
-    Shoebox<> shoebox = shoeboxes[i];
-    Shoebox<> i_shoebox = e_shoeboxes[i];
-    Shoebox<> e_shoebox = i_shoeboxes[i];
-    int6 bbox = bboxes[i];
-    int panel = shoebox.panel;
-
-    // Shoebox data are ordered (z, y, x)
-    for (std::size_t z = 0; z < shoebox.zsize(); ++z) {
-      int frame_z = bbox[4] + z;
-      double tof = img_tof[frame_z] * std::pow(10, -6);  // (s)
-
-      for (std::size_t y = 0; y < shoebox.ysize(); ++y) {
-        int panel_y = bbox[2] + y;
-        if (panel_y > image_size[1] || panel_y < 0) {
-          continue;
-        }
-        for (std::size_t x = 0; x < shoebox.xsize(); ++x) {
-          int panel_x = bbox[0] + x;
-          if (panel_x > image_size[0] || panel_x < 0) {
-            continue;
-          }
-
-          double incident_pixel_data = i_shoebox.data(z, y, x);
-          double empty_pixel_data = e_shoebox.data(z, y, x);
-          double pixel_data = shoebox.data(z, y, x);
-
-          // Normalise w.r.t proton charge
-          pixel_data /= corrections_data.sample_proton_charge;
-          incident_pixel_data /= corrections_data.incident_proton_charge;
-          empty_pixel_data /= corrections_data.empty_proton_charge;
-
-          // Subtract empty from incident and sample
-          pixel_data -= empty_pixel_data;
-          incident_pixel_data -= empty_pixel_data;
-
-          double two_theta = detector[panel].get_two_theta_at_pixel(
-            unit_s0, scitbx::vec2<double>(panel_x, panel_y));
-          double two_theta_deg = two_theta * (180 / pi);
-          int two_theta_idx = static_cast<int>(two_theta_deg / 10);
-
-          scitbx::vec3<double> s1 =
-            detector[panel].get_pixel_lab_coord(scitbx::vec2<double>(panel_x, panel_y));
-          double distance = s1.length() + sample_to_source_distance;
-          distance *= std::pow(10, -3);  // (m)
-          double wl = ((Planck * tof) / (m_n * (distance))) * std::pow(10, 10);
-
-          // Spherical absorption correction
-          // for image data and incident data
-          double sample_muR =
-            (corrections_data.sample_linear_scattering_c
-             + (corrections_data.sample_linear_absorption_c / 1.8) * wl)
-            * corrections_data.sample_radius;
-          double sample_absorption_correction =
-            tof_pixel_spherical_absorption_correction(
-              pixel_data, sample_muR, two_theta, two_theta_idx);
-
-          // Pixel data will be divided by absorption correction
-          // Infinities are set to zero
-          if (sample_absorption_correction < 1e-5) {
-            shoebox.data(z, y, x) = 0;
-            continue;
-          }
-
-          double incident_muR =
-            (corrections_data.incident_linear_scattering_c
-             + (corrections_data.incident_linear_absorption_c / 1.8) * wl)
-            * corrections_data.incident_radius;
-          double incident_absorption_correction =
-            tof_pixel_spherical_absorption_correction(
-              pixel_data, incident_muR, two_theta, two_theta_idx);
-
-          // Pixel data will be divided by absorption correction
-          // Infinities are set to zero
-          if (incident_absorption_correction < 1e-5) {
-            shoebox.data(z, y, x) = 0;
-            continue;
-          }
-
-          // Pixel data will be divided by incident run
-          // Infinities are set to zero
-          incident_pixel_data /= incident_absorption_correction;
-          if (incident_pixel_data < 1e-5) {
-            shoebox.data(z, y, x) = 0;
-            continue;
-          }
-
-          pixel_data /= incident_pixel_data;
-          pixel_data /= sample_absorption_correction;
-
-          // Lorentz correction
-          if (apply_lorentz_correction) {
-            double sin_two_theta_sq = std::pow(sin(two_theta * .5), 2);
-            double lorentz_correction = sin_two_theta_sq / std::pow(wl, 4);
-            pixel_data *= lorentz_correction;
-          }
-
-          shoebox.data(z, y, x) = double(pixel_data);
-        }
-      }
-    }
-  }
+  bool apply_lorentz_correction,
+  std::size_t nthreads = 1) {
+  TOFShoeboxCorrector corrector(experiment, apply_lorentz_correction, nthreads);
+  corrector.set_absorption(corrections_data);
+  corrector.extract(reflection_table, data, incident_data, empty_data);
 }
 
 }  // namespace dials_scaling
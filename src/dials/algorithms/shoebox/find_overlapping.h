@@ -11,11 +11,15 @@
 #ifndef DIALS_ALGORITHMS_INTEGRATION_FIND_OVERLAPPING_H
 #define DIALS_ALGORITHMS_INTEGRATION_FIND_OVERLAPPING_H
 
+#include <algorithm>
+#include <exception>
+#include <string>
 #include <vector>
 #include <scitbx/array_family/tiny_types.h>
 #include <dials/array_family/scitbx_shared_and_versa.h>
 #include <dials/model/data/adjacency_list.h>
 #include <dials/algorithms/spatial_indexing/detect_collisions.h>
+#include <dials/util/thread_pool.h>
 #include <dials/error.h>
 
 namespace dials { namespace algorithms {
@@ -59,6 +63,156 @@ namespace dials { namespace algorithms { namespace shoebox {
   using dials::model::AdjacencyList;
   using scitbx::af::int6;
 
+  namespace detail {
+
+    typedef std::vector<int6>::const_iterator bbox_iterator;
+    typedef std::vector<std::pair<int, int> > collision_list;
+    typedef DetectCollisions<3, bbox_iterator, collision_list, false>
+      bbox_collision_detector;
+
+    // Struct to help sort data
+    struct sort_by_group {
+      const std::vector<std::size_t> &g_;
+      sort_by_group(const std::vector<std::size_t> &g) : g_(g) {}
+      bool operator()(std::size_t a, std::size_t b) const {
+        return g_[a] < g_[b];
+      }
+    };
+
+    /**
+     * A job to find the collisions within part of the partition tree of one
+     * group of bounding boxes
+     */
+    struct collision_job {
+      const bbox_collision_detector *detector;
+      const bbox_collision_detector::Task *task;
+      bbox_iterator first;
+      std::size_t offset;
+      collision_list collisions;
+      std::string error;
+
+      void operator()() {
+        try {
+          detector->run(*task, first, collisions);
+        } catch (const std::exception &e) {
+          error = e.what();
+        } catch (...) {
+          error = "Unknown error finding overlapping bounding boxes";
+        }
+      }
+    };
+
+    struct collision_job_runner {
+      collision_job *job;
+      collision_job_runner(collision_job *job_) : job(job_) {}
+      void operator()() const {
+        (*job)();
+      }
+    };
+
+    /**
+     * Visit the collisions found by each job, as the indices of the original
+     * bounding boxes
+     */
+    struct collision_edges {
+      const std::vector<collision_job> &jobs;
+      const std::vector<std::size_t> &index;
+      collision_edges(const std::vector<collision_job> &jobs_,
+                      const std::vector<std::size_t> &index_)
+          : jobs(jobs_), index(index_) {}
+      template <typename Function>
+      void operator()(const Function &function) const {
+        for (std::size_t j = 0; j < jobs.size(); ++j) {
+          const collision_list &collisions = jobs[j].collisions;
+          std::size_t d0 = jobs[j].offset;
+          for (std::size_t i = 0; i < collisions.size(); ++i) {
+            function(index[d0 + collisions[i].first],
+                     index[d0 + collisions[i].second]);
+          }
+        }
+      }
+    };
+
+    /**
+     * Find the overlaps between the bounding boxes within each group. Each
+     * group is split into parts of the partition tree which are searched in
+     * parallel, each into its own list of collisions.
+     * @param bbox The list of bounding boxes
+     * @param group The group of each bounding box
+     * @param nthreads The number of threads
+     * @returns An adjacency list
+     */
+    inline AdjacencyList find_overlapping_in_groups(
+      const af::const_ref<int6> &bbox,
+      const std::vector<std::size_t> &group,
+      std::size_t nthreads) {
+      DIALS_ASSERT(bbox.size() > 0);
+      DIALS_ASSERT(bbox.size() == group.size());
+      DIALS_ASSERT(nthreads > 0);
+
+      // Sort the bounding boxes by group and find the start of each group
+      std::vector<std::size_t> index(bbox.size());
+      for (std::size_t i = 0; i < index.size(); ++i) {
+        index[i] = i;
+      }
+      std::sort(index.begin(), index.end(), sort_by_group(group));
+      std::vector<int6> data(bbox.size());
+      std::vector<std::size_t> offset(1, 0);
+      for (std::size_t i = 0; i < index.size(); ++i) {
+        data[i] = bbox[index[i]];
+        if (i > 0 && group[index[i]] != group[index[i - 1]]) {
+          offset.push_back(i);
+        }
+      }
+      offset.push_back(index.size());
+
+      // Split each group into independent tasks
+      std::size_t ngroups = offset.size() - 1;
+      std::size_t min_tasks = nthreads == 1 ? 1 : 4 * nthreads;
+      std::vector<bbox_collision_detector> detectors(ngroups);
+      std::vector<bbox_collision_detector::TaskList> tasks(ngroups);
+      for (std::size_t j = 0; j < ngroups; ++j) {
+        detectors[j].split(data.begin() + offset[j],
+                           data.begin() + offset[j + 1],
+                           tasks[j],
+                           min_tasks);
+      }
+      std::vector<collision_job> jobs;
+      for (std::size_t j = 0; j < ngroups; ++j) {
+        for (std::size_t i = 0; i < tasks[j].size(); ++i) {
+          collision_job job;
+          job.detector = &detectors[j];
+          job.task = &tasks[j][i];
+          job.first = data.begin() + offset[j];
+          job.offset = offset[j];
+          jobs.push_back(job);
+        }
+      }
+
+      // Search the tasks
+      if (nthreads == 1 || jobs.size() <= 1) {
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+          jobs[i]();
+        }
+      } else {
+        dials::util::ThreadPool pool(std::min(nthreads, jobs.size()));
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+          pool.post(collision_job_runner(&jobs[i]));
+        }
+        pool.wait();
+      }
+
+      // Check the jobs succeeded and put the collisions into an adjacency list
+      for (std::size_t j = 0; j < jobs.size(); ++j) {
+        if (!jobs[j].error.empty()) {
+          throw DIALS_ERROR(jobs[j].error);
+        }
+      }
+      return AdjacencyList(bbox.size(), collision_edges(jobs, index));
+    }
+
+  }  // namespace detail
+
   /**
    * Given a set of reflections, find the bounding_boxes that overlap.
    * This function uses a single shot collision detection algorithm to
@@ -66,39 +220,15 @@ namespace dials { namespace algorithms { namespace shoebox {
    * indices into an adjacency list. Vertices are referred to in the
    * adjacency list by index.
    * @param bbox The list of bounding boxes
+   * @param nthreads The number of threads
    * @returns An adjacency list
    */
-  inline AdjacencyList find_overlapping(const af::const_ref<int6> &bboxes) {
-    // Ensure we have a valid number of bboxes
-    DIALS_ASSERT(bboxes.size() > 0);
-
-    // Create a list of all the pairs of collisions between bounding boxes.
-    std::vector<std::pair<int, int> > collisions;
-    detect_collisions3d(bboxes.begin(), bboxes.end(), collisions);
-
-    // Put all the collisions into an adjacency list
-    AdjacencyList list(bboxes.size());
-    for (std::size_t i = 0; i < collisions.size(); ++i) {
-      list.add_edge(collisions[i].first, collisions[i].second);
-    }
-    list.finish();
-
-    // Return the adjacency list
-    return list;
+  inline AdjacencyList find_overlapping(const af::const_ref<int6> &bboxes,
+                                        std::size_t nthreads = 1) {
+    std::vector<std::size_t> group(bboxes.size(), 0);
+    return detail::find_overlapping_in_groups(bboxes, group, nthreads);
   }
 
-  namespace detail {
-
-    // Struct to help sort data
-    struct sort_by_panel {
-      const af::const_ref<std::size_t> p_;
-      sort_by_panel(const af::const_ref<std::size_t> &p) : p_(p) {}
-      bool operator()(std::size_t a, std::size_t b) {
-        return p_[a] < p_[b];
-      }
-    };
-  }  // namespace detail
-
   /**
    * Given a set of reflections, find the bounding_boxes that overlap.
    * This function uses a single shot collision detection algorithm to
@@ -107,130 +237,38 @@ namespace dials { namespace algorithms { namespace shoebox {
    * adjacency list by index.
    * @param panel The list of panels
    * @param bbox The list of bounding boxes
+   * @param nthreads The number of threads
    * @returns An adjacency list
    */
   inline AdjacencyList find_overlapping_multi_panel(
     const af::const_ref<int6> &bbox,
-    const af::const_ref<std::size_t> &panel) {
+    const af::const_ref<std::size_t> &panel,
+    std::size_t nthreads = 1) {
     DIALS_ASSERT(panel.size() > 0);
     DIALS_ASSERT(panel.size() == bbox.size());
-
-    // The arrays to use in the collision detection
-    std::vector<int6> data(panel.size());
-    std::vector<std::size_t> index(panel.size());
-    for (std::size_t i = 0; i < index.size(); ++i) {
-      index[i] = i;
-    }
-    std::vector<std::size_t> offset;
-
-    // Sort arrays by panel
-    std::sort(index.begin(), index.end(), detail::sort_by_panel(panel));
-
-    // Create an array of offsets where the panel number is the same
-    // and put the sorted list of bboxes into an new array
-    offset.push_back(0);
-    std::size_t p = panel[index[0]];
-    for (std::size_t i = 0; i < index.size(); ++i) {
-      std::size_t j = index[i];
-      data[i] = bbox[j];
-      if (panel[j] != p) {
-        p = panel[j];
-        offset.push_back(i);
-      }
-    }
-    offset.push_back(index.size());
-
-    // Do the collision detection for all bboxes in the same panel
-    AdjacencyList list(bbox.size());
-    for (std::size_t j = 0; j < offset.size() - 1; ++j) {
-      std::size_t d0 = offset[j];
-      std::size_t d1 = offset[j + 1];
-      std::vector<std::pair<int, int> > collisions;
-
-      // Detect the collisions
-      detect_collisions3d(data.begin() + d0, data.begin() + d1, collisions);
-
-      // Put all the collisions into an adjacency list
-      for (std::size_t i = 0; i < collisions.size(); ++i) {
-        list.add_edge(index[d0 + collisions[i].first],
-                      index[d0 + collisions[i].second]);
-      }
-    }
-    list.finish();
-    return list;
+    std::vector<std::size_t> group(panel.begin(), panel.end());
+    return detail::find_overlapping_in_groups(bbox, group, nthreads);
   }
 
   class OverlapFinder {
   public:
     OverlapFinder() {}
 
-    struct sort_by_group {
-      const std::vector<std::size_t> &g_;
-      sort_by_group(const std::vector<std::size_t> &g) : g_(g) {}
-      bool operator()(std::size_t a, std::size_t b) {
-        return g_[a] < g_[b];
-      }
-    };
-
     AdjacencyList operator()(const af::const_ref<std::size_t> &id,
                              const af::const_ref<std::size_t> &panel,
-                             const af::const_ref<int6> &bbox) const {
+                             const af::const_ref<int6> &bbox,
+                             std::size_t nthreads = 1) const {
       DIALS_ASSERT(panel.size() > 0);
       DIALS_ASSERT(panel.size() == bbox.size());
       DIALS_ASSERT(panel.size() == id.size());
 
-      // Get the maximum panel number
+      // Group by experiment and panel
       std::size_t max_panel = af::max(panel);
-      std::size_t max_id = af::max(id);
-      std::size_t max_group = (max_panel + 1) * (max_id + 1);
-
-      // The arrays to use in the collision detection
       std::vector<std::size_t> group(panel.size());
-      std::vector<int6> data(panel.size());
-      std::vector<std::size_t> index(panel.size());
-      for (std::size_t i = 0; i < index.size(); ++i) {
+      for (std::size_t i = 0; i < group.size(); ++i) {
         group[i] = id[i] * (max_panel + 1) + panel[i];
-        index[i] = i;
-      }
-      std::vector<std::size_t> offset;
-
-      // Sort arrays by group
-      std::sort(index.begin(), index.end(), sort_by_group(group));
-
-      // Create an array of offsets where the group number is the same and put
-      // the sorted list of bboxes into an new array
-      offset.push_back(0);
-      std::size_t g = group[index[0]];
-      for (std::size_t i = 0; i < index.size(); ++i) {
-        std::size_t j = index[i];
-        data[i] = bbox[j];
-        if (group[j] != g) {
-          DIALS_ASSERT(group[j] > g);
-          g = group[j];
-          offset.push_back(i);
-        }
-      }
-      offset.push_back(index.size());
-      DIALS_ASSERT(offset.size() <= max_group + 1);
-
-      // Do the collision detection for all bboxes in the same group
-      AdjacencyList list(bbox.size());
-      for (std::size_t j = 0; j < offset.size() - 1; ++j) {
-        std::size_t d0 = offset[j];
-        std::size_t d1 = offset[j + 1];
-        std::vector<std::pair<int, int> > collisions;
-
-        // Detect the collisions
-        detect_collisions3d(data.begin() + d0, data.begin() + d1, collisions);
-
-        // Put all the collisions into an adjacency list
-        for (std::size_t i = 0; i < collisions.size(); ++i) {
-          list.add_edge(index[d0 + collisions[i].first],
-                        index[d0 + collisions[i].second]);
-        }
       }
-      list.finish();
-      return list;
+      return detail::find_overlapping_in_groups(bbox, group, nthreads);
     }
   };
 
@@ -11,6 +11,7 @@
 #ifndef DIALS_ALGORITHMS_INTEGRATION_MASK_OVERLAPPING_H
 #define DIALS_ALGORITHMS_INTEGRATION_MASK_OVERLAPPING_H
 
+#include <algorithm>
 #include <memory>
 #include <scitbx/vec3.h>
 #include <scitbx/array_family/tiny_types.h>
@@ -29,10 +30,6 @@ namespace dials { namespace algorithms { namespace shoebox {
   /** Class to calculate the shoebox masks for all reflections */
   class MaskOverlapping {
   public:
-    // Useful typedefs
-    typedef AdjacencyList::edge_iterator edge_iterator;
-    typedef AdjacencyList::edge_iterator_range edge_iterator_range;
-
     /**
      * Initialise the algorithm
      */
@@ -61,15 +58,16 @@ namespace dials { namespace algorithms { namespace shoebox {
           Shoebox<> &s = shoeboxes[i];
           vec3<double> c = coords[i];
 
-          // Get the list of overlapping shoeboxes
-          edge_iterator_range range = adjacency_list->edges(i);
-          for (edge_iterator it = range.first; it != range.second; ++it) {
-            std::size_t index1 = it->first;
-            std::size_t index2 = it->second;
-            DIALS_ASSERT(index1 == i);
-            if (index1 < index2) {
-              assign_ownership(s, c, shoeboxes[index2], coords[index2]);
-            }
+          // Get the list of overlapping shoeboxes. These are sorted so only
+          // those after this one need to be checked.
+          af::const_ref<AdjacencyList::vertex_index> adjacent =
+            adjacency_list->adjacent_vertices(i);
+          const AdjacencyList::vertex_index *first =
+            std::upper_bound(adjacent.begin(), adjacent.end(), i);
+          for (; first != adjacent.end(); ++first) {
+            std::size_t index2 = *first;
+            DIALS_ASSERT(index2 < shoeboxes.size());
+            assign_ownership(s, c, shoeboxes[index2], coords[index2]);
           }
         }
       }
@@ -349,12 +349,83 @@ namespace dials { namespace algorithms {
      * @param collisions The list of collisions
      */
     void operator()(DataIterator first, DataIterator last, CollisionList &collisions) {
+      IndexList index;
+      BoxType box = initialize(first, last, index);
+
+      // Start the recursive partitioning of the data to find the collisions.
+      partition_data<0>(index.begin(), index.end(), first, collisions, box, 0, 0);
+    }
+
+    /**
+     * A part of the partition tree which can be searched independently of
+     * the others. The task holds its own copy of the indices of the objects
+     * in its part of the space.
+     */
+    struct Task {
+      IndexList index;
+      BoxType box;
+      int depth;
+    };
+
+    typedef std::vector<Task> TaskList;
+
+    /**
+     * Split the search into independent tasks. The space is partitioned as
+     * in the () operator down to a fixed depth, giving at least min_tasks
+     * tasks unless the partitioning stops earlier. Running each of the tasks
+     * in order and concatenating the lists of collisions gives the same
+     * list as the () operator, so the tasks can be searched in parallel.
+     *
+     * @param first The first iterator in the range
+     * @param last The last iterator in the range
+     * @param tasks The list of tasks
+     * @param min_tasks The minimum number of tasks to create
+     */
+    void split(DataIterator first,
+               DataIterator last,
+               TaskList &tasks,
+               std::size_t min_tasks) {
+      IndexList index;
+      BoxType box = initialize(first, last, index);
+
+      // The partition axis is 0 at every multiple of DIM, so tasks can
+      // always be resumed by partitioning along the first axis.
+      task_depth_ = 0;
+      while ((std::size_t(1) << task_depth_) < min_tasks) {
+        task_depth_ += DIM;
+      }
+      CollisionList unused;
+      partition_data<0>(index.begin(), index.end(), first, unused, box, 0, &tasks);
+      DIALS_ASSERT(unused.size() == 0);
+    }
+
+    /**
+     * Find the collisions in a single task
+     * @param task The task
+     * @param first The first iterator in the range given to split
+     * @param collisions The list of collisions
+     */
+    void run(const Task &task, DataIterator first, CollisionList &collisions) const {
+      IndexList index(task.index);
+      partition_data<0>(
+        index.begin(), index.end(), first, collisions, task.box, task.depth, 0);
+    }
+
+  private:
+    int max_depth_;
+    int task_depth_;
+
+    /**
+     * Fill the list of indices, compute the maximum recursion depth and
+     * return the bounding box of the whole data range.
+     */
+    BoxType initialize(DataIterator first, DataIterator last, IndexList &index) {
       // Ensure the amount of data is greater than zero.
       int n = last - first;
       DIALS_ASSERT(n > 0);
 
       // Create and fill a vector with the indices of the input data range
-      IndexList index(n);
+      index.resize(n);
       for (std::size_t i = 0; i < n; ++i) {
         index[i] = i;
       }
@@ -379,14 +450,9 @@ namespace dials { namespace algorithms {
       max_depth_ = log2(min_length / min_size.d[j]) - 1;
       if (max_depth_ < 1) max_depth_ = 1;
       max_depth_ *= DIM;
-
-      // Start the recursive partitioning of the data to find the collisions.
-      partition_data<0>(index.begin(), index.end(), first, collisions, box, 0);
+      return box;
     }
 
-  private:
-    int max_depth_;
-
     /**
      * The main body of the algorithm.
      *
@@ -431,6 +497,7 @@ namespace dials { namespace algorithms {
      * @param collisions The collision list
      * @param box The bounding box of the range we're to partition
      * @param depth The current recursion depth.
+     * @param tasks If not null, add a task instead of searching at the task depth
      */
     template <int D>
     void partition_data(IndexIterator first,
@@ -438,13 +505,26 @@ namespace dials { namespace algorithms {
                         DataIterator data,
                         ListType &collisions,
                         const BoxType &box,
-                        int depth) const {
+                        int depth,
+                        TaskList *tasks) const {
       // The next dimensions: X -> Y -> Z -> X ...
       const int D_NEXT = (D + 1) % DIM;
 
       // Keep recursing until we either reach the maximum recursion depth or
       // the threshold of number of objects for brute force search is reached.
-      if (depth < max_depth_ && last - first > BF_THRESHOLD) {
+      bool recurse = depth < max_depth_ && last - first > BF_THRESHOLD;
+
+      // When splitting into tasks, stop at the task depth or where the search
+      // would stop anyway and save the current range for later.
+      if (tasks != 0 && (depth >= task_depth_ || !recurse)) {
+        tasks->push_back(Task());
+        tasks->back().index.assign(first, last);
+        tasks->back().box = box;
+        tasks->back().depth = depth;
+        return;
+      }
+
+      if (recurse) {
         IndexIterator mid;
 
         // Copy the current level bounding box and starting with the lower
@@ -457,7 +537,8 @@ namespace dials { namespace algorithms {
         // Then call the partition function on the next dimension, the order
         // of this is X -> Y -> Z -> X ...
         mid = std::partition(first, last, by_lower<D>(data, sub_box.max[D]));
-        partition_data<D_NEXT>(first, mid, data, collisions, sub_box, depth + 1);
+        partition_data<D_NEXT>(
+          first, mid, data, collisions, sub_box, depth + 1, tasks);
 
         // Rejig the subdivided box to set the maximum of the current dimension
         // back to that of the current level box and the minimum to the maximum
@@ -469,7 +550,8 @@ namespace dials { namespace algorithms {
         // Then call the partition function on the next dimension, the order
         // of this is X -> Y -> Z -> X ...
         mid = std::partition(first, last, by_upper<D>(data, sub_box.min[D]));
-        partition_data<D_NEXT>(mid, last, data, collisions, sub_box, depth + 1);
+        partition_data<D_NEXT>(
+          mid, last, data, collisions, sub_box, depth + 1, tasks);
 
       } else {
         // If the stopping condition has been met, then proceed with a
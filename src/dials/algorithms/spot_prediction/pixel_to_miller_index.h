@@ -11,11 +11,17 @@
 #ifndef DIALS_ALGORITHMS_SPOT_PREDICTION_PIXEL_TO_MILLER_INDEX_H
 #define DIALS_ALGORITHMS_SPOT_PREDICTION_PIXEL_TO_MILLER_INDEX_H
 
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
 #include <dxtbx/model/beam.h>
 #include <dxtbx/model/detector.h>
 #include <dxtbx/model/goniometer.h>
 #include <dxtbx/model/scan.h>
 #include <dxtbx/model/crystal.h>
+#include <dials/array_family/scitbx_shared_and_versa.h>
+#include <dials/util/thread_pool.h>
 #include <dials/error.h>
 
 namespace dials { namespace algorithms {
@@ -68,21 +74,13 @@ namespace dials { namespace algorithms {
      */
     vec3<double> h(std::size_t panel, double x, double y, double z) const {
       DIALS_ASSERT(!(m2_[0] == 0 && m2_[1] == 0 && m2_[2] == 0));
+      return rotation_matrix(z) * q(panel, x, y);
+    }
 
-      // Compute the diffracted beam vector
-      vec3<double> s1 =
-        detector_[panel].get_pixel_lab_coord(vec2<double>(x, y)).normalize()
-        * s0_.length();
-
-      // Compute the angle
-      double angle = scan_.get_angle_from_array_index(z);
-
-      // Compute the reciprocal lattice vector
-      vec3<double> r = s1 - s0_;
-
-      // Create the rotation matrix
-      mat3<double> R = scitbx::math::r3_rotation::axis_and_angle_as_matrix(m2_, angle);
-
+    /**
+     * Compute the miller index
+     */
+    vec3<double> h(std::size_t panel, double x, double y) const {
       // Compue the miller index
       //  r = S R F A h
       //  where:
@@ -90,20 +88,52 @@ namespace dials { namespace algorithms {
       //   R = rotation
       //   F = fixed rotation
       //   A = UB
-      return A_inv_ * F_inv_ * R.transpose() * S_inv_ * r;
+      return A_inv_ * q(panel, x, y);
+    }
+
+    /**
+     * Compute the miller index of a list of points on a panel. The matrix
+     * for each frame is only computed when the frame changes so it is
+     * fastest if the points are ordered by frame.
+     * @param panel The panel
+     * @param xyz The (x, y, z) coordinates
+     * @param nthreads The number of threads
+     * @returns The fractional miller indices
+     */
+    af::shared<vec3<double> > h(std::size_t panel,
+                                const af::const_ref<vec3<double> > &xyz,
+                                std::size_t nthreads = 1) const {
+      DIALS_ASSERT(!(m2_[0] == 0 && m2_[1] == 0 && m2_[2] == 0));
+      DIALS_ASSERT(panel < detector_.size());
+      af::shared<vec3<double> > result(xyz.size());
+      run(rotation_job(this, panel, xyz.begin(), result.begin()), xyz.size(), nthreads);
+      return result;
     }
 
     /**
      * Compute the miller index
      */
-    vec3<double> h(std::size_t panel, double x, double y) const {
+    vec3<double> q(std::size_t panel, double x, double y) const {
       // Compute the diffracted beam vector
       vec3<double> s1 =
         detector_[panel].get_pixel_lab_coord(vec2<double>(x, y)).normalize()
         * s0_.length();
 
       // Compute the reciprocal lattice vector
-      vec3<double> r = s1 - s0_;
+      return s1 - s0_;
+    }
+
+  protected:
+    /**
+     * Compute the matrix to take the reciprocal lattice vector to the
+     * miller index at a given frame
+     */
+    mat3<double> rotation_matrix(double z) const {
+      // Compute the angle
+      double angle = scan_.get_angle_from_array_index(z);
+
+      // Create the rotation matrix
+      mat3<double> R = scitbx::math::r3_rotation::axis_and_angle_as_matrix(m2_, angle);
 
       // Compue the miller index
       //  r = S R F A h
@@ -112,20 +142,97 @@ namespace dials { namespace algorithms {
       //   R = rotation
       //   F = fixed rotation
       //   A = UB
-      return A_inv_ * r;
+      return A_inv_ * F_inv_ * R.transpose() * S_inv_;
     }
 
     /**
-     * Compute the miller index
+     * Compute the miller indices of a range of points with a rotation
      */
-    vec3<double> q(std::size_t panel, double x, double y) const {
-      // Compute the diffracted beam vector
-      vec3<double> s1 =
-        detector_[panel].get_pixel_lab_coord(vec2<double>(x, y)).normalize()
-        * s0_.length();
+    struct rotation_job {
+      const PixelToMillerIndex *self;
+      std::size_t panel;
+      const vec3<double> *xyz;
+      vec3<double> *result;
+
+      rotation_job(const PixelToMillerIndex *self_,
+                   std::size_t panel_,
+                   const vec3<double> *xyz_,
+                   vec3<double> *result_)
+          : self(self_), panel(panel_), xyz(xyz_), result(result_) {}
+
+      void operator()(std::size_t first, std::size_t last) const {
+        double z = 0;
+        mat3<double> M(0, 0, 0, 0, 0, 0, 0, 0, 0);
+        for (std::size_t i = first; i < last; ++i) {
+          if (i == first || xyz[i][2] != z) {
+            z = xyz[i][2];
+            M = self->rotation_matrix(z);
+          }
+          result[i] = M * self->q(panel, xyz[i][0], xyz[i][1]);
+        }
+      }
+    };
 
-      // Compute the reciprocal lattice vector
-      return s1 - s0_;
+    /**
+     * A contiguous range of points processed by one thread
+     */
+    template <typename Job>
+    struct chunk {
+      Job job;
+      std::size_t first;
+      std::size_t last;
+      std::string error;
+
+      chunk(Job job_, std::size_t first_, std::size_t last_)
+          : job(job_), first(first_), last(last_) {}
+
+      void operator()() {
+        try {
+          job(first, last);
+        } catch (const std::exception &e) {
+          error = e.what();
+        } catch (...) {
+          error = "Unknown error computing miller indices";
+        }
+      }
+    };
+
+    template <typename Job>
+    struct chunk_runner {
+      chunk<Job> *c;
+      chunk_runner(chunk<Job> *c_) : c(c_) {}
+      void operator()() const {
+        (*c)();
+      }
+    };
+
+    /**
+     * Split the points into chunks and run the job on each one
+     */
+    template <typename Job>
+    static void run(Job job, std::size_t size, std::size_t nthreads) {
+      DIALS_ASSERT(nthreads > 0);
+      const std::size_t chunk_size = 4096;
+      std::vector<chunk<Job> > chunks;
+      for (std::size_t i = 0; i < size; i += chunk_size) {
+        chunks.push_back(chunk<Job>(job, i, std::min(i + chunk_size, size)));
+      }
+      if (nthreads == 1 || chunks.size() <= 1) {
+        for (std::size_t i = 0; i < chunks.size(); ++i) {
+          chunks[i]();
+        }
+      } else {
+        dials::util::ThreadPool pool(std::min(nthreads, chunks.size()));
+        for (std::size_t i = 0; i < chunks.size(); ++i) {
+          pool.post(chunk_runner<Job>(&chunks[i]));
+        }
+        pool.wait();
+      }
+      for (std::size_t i = 0; i < chunks.size(); ++i) {
+        if (!chunks[i].error.empty()) {
+          throw DIALS_ERROR(chunks[i].error);
+        }
+      }
     }
 
   protected:
@@ -4,6 +4,7 @@
 
 from scitbx.array_family import flex
 
+from dials_refinement_helpers_ext import FastMCD as FastMCDCore
 from dials_refinement_helpers_ext import maha_dist_sq as maha_dist_sq_cpp
 from dials_refinement_helpers_ext import mcd_consistency
 
@@ -129,8 +130,11 @@ def mcd_finite_sample(p, n, alpha):
 
 
 class FastMCD:
-    """Experimental implementation of the FAST-MCD algorithm of Rousseeuw and
-    van Driessen"""
+    """Implementation of the FAST-MCD algorithm of Rousseeuw and van Driessen.
+    The trials are performed in C++, in parallel over nproc threads. Each
+    trial draws its random starting subset from a stream of random numbers
+    determined by the seed and the trial number, so the result does not depend
+    on nproc."""
 
     def __init__(
         self,
@@ -142,6 +146,8 @@ def __init__(
         k1=2,
         k2=2,
         k3=100,
+        seed=0,
+        nproc=1,
     ):
         """data expected to be a list of flex.double arrays of the same length,
         representing the vectors of observations in each dimension"""
@@ -188,6 +194,10 @@ def __init__(
         self._k2 = k2
         self._k3 = k3
 
+        # random seed and number of threads
+        self._seed = seed
+        self._nproc = nproc
+
         # correction factors
         self._consistency_fac = mcd_consistency(self._p, self._h / self._n)
         self._finite_samp_fac = mcd_finite_sample(self._p, self._n, self._alpha)
@@ -201,14 +211,29 @@ def __init__(
     def run(self):
         """Run the Fast MCD calculation"""
 
-        # algorithm for a small number of observations (up to twice the minimum
-        # group size)
-        if self._n < 2 * self._min_group_size:
-            self._T_raw, self._S_raw = self.small_dataset_estimate()
-
-        # algorithm for a larger number of observations
-        else:
-            self._T_raw, self._S_raw = self.large_dataset_estimate()
+        # the observations as a matrix with one row per variable
+        data = flex.double()
+        for col in self._data:
+            data.extend(flex.double(col))
+        data.reshape(flex.grid(self._p, self._n))
+
+        # the algorithm for a small number of observations (up to twice the
+        # minimum group size) or for a larger number is chosen in C++
+        mcd = FastMCDCore(
+            data,
+            alpha=self._alpha,
+            max_n_groups=self._max_n_groups,
+            min_group_size=self._min_group_size,
+            n_trials=self._n_trials,
+            k1=self._k1,
+            k2=self._k2,
+            k3=self._k3,
+            seed=self._seed,
+            nthreads=self._nproc,
+        )
+        assert mcd.h() == self._h
+        self._T_raw = mcd.T()
+        self._S_raw = mcd.S()
 
     def get_raw_T_and_S(self):
         """Get the raw MCD location (T) and covariance matrix (S) estimates"""
@@ -221,241 +246,3 @@ def get_corrected_T_and_S(self):
 
         fac = self._consistency_fac * self._finite_samp_fac
         return self._T_raw, self._S_raw * fac
-
-    @staticmethod
-    def means_and_covariance(vecs):
-        """Prepare a dataset of equal length vectors for Mahalanobis distance
-        squared calculation. The maha_dist_sq function requires the vectors,
-        the vector of their means and their covariance matrix. Given the vectors,
-        return the latter pair as a tuple"""
-
-        center = flex.double([flex.mean(e) for e in vecs])
-        covmat = cov(*vecs)
-        return (center, covmat)
-
-    @staticmethod
-    def sample_data(data, sample_size):
-        """sample (without replacement) the data vectors to select the same
-        sample_size rows from each."""
-
-        n = len(data[0])
-        rows = flex.random_selection(n, sample_size)
-        cols = [e.select(rows) for e in data]
-        return cols
-
-    def split_into_groups(self, sample, ngroups):
-        """Split each vector in the data sample into groups of approximately equal
-        size."""
-
-        # number of obs in the sample
-        sample_size = len(sample[0])
-
-        # random permutation
-        p = flex.random_permutation(sample_size)
-        permuted = [col.select(p) for col in sample]
-
-        # determine groups
-        blocksize = int(sample_size / ngroups)
-        rem = sample_size % ngroups
-        blocksizes = [blocksize] * (ngroups - rem) + [blocksize + 1] * rem
-
-        starts = [0]
-        ends = [blocksizes[0]]
-        for b in blocksizes[1:]:
-            starts.append(ends[-1])
-            ends.append(ends[-1] + b)
-        blocks = zip(starts, ends)
-
-        # split into groups
-        groups = [[col[start:end] for col in permuted] for start, end in blocks]
-
-        return groups
-
-    def form_initial_subset(self, h, data):
-        """Method 2 of subsection 3.1 of R&vD"""
-
-        # permutation of input data for sampling
-        p = flex.random_permutation(len(data[0]))
-        permuted = [col.select(p) for col in data]
-
-        # draw random p+1 subset J (or larger if required)
-        detS0 = 0.0
-        i = 0
-        while not detS0 > 0.0:
-            subset_size = self._p + 1 + i
-            J = [e[0:subset_size] for e in permuted]
-            i += 1
-            T0, S0 = self.means_and_covariance(J)
-            detS0 = S0.matrix_determinant_via_lu()
-
-        H1 = self.concentration_step(h, data, T0, S0)
-        return H1
-
-    @staticmethod
-    def concentration_step(h, data, T, S):
-        """Practical application of Theorem 1 of R&vD"""
-
-        d2s = maha_dist_sq(data, T, S)
-        p = flex.sort_permutation(d2s)
-        H1 = [col.select(p)[0:h] for col in data]
-        return H1
-
-    def small_dataset_estimate(self):
-        """When a dataset is small, perform the initial trials directly on the
-        whole dataset"""
-
-        trials = []
-        for i in range(self._n_trials):
-            H1 = self.form_initial_subset(h=self._h, data=self._data)
-            T1, S1 = self.means_and_covariance(H1)
-            detS1 = S1.matrix_determinant_via_lu()
-
-            # perform concentration steps
-            detScurr, Tcurr, Scurr = detS1, T1, S1
-            for j in range(self._k1):  # take maximum of k1 steps
-                Hnew = self.concentration_step(self._h, self._data, Tcurr, Scurr)
-                Tnew, Snew = self.means_and_covariance(Hnew)
-                detSnew = Snew.matrix_determinant_via_lu()
-
-                # detS3 < detS2 < detS1 by Theorem 1. In practice (rounding errors?)
-                # this is not always the case here. Ensure that detScurr is no smaller than
-                # one billionth the value of detSnew less than detSnew
-                assert detScurr > (detSnew - detSnew / 1.0e9)
-                detScurr, Tcurr, Scurr = detSnew, Tnew, Snew
-
-            trials.append((detSnew, Tnew, Snew))
-
-        # choose 10 trials with the lowest detS3
-        trials.sort(key=lambda x: x[0])
-        best_trials = []
-        for i in range(10):
-            detCurr, Tcurr, Scurr = trials[i]
-            for j in range(self._k3):  # take maximum of k3 steps
-                Hnew = self.concentration_step(self._h, self._data, Tcurr, Scurr)
-                Tnew, Snew = self.means_and_covariance(Hnew)
-                detNew = Snew.matrix_determinant_via_lu()
-                if detNew == detCurr:
-                    # print "trial {0}; iteration {1}; convergence".format(i,j)
-                    break
-                detCurr, Tcurr, Scurr = detNew, Tnew, Snew
-            best_trials.append((detNew, Tnew, Snew))
-
-        # Find the minimum covariance determinant from that set of 10
-        best_trials.sort(key=lambda x: x[0])
-        _, Tbest, Sbest = best_trials[0]
-        return Tbest, Sbest
-
-    def large_dataset_estimate(self):
-        """When a dataset is large, construct disjoint subsets of the full data
-        and perform initial trials within each of these, then merge"""
-
-        ngroups = int(self._n / self._min_group_size)
-        if ngroups < self._max_n_groups:
-            # use all the data and split into ngroups
-            sample_size = self._n
-        else:
-            # sample the data and split into the maximum number of groups
-            ngroups = self._max_n_groups
-            sample_size = self._min_group_size * self._max_n_groups
-
-        # sample the data and split into groups
-        sampled = self.sample_data(self._data, sample_size=sample_size)
-        groups = self.split_into_groups(sample=sampled, ngroups=ngroups)
-
-        # work within the groups now
-        n_trials = self._n_trials // ngroups
-        trials = []
-        h_frac = self._h / self._n
-        for group in groups:
-            h_sub = int(len(group[0]) * h_frac)
-            gp_trials = []
-            for i in range(n_trials):
-                H1 = self.form_initial_subset(h=h_sub, data=group)
-                T1, S1 = self.means_and_covariance(H1)
-                detS1 = S1.matrix_determinant_via_lu()
-
-                # perform concentration steps
-                detScurr, Tcurr, Scurr = detS1, T1, S1
-                for j in range(self._k1):  # take k1 steps
-                    Hnew = self.concentration_step(h_sub, group, Tcurr, Scurr)
-                    Tnew, Snew = self.means_and_covariance(Hnew)
-                    detSnew = Snew.matrix_determinant_via_lu()
-
-                    # detS3 < detS2 < detS1 by Theorem 1. In practice (rounding errors?)
-                    # this is not always the case here. Ensure that detScurr is no smaller than
-                    # one billionth the value of detSnew less than detSnew
-                    assert detScurr > (detSnew - detSnew / 1.0e9)
-                    detScurr, Tcurr, Scurr = detSnew, Tnew, Snew
-
-                gp_trials.append((detSnew, Tnew, Snew))
-
-            # choose 10 trials with the lowest determinant and put in the outer list
-            gp_trials.sort(key=lambda x: x[0])
-            trials.extend(gp_trials[0:10])
-
-        # now have 10 best trials from each group. Work with the merged (==sampled)
-        # set
-        mrgd_trials = []
-        h_mrgd = int(sample_size * h_frac)
-        for trial in trials:
-            detScurr, Tcurr, Scurr = trial
-            for j in range(self._k2):  # take k2 steps
-                Hnew = self.concentration_step(h_mrgd, sampled, Tcurr, Scurr)
-                Tnew, Snew = self.means_and_covariance(Hnew)
-                detSnew = Snew.matrix_determinant_via_lu()
-                detScurr, Tcurr, Scurr = detSnew, Tnew, Snew
-
-            mrgd_trials.append((detSnew, Tnew, Snew))
-
-        # sort trials by the lowest detS3 and work with the whole dataset now
-        mrgd_trials.sort(key=lambda x: x[0])
-
-        # choose number of steps to iterate based on dataset size (ugly)
-        size = self._n * self._p
-        if size <= 100000:
-            k4 = self._k3
-        elif size <= 200000:
-            k4 = 10
-        elif size <= 300000:
-            k4 = 9
-        elif size <= 400000:
-            k4 = 8
-        elif size <= 500000:
-            k4 = 7
-        elif size <= 600000:
-            k4 = 6
-        elif size <= 700000:
-            k4 = 5
-        elif size <= 800000:
-            k4 = 4
-        elif size <= 900000:
-            k4 = 3
-        elif size <= 1000000:
-            k4 = 2
-        else:
-            k4 = 1
-
-        # choose number of trials to look at based on number of obs (ugly)
-        n_reps = 1 if self._n > 5000 else 10
-
-        best_trials = []
-        for i in range(n_reps):
-            detCurr, Tcurr, Scurr = mrgd_trials[i]
-            for j in range(k4):  # take maximum of k4 steps
-                Hnew = self.concentration_step(self._h, self._data, Tcurr, Scurr)
-                Tnew, Snew = self.means_and_covariance(Hnew)
-                detNew = Snew.matrix_determinant_via_lu()
-                if detNew == detCurr:
-                    # print "trial {0}; iteration {1}; convergence".format(i,j)
-                    break
-                detCurr, Tcurr, Scurr = detNew, Tnew, Snew
-            # print "determinant", detNew
-            # print "location:", list(Tnew)
-            # print "covariance:"
-            # print Snew.as_scitbx_matrix()
-            best_trials.append((detNew, Tnew, Snew))
-
-        # Find the minimum covariance determinant from that set of 10
-        best_trials.sort(key=lambda x: x[0])
-        _, Tbest, Sbest = best_trials[0]
-        return Tbest, Sbest
@@ -28,6 +28,8 @@ namespace dials { namespace af { namespace boost_python {
   void export_flex_intensity();
   void export_flex_observation();
   void export_flex_reflection_table();
+  void export_flex_reflection_table_msgpack_reader();
+  void export_flex_reflection_table_chunked_file();
   void export_flex_unit_cell();
   void export_flex_shoebox_extractor();
   void export_flex_binner();
@@ -53,6 +55,8 @@ namespace dials { namespace af { namespace boost_python {
     export_flex_intensity();
     export_flex_observation();
     export_flex_reflection_table();
+    export_flex_reflection_table_msgpack_reader();
+    export_flex_reflection_table_chunked_file();
     export_flex_unit_cell();
     export_flex_shoebox_extractor();
     export_flex_binner();
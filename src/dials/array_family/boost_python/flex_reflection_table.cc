@@ -18,6 +18,7 @@
 #include <dials/array_family/reflection_table.h>
 #include <dials/array_family/reflection.h>
 #include <dials/array_family/reflection_table_msgpack_adapter.h>
+#include <dials/array_family/reflection_table_msgpack_writer.h>
 #include <dials/model/data/shoebox.h>
 #include <dials/model/data/observation.h>
 #include <dials/algorithms/profile_model/gaussian_rs/coordinate_system.h>
@@ -745,18 +746,39 @@ namespace dials { namespace af { namespace boost_python {
     return result;
   }
 
+  /**
+   * The number of shoeboxes to serialise in each parallel msgpack job
+   */
+  const std::size_t msgpack_shoebox_chunk_size = 10000;
+
+  /**
+   * A stream interface to write into preallocated memory
+   */
+  struct memory_writer {
+    char *data;
+    memory_writer(char *data_) : data(data_) {}
+    void write(const char *src, std::size_t size) {
+      std::copy(src, src + size, data);
+      data += size;
+    }
+  };
+
   /**
    * Pack the reflection table in msgpack format
    * @param self The reflection table
+   * @param nthreads The number of threads to use to serialise shoeboxes
    * @returns The msgpack string
    */
-  boost::python::object reflection_table_as_msgpack(reflection_table self) {
-    std::stringstream buffer;
-    msgpack::pack(buffer, self);
+  boost::python::object reflection_table_as_msgpack(reflection_table self,
+                                                    std::size_t nthreads) {
+    ReflectionTableMsgpackWriter writer(self, nthreads, msgpack_shoebox_chunk_size);
     // Convert to a python bytes object
-    std::string data = buffer.str();
     boost::python::object data_bytes(
-      boost::python::handle<>(PyBytes_FromStringAndSize(data.c_str(), data.size())));
+      boost::python::handle<>(PyBytes_FromStringAndSize(NULL, writer.size())));
+    char *data = PyBytes_AsString(data_bytes.ptr());
+    memory_writer buffer(data);
+    writer.write(buffer);
+    DIALS_ASSERT(buffer.data == data + writer.size());
     return data_bytes;
   }
 
@@ -764,10 +786,14 @@ namespace dials { namespace af { namespace boost_python {
    * Pack the reflection table in msgpack format into a streambuf object
    * @param self The reflection table
    * @param output A streambuf object encapsulating a Python file-like object
+   * @param nthreads The number of threads to use to serialise shoeboxes
    */
-  void reflection_table_as_msgpack_to_file(reflection_table self, streambuf &output) {
+  void reflection_table_as_msgpack_to_file(reflection_table self,
+                                           streambuf &output,
+                                           std::size_t nthreads) {
+    ReflectionTableMsgpackWriter writer(self, nthreads, msgpack_shoebox_chunk_size);
     streambuf::ostream os(output);
-    msgpack::pack(os, self);
+    writer.write(os);
   }
 
   /**
@@ -952,8 +978,12 @@ namespace dials { namespace af { namespace boost_python {
         .def("split_indices_by_experiment_id",
              &split_indices_by_experiment_id<flex_table_type>)
         .def("compute_phi_range", &compute_phi_range<flex_table_type>)
-        .def("as_msgpack", &reflection_table_as_msgpack)
-        .def("as_msgpack_to_file", &reflection_table_as_msgpack_to_file)
+        .def("as_msgpack",
+             &reflection_table_as_msgpack,
+             (boost::python::arg("nthreads") = 1))
+        .def("as_msgpack_to_file",
+             &reflection_table_as_msgpack_to_file,
+             (boost::python::arg("output"), boost::python::arg("nthreads") = 1))
         .def("from_msgpack", &reflection_table_from_msgpack)
         .staticmethod("from_msgpack")
         .def("experiment_identifiers", &T::experiment_identifiers)
@@ -0,0 +1,68 @@
+/*
+ * flex_reflection_table_chunked_file.cc
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+#include <boost/python.hpp>
+#include <boost/python/def.hpp>
+#include <dials/array_family/reflection_table_chunked_file.h>
+
+namespace dials { namespace af { namespace boost_python {
+
+  using namespace boost::python;
+
+  reflection_table chunked_reader_read_all(ChunkedReflectionTableReader &self) {
+    return self.read();
+  }
+
+  reflection_table chunked_reader_read_keys(ChunkedReflectionTableReader &self,
+                                            const af::const_ref<std::string> &keys) {
+    return self.read(keys);
+  }
+
+  reflection_table chunked_reader_read_groups(
+    ChunkedReflectionTableReader &self,
+    const af::const_ref<std::size_t> &groups,
+    const af::const_ref<std::string> &keys) {
+    return self.read(groups, keys);
+  }
+
+  void export_flex_reflection_table_chunked_file() {
+    class_<ChunkedReflectionTableWriter, boost::noncopyable>(
+      "ChunkedReflectionTableWriter", no_init)
+      .def(init<std::string, std::size_t, int, bool>(
+        (arg("filename"),
+         arg("rows_per_group") = 65536,
+         arg("compression_level") = 1,
+         arg("append") = false)))
+      .def("write", &ChunkedReflectionTableWriter::write)
+      .def("flush", &ChunkedReflectionTableWriter::flush)
+      .def("close", &ChunkedReflectionTableWriter::close)
+      .def("nrows", &ChunkedReflectionTableWriter::nrows)
+      .def("n_row_groups", &ChunkedReflectionTableWriter::n_row_groups);
+
+    class_<ChunkedReflectionTableReader, boost::noncopyable>(
+      "ChunkedReflectionTableReader", no_init)
+      .def(init<std::string>((arg("filename"))))
+      .def("nrows", &ChunkedReflectionTableReader::nrows)
+      .def("ncols", &ChunkedReflectionTableReader::ncols)
+      .def("__len__", &ChunkedReflectionTableReader::nrows)
+      .def("keys", &ChunkedReflectionTableReader::keys)
+      .def("__contains__", &ChunkedReflectionTableReader::contains)
+      .def("n_row_groups", &ChunkedReflectionTableReader::n_row_groups)
+      .def("row_group_nrows", &ChunkedReflectionTableReader::row_group_nrows)
+      .def("has_footer", &ChunkedReflectionTableReader::has_footer)
+      .def("experiment_identifiers",
+           &ChunkedReflectionTableReader::experiment_identifiers)
+      .def("row_groups", &ChunkedReflectionTableReader::row_groups)
+      .def("row_groups_with_id", &ChunkedReflectionTableReader::row_groups_with_id)
+      .def("row_groups_with_flags",
+           &ChunkedReflectionTableReader::row_groups_with_flags)
+      .def("row_groups_in_z", &ChunkedReflectionTableReader::row_groups_in_z)
+      .def("read", &chunked_reader_read_all)
+      .def("read", &chunked_reader_read_keys)
+      .def("read", &chunked_reader_read_groups);
+  }
+
+}}}  // namespace dials::af::boost_python
@@ -0,0 +1,56 @@
+/*
+ * flex_reflection_table_msgpack_reader.cc
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+#include <boost/python.hpp>
+#include <boost/python/def.hpp>
+#include <dxtbx/array_family/flex_table_suite.h>
+#include <dials/array_family/reflection_table_msgpack_reader.h>
+
+namespace dials { namespace af { namespace boost_python {
+
+  using namespace boost::python;
+
+  namespace flex_table_suite = dxtbx::af::flex_table_suite;
+
+  /**
+   * Get a column as a python object, decoding it if necessary
+   */
+  object msgpack_reader_getitem(MsgpackReflectionTableReader &self,
+                                const std::string &key) {
+    flex_table_suite::column_to_object_visitor visitor;
+    MsgpackReflectionTableReader::mapped_type column = self.column(key);
+    return column.apply_visitor(visitor);
+  }
+
+  reflection_table msgpack_reader_as_reflection_table(
+    MsgpackReflectionTableReader &self) {
+    return self.as_reflection_table();
+  }
+
+  reflection_table msgpack_reader_as_reflection_table_keys(
+    MsgpackReflectionTableReader &self,
+    const af::const_ref<std::string> &keys) {
+    return self.as_reflection_table(keys);
+  }
+
+  void export_flex_reflection_table_msgpack_reader() {
+    class_<MsgpackReflectionTableReader, boost::noncopyable>(
+      "MsgpackReflectionTableReader", no_init)
+      .def(init<std::string>((arg("filename"))))
+      .def("nrows", &MsgpackReflectionTableReader::nrows)
+      .def("ncols", &MsgpackReflectionTableReader::ncols)
+      .def("__len__", &MsgpackReflectionTableReader::nrows)
+      .def("keys", &MsgpackReflectionTableReader::keys)
+      .def("__contains__", &MsgpackReflectionTableReader::contains)
+      .def("column_type_name", &MsgpackReflectionTableReader::column_type_name)
+      .def("experiment_identifiers",
+           &MsgpackReflectionTableReader::experiment_identifiers)
+      .def("__getitem__", &msgpack_reader_getitem)
+      .def("as_reflection_table", &msgpack_reader_as_reflection_table)
+      .def("as_reflection_table", &msgpack_reader_as_reflection_table_keys);
+  }
+
+}}}  // namespace dials::af::boost_python
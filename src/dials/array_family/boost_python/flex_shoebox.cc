@@ -843,15 +843,13 @@ namespace dials { namespace af { namespace boost_python {
   }
 
   /**
-   * Do a pixel labelling filter to set any pixel closer to another pixel to
-   * background
+   * Add the points at which to compute the miller index for the pixel labelling
+   * filter. These are the centres of the pixels at the frame boundaries from z0
+   * to z1 inclusive, ordered by frame.
    */
   template <typename FloatType>
-  bool mask_neighbouring_single(Shoebox<FloatType> &self,
-                                cctbx::miller::index<> hkl,
-                                const PixelToMillerIndex &compute_miller_index) {
-    bool modified = false;
-    int mask_code = Valid | Background;
+  void mask_neighbouring_points(const Shoebox<FloatType> &self,
+                                af::shared<vec3<double> > &xyz) {
     int x0 = self.bbox[0];
     int x1 = self.bbox[1];
     int y0 = self.bbox[2];
@@ -865,14 +863,37 @@ namespace dials { namespace af { namespace boost_python {
     std::size_t xsize = self.xsize();
     std::size_t ysize = self.ysize();
     std::size_t zsize = self.zsize();
+    for (int z = 0; z <= zsize; ++z) {
+      for (std::size_t y = 0; y < ysize; ++y) {
+        for (std::size_t x = 0; x < xsize; ++x) {
+          xyz.push_back(vec3<double>(x0 + x + 0.5, y0 + y + 0.5, z0 + z));
+        }
+      }
+    }
+  }
+
+  /**
+   * Do a pixel labelling filter to set any pixel closer to another pixel to
+   * background. The miller indices are given at the points from
+   * mask_neighbouring_points; a pixel is kept if both its frame boundaries
+   * round to the reflection's index.
+   */
+  template <typename FloatType>
+  bool mask_neighbouring_single(Shoebox<FloatType> &self,
+                                cctbx::miller::index<> hkl,
+                                const vec3<double> *pixel_hkl) {
+    bool modified = false;
+    int mask_code = Valid | Background;
+    std::size_t xsize = self.xsize();
+    std::size_t ysize = self.ysize();
+    std::size_t zsize = self.zsize();
+    std::size_t frame_size = xsize * ysize;
     for (int z = 0; z < zsize; ++z) {
       for (std::size_t y = 0; y < ysize; ++y) {
         for (std::size_t x = 0; x < xsize; ++x) {
-          double z1 = z0 + z;
-          double y1 = y0 + y + 0.5;
-          double x1 = x0 + x + 0.5;
-          vec3<double> pixel_hkl1 = compute_miller_index.h(self.panel, x1, y1, z1);
-          vec3<double> pixel_hkl2 = compute_miller_index.h(self.panel, x1, y1, z1 + 1);
+          std::size_t k = z * frame_size + y * xsize + x;
+          vec3<double> pixel_hkl1 = pixel_hkl[k];
+          vec3<double> pixel_hkl2 = pixel_hkl[k + frame_size];
           int h1 = (int)std::floor(pixel_hkl1[0] + 0.5);
           int k1 = (int)std::floor(pixel_hkl1[1] + 0.5);
           int l1 = (int)std::floor(pixel_hkl1[2] + 0.5);
@@ -892,7 +913,8 @@ namespace dials { namespace af { namespace boost_python {
 
   /**
    * Do a pixel labelling filter to set any pixel closer to another pixel to
-   * background
+   * background. The miller indices of runs of shoeboxes on the same panel are
+   * computed together in batches, split over a number of threads.
    */
   template <typename FloatType>
   af::shared<bool> mask_neighbouring(af::ref<Shoebox<FloatType> > self,
@@ -901,12 +923,32 @@ namespace dials { namespace af { namespace boost_python {
                                      const Detector &detector,
                                      const Goniometer &goniometer,
                                      const Scan &scan,
-                                     const CrystalBase &crystal) {
+                                     const CrystalBase &crystal,
+                                     std::size_t nthreads) {
     DIALS_ASSERT(self.size() == hkl.size());
+    DIALS_ASSERT(nthreads > 0);
+    const std::size_t max_batch_size = 1 << 20;
     af::shared<bool> modified(self.size());
     PixelToMillerIndex compute_miller_index(beam, detector, goniometer, scan, crystal);
-    for (std::size_t i = 0; i < self.size(); ++i) {
-      modified[i] = mask_neighbouring_single(self[i], hkl[i], compute_miller_index);
+    std::size_t first = 0;
+    while (first < self.size()) {
+      std::size_t panel = self[first].panel;
+      std::size_t last = first;
+      af::shared<vec3<double> > xyz;
+      while (last < self.size() && self[last].panel == panel
+             && (last == first || xyz.size() < max_batch_size)) {
+        mask_neighbouring_points(self[last], xyz);
+        ++last;
+      }
+      af::shared<vec3<double> > pixel_hkl =
+        compute_miller_index.h(panel, xyz.const_ref(), nthreads);
+      std::size_t offset = 0;
+      for (std::size_t i = first; i < last; ++i) {
+        modified[i] = mask_neighbouring_single(self[i], hkl[i], &pixel_hkl[offset]);
+        offset += (self[i].zsize() + 1) * self[i].ysize() * self[i].xsize();
+      }
+      DIALS_ASSERT(offset == pixel_hkl.size());
+      first = last;
     }
     return modified;
   }
@@ -1075,7 +1117,15 @@ namespace dials { namespace af { namespace boost_python {
         .def("flatten", &flatten<FloatType>)
         .def("apply_background_mask", &apply_background_mask<FloatType>)
         .def("apply_pixel_data", &apply_pixel_data<FloatType>)
-        .def("mask_neighbouring", &mask_neighbouring<FloatType>)
+        .def("mask_neighbouring",
+             &mask_neighbouring<FloatType>,
+             (arg("miller_index"),
+              arg("beam"),
+              arg("detector"),
+              arg("goniometer"),
+              arg("scan"),
+              arg("crystal"),
+              arg("nthreads") = 1))
         .def("get_shoebox_data_arrays", &get_shoebox_data_arrays<FloatType>)
         .def_pickle(flex_pickle_double_buffered<shoebox_type,
                                                 shoebox_to_string<FloatType>,
@@ -142,6 +142,9 @@
 )
 from dials_array_family_flex_ext import (  # noqa: F401; lgtm
     Binner,
+    ChunkedReflectionTableReader,
+    ChunkedReflectionTableWriter,
+    MsgpackReflectionTableReader,
     PixelListShoeboxCreator,
     int6,
     observation,
@@ -46,6 +46,21 @@
     raise TypeError('unknown "real" type')
 
 
+def _check_columns(keys, columns):
+    """Raise a KeyError if any of the named columns are not in keys."""
+    missing = set(columns) - set(keys)
+    if missing:
+        raise KeyError(f"Unknown columns {sorted(missing)}")
+
+
+def _select_columns(table, columns):
+    """Drop all but the named columns of a table, which must all exist."""
+    _check_columns(table.keys(), columns)
+    for key in set(table.keys()) - set(columns):
+        del table[key]
+    return table
+
+
 @boost_adaptbx.boost.python.inject_into(dials_array_family_flex_ext.reflection_table)
 class _:
     """
@@ -204,54 +219,185 @@ def from_pickle(filename):
             assert isinstance(result, dials_array_family_flex_ext.reflection_table)
             return result
 
-    def as_msgpack_file(self, filename):
+    def as_msgpack_file(self, filename, nthreads=1):
         """
         Write the reflection table to file in msgpack format
+
+        :param filename: The output filename
+        :param nthreads: The number of threads to use to serialise shoeboxes
         """
         if filename and hasattr(filename, "__fspath__"):
             filename = filename.__fspath__()
         with libtbx.smart_open.for_writing(filename, "wb") as outfile:
-            self.as_msgpack_to_file(dials.util.ext.streambuf(python_file_obj=outfile))
+            self.as_msgpack_to_file(
+                dials.util.ext.streambuf(python_file_obj=outfile, buffer_size=1 << 22),
+                nthreads=nthreads,
+            )
 
     @staticmethod
-    def from_msgpack_file(filename):
+    def from_msgpack_file(filename, columns=None):
         """
         Read the reflection table from file in msgpack format
+
+        :param filename: The msgpack filename
+        :param columns: If set, only the named columns are decoded. For an
+                        uncompressed file the other columns are skipped in a
+                        memory mapping of the file, otherwise the whole file
+                        is decoded and the other columns are dropped.
+        :return: The reflection table
         """
         if filename and hasattr(filename, "__fspath__"):
             filename = filename.__fspath__()
+        compressed = filename.endswith((".gz", ".Z", ".bz2"))
+        if columns is not None and not compressed:
+            reader = dials_array_family_flex_ext.MsgpackReflectionTableReader(filename)
+            _check_columns(reader.keys(), columns)
+            return reader.as_reflection_table(
+                cctbx.array_family.flex.std_string(columns)
+            )
         with libtbx.smart_open.for_reading(filename, "rb") as infile:
-            return dials_array_family_flex_ext.reflection_table.from_msgpack(
+            result = dials_array_family_flex_ext.reflection_table.from_msgpack(
                 infile.read()
             )
+        if columns is not None:
+            result = _select_columns(result, columns)
+        return result
+
+    def as_chunked_file(
+        self, filename, rows_per_group=65536, compression_level=1, append=False
+    ):
+        """
+        Write the reflection table to file in the chunked columnar format
+
+        :param filename: The output filename
+        :param rows_per_group: The number of reflections in each row group
+        :param compression_level: The zlib compression level (0 for none)
+        :param append: Append the table to an existing file
+        """
+        if filename and hasattr(filename, "__fspath__"):
+            filename = filename.__fspath__()
+        writer = dials_array_family_flex_ext.ChunkedReflectionTableWriter(
+            filename,
+            rows_per_group=rows_per_group,
+            compression_level=compression_level,
+            append=append,
+        )
+        writer.write(self)
+        writer.close()
+
+    @staticmethod
+    def from_chunked_file(
+        filename,
+        columns=None,
+        experiment_id=None,
+        flags=None,
+        z_range=None,
+        z_column="xyzobs.px.value",
+    ):
+        """
+        Read the reflection table from file in the chunked columnar format.
+
+        Only the requested columns are read. If any of experiment_id, flags or
+        z_range are given, row groups which cannot contain matching rows are
+        skipped using the per-group statistics, and the remaining rows are
+        then filtered.
+
+        :param filename: The input filename
+        :param columns: The columns to read (default all)
+        :param experiment_id: Only read rows with this experiment id
+        :param flags: Only read rows with all of these flags set
+        :param z_range: Only read rows with z0 <= z < z1
+        :param z_column: The column to use for the z range
+        :return: The reflection table
+        """
+        if filename and hasattr(filename, "__fspath__"):
+            filename = filename.__fspath__()
+        reader = dials_array_family_flex_ext.ChunkedReflectionTableReader(filename)
+        groups = set(reader.row_groups())
+        filter_keys = []
+        if experiment_id is not None and "id" in reader:
+            groups &= set(reader.row_groups_with_id(experiment_id))
+            filter_keys.append("id")
+        if flags is not None and "flags" in reader:
+            groups &= set(reader.row_groups_with_flags(flags))
+            filter_keys.append("flags")
+        if z_range is not None:
+            groups &= set(reader.row_groups_in_z(z_column, *z_range))
+            filter_keys.append(z_column)
+        if columns is not None:
+            _check_columns(reader.keys(), columns)
+        keys = list(reader.keys()) if columns is None else list(columns)
+        extra_keys = [k for k in filter_keys if k not in keys]
+        table = reader.read(
+            cctbx.array_family.flex.size_t(sorted(groups)),
+            cctbx.array_family.flex.std_string(keys + extra_keys),
+        )
+        if filter_keys:
+            selection = cctbx.array_family.flex.bool(table.size(), True)
+            if "id" in filter_keys:
+                selection &= table["id"] == experiment_id
+            if "flags" in filter_keys:
+                selection &= table.get_flags(flags)
+            if z_column in filter_keys:
+                z = table[z_column]
+                if isinstance(z, cctbx.array_family.flex.vec3_double):
+                    z = z.parts()[2]
+                selection &= (z >= z_range[0]) & (z < z_range[1])
+            table = table.select(selection)
+            for key in extra_keys:
+                del table[key]
+        return table
 
-    def as_file(self, filename):
+    def as_file(self, filename, nthreads=1):
         """
         Write the reflection table to file in either msgpack or pickle format
+
+        :param filename: The output filename
+        :param nthreads: The number of threads to use to write a msgpack file
         """
         if os.getenv("DIALS_USE_PICKLE"):
             self.as_pickle(filename)
         elif os.getenv("DIALS_USE_H5"):
             self.as_hdf5(filename)
+        elif os.getenv("DIALS_USE_CHUNKED"):
+            self.as_chunked_file(filename)
         else:
-            self.as_msgpack_file(filename)
+            self.as_msgpack_file(filename, nthreads=nthreads)
 
     @staticmethod
-    def from_file(filename):
+    def from_file(filename, columns=None):
         """
         Read the reflection table from either pickle or msgpack
+
+        :param filename: The reflection filename
+        :param columns: If set, only the named columns are read from a msgpack
+                        or chunked file. Other formats are read in full and
+                        the other columns are dropped.
+        :return: The reflection table
         """
+        if filename and hasattr(filename, "__fspath__"):
+            filename = filename.__fspath__()
+        with open(filename, "rb") as infile:
+            if infile.read(8) == b"DIALSRTC":
+                return dials_array_family_flex_ext.reflection_table.from_chunked_file(
+                    filename, columns=columns
+                )
         try:
             return dials_array_family_flex_ext.reflection_table.from_msgpack_file(
-                filename
+                filename, columns=columns
             )
         except RuntimeError:
             try:
-                return dials_array_family_flex_ext.reflection_table.from_hdf5(filename)
+                result = dials_array_family_flex_ext.reflection_table.from_hdf5(
+                    filename
+                )
             except OSError:
-                return dials_array_family_flex_ext.reflection_table.from_pickle(
+                result = dials_array_family_flex_ext.reflection_table.from_pickle(
                     filename
                 )
+        if columns is not None:
+            result = _select_columns(result, columns)
+        return result
 
     @staticmethod
     def empty_standard(nrows):
@@ -790,13 +936,14 @@ def compute_d(self, experiments):
         )
         return self["d"]
 
-    def compute_bbox(self, experiments, sigma_b_multiplier=2.0):
+    def compute_bbox(self, experiments, sigma_b_multiplier=2.0, nthreads=1):
         """
         Compute the bounding boxes.
 
         :param experiments: The list of experiments
         :param profile_model: The profile models
         :param sigma_b_multiplier: Multiplier to cover extra background
+        :param nthreads: The number of threads
         :return: The bounding box for each reflection
         """
         self["bbox"] = dials_array_family_flex_ext.int6(len(self))
@@ -811,16 +958,18 @@ def compute_bbox(self, experiments, sigma_b_multiplier=2.0):
                     expr.goniometer,
                     expr.scan,
                     sigma_b_multiplier=sigma_b_multiplier,
+                    nthreads=nthreads,
                 ),
             )
         return self["bbox"]
 
-    def compute_partiality(self, experiments):
+    def compute_partiality(self, experiments, nthreads=1):
         """
         Compute the reflection partiality.
 
         :param experiments: The experiment list
         :param profile_model: The profile models
+        :param nthreads: The number of threads
         :return: The partiality for each reflection
         """
         self["partiality"] = cctbx.array_family.flex.double(len(self))
@@ -834,16 +983,18 @@ def compute_partiality(self, experiments):
                     expr.detector,
                     expr.goniometer,
                     expr.scan,
+                    nthreads=nthreads,
                 ),
             )
         return self["partiality"]
 
-    def compute_mask(self, experiments, image_volume=None, overlaps=None):
+    def compute_mask(self, experiments, image_volume=None, overlaps=None, nthreads=1):
         """
         Apply a mask to the shoeboxes.
 
         :param experiments: The list of experiments
         :param profile_model: The profile model
+        :param nthreads: The number of threads
         """
         for expr, indices in self.iterate_experiments_and_indices(experiments):
             result = expr.profile.compute_mask(
@@ -854,6 +1005,7 @@ def compute_mask(self, experiments, image_volume=None, overlaps=None):
                 expr.goniometer,
                 expr.scan,
                 image_volume=image_volume,
+                nthreads=nthreads,
             )
             if result is not None:
                 if "fraction" not in self:
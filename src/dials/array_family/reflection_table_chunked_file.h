@@ -0,0 +1,1233 @@
+/*
+ * reflection_table_chunked_file.h
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+#ifndef DIALS_ARRAY_FAMILY_REFLECTION_TABLE_CHUNKED_FILE_H
+#define DIALS_ARRAY_FAMILY_REFLECTION_TABLE_CHUNKED_FILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+#include <dials/array_family/reflection_table.h>
+#include <dials/array_family/reflection_table_msgpack_adapter.h>
+#include <dials/error.h>
+
+namespace dials { namespace af {
+
+  /**
+   * The layout of a chunked reflection file is as follows:
+   *
+   *  MAGIC
+   *  ROW GROUP 0
+   *  ...
+   *  ROW GROUP N-1
+   *  FOOTER
+   *  FOOTER SIZE (uint64)
+   *  MAGIC
+   *
+   * Each row group is written as:
+   *
+   *  "DRGP"
+   *  META SIZE (uint64)
+   *  META: msgpack [nrows, identifiers, columns, blocks]
+   *  BLOCK 0 ... BLOCK M-1
+   *
+   * There is one block per column in each row group. Each block is byte
+   * shuffled by the size of the scalar type of the column and then deflated
+   * with zlib, unless the compressed block would be larger than the raw block.
+   * The footer is a msgpack structure collecting all the row group metadata so
+   * that a reader only needs to seek to the blocks that it needs. Since each
+   * row group carries its own metadata, a file without a valid footer (e.g.
+   * from a crashed process) can be recovered by scanning the row groups.
+   */
+  namespace chunked_file {
+
+    static const char magic[8] = {'D', 'I', 'A', 'L', 'S', 'R', 'T', 'C'};
+    static const char row_group_magic[4] = {'D', 'R', 'G', 'P'};
+    static const std::size_t version = 1;
+
+    enum Codec { CodecNone = 0, CodecZlib = 1 };
+
+    /**
+     * Metadata for a single column block
+     */
+    struct block_info {
+      uint64_t offset;      ///< Offset relative to the start of the group data
+      uint64_t nbytes;      ///< Size of the (possibly compressed) block
+      uint64_t raw_nbytes;  ///< Size of the raw block
+      uint32_t codec;       ///< The compression codec
+      uint32_t typesize;    ///< The shuffle size (0 for no shuffle)
+      std::vector<double> stats;  ///< Min/max statistics
+      std::vector<uint64_t> bits;  ///< Bitwise or/and for flag-like columns
+    };
+
+    /**
+     * Metadata for a row group
+     */
+    struct row_group_info {
+      uint64_t data_offset;  ///< Absolute offset of the first block
+      std::size_t nrows;
+      std::vector<block_info> blocks;
+    };
+
+    /**
+     * The size of the scalar type to use for byte shuffling
+     */
+    template <typename T>
+    struct scalar_size {
+      static std::size_t value() {
+        return sizeof(T);
+      }
+    };
+
+    template <typename T>
+    struct scalar_size<scitbx::vec2<T> > {
+      static std::size_t value() {
+        return sizeof(T);
+      }
+    };
+
+    template <typename T>
+    struct scalar_size<scitbx::vec3<T> > {
+      static std::size_t value() {
+        return sizeof(T);
+      }
+    };
+
+    template <typename T>
+    struct scalar_size<scitbx::mat3<T> > {
+      static std::size_t value() {
+        return sizeof(T);
+      }
+    };
+
+    template <typename T, std::size_t N>
+    struct scalar_size<scitbx::af::tiny<T, N> > {
+      static std::size_t value() {
+        return sizeof(T);
+      }
+    };
+
+    template <typename T>
+    struct scalar_size<cctbx::miller::index<T> > {
+      static std::size_t value() {
+        return sizeof(T);
+      }
+    };
+
+    /**
+     * Encode and decode plain data columns as raw bytes
+     */
+    template <typename T>
+    struct column_codec {
+      static std::size_t typesize() {
+        return scalar_size<T>::value();
+      }
+
+      static void encode(const af::const_ref<T> &data, std::string &out) {
+        out.assign(reinterpret_cast<const char *>(data.begin()),
+                   data.size() * sizeof(T));
+      }
+
+      static void decode(const std::string &raw, af::ref<T> result) {
+        DIALS_ASSERT(raw.size() == result.size() * sizeof(T));
+        if (raw.size() > 0) {
+          std::memcpy(result.begin(), raw.data(), raw.size());
+        }
+      }
+    };
+
+    /**
+     * Encode strings with a length prefix
+     */
+    template <>
+    struct column_codec<std::string> {
+      static std::size_t typesize() {
+        return 0;
+      }
+
+      static void encode(const af::const_ref<std::string> &data, std::string &out) {
+        out.clear();
+        for (std::size_t i = 0; i < data.size(); ++i) {
+          uint32_t length = data[i].size();
+          out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+          out.append(data[i]);
+        }
+      }
+
+      static void decode(const std::string &raw, af::ref<std::string> result) {
+        std::size_t offset = 0;
+        for (std::size_t i = 0; i < result.size(); ++i) {
+          uint32_t length = 0;
+          DIALS_ASSERT(offset + sizeof(length) <= raw.size());
+          std::memcpy(&length, raw.data() + offset, sizeof(length));
+          offset += sizeof(length);
+          DIALS_ASSERT(offset + length <= raw.size());
+          result[i] = raw.substr(offset, length);
+          offset += length;
+        }
+        DIALS_ASSERT(offset == raw.size());
+      }
+    };
+
+    /**
+     * Encode shoeboxes using the same record layout as the msgpack format
+     */
+    template <>
+    struct column_codec<Shoebox<> > {
+      typedef Shoebox<>::float_type float_type;
+
+      static std::size_t typesize() {
+        return 0;
+      }
+
+      template <typename ValueType>
+      static void write(std::string &out, const ValueType &x) {
+        out.append(reinterpret_cast<const char *>(&x), sizeof(ValueType));
+      }
+
+      template <typename ValueType>
+      static ValueType read(const std::string &raw, std::size_t &offset) {
+        ValueType x;
+        DIALS_ASSERT(offset + sizeof(ValueType) <= raw.size());
+        std::memcpy(&x, raw.data() + offset, sizeof(ValueType));
+        offset += sizeof(ValueType);
+        return x;
+      }
+
+      static void encode(const af::const_ref<Shoebox<> > &data, std::string &out) {
+        out.clear();
+        for (std::size_t i = 0; i < data.size(); ++i) {
+          const Shoebox<> &sbox = data[i];
+          DIALS_ASSERT(sbox.bbox[1] >= sbox.bbox[0]);
+          DIALS_ASSERT(sbox.bbox[3] >= sbox.bbox[2]);
+          DIALS_ASSERT(sbox.bbox[5] >= sbox.bbox[4]);
+          write(out, (uint32_t)sbox.panel);
+          for (std::size_t j = 0; j < 6; ++j) {
+            write(out, (int32_t)sbox.bbox[j]);
+          }
+          if (sbox.data.size() > 0) {
+            DIALS_ASSERT(sbox.is_consistent());
+            write(out, (uint8_t)1);
+            out.append(reinterpret_cast<const char *>(&sbox.data[0]),
+                       sbox.data.size() * sizeof(float_type));
+            out.append(reinterpret_cast<const char *>(&sbox.mask[0]),
+                       sbox.mask.size() * sizeof(int));
+            out.append(reinterpret_cast<const char *>(&sbox.background[0]),
+                       sbox.background.size() * sizeof(float_type));
+          } else {
+            write(out, (uint8_t)0);
+          }
+        }
+      }
+
+      static void decode(const std::string &raw, af::ref<Shoebox<> > result) {
+        std::size_t offset = 0;
+        for (std::size_t i = 0; i < result.size(); ++i) {
+          Shoebox<> &sbox = result[i];
+          sbox.panel = read<uint32_t>(raw, offset);
+          for (std::size_t j = 0; j < 6; ++j) {
+            sbox.bbox[j] = read<int32_t>(raw, offset);
+          }
+          DIALS_ASSERT(sbox.bbox[1] >= sbox.bbox[0]);
+          DIALS_ASSERT(sbox.bbox[3] >= sbox.bbox[2]);
+          DIALS_ASSERT(sbox.bbox[5] >= sbox.bbox[4]);
+          if (read<uint8_t>(raw, offset)) {
+            af::c_grid<3> accessor(sbox.bbox[5] - sbox.bbox[4],
+                                   sbox.bbox[3] - sbox.bbox[2],
+                                   sbox.bbox[1] - sbox.bbox[0]);
+            std::size_t n = accessor.size_1d();
+            DIALS_ASSERT(offset + n * (2 * sizeof(float_type) + sizeof(int))
+                         <= raw.size());
+            sbox.data = af::versa<float_type, af::c_grid<3> >(accessor);
+            sbox.mask = af::versa<int, af::c_grid<3> >(accessor);
+            sbox.background = af::versa<float_type, af::c_grid<3> >(accessor);
+            if (n > 0) {
+              std::memcpy(&sbox.data[0], raw.data() + offset, n * sizeof(float_type));
+              offset += n * sizeof(float_type);
+              std::memcpy(&sbox.mask[0], raw.data() + offset, n * sizeof(int));
+              offset += n * sizeof(int);
+              std::memcpy(
+                &sbox.background[0], raw.data() + offset, n * sizeof(float_type));
+              offset += n * sizeof(float_type);
+            }
+            DIALS_ASSERT(sbox.is_consistent());
+          }
+        }
+        DIALS_ASSERT(offset == raw.size());
+      }
+    };
+
+    /**
+     * Per-block statistics. By default no statistics are recorded.
+     */
+    template <typename T>
+    void column_statistics(const af::const_ref<T> &data,
+                           std::vector<double> &stats,
+                           std::vector<uint64_t> &bits) {}
+
+    /**
+     * Record the min and max of an int column (e.g. the experiment id)
+     */
+    inline void column_statistics(const af::const_ref<int> &data,
+                                  std::vector<double> &stats,
+                                  std::vector<uint64_t> &bits) {
+      if (data.size() > 0) {
+        std::pair<const int *, const int *> mm =
+          std::minmax_element(data.begin(), data.end());
+        stats.push_back(*mm.first);
+        stats.push_back(*mm.second);
+      }
+    }
+
+    /**
+     * Record the min and max of a double column
+     */
+    inline void column_statistics(const af::const_ref<double> &data,
+                                  std::vector<double> &stats,
+                                  std::vector<uint64_t> &bits) {
+      if (data.size() > 0) {
+        std::pair<const double *, const double *> mm =
+          std::minmax_element(data.begin(), data.end());
+        stats.push_back(*mm.first);
+        stats.push_back(*mm.second);
+      }
+    }
+
+    /**
+     * Record the min and max of a size_t column together with the bitwise or
+     * and and of the values, so that flag queries can be pushed down.
+     */
+    inline void column_statistics(const af::const_ref<std::size_t> &data,
+                                  std::vector<double> &stats,
+                                  std::vector<uint64_t> &bits) {
+      if (data.size() > 0) {
+        std::pair<const std::size_t *, const std::size_t *> mm =
+          std::minmax_element(data.begin(), data.end());
+        stats.push_back(*mm.first);
+        stats.push_back(*mm.second);
+        uint64_t any = 0;
+        uint64_t all = ~uint64_t(0);
+        for (std::size_t i = 0; i < data.size(); ++i) {
+          any |= data[i];
+          all &= data[i];
+        }
+        bits.push_back(any);
+        bits.push_back(all);
+      }
+    }
+
+    /**
+     * Record the min and max of each component of a vec3<double> column
+     * (e.g. the z of the predicted or observed centroid)
+     */
+    inline void column_statistics(const af::const_ref<vec3<double> > &data,
+                                  std::vector<double> &stats,
+                                  std::vector<uint64_t> &bits) {
+      if (data.size() > 0) {
+        vec3<double> lo = data[0];
+        vec3<double> hi = data[0];
+        for (std::size_t i = 1; i < data.size(); ++i) {
+          for (std::size_t j = 0; j < 3; ++j) {
+            lo[j] = std::min(lo[j], data[i][j]);
+            hi[j] = std::max(hi[j], data[i][j]);
+          }
+        }
+        for (std::size_t j = 0; j < 3; ++j) {
+          stats.push_back(lo[j]);
+        }
+        for (std::size_t j = 0; j < 3; ++j) {
+          stats.push_back(hi[j]);
+        }
+      }
+    }
+
+    /**
+     * Shuffle the bytes so that byte k of each element is contiguous
+     */
+    inline void byte_shuffle(const std::string &src,
+                             std::string &dst,
+                             std::size_t typesize) {
+      dst.resize(src.size());
+      std::size_t count = typesize > 1 ? src.size() / typesize : 0;
+      for (std::size_t j = 0; j < typesize && count > 0; ++j) {
+        for (std::size_t i = 0; i < count; ++i) {
+          dst[j * count + i] = src[i * typesize + j];
+        }
+      }
+      std::copy(
+        src.begin() + count * typesize, src.end(), dst.begin() + count * typesize);
+    }
+
+    /**
+     * Reverse the byte shuffle
+     */
+    inline void byte_unshuffle(const std::string &src,
+                               std::string &dst,
+                               std::size_t typesize) {
+      dst.resize(src.size());
+      std::size_t count = typesize > 1 ? src.size() / typesize : 0;
+      for (std::size_t j = 0; j < typesize && count > 0; ++j) {
+        for (std::size_t i = 0; i < count; ++i) {
+          dst[i * typesize + j] = src[j * count + i];
+        }
+      }
+      std::copy(
+        src.begin() + count * typesize, src.end(), dst.begin() + count * typesize);
+    }
+
+    /**
+     * Shuffle and compress a raw block
+     */
+    inline void compress_block(const std::string &raw,
+                               std::size_t typesize,
+                               int level,
+                               std::string &out,
+                               block_info &info) {
+      std::string shuffled;
+      const std::string *src = &raw;
+      if (typesize > 1) {
+        byte_shuffle(raw, shuffled, typesize);
+        src = &shuffled;
+      }
+      info.raw_nbytes = raw.size();
+      info.typesize = typesize;
+      info.codec = CodecNone;
+      if (level > 0 && raw.size() > 0) {
+        DIALS_ASSERT(raw.size() <= std::numeric_limits<uLong>::max());
+        uLongf size = compressBound(src->size());
+        out.resize(size);
+        int status = compress2(reinterpret_cast<Bytef *>(&out[0]),
+                               &size,
+                               reinterpret_cast<const Bytef *>(src->data()),
+                               src->size(),
+                               level);
+        if (status == Z_OK && size < src->size()) {
+          out.resize(size);
+          info.codec = CodecZlib;
+          info.nbytes = size;
+          return;
+        }
+      }
+      out = *src;
+      info.nbytes = out.size();
+    }
+
+    /**
+     * Decompress and unshuffle a block
+     */
+    inline void decompress_block(const std::string &in,
+                                 const block_info &info,
+                                 std::string &raw) {
+      std::string unpacked;
+      if (info.codec == CodecZlib) {
+        unpacked.resize(info.raw_nbytes);
+        uLongf size = info.raw_nbytes;
+        int status = uncompress(reinterpret_cast<Bytef *>(&unpacked[0]),
+                                &size,
+                                reinterpret_cast<const Bytef *>(in.data()),
+                                in.size());
+        if (status != Z_OK || size != info.raw_nbytes) {
+          throw DIALS_ERROR("Failed to decompress reflection table block");
+        }
+      } else if (info.codec == CodecNone) {
+        unpacked = in;
+      } else {
+        throw DIALS_ERROR("Unknown reflection table block codec");
+      }
+      DIALS_ASSERT(unpacked.size() == info.raw_nbytes);
+      if (info.typesize > 1) {
+        byte_unshuffle(unpacked, raw, info.typesize);
+      } else {
+        raw.swap(unpacked);
+      }
+    }
+
+    /**
+     * Pack block metadata into a msgpack array
+     */
+    template <typename Stream>
+    void pack_blocks(msgpack::packer<Stream> &o,
+                     const std::vector<block_info> &blocks) {
+      o.pack_array(blocks.size());
+      for (std::size_t i = 0; i < blocks.size(); ++i) {
+        o.pack_array(7);
+        o.pack(blocks[i].offset);
+        o.pack(blocks[i].nbytes);
+        o.pack(blocks[i].raw_nbytes);
+        o.pack(blocks[i].codec);
+        o.pack(blocks[i].typesize);
+        o.pack(blocks[i].stats);
+        o.pack(blocks[i].bits);
+      }
+    }
+
+    /**
+     * Unpack block metadata from a msgpack array
+     */
+    inline std::vector<block_info> unpack_blocks(const msgpack::object &o) {
+      if (o.type != msgpack::type::ARRAY) {
+        throw DIALS_ERROR("chunked reflection file: blocks are not an array");
+      }
+      std::vector<block_info> blocks(o.via.array.size);
+      for (std::size_t i = 0; i < blocks.size(); ++i) {
+        const msgpack::object &b = o.via.array.ptr[i];
+        if (b.type != msgpack::type::ARRAY || b.via.array.size != 7) {
+          throw DIALS_ERROR("chunked reflection file: invalid block metadata");
+        }
+        b.via.array.ptr[0].convert(blocks[i].offset);
+        b.via.array.ptr[1].convert(blocks[i].nbytes);
+        b.via.array.ptr[2].convert(blocks[i].raw_nbytes);
+        b.via.array.ptr[3].convert(blocks[i].codec);
+        b.via.array.ptr[4].convert(blocks[i].typesize);
+        b.via.array.ptr[5].convert(blocks[i].stats);
+        b.via.array.ptr[6].convert(blocks[i].bits);
+      }
+      return blocks;
+    }
+
+    /**
+     * The index of a chunked reflection file. This is read from the footer if
+     * present, otherwise it is recovered by scanning the row groups.
+     */
+    class FileIndex {
+    public:
+      typedef reflection_table::experiment_map_type experiment_map_type;
+      typedef std::vector<std::pair<std::string, std::string> > column_list;
+
+      FileIndex() : nrows(0), end_offset(sizeof(magic)), has_footer(false) {}
+
+      /**
+       * Read the index from a stream
+       * @param stream The input stream
+       */
+      void read(std::istream &stream) {
+        stream.seekg(0, std::ios::end);
+        uint64_t file_size = stream.tellg();
+        char header[sizeof(magic)];
+        stream.seekg(0);
+        stream.read(header, sizeof(header));
+        if (!stream || std::memcmp(header, magic, sizeof(magic)) != 0) {
+          throw DIALS_ERROR("Not a chunked reflection file");
+        }
+        if (!read_footer(stream, file_size)) {
+          stream.clear();
+          recover(stream, file_size);
+        }
+      }
+
+      /**
+       * Pack the footer
+       */
+      template <typename Stream>
+      void pack(msgpack::packer<Stream> &o) const {
+        o.pack_array(6);
+        o.pack(std::string("dials::af::reflection_table::chunked"));
+        o.pack(version);
+        o.pack(nrows);
+        o.pack(identifiers);
+        o.pack(columns);
+        o.pack_array(row_groups.size());
+        for (std::size_t i = 0; i < row_groups.size(); ++i) {
+          o.pack_array(3);
+          o.pack(row_groups[i].data_offset);
+          o.pack(row_groups[i].nrows);
+          pack_blocks(o, row_groups[i].blocks);
+        }
+      }
+
+      std::size_t nrows;
+      experiment_map_type identifiers;
+      column_list columns;
+      std::vector<row_group_info> row_groups;
+      uint64_t end_offset;  ///< The offset of the end of the last row group
+      bool has_footer;
+
+    protected:
+      /**
+       * Try to read the footer at the end of the file
+       */
+      bool read_footer(std::istream &stream, uint64_t file_size) {
+        uint64_t footer_size = 0;
+        char trailer[sizeof(magic)];
+        if (file_size < 2 * sizeof(magic) + sizeof(footer_size)) {
+          return false;
+        }
+        stream.seekg(file_size - sizeof(magic) - sizeof(footer_size));
+        stream.read(reinterpret_cast<char *>(&footer_size), sizeof(footer_size));
+        stream.read(trailer, sizeof(trailer));
+        if (!stream || std::memcmp(trailer, magic, sizeof(magic)) != 0
+            || footer_size + 2 * sizeof(magic) + sizeof(footer_size) > file_size) {
+          return false;
+        }
+        uint64_t footer_offset =
+          file_size - sizeof(magic) - sizeof(footer_size) - footer_size;
+        std::string buffer(footer_size, '\0');
+        stream.seekg(footer_offset);
+        stream.read(&buffer[0], footer_size);
+        if (!stream) {
+          return false;
+        }
+        msgpack::unpacked result;
+        std::size_t off = 0;
+        msgpack::unpack(result, buffer.data(), buffer.size(), off);
+        const msgpack::object &o = result.get();
+        if (o.type != msgpack::type::ARRAY || o.via.array.size != 6) {
+          throw DIALS_ERROR("chunked reflection file: invalid footer");
+        }
+        std::string filetype;
+        std::size_t file_version = 0;
+        o.via.array.ptr[0].convert(filetype);
+        o.via.array.ptr[1].convert(file_version);
+        if (filetype != "dials::af::reflection_table::chunked"
+            || file_version != version) {
+          throw DIALS_ERROR("chunked reflection file: unexpected file type or version");
+        }
+        o.via.array.ptr[2].convert(nrows);
+        o.via.array.ptr[3].convert(identifiers);
+        o.via.array.ptr[4].convert(columns);
+        const msgpack::object &groups = o.via.array.ptr[5];
+        if (groups.type != msgpack::type::ARRAY) {
+          throw DIALS_ERROR("chunked reflection file: row groups are not an array");
+        }
+        row_groups.resize(groups.via.array.size);
+        for (std::size_t i = 0; i < row_groups.size(); ++i) {
+          const msgpack::object &g = groups.via.array.ptr[i];
+          if (g.type != msgpack::type::ARRAY || g.via.array.size != 3) {
+            throw DIALS_ERROR("chunked reflection file: invalid row group");
+          }
+          g.via.array.ptr[0].convert(row_groups[i].data_offset);
+          g.via.array.ptr[1].convert(row_groups[i].nrows);
+          row_groups[i].blocks = unpack_blocks(g.via.array.ptr[2]);
+          DIALS_ASSERT(row_groups[i].blocks.size() == columns.size());
+        }
+        end_offset = footer_offset;
+        has_footer = true;
+        return true;
+      }
+
+      /**
+       * Scan the row groups to rebuild the index. Scanning stops at the
+       * first incomplete row group.
+       */
+      void recover(std::istream &stream, uint64_t file_size) {
+        nrows = 0;
+        row_groups.clear();
+        uint64_t offset = sizeof(magic);
+        while (true) {
+          char group_magic[sizeof(row_group_magic)];
+          uint64_t meta_size = 0;
+          if (offset + sizeof(group_magic) + sizeof(meta_size) > file_size) {
+            break;
+          }
+          stream.seekg(offset);
+          stream.read(group_magic, sizeof(group_magic));
+          stream.read(reinterpret_cast<char *>(&meta_size), sizeof(meta_size));
+          if (!stream
+              || std::memcmp(group_magic, row_group_magic, sizeof(group_magic)) != 0) {
+            break;
+          }
+          uint64_t data_offset =
+            offset + sizeof(group_magic) + sizeof(meta_size) + meta_size;
+          if (data_offset > file_size) {
+            break;
+          }
+          std::string buffer(meta_size, '\0');
+          stream.read(&buffer[0], meta_size);
+          row_group_info group;
+          group.data_offset = data_offset;
+          experiment_map_type group_identifiers;
+          column_list group_columns;
+          try {
+            msgpack::unpacked result;
+            std::size_t off = 0;
+            msgpack::unpack(result, buffer.data(), buffer.size(), off);
+            const msgpack::object &o = result.get();
+            if (o.type != msgpack::type::ARRAY || o.via.array.size != 4) {
+              break;
+            }
+            o.via.array.ptr[0].convert(group.nrows);
+            o.via.array.ptr[1].convert(group_identifiers);
+            o.via.array.ptr[2].convert(group_columns);
+            group.blocks = unpack_blocks(o.via.array.ptr[3]);
+          } catch (const std::exception &) {
+            break;
+          }
+          uint64_t data_size = 0;
+          for (std::size_t i = 0; i < group.blocks.size(); ++i) {
+            data_size += group.blocks[i].nbytes;
+          }
+          if (data_offset + data_size > file_size) {
+            break;
+          }
+          if (row_groups.empty()) {
+            columns = group_columns;
+          } else if (columns != group_columns) {
+            break;
+          }
+          identifiers.insert(group_identifiers.begin(), group_identifiers.end());
+          nrows += group.nrows;
+          row_groups.push_back(group);
+          offset = data_offset + data_size;
+        }
+        end_offset = offset;
+        has_footer = false;
+      }
+    };
+
+    /**
+     * A visitor to encode a column slice into a block
+     */
+    struct encode_visitor : boost::static_visitor<void> {
+      std::size_t first;
+      std::size_t last;
+      int level;
+      std::string &out;
+      block_info &info;
+
+      encode_visitor(std::size_t first_,
+                     std::size_t last_,
+                     int level_,
+                     std::string &out_,
+                     block_info &info_)
+          : first(first_), last(last_), level(level_), out(out_), info(info_) {}
+
+      template <typename T>
+      void operator()(const af::shared<T> &column) const {
+        DIALS_ASSERT(first <= last && last <= column.size());
+        af::const_ref<T> data(column.begin() + first, last - first);
+        std::string raw;
+        column_codec<T>::encode(data, raw);
+        compress_block(raw, column_codec<T>::typesize(), level, out, info);
+        column_statistics(data, info.stats, info.bits);
+      }
+    };
+
+    /**
+     * A visitor to get the type name of a column
+     */
+    struct type_name_visitor : boost::static_visitor<std::string> {
+      template <typename T>
+      std::string operator()(const af::shared<T> &column) const {
+        return msgpack::adaptor::column_type<T>::name();
+      }
+    };
+
+  }  // namespace chunked_file
+
+  /**
+   * A class to write a reflection table in the chunked columnar format. Tables
+   * are split into row groups of a fixed number of rows and each column of
+   * each group is compressed separately. Further tables can be appended to
+   * the file, either from the same writer or by reopening the file in append
+   * mode, provided they have the same columns.
+   */
+  class ChunkedReflectionTableWriter {
+  public:
+    typedef chunked_file::FileIndex FileIndex;
+
+    /**
+     * Open the file for writing
+     * @param filename The output filename
+     * @param rows_per_group The number of rows in each row group
+     * @param compression_level The zlib compression level (0 for none)
+     * @param append Append to an existing file
+     */
+    ChunkedReflectionTableWriter(const std::string &filename,
+                                 std::size_t rows_per_group,
+                                 int compression_level,
+                                 bool append)
+        : rows_per_group_(rows_per_group),
+          compression_level_(compression_level),
+          closed_(false) {
+      DIALS_ASSERT(rows_per_group_ > 0);
+      DIALS_ASSERT(compression_level_ >= 0 && compression_level_ <= 9);
+      if (append) {
+        std::ifstream input(filename.c_str(), std::ios::binary);
+        DIALS_ASSERT(input.is_open());
+        index_.read(input);
+        input.close();
+        stream_.open(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        DIALS_ASSERT(stream_.is_open());
+        stream_.seekp(index_.end_offset);
+      } else {
+        stream_.open(filename.c_str(),
+                     std::ios::out | std::ios::trunc | std::ios::binary);
+        DIALS_ASSERT(stream_.is_open());
+        stream_.write(chunked_file::magic, sizeof(chunked_file::magic));
+      }
+      position_ = index_.end_offset;
+    }
+
+    /**
+     * Close the file on destruction if it has not been closed
+     */
+    ~ChunkedReflectionTableWriter() {
+      if (!closed_) {
+        try {
+          close();
+        } catch (...) {
+          // pass
+        }
+      }
+    }
+
+    /**
+     * Write the table to the file as one or more row groups.
+     * @param table The reflection table
+     */
+    void write(const reflection_table &table) {
+      DIALS_ASSERT(!closed_);
+      DIALS_ASSERT(table.is_consistent());
+      check_columns(table);
+      merge_identifiers(table);
+      for (std::size_t first = 0; first < table.nrows(); first += rows_per_group_) {
+        std::size_t last = std::min(first + rows_per_group_, table.nrows());
+        write_row_group(table, first, last);
+      }
+    }
+
+    /**
+     * Flush the written row groups to disk
+     */
+    void flush() {
+      stream_.flush();
+    }
+
+    /**
+     * Write the footer and close the file
+     */
+    void close() {
+      if (closed_) {
+        return;
+      }
+      closed_ = true;
+      msgpack::sbuffer buffer;
+      msgpack::packer<msgpack::sbuffer> packer(&buffer);
+      index_.pack(packer);
+      uint64_t footer_size = buffer.size();
+      stream_.seekp(position_);
+      stream_.write(buffer.data(), buffer.size());
+      stream_.write(reinterpret_cast<const char *>(&footer_size), sizeof(footer_size));
+      stream_.write(chunked_file::magic, sizeof(chunked_file::magic));
+      stream_.close();
+      DIALS_ASSERT(!stream_.fail());
+    }
+
+    /**
+     * @returns The total number of rows written
+     */
+    std::size_t nrows() const {
+      return index_.nrows;
+    }
+
+    /**
+     * @returns The number of row groups written
+     */
+    std::size_t n_row_groups() const {
+      return index_.row_groups.size();
+    }
+
+  protected:
+    /**
+     * Check the columns in the table match those already in the file
+     */
+    void check_columns(const reflection_table &table) {
+      FileIndex::column_list columns;
+      for (reflection_table::const_iterator it = table.begin(); it != table.end();
+           ++it) {
+        columns.push_back(std::make_pair(
+          it->first,
+          boost::apply_visitor(chunked_file::type_name_visitor(), it->second)));
+      }
+      if (index_.row_groups.empty()) {
+        index_.columns = columns;
+      } else if (columns != index_.columns) {
+        throw DIALS_ERROR("Table columns do not match those in the file");
+      }
+    }
+
+    /**
+     * Add the experiment identifiers to the file index
+     */
+    void merge_identifiers(const reflection_table &table) {
+      typedef reflection_table::experiment_map_type::const_iterator const_iterator;
+      for (const_iterator it = table.experiment_identifiers()->begin();
+           it != table.experiment_identifiers()->end();
+           ++it) {
+        FileIndex::experiment_map_type::iterator found =
+          index_.identifiers.find(it->first);
+        if (found == index_.identifiers.end()) {
+          index_.identifiers[it->first] = it->second;
+        } else if (found->second != it->second) {
+          throw DIALS_ERROR("Experiment identifiers do not match");
+        }
+      }
+    }
+
+    /**
+     * Compress and write a single row group
+     */
+    void write_row_group(const reflection_table &table,
+                         std::size_t first,
+                         std::size_t last) {
+      chunked_file::row_group_info group;
+      group.nrows = last - first;
+      group.blocks.resize(index_.columns.size());
+      std::vector<std::string> data(index_.columns.size());
+      uint64_t offset = 0;
+      std::size_t i = 0;
+      for (reflection_table::const_iterator it = table.begin(); it != table.end();
+           ++it, ++i) {
+        DIALS_ASSERT(it->first == index_.columns[i].first);
+        chunked_file::encode_visitor visitor(
+          first, last, compression_level_, data[i], group.blocks[i]);
+        boost::apply_visitor(visitor, it->second);
+        group.blocks[i].offset = offset;
+        offset += group.blocks[i].nbytes;
+      }
+
+      // Write the row group metadata so the group is self describing
+      msgpack::sbuffer buffer;
+      msgpack::packer<msgpack::sbuffer> packer(&buffer);
+      packer.pack_array(4);
+      packer.pack(group.nrows);
+      packer.pack(index_.identifiers);
+      packer.pack(index_.columns);
+      chunked_file::pack_blocks(packer, group.blocks);
+      uint64_t meta_size = buffer.size();
+      stream_.seekp(position_);
+      stream_.write(chunked_file::row_group_magic,
+                    sizeof(chunked_file::row_group_magic));
+      stream_.write(reinterpret_cast<const char *>(&meta_size), sizeof(meta_size));
+      stream_.write(buffer.data(), buffer.size());
+      for (std::size_t j = 0; j < data.size(); ++j) {
+        stream_.write(data[j].data(), data[j].size());
+      }
+      DIALS_ASSERT(!stream_.fail());
+
+      // Update the index
+      group.data_offset = position_ + sizeof(chunked_file::row_group_magic)
+                          + sizeof(meta_size) + meta_size;
+      position_ = group.data_offset + offset;
+      index_.row_groups.push_back(group);
+      index_.nrows += group.nrows;
+      index_.end_offset = position_;
+    }
+
+    std::size_t rows_per_group_;
+    int compression_level_;
+    bool closed_;
+    std::fstream stream_;
+    FileIndex index_;
+    uint64_t position_;
+  };
+
+  /**
+   * A class to read a reflection table in the chunked columnar format. Only
+   * the blocks for the requested columns and row groups are read from disk,
+   * and row groups can be selected using the per-block statistics.
+   */
+  class ChunkedReflectionTableReader {
+  public:
+    typedef chunked_file::FileIndex FileIndex;
+    typedef reflection_table::experiment_map_type experiment_map_type;
+
+    /**
+     * Open the file and read the index
+     * @param filename The input filename
+     */
+    ChunkedReflectionTableReader(const std::string &filename)
+        : stream_(filename.c_str(), std::ios::binary) {
+      if (!stream_.is_open()) {
+        throw DIALS_ERROR("Unable to open reflection file: " + filename);
+      }
+      index_.read(stream_);
+    }
+
+    /**
+     * @returns The number of rows in the file
+     */
+    std::size_t nrows() const {
+      return index_.nrows;
+    }
+
+    /**
+     * @returns The number of columns in the file
+     */
+    std::size_t ncols() const {
+      return index_.columns.size();
+    }
+
+    /**
+     * @returns The column names
+     */
+    af::shared<std::string> keys() const {
+      af::shared<std::string> result;
+      for (std::size_t i = 0; i < index_.columns.size(); ++i) {
+        result.push_back(index_.columns[i].first);
+      }
+      return result;
+    }
+
+    /**
+     * @returns Does the file contain the column
+     */
+    bool contains(const std::string &key) const {
+      return column_index(key) < index_.columns.size();
+    }
+
+    /**
+     * @returns The number of row groups
+     */
+    std::size_t n_row_groups() const {
+      return index_.row_groups.size();
+    }
+
+    /**
+     * @returns The number of rows in a row group
+     */
+    std::size_t row_group_nrows(std::size_t index) const {
+      DIALS_ASSERT(index < index_.row_groups.size());
+      return index_.row_groups[index].nrows;
+    }
+
+    /**
+     * @returns Was the index read from the footer (false if recovered)
+     */
+    bool has_footer() const {
+      return index_.has_footer;
+    }
+
+    /**
+     * @returns The experiment identifiers
+     */
+    std::shared_ptr<experiment_map_type> experiment_identifiers() const {
+      return std::make_shared<experiment_map_type>(index_.identifiers);
+    }
+
+    /**
+     * @returns All the row groups
+     */
+    af::shared<std::size_t> row_groups() const {
+      af::shared<std::size_t> result;
+      for (std::size_t i = 0; i < index_.row_groups.size(); ++i) {
+        result.push_back(i);
+      }
+      return result;
+    }
+
+    /**
+     * Find the row groups which may contain an experiment id
+     * @param id The experiment id
+     * @returns The row group indices
+     */
+    af::shared<std::size_t> row_groups_with_id(int id) const {
+      af::shared<std::size_t> result;
+      std::size_t col = column_index("id");
+      for (std::size_t i = 0; i < index_.row_groups.size(); ++i) {
+        if (col < ncols()) {
+          const std::vector<double> &stats = index_.row_groups[i].blocks[col].stats;
+          if (stats.size() == 2 && (id < stats[0] || id > stats[1])) {
+            continue;
+          }
+        }
+        result.push_back(i);
+      }
+      return result;
+    }
+
+    /**
+     * Find the row groups which may contain rows with all the flags set
+     * @param mask The flags
+     * @returns The row group indices
+     */
+    af::shared<std::size_t> row_groups_with_flags(std::size_t mask) const {
+      af::shared<std::size_t> result;
+      std::size_t col = column_index("flags");
+      for (std::size_t i = 0; i < index_.row_groups.size(); ++i) {
+        if (col < ncols()) {
+          const std::vector<uint64_t> &bits = index_.row_groups[i].blocks[col].bits;
+          if (bits.size() == 2 && (bits[0] & mask) != mask) {
+            continue;
+          }
+        }
+        result.push_back(i);
+      }
+      return result;
+    }
+
+    /**
+     * Find the row groups which may contain rows with z in the range [z0, z1)
+     * @param key A double or vec3<double> column
+     * @param z0 The start of the range
+     * @param z1 The end of the range
+     * @returns The row group indices
+     */
+    af::shared<std::size_t> row_groups_in_z(const std::string &key,
+                                            double z0,
+                                            double z1) const {
+      af::shared<std::size_t> result;
+      std::size_t col = column_index(key);
+      if (col >= ncols()) {
+        throw dials::error_index("Unknown column '" + key + "'");
+      }
+      for (std::size_t i = 0; i < index_.row_groups.size(); ++i) {
+        const std::vector<double> &stats = index_.row_groups[i].blocks[col].stats;
+        double zmin = 0, zmax = 0;
+        if (stats.size() == 2) {
+          zmin = stats[0];
+          zmax = stats[1];
+        } else if (stats.size() == 6) {
+          zmin = stats[2];
+          zmax = stats[5];
+        } else {
+          result.push_back(i);
+          continue;
+        }
+        if (zmax >= z0 && zmin < z1) {
+          result.push_back(i);
+        }
+      }
+      return result;
+    }
+
+    /**
+     * Read the requested columns from the requested row groups
+     * @param groups The row group indices
+     * @param keys The column names
+     * @returns The reflection table
+     */
+    reflection_table read(const af::const_ref<std::size_t> &groups,
+                          const af::const_ref<std::string> &keys) {
+      std::size_t n = 0;
+      for (std::size_t i = 0; i < groups.size(); ++i) {
+        DIALS_ASSERT(groups[i] < index_.row_groups.size());
+        n += index_.row_groups[groups[i]].nrows;
+      }
+      reflection_table result(n);
+      *result.experiment_identifiers() = index_.identifiers;
+      for (std::size_t i = 0; i < keys.size(); ++i) {
+        std::size_t col = column_index(keys[i]);
+        if (col >= ncols()) {
+          throw dials::error_index("Unknown column '" + keys[i] + "'");
+        }
+        read_column(result, col, groups);
+      }
+      return result;
+    }
+
+    /**
+     * Read the requested columns from all row groups
+     * @param keys The column names
+     * @returns The reflection table
+     */
+    reflection_table read(const af::const_ref<std::string> &keys) {
+      af::shared<std::size_t> groups = row_groups();
+      return read(groups.const_ref(), keys);
+    }
+
+    /**
+     * Read the whole table
+     * @returns The reflection table
+     */
+    reflection_table read() {
+      af::shared<std::string> all_keys = keys();
+      return read(all_keys.const_ref());
+    }
+
+  protected:
+    /**
+     * @returns The index of the column or ncols() if not present
+     */
+    std::size_t column_index(const std::string &key) const {
+      for (std::size_t i = 0; i < index_.columns.size(); ++i) {
+        if (index_.columns[i].first == key) {
+          return i;
+        }
+      }
+      return index_.columns.size();
+    }
+
+    /**
+     * Dispatch on the column type
+     */
+    void read_column(reflection_table &result,
+                     std::size_t col,
+                     const af::const_ref<std::size_t> &groups) {
+      const std::string &name = index_.columns[col].first;
+      const std::string &type = index_.columns[col].second;
+      if (type == "bool") {
+        result[name] = read_typed_column<bool>(col, groups);
+      } else if (type == "int") {
+        result[name] = read_typed_column<int>(col, groups);
+      } else if (type == "std::size_t") {
+        result[name] = read_typed_column<std::size_t>(col, groups);
+      } else if (type == "double") {
+        result[name] = read_typed_column<double>(col, groups);
+      } else if (type == "std::string") {
+        result[name] = read_typed_column<std::string>(col, groups);
+      } else if (type == "vec2<double>") {
+        result[name] = read_typed_column<vec2<double> >(col, groups);
+      } else if (type == "vec3<double>") {
+        result[name] = read_typed_column<vec3<double> >(col, groups);
+      } else if (type == "mat3<double>") {
+        result[name] = read_typed_column<mat3<double> >(col, groups);
+      } else if (type == "int6") {
+        result[name] = read_typed_column<int6>(col, groups);
+      } else if (type == "cctbx::miller::index<>") {
+        result[name] = read_typed_column<cctbx::miller::index<> >(col, groups);
+      } else if (type == "Shoebox<>") {
+        result[name] = read_typed_column<Shoebox<> >(col, groups);
+      } else {
+        throw DIALS_ERROR("chunked reflection file: unexpected column type");
+      }
+    }
+
+    /**
+     * Read and decode the blocks of a column
+     */
+    template <typename T>
+    af::shared<T> read_typed_column(std::size_t col,
+                                    const af::const_ref<std::size_t> &groups) {
+      std::size_t n = 0;
+      for (std::size_t i = 0; i < groups.size(); ++i) {
+        n += index_.row_groups[groups[i]].nrows;
+      }
+      af::shared<T> result(n);
+      std::size_t first = 0;
+      std::string buffer;
+      std::string raw;
+      for (std::size_t i = 0; i < groups.size(); ++i) {
+        const chunked_file::row_group_info &group = index_.row_groups[groups[i]];
+        const chunked_file::block_info &block = group.blocks[col];
+        buffer.resize(block.nbytes);
+        stream_.seekg(group.data_offset + block.offset);
+        stream_.read(&buffer[0], block.nbytes);
+        if (!stream_) {
+          throw DIALS_ERROR("chunked reflection file: unable to read block");
+        }
+        chunked_file::decompress_block(buffer, block, raw);
+        chunked_file::column_codec<T>::decode(
+          raw, af::ref<T>(result.begin() + first, group.nrows));
+        first += group.nrows;
+      }
+      return result;
+    }
+
+    std::ifstream stream_;
+    FileIndex index_;
+  };
+
+}}  // namespace dials::af
+
+#endif  // DIALS_ARRAY_FAMILY_REFLECTION_TABLE_CHUNKED_FILE_H
@@ -187,9 +187,26 @@ MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
       msgpack::packer<Stream>& operator()(
         msgpack::packer<Stream>& o,
         const scitbx::af::const_ref<dials::af::Shoebox<T> >& v) const {
+        std::stringstream buffer;
+        write_records(buffer, v);
+
+        // Serialise the string to msgpack binary
+        std::string buffer_string = buffer.str();
+        o.pack_bin(buffer_string.size());
+        o.pack_bin_body(buffer_string.c_str(), buffer_string.size());
+        return o;
+      }
+
+      /**
+       * Write the raw shoebox records to a stream. This is the content of the
+       * msgpack binary structure.
+       */
+      template <typename Stream>
+      static void write_records(
+        Stream& buffer,
+        const scitbx::af::const_ref<dials::af::Shoebox<T> >& v) {
         typedef typename scitbx::af::const_ref<dials::af::Shoebox<T> >::const_iterator
           iterator;
-        std::stringstream buffer;
         for (iterator it = v.begin(); it != v.end(); ++it) {
           // Write the panel
           write(buffer, (uint32_t)it->panel);
@@ -231,16 +248,10 @@ MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
             write(buffer, (uint8_t)0);
           }
         }
-
-        // Serialise the string to msgpack binary
-        std::string buffer_string = buffer.str();
-        o.pack_bin(buffer_string.size());
-        o.pack_bin_body(buffer_string.c_str(), buffer_string.size());
-        return o;
       }
 
       template <typename Stream, typename ValueType>
-      void write(Stream& buffer, const ValueType& x) const {
+      static void write(Stream& buffer, const ValueType& x) {
         buffer.write((const char*)&x, sizeof(ValueType));
       }
     };
@@ -0,0 +1,277 @@
+/*
+ * reflection_table_msgpack_reader.h
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+#ifndef DIALS_ARRAY_FAMILY_REFLECTION_TABLE_MSGPACK_READER_H
+#define DIALS_ARRAY_FAMILY_REFLECTION_TABLE_MSGPACK_READER_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <dials/array_family/reflection_table.h>
+#include <dials/array_family/reflection_table_msgpack_adapter.h>
+#include <dials/error.h>
+
+namespace dials { namespace af {
+
+  /**
+   * A class to read a reflection table from a msgpack file on demand.
+   *
+   * The file is memory mapped and, on construction, only the structure of the
+   * file is parsed to find the location of each column in the mapped buffer.
+   * Columns are then decoded the first time they are accessed, so reading a
+   * subset of the columns skips the others.
+   */
+  class MsgpackReflectionTableReader {
+  public:
+    typedef reflection_table::key_type key_type;
+    typedef reflection_table::mapped_type mapped_type;
+    typedef reflection_table::experiment_map_type experiment_map_type;
+
+    /**
+     * Map the file and index the columns
+     * @param filename The msgpack reflection file
+     */
+    MsgpackReflectionTableReader(const std::string &filename)
+        : nrows_(0), experiment_identifiers_(std::make_shared<experiment_map_type>()) {
+      try {
+        mapping_ = boost::interprocess::file_mapping(filename.c_str(),
+                                                     boost::interprocess::read_only);
+        region_ =
+          boost::interprocess::mapped_region(mapping_, boost::interprocess::read_only);
+      } catch (const boost::interprocess::interprocess_exception &e) {
+        throw DIALS_ERROR(std::string("Unable to map reflection file: ") + e.what());
+      }
+      index();
+    }
+
+    /**
+     * @returns The number of rows in the table
+     */
+    std::size_t nrows() const {
+      return nrows_;
+    }
+
+    /**
+     * @returns The number of columns in the table
+     */
+    std::size_t ncols() const {
+      return columns_.size();
+    }
+
+    /**
+     * @returns The column names in file order
+     */
+    af::shared<std::string> keys() const {
+      af::shared<std::string> result;
+      for (std::size_t i = 0; i < columns_.size(); ++i) {
+        result.push_back(columns_[i].name);
+      }
+      return result;
+    }
+
+    /**
+     * @returns Does the file contain the column
+     */
+    bool contains(const key_type &key) const {
+      return lookup_.find(key) != lookup_.end();
+    }
+
+    /**
+     * @returns The type name of the column as stored in the file
+     */
+    std::string column_type_name(const key_type &key) const {
+      return find(key).type;
+    }
+
+    /**
+     * @returns The experiment identifiers
+     */
+    std::shared_ptr<experiment_map_type> experiment_identifiers() const {
+      return experiment_identifiers_;
+    }
+
+    /**
+     * Get a column, decoding it the first time it is accessed.
+     * @param key The column name
+     * @returns The column
+     */
+    mapped_type column(const key_type &key) {
+      std::map<key_type, mapped_type>::iterator it = cache_.find(key);
+      if (it == cache_.end()) {
+        mapped_type value;
+        find(key).object.convert(value);
+        it = cache_.insert(std::make_pair(key, value)).first;
+      }
+      return it->second;
+    }
+
+    /**
+     * Decode a set of columns into a reflection table.
+     * @param keys The columns to read
+     * @returns The reflection table
+     */
+    reflection_table as_reflection_table(const af::const_ref<std::string> &keys) {
+      reflection_table result(nrows_);
+      *result.experiment_identifiers() = *experiment_identifiers_;
+      for (std::size_t i = 0; i < keys.size(); ++i) {
+        result[keys[i]] = column(keys[i]);
+      }
+      return result;
+    }
+
+    /**
+     * Decode all the columns into a reflection table.
+     * @returns The reflection table
+     */
+    reflection_table as_reflection_table() {
+      af::shared<std::string> all_keys = keys();
+      return as_reflection_table(all_keys.const_ref());
+    }
+
+  protected:
+    /**
+     * Information about the location of a column in the mapped buffer
+     */
+    struct column_info {
+      std::string name;
+      std::string type;
+      std::size_t size;
+      msgpack::object object;
+    };
+
+    /**
+     * Strings and binary data reference the mapped buffer rather than being
+     * copied into the msgpack zone.
+     */
+    static bool reference_func(msgpack::type::object_type type,
+                               std::size_t length,
+                               void *user_data) {
+      return true;
+    }
+
+    /**
+     * Parse the msgpack structure and record the location of each column.
+     * The structure is as written by pack<dials::af::reflection_table>.
+     */
+    void index() {
+      const char *data = static_cast<const char *>(region_.get_address());
+      std::size_t size = region_.get_size();
+      std::size_t off = 0;
+      msgpack::unpack(unpacked_, data, size, off, reference_func);
+      const msgpack::object &o = unpacked_.get();
+
+      // Check the header
+      if (o.type != msgpack::type::ARRAY || o.via.array.size != 3) {
+        throw DIALS_ERROR("dials::af::reflection_table: msgpack type is not an array");
+      }
+      std::string filetype;
+      o.via.array.ptr[0].convert(filetype);
+      if (filetype != "dials::af::reflection_table") {
+        throw DIALS_ERROR(
+          "dials::af::reflection_table: expected dials::af::reflection_table, got "
+          "something else");
+      }
+      std::size_t version;
+      o.via.array.ptr[1].convert(version);
+      if (version != 1) {
+        throw DIALS_ERROR(
+          "dials::af::reflection_table: expected version 1, got something else");
+      }
+      const msgpack::object &header = o.via.array.ptr[2];
+      if (header.type != msgpack::type::MAP) {
+        throw DIALS_ERROR(
+          "dials::af::reflection_table: header msgpack type is not an map");
+      }
+
+      // Read the metadata and find the column map
+      const msgpack::object *map_object = NULL;
+      bool found_nrows = false;
+      for (std::size_t i = 0; i < header.via.map.size; ++i) {
+        const msgpack::object_kv &kv = header.via.map.ptr[i];
+        std::string name;
+        kv.key.convert(name);
+        if (name == "nrows") {
+          kv.val.convert(nrows_);
+          found_nrows = true;
+        } else if (name == "identifiers") {
+          if (kv.val.type != msgpack::type::MAP) {
+            throw DIALS_ERROR("dials::af::reflection_table: identifier data not found");
+          }
+          for (std::size_t j = 0; j < kv.val.via.map.size; ++j) {
+            experiment_map_type::key_type key = -1;
+            experiment_map_type::mapped_type value;
+            kv.val.via.map.ptr[j].key.convert(key);
+            kv.val.via.map.ptr[j].val.convert(value);
+            (*experiment_identifiers_)[key] = value;
+          }
+        } else if (name == "data") {
+          map_object = &kv.val;
+        } else {
+          throw DIALS_ERROR(
+            "dials::af::reflection_table: unknown key in reflection file");
+        }
+      }
+      if (!found_nrows) {
+        throw DIALS_ERROR("dials::af::reflection_table: number of rows not found");
+      }
+      if (map_object == NULL || map_object->type != msgpack::type::MAP) {
+        throw DIALS_ERROR("dials::af::reflection_table: table data not found");
+      }
+
+      // Record the location of each column without decoding it
+      for (std::size_t i = 0; i < map_object->via.map.size; ++i) {
+        const msgpack::object_kv &kv = map_object->via.map.ptr[i];
+        column_info info;
+        kv.key.convert(info.name);
+        const msgpack::object &column = kv.val;
+        if (column.type != msgpack::type::ARRAY || column.via.array.size != 2) {
+          throw DIALS_ERROR(
+            "dials::af::reflection_table::mapped_type: msgpack array does not have "
+            "correct dimensions");
+        }
+        column.via.array.ptr[0].convert(info.type);
+        const msgpack::object &content = column.via.array.ptr[1];
+        if (content.type != msgpack::type::ARRAY || content.via.array.size != 2
+            || content.via.array.ptr[1].type != msgpack::type::BIN) {
+          throw DIALS_ERROR("scitbx::af::shared: msgpack array is not [size, BIN]");
+        }
+        content.via.array.ptr[0].convert(info.size);
+        if (info.size != nrows_) {
+          throw DIALS_ERROR("dials::af::reflection_table: inconsistent column size");
+        }
+        info.object = column;
+        lookup_[info.name] = columns_.size();
+        columns_.push_back(info);
+      }
+    }
+
+    /**
+     * Find the column info or throw a KeyError
+     */
+    const column_info &find(const key_type &key) const {
+      std::map<key_type, std::size_t>::const_iterator it = lookup_.find(key);
+      if (it == lookup_.end()) {
+        throw dials::error_index("Unknown column '" + key + "'");
+      }
+      return columns_[it->second];
+    }
+
+    boost::interprocess::file_mapping mapping_;
+    boost::interprocess::mapped_region region_;
+    msgpack::unpacked unpacked_;
+    std::size_t nrows_;
+    std::shared_ptr<experiment_map_type> experiment_identifiers_;
+    std::vector<column_info> columns_;
+    std::map<key_type, std::size_t> lookup_;
+    std::map<key_type, mapped_type> cache_;
+  };
+
+}}  // namespace dials::af
+
+#endif  // DIALS_ARRAY_FAMILY_REFLECTION_TABLE_MSGPACK_READER_H
@@ -0,0 +1,301 @@
+/*
+ * reflection_table_msgpack_writer.h
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+#ifndef DIALS_ARRAY_FAMILY_REFLECTION_TABLE_MSGPACK_WRITER_H
+#define DIALS_ARRAY_FAMILY_REFLECTION_TABLE_MSGPACK_WRITER_H
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+#include <dials/array_family/reflection_table.h>
+#include <dials/array_family/reflection_table_msgpack_adapter.h>
+#include <dials/util/thread_pool.h>
+#include <dials/error.h>
+
+namespace dials { namespace af {
+
+  /**
+   * A class to serialise a reflection table in msgpack format using multiple
+   * threads. The output is byte-for-byte identical to
+   * msgpack::pack<dials::af::reflection_table>.
+   *
+   * The serialised table is held as a list of segments which are written to
+   * the output stream in order. The msgpack headers for each column are small
+   * buffers; the binary content of plain data columns is written directly from
+   * the column memory without any intermediate copy; shoebox columns are split
+   * into chunks which are serialised into independent buffers on a thread
+   * pool.
+   */
+  class ReflectionTableMsgpackWriter {
+  public:
+    /**
+     * Serialise the table
+     * @param table The reflection table
+     * @param nthreads The number of threads
+     * @param shoebox_chunk_size The number of shoeboxes in each chunk
+     */
+    ReflectionTableMsgpackWriter(const reflection_table &table,
+                                 std::size_t nthreads,
+                                 std::size_t shoebox_chunk_size)
+        : shoebox_chunk_size_(shoebox_chunk_size) {
+      DIALS_ASSERT(nthreads > 0);
+      DIALS_ASSERT(shoebox_chunk_size > 0);
+      parts_.reserve(table.ncols() + 1);
+      pack_header(table);
+      for (reflection_table::const_iterator it = table.begin(); it != table.end();
+           ++it) {
+        boost::apply_visitor(column_visitor(*this, it->first), it->second);
+      }
+      serialise_shoeboxes(nthreads);
+    }
+
+    /**
+     * Write the segments to the output stream in order
+     * @param stream The output stream
+     */
+    template <typename Stream>
+    void write(Stream &stream) const {
+      for (std::size_t i = 0; i < parts_.size(); ++i) {
+        const part &p = parts_[i];
+        stream.write(p.header.data(), p.header.size());
+        if (p.is_shoebox) {
+          std::string bin_header = shoebox_bin_header(p);
+          stream.write(bin_header.data(), bin_header.size());
+          for (std::size_t j = 0; j < p.chunks.size(); ++j) {
+            stream.write(p.chunks[j].data(), p.chunks[j].size());
+          }
+        } else if (p.size > 0) {
+          stream.write(p.data, p.size);
+        }
+      }
+    }
+
+    /**
+     * @returns The total size of the serialised table
+     */
+    std::size_t size() const {
+      std::size_t result = 0;
+      for (std::size_t i = 0; i < parts_.size(); ++i) {
+        const part &p = parts_[i];
+        result += p.header.size();
+        if (p.is_shoebox) {
+          result += shoebox_bin_header(p).size() + shoebox_size(p);
+        } else {
+          result += p.size;
+        }
+      }
+      return result;
+    }
+
+  protected:
+    /**
+     * A part of the output consisting of a msgpack header followed by binary
+     * content. The content is either a pointer into the column or, for
+     * shoeboxes, a list of serialised chunks.
+     */
+    struct part {
+      std::string header;
+      const char *data;
+      std::size_t size;
+      bool is_shoebox;
+      af::shared<Shoebox<> > shoeboxes;
+      std::vector<std::string> chunks;
+      std::vector<std::string> errors;
+
+      part() : data(0), size(0), is_shoebox(false) {}
+    };
+
+    /**
+     * A stream interface to append to a string
+     */
+    struct string_writer {
+      std::string &buffer;
+      string_writer(std::string &buffer_) : buffer(buffer_) {}
+      void write(const char *data, std::size_t size) {
+        buffer.append(data, size);
+      }
+    };
+
+    /**
+     * A visitor to add the segments for each column
+     */
+    struct column_visitor : boost::static_visitor<void> {
+      ReflectionTableMsgpackWriter &writer;
+      const std::string &key;
+      column_visitor(ReflectionTableMsgpackWriter &writer_, const std::string &key_)
+          : writer(writer_), key(key_) {}
+      template <typename T>
+      void operator()(const af::shared<T> &column) const {
+        writer.add_column(key, column);
+      }
+    };
+
+    /**
+     * A job to serialise a chunk of shoeboxes
+     */
+    struct shoebox_job {
+      part *p;
+      std::size_t index;
+      std::size_t first;
+      std::size_t last;
+
+      shoebox_job(part *p_, std::size_t index_, std::size_t first_, std::size_t last_)
+          : p(p_), index(index_), first(first_), last(last_) {}
+
+      void operator()() const {
+        typedef msgpack::adaptor::pack<af::const_ref<Shoebox<> > > packer_type;
+        try {
+          string_writer buffer(p->chunks[index]);
+          packer_type::write_records(
+            buffer,
+            af::const_ref<Shoebox<> >(p->shoeboxes.begin() + first, last - first));
+        } catch (const std::exception &e) {
+          p->errors[index] = e.what();
+        } catch (...) {
+          p->errors[index] = "Unknown error serialising shoeboxes";
+        }
+      }
+    };
+
+    /**
+     * Pack the table header up to and including the data map header. This
+     * mirrors pack<dials::af::reflection_table>.
+     */
+    void pack_header(const reflection_table &table) {
+      typedef reflection_table::experiment_map_type::const_iterator const_iterator;
+      msgpack::sbuffer buffer;
+      msgpack::packer<msgpack::sbuffer> o(&buffer);
+      std::string filetype = "dials::af::reflection_table";
+      std::size_t version = 1;
+      o.pack_array(3);
+      o.pack(filetype);
+      o.pack(version);
+      o.pack_map(3);
+      o.pack("identifiers");
+      o.pack_map(table.experiment_identifiers()->size());
+      for (const_iterator it = table.experiment_identifiers()->begin();
+           it != table.experiment_identifiers()->end();
+           ++it) {
+        o.pack(it->first);
+        o.pack(it->second);
+      }
+      o.pack("nrows");
+      o.pack(table.nrows());
+      o.pack("data");
+      o.pack_map(table.ncols());
+      parts_.push_back(part());
+      parts_.back().header.assign(buffer.data(), buffer.size());
+    }
+
+    /**
+     * Add a plain data column. The content is not copied.
+     */
+    template <typename T>
+    void add_column(const std::string &key, const af::shared<T> &column) {
+      std::size_t binary_size =
+        column.size() * msgpack::adaptor::element_size_helper<T>::size();
+      msgpack::sbuffer buffer;
+      msgpack::packer<msgpack::sbuffer> o(&buffer);
+      o.pack(key);
+      o.pack_array(2);
+      o.pack(msgpack::adaptor::column_type<T>::name());
+      o.pack_array(2);
+      o.pack(column.size());
+      o.pack_bin(binary_size);
+      parts_.push_back(part());
+      part &p = parts_.back();
+      p.header.assign(buffer.data(), buffer.size());
+      p.data = reinterpret_cast<const char *>(column.begin());
+      p.size = binary_size;
+      columns_.push_back(column);
+    }
+
+    /**
+     * Add a shoebox column. The binary header is written once the size of the
+     * serialised chunks is known.
+     */
+    void add_column(const std::string &key, const af::shared<Shoebox<> > &column) {
+      msgpack::sbuffer buffer;
+      msgpack::packer<msgpack::sbuffer> o(&buffer);
+      o.pack(key);
+      o.pack_array(2);
+      o.pack(msgpack::adaptor::column_type<Shoebox<> >::name());
+      o.pack_array(2);
+      o.pack(column.size());
+      parts_.push_back(part());
+      part &p = parts_.back();
+      p.header.assign(buffer.data(), buffer.size());
+      p.is_shoebox = true;
+      p.shoeboxes = column;
+      std::size_t nchunks =
+        (column.size() + shoebox_chunk_size_ - 1) / shoebox_chunk_size_;
+      p.chunks.resize(nchunks);
+      p.errors.resize(nchunks);
+    }
+
+    /**
+     * Serialise all the shoebox chunks, in parallel if requested
+     */
+    void serialise_shoeboxes(std::size_t nthreads) {
+      std::vector<shoebox_job> jobs;
+      for (std::size_t i = 0; i < parts_.size(); ++i) {
+        part &p = parts_[i];
+        for (std::size_t j = 0; j < p.chunks.size(); ++j) {
+          std::size_t first = j * shoebox_chunk_size_;
+          std::size_t last = std::min(first + shoebox_chunk_size_, p.shoeboxes.size());
+          jobs.push_back(shoebox_job(&p, j, first, last));
+        }
+      }
+      if (nthreads == 1 || jobs.size() <= 1) {
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+          jobs[i]();
+        }
+      } else {
+        dials::util::ThreadPool pool(std::min(nthreads, jobs.size()));
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+          pool.post(jobs[i]);
+        }
+        pool.wait();
+      }
+      for (std::size_t i = 0; i < parts_.size(); ++i) {
+        for (std::size_t j = 0; j < parts_[i].errors.size(); ++j) {
+          if (!parts_[i].errors[j].empty()) {
+            throw DIALS_ERROR(parts_[i].errors[j]);
+          }
+        }
+      }
+    }
+
+    /**
+     * @returns The size of the serialised shoeboxes
+     */
+    static std::size_t shoebox_size(const part &p) {
+      std::size_t size = 0;
+      for (std::size_t j = 0; j < p.chunks.size(); ++j) {
+        size += p.chunks[j].size();
+      }
+      return size;
+    }
+
+    /**
+     * @returns The msgpack binary header for the serialised shoeboxes
+     */
+    static std::string shoebox_bin_header(const part &p) {
+      msgpack::sbuffer buffer;
+      msgpack::packer<msgpack::sbuffer> o(&buffer);
+      o.pack_bin(shoebox_size(p));
+      return std::string(buffer.data(), buffer.size());
+    }
+
+    std::size_t shoebox_chunk_size_;
+    std::vector<part> parts_;
+    std::vector<reflection_table::mapped_type> columns_;
+  };
+
+}}  // namespace dials::af
+
+#endif  // DIALS_ARRAY_FAMILY_REFLECTION_TABLE_MSGPACK_WRITER_H
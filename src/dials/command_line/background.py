@@ -122,6 +122,15 @@ def run(args=None):
         intensities = []
         sigmas = []
 
+        # The mask from the masking parameters and the two-theta of each pixel
+        # are the same for every image, so compute them once per imageset
+        static_mask = dials.util.masking.generate_mask(imageset, params.masking)[0]
+        two_theta_array = (
+            imageset.get_detector()[0]
+            .get_two_theta_array(imageset.get_beam().get_s0())
+            .as_1d()
+        )
+
         for indx in images:
             logger.info(f"For imageset {i_imgset} image {indx}:")
             d, I, sig = background(
@@ -131,6 +140,8 @@ def run(args=None):
                 corrected=params.corrected,
                 mask_params=params.masking,
                 show_summary=True,
+                static_mask=static_mask,
+                two_theta_array=two_theta_array,
             )
 
             msg = [f"{'d':>8} {'I':>8} {'sig':>8}"]
@@ -174,8 +185,18 @@ def run(args=None):
 
 
 def background(
-    imageset, indx, n_bins, corrected=False, mask_params=None, show_summary=False
+    imageset,
+    indx,
+    n_bins,
+    corrected=False,
+    mask_params=None,
+    show_summary=False,
+    static_mask=None,
+    two_theta_array=None,
 ):
+    """Compute the radial profile of the background on an image. The mask from
+    mask_params and the two-theta array of the panel do not depend on the
+    image, so may be passed in when processing several images."""
     if mask_params is None:
         # Default mask params for trusted range
         mask_params = phil_scope.fetch(parse("")).extract().masking
@@ -187,8 +208,9 @@ def background(
     assert len(detector) == 1
     panel = detector[0]
     imageset_mask = imageset.get_mask(indx)[0]
-    mask = dials.util.masking.generate_mask(imageset, mask_params)[0]
-    mask = imageset_mask & mask
+    if static_mask is None:
+        static_mask = dials.util.masking.generate_mask(imageset, mask_params)[0]
+    mask = imageset_mask & static_mask
 
     n = matrix.col(panel.get_normal()).normalize()
     b = matrix.col(beam.get_s0()).normalize()
@@ -234,8 +256,9 @@ def background(
     # the radial profile out, need to set the number of bins
     # sensibly; inspired by method in PyFAI
 
-    two_theta_array = panel.get_two_theta_array(beam.get_s0())
-    two_theta_array = two_theta_array.as_1d().select(background_pixels.iselection())
+    if two_theta_array is None:
+        two_theta_array = panel.get_two_theta_array(beam.get_s0()).as_1d()
+    two_theta_array = two_theta_array.select(background_pixels.iselection())
 
     # Use flex.weighted_histogram
     h0 = flex.weighted_histogram(two_theta_array, n_slots=n_bins)
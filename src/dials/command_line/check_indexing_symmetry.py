@@ -266,7 +266,10 @@ def test_P1_crystal_indexing(reflections, experiment, params):
     logger.info("dH dK dL %6s %5s", "Nref", "CC")
 
     if params.reference:
-        reference = flex.reflection_table.from_file(params.reference)
+        reference = flex.reflection_table.from_file(
+            params.reference,
+            columns=["miller_index", "intensity.sum.value", "intensity.sum.variance"],
+        )
     else:
         reference = None
 
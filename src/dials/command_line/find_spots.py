@@ -15,6 +15,7 @@
 from dials.util.ascii_art import spot_counts_per_image_plot
 from dials.util.multi_dataset_handling import generate_experiment_identifiers
 from dials.util.options import ArgumentParser, flatten_experiments
+from dials.util.system import CPU_COUNT
 from dials.util.version import dials_version
 
 logger = logging.getLogger("dials.command_line.find_spots")
@@ -160,7 +161,10 @@ def do_spotfinding(
             for k in reflections.experiment_identifiers().keys():
                 del reflections.experiment_identifiers()[k]
 
-    reflections.as_file(params.output.reflections)
+    nproc = params.spotfinder.mp.nproc
+    if nproc is libtbx.Auto:
+        nproc = CPU_COUNT
+    reflections.as_file(params.output.reflections, nthreads=nproc)
 
     logger.info(
         "Saved %s reflections to %s", len(reflections), params.output.reflections
@@ -29,6 +29,7 @@
 from orderedset import OrderedSet
 
 from dxtbx.model.experiment_list import Experiment, ExperimentList
+from libtbx import Auto
 from libtbx.phil import parse
 
 import dials.util.log
@@ -40,6 +41,7 @@
 from dials.util.exclude_images import expand_exclude_multiples, set_invalid_images
 from dials.util.options import ArgumentParser, reflections_and_experiments_from_files
 from dials.util.slice import slice_crystal
+from dials.util.system import CPU_COUNT
 from dials.util.version import dials_version
 
 logger = logging.getLogger("dials.command_line.integrate")
@@ -215,13 +217,14 @@ def process_reference(reference):
     return reference, rubbish
 
 
-def filter_reference_pixels(reference, experiments):
+def filter_reference_pixels(reference, experiments, nthreads=1):
     """
     Set any pixel closer to other reflections to background.
 
     Args:
         reference: A reflection table
         experiments: The experiment list
+        nthreads: The number of threads to compute the pixel miller indices
 
     Returns:
         The input reflection table with modified shoeboxes.
@@ -236,6 +239,7 @@ def filter_reference_pixels(reference, experiments):
             experiment.goniometer,
             experiment.scan,
             experiment.crystal,
+            nthreads=nthreads,
         )
         modified_count += modified.count(True)
         reference.set_selected(indices, subset)
@@ -461,7 +465,10 @@ def run_integration(params, experiments, reference=None):
 
         # Check pixels don't belong to neighbours
         if exp.goniometer is not None and exp.scan is not None:
-            reference = filter_reference_pixels(reference, experiments)
+            nproc = params.integration.mp.nproc
+            if nproc is Auto:
+                nproc = CPU_COUNT
+            reference = filter_reference_pixels(reference, experiments, nproc)
 
         # Modify experiment list if scan range is set.
         experiments, reference = split_for_scan_range(
@@ -754,7 +761,10 @@ def run(args=None, phil=working_phil):
         logger.info(
             "Saving %d reflections to %s", reflections.size(), params.output.reflections
         )
-        reflections.as_file(params.output.reflections)
+        nproc = params.integration.mp.nproc
+        if nproc is Auto:
+            nproc = CPU_COUNT
+        reflections.as_file(params.output.reflections, nthreads=nproc)
         logger.info("Saving the experiments to %s", params.output.experiments)
         experiments.as_file(params.output.experiments)
 
@@ -14,10 +14,12 @@
 import pickle
 import sys
 
+import libtbx
 from libtbx.phil import parse
 
 import dials.util
 import dials.util.log
+from dials.util.system import CPU_COUNT
 
 logger = logging.getLogger("dials.command_line.model_background")
 
@@ -89,6 +91,11 @@
       .type = choice
       .help = "Which image to use"
 
+    nproc = Auto
+      .type = int(value_min=1)
+      .help = "The number of threads to use for the median filter. If set to"
+              "Auto, DIALS will choose automatically."
+
   }
 
   include scope dials.algorithms.integration.integrator.phil_scope
@@ -230,6 +237,10 @@ def run(self, args=None):
             params.integration.mp.nproc = 1
             params.integration.mp.njobs = 1
 
+        # The model is finalized in this process once the images are read
+        if params.modeller.nproc is libtbx.Auto:
+            params.modeller.nproc = CPU_COUNT
+
         from dials.util.version import dials_version
 
         logger.info(dials_version())
@@ -54,9 +54,14 @@
     .type = bool
     .optional = True
     .short_caption = Ignore masks from dxtbx class
+  trilinear = False
+    .type = bool
+    .help = "Spread each pixel over the 8 nearest voxels with trilinear weights"
+            "instead of adding it to the nearest voxel."
   nproc = Auto
-    .help = "Number of processes over which to split the calculation. If set to"
-            "Auto, DIALS will choose automatically."
+    .help = "Number of processes over which to split the calculation. If"
+            "there are too few images to split, the mapping uses this many"
+            "threads instead. If set to Auto, DIALS will choose automatically."
     .type = int(value_min=1)
     .expert_level = 1
 }
@@ -77,12 +82,27 @@
 
 
 def process_block(
-    block, imageset, i_panel, grid_size, reverse_phi, S, ignore_mask, xy, rec_range
+    block,
+    imageset,
+    i_panel,
+    grid_size,
+    reverse_phi,
+    S,
+    ignore_mask,
+    xy,
+    rec_range,
+    trilinear,
+    nthreads,
 ):
-    grid = flex.double(flex.grid(grid_size, grid_size, grid_size), 0)
-    counts = flex.int(flex.grid(grid_size, grid_size, grid_size), 0)
-
-    axis = imageset.get_goniometer().get_rotation_axis()
+    mapper = recviewer.VoxelMapper(
+        grid_size,
+        rec_range,
+        S,
+        xy,
+        imageset.get_goniometer().get_rotation_axis(),
+        trilinear=trilinear,
+        nthreads=nthreads,
+    )
     for i in block:
         osc_range = imageset.get_scan(i).get_oscillation_range()
 
@@ -90,16 +110,15 @@ def process_block(
         if not reverse_phi:
             # the pixel is in S AFTER rotation. Thus we have to rotate BACK.
             angle *= -1
-        rotated_S = S.rotate_around_origin(axis, angle)
 
         data = imageset.get_raw_data(i)[i_panel]
         if not ignore_mask:
             mask = imageset.get_mask(i)[i_panel]
             data.set_selected(~mask, 0)
 
-        recviewer.fill_voxels(data, grid, counts, rotated_S, xy, rec_range)
+        mapper.add(data, angle)
 
-    return grid, counts
+    return mapper.grid(), mapper.counts()
 
 
 class Script:
@@ -140,11 +159,12 @@ def run(self, args=None):
         self.grid_size = params.rs_mapper.grid_size
         self.max_resolution = params.rs_mapper.max_resolution
         self.ignore_mask = params.rs_mapper.ignore_mask
+        self.trilinear = params.rs_mapper.trilinear
 
         self.grid = flex.double(
             flex.grid(self.grid_size, self.grid_size, self.grid_size), 0
         )
-        self.counts = flex.int(
+        self.counts = flex.double(
             flex.grid(self.grid_size, self.grid_size, self.grid_size), 0
         )
 
@@ -216,38 +236,27 @@ def process_imageset(self, imageset, i_panel):
         ]
         logger.info(dials.util.tabulate(rows, header, numalign="right") + "\n")
 
+        # Each block is read and mapped in its own process. A single block is
+        # mapped in this process on nproc threads instead.
+        args = (
+            imageset,
+            i_panel,
+            self.grid_size,
+            self.reverse_phi,
+            S,
+            self.ignore_mask,
+            xy,
+            rec_range,
+            self.trilinear,
+        )
         if len(blocks) == 1:
-            results = [
-                process_block(
-                    blocks[0],
-                    imageset,
-                    i_panel,
-                    self.grid_size,
-                    self.reverse_phi,
-                    S,
-                    self.ignore_mask,
-                    xy,
-                    rec_range,
-                ),
-            ]
+            results = [process_block(blocks[0], *args, self.nproc)]
         else:
             with concurrent.futures.ProcessPoolExecutor(
                 max_workers=len(blocks)
             ) as pool:
                 results = [
-                    pool.submit(
-                        process_block,
-                        block,
-                        imageset,
-                        i_panel,
-                        self.grid_size,
-                        self.reverse_phi,
-                        S,
-                        self.ignore_mask,
-                        xy,
-                        rec_range,
-                    )
-                    for block in blocks
+                    pool.submit(process_block, block, *args, 1) for block in blocks
                 ]
             results = [e.result() for e in results]
 
@@ -28,6 +28,22 @@ def phil():
       min_pixels = 10
         .type = int(value_min=1)
         .help = "The minimum number of pixels required"
+
+      tile_size = None
+        .type = int(value_min=1)
+        .help = "When integrating from an image volume, fit the background"
+                "once for each square tile of this size on each frame and"
+                "panel, and share it between all the shoeboxes on the tile,"
+                "rather than fitting each shoebox separately. Each tile is"
+                "fitted with a constant model, ignoring the model algorithm."
+        .expert_level = 2
+
+      nthreads = 1
+        .type = int(value_min=1)
+        .help = "The number of threads used to fit the tiles when tile_size"
+                "is set. These threads are started within each integration"
+                "process, so the total is nthreads times integration.mp.nproc."
+        .expert_level = 2
     """
         )
         return phil
@@ -55,6 +71,8 @@ def __init__(self, params, experiments):
             tuning_constant=params.robust.tuning_constant,
             model=params.model.algorithm,
             min_pixels=params.min_pixels,
+            tile_size=params.tile_size,
+            nthreads=params.nthreads,
         )
 
     def compute_background(self, reflections, image_volume=None):
@@ -21,6 +21,13 @@
 n_bins = 100
     .type = int
     .help = "Number of 2θ bins in which to calculate background"
+
+nthreads = 1
+    .type = int(value_min=1)
+    .help = "The number of threads used for the blurring convolution. These"
+            "threads are started within each spot finding process, so the"
+            "total is nthreads times spotfinder.mp.nproc."
+    .expert_level = 2
 """
 
 
@@ -99,7 +106,11 @@ def compute_threshold(
         """
 
         if self.kernel:
-            image = convolve(image, self.kernel)
+            image = convolve(
+                image,
+                self.kernel,
+                nthreads=self.params.spotfinder.threshold.radial_profile.nthreads,
+            )
 
         panel = imageset.get_detector()[i_panel]
         beam = imageset.get_beam()
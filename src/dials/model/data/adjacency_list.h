@@ -11,31 +11,152 @@
 #ifndef DIALS_MODEL_ADJACENCY_LIST_H
 #define DIALS_MODEL_ADJACENCY_LIST_H
 
-#include <iostream>
-#include <deque>
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <utility>
 #include <vector>
+#include <dials/array_family/scitbx_shared_and_versa.h>
 #include <dials/error.h>
 
 namespace dials { namespace model {
 
-  // Create the adjacency list type
-  // typedef boost::adjacency_list<
-  //  boost::listS,
-  //  boost::vecS,
-  //  boost::undirectedS> AdjacencyList;
-
-  // typedef boost_adaptbx::graph_type::adjacency_list_undirected_vecS_setS_type
-  // AdjacencyList;
-
+  /**
+   * An undirected graph stored in compressed sparse row format. The
+   * neighbours of each vertex are stored contiguously and in increasing
+   * order, with the offset of each vertex's neighbours in a separate array,
+   * so each undirected edge is stored once for each of its vertices.
+   *
+   * The graph can be built directly from a set of edges, or the edges can
+   * be added one at a time with add_edge and the graph built by finish.
+   * Once built, the graph is not modified by any const method so it can be
+   * shared between threads without locking.
+   */
   class AdjacencyList {
   public:
+    typedef std::uint32_t vertex_index;
     typedef std::pair<std::size_t, std::size_t> edge_descriptor;
-    typedef std::deque<edge_descriptor> edge_list;
-    typedef edge_list::const_iterator edge_iterator;
+
+    /**
+     * An iterator over the edges in the graph. Each edge is given as a
+     * (source, target) pair, in order of source and then target.
+     */
+    class edge_iterator {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef edge_descriptor value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const edge_descriptor *pointer;
+      typedef const edge_descriptor &reference;
+
+      edge_iterator() : list_(0), vertex_(0), position_(0) {}
+
+      edge_iterator(const AdjacencyList *list,
+                    std::size_t vertex,
+                    std::size_t position)
+          : list_(list), vertex_(vertex), position_(position) {
+        update();
+      }
+
+      reference operator*() const {
+        return value_;
+      }
+
+      pointer operator->() const {
+        return &value_;
+      }
+
+      edge_iterator &operator++() {
+        ++position_;
+        update();
+        return *this;
+      }
+
+      edge_iterator operator++(int) {
+        edge_iterator result(*this);
+        ++(*this);
+        return result;
+      }
+
+      bool operator==(const edge_iterator &other) const {
+        return position_ == other.position_;
+      }
+
+      bool operator!=(const edge_iterator &other) const {
+        return position_ != other.position_;
+      }
+
+    private:
+      /**
+       * Move to the vertex which owns the current position
+       */
+      void update() {
+        if (position_ < list_->neighbours_.size()) {
+          while (list_->offset_[vertex_ + 1] <= position_) {
+            ++vertex_;
+          }
+          value_ = edge_descriptor(vertex_, list_->neighbours_[position_]);
+        }
+      }
+
+      const AdjacencyList *list_;
+      std::size_t vertex_;
+      std::size_t position_;
+      edge_descriptor value_;
+    };
+
     typedef std::pair<edge_iterator, edge_iterator> edge_iterator_range;
 
+    /**
+     * Create an empty graph
+     * @param num_vertices The number of vertices
+     */
     AdjacencyList(std::size_t num_vertices)
-        : offset_(num_vertices + 1), num_vertices_(num_vertices), consistent_(false) {}
+        : offset_(num_vertices + 1, 0), consistent_(false) {
+      DIALS_ASSERT(num_vertices <= std::numeric_limits<vertex_index>::max());
+    }
+
+    /**
+     * Create the graph from a set of undirected edges. The edges are visited
+     * twice: once to count the degree of each vertex, which gives the
+     * offsets, and once to write each edge into the neighbours of both its
+     * vertices. No intermediate list of the edges is made.
+     * @param num_vertices The number of vertices
+     * @param edges A function object which calls its argument with the two
+     *              vertices of each edge
+     */
+    template <typename EdgeVisitor>
+    AdjacencyList(std::size_t num_vertices, const EdgeVisitor &edges)
+        : offset_(num_vertices + 1, 0), consistent_(false) {
+      DIALS_ASSERT(num_vertices <= std::numeric_limits<vertex_index>::max());
+      build(edges);
+    }
+
+    /**
+     * Create the graph from its compressed representation, for example as
+     * returned by offset() and neighbours().
+     * @param offset The offset of the neighbours of each vertex
+     * @param neighbours The neighbours of each vertex
+     */
+    AdjacencyList(const af::const_ref<std::size_t> &offset,
+                  const af::const_ref<std::size_t> &neighbours)
+        : offset_(offset.begin(), offset.end()), consistent_(true) {
+      DIALS_ASSERT(offset.size() > 0);
+      DIALS_ASSERT(offset.size() - 1 <= std::numeric_limits<vertex_index>::max());
+      DIALS_ASSERT(offset[0] == 0);
+      DIALS_ASSERT(offset[offset.size() - 1] == neighbours.size());
+      DIALS_ASSERT((neighbours.size() & 1) == 0);
+      neighbours_.reserve(neighbours.size());
+      for (std::size_t i = 0; i < num_vertices(); ++i) {
+        DIALS_ASSERT(offset[i + 1] >= offset[i]);
+        for (std::size_t j = offset[i]; j < offset[i + 1]; ++j) {
+          DIALS_ASSERT(neighbours[j] < num_vertices());
+          DIALS_ASSERT(j == offset[i] || neighbours[j] >= neighbours[j - 1]);
+          neighbours_.push_back(neighbours[j]);
+        }
+      }
+    }
 
     std::size_t source(edge_descriptor edge) const {
       DIALS_ASSERT(consistent_);
@@ -47,65 +168,195 @@ namespace dials { namespace model {
       return edge.second;
     }
 
+    /**
+     * @returns The range of all the edges
+     */
     edge_iterator_range edges() const {
       DIALS_ASSERT(consistent_);
-      return edge_iterator_range(edges_.begin(), edges_.end());
+      return edge_iterator_range(edge_iterator(this, 0, 0),
+                                 edge_iterator(this, 0, neighbours_.size()));
     }
 
+    /**
+     * @returns The range of the edges from a vertex
+     */
     edge_iterator_range edges(std::size_t i) const {
       DIALS_ASSERT(consistent_);
       DIALS_ASSERT(i < num_vertices());
-      DIALS_ASSERT(i < offset_.size() - 1);
+      return edge_iterator_range(edge_iterator(this, i, offset_[i]),
+                                 edge_iterator(this, i, offset_[i + 1]));
+    }
+
+    /**
+     * @returns The vertices adjacent to a vertex, in increasing order
+     */
+    af::const_ref<vertex_index> adjacent_vertices(std::size_t i) const {
+      DIALS_ASSERT(consistent_);
+      DIALS_ASSERT(i < num_vertices());
       std::size_t o1 = offset_[i];
       std::size_t o2 = offset_[i + 1];
       DIALS_ASSERT(o2 >= o1);
-      DIALS_ASSERT(o2 <= edges_.size());
-      return edge_iterator_range(edges_.begin() + o1, edges_.begin() + o2);
+      DIALS_ASSERT(o2 <= neighbours_.size());
+      return af::const_ref<vertex_index>(neighbours_.data() + o1, o2 - o1);
     }
 
+    /**
+     * Add an edge. The graph must be rebuilt with finish before it can be
+     * queried again.
+     */
     void add_edge(std::size_t a, std::size_t b) {
-      consistent_ = false;
-      DIALS_ASSERT(num_vertices());
-      DIALS_ASSERT(num_vertices());
-      edges_.push_back(edge_descriptor(a, b));
-      edges_.push_back(edge_descriptor(b, a));
+      DIALS_ASSERT(a < num_vertices());
+      DIALS_ASSERT(b < num_vertices());
+      if (consistent_) {
+        unpack();
+      }
+      pending_.push_back(std::make_pair((vertex_index)a, (vertex_index)b));
     }
 
+    /**
+     * Build the compressed graph from the added edges
+     */
     void finish() {
-      std::sort(edges_.begin(), edges_.end());
-      std::vector<std::size_t> num(num_vertices());
-      for (std::size_t i = 0; i < edges_.size(); ++i) {
-        num[edges_[i].first]++;
+      if (consistent_) {
+        return;
       }
-      offset_[0] = 0;
-      for (std::size_t i = 0; i < num.size(); ++i) {
-        offset_[i + 1] = offset_[i] + num[i];
-      }
-      DIALS_ASSERT(offset_.back() == edges_.size());
-      consistent_ = true;
+      build(pending_edges(pending_));
+      std::vector<std::pair<vertex_index, vertex_index> >().swap(pending_);
     }
 
     std::size_t num_vertices() const {
-      return num_vertices_;
+      return offset_.size() - 1;
     }
 
     std::size_t num_edges() const {
-      DIALS_ASSERT((edges_.size() & 1) == 0);
-      return edges_.size() / 2;
+      if (!consistent_) {
+        return pending_.size();
+      }
+      DIALS_ASSERT((neighbours_.size() & 1) == 0);
+      return neighbours_.size() / 2;
     }
 
     std::size_t vertex_num_edges(std::size_t i) const {
-      DIALS_ASSERT(i < offset_.size() - 1);
+      DIALS_ASSERT(consistent_);
+      DIALS_ASSERT(i < num_vertices());
       std::size_t o1 = offset_[i];
       std::size_t o2 = offset_[i + 1];
       DIALS_ASSERT(o2 >= o1);
       return o2 - o1;
     }
 
+    /**
+     * @returns The offset of the neighbours of each vertex
+     */
+    af::shared<std::size_t> offset() const {
+      DIALS_ASSERT(consistent_);
+      return af::shared<std::size_t>(offset_.begin(), offset_.end());
+    }
+
+    /**
+     * @returns The neighbours of all the vertices
+     */
+    af::shared<std::size_t> neighbours() const {
+      DIALS_ASSERT(consistent_);
+      return af::shared<std::size_t>(neighbours_.begin(), neighbours_.end());
+    }
+
   private:
-    edge_list edges_;
+    /**
+     * Count the degree of each vertex into the offset array
+     */
+    struct degree_counter {
+      std::vector<std::size_t> &offset;
+      degree_counter(std::vector<std::size_t> &offset_) : offset(offset_) {}
+      void operator()(std::size_t a, std::size_t b) const {
+        DIALS_ASSERT(a + 1 < offset.size());
+        DIALS_ASSERT(b + 1 < offset.size());
+        offset[a + 1]++;
+        offset[b + 1]++;
+      }
+    };
+
+    /**
+     * Write each edge into the next free position of both its vertices
+     */
+    struct edge_scatter {
+      std::vector<std::size_t> &position;
+      std::vector<vertex_index> &neighbours;
+      edge_scatter(std::vector<std::size_t> &position_,
+                   std::vector<vertex_index> &neighbours_)
+          : position(position_), neighbours(neighbours_) {}
+      void operator()(std::size_t a, std::size_t b) const {
+        neighbours[position[a]++] = (vertex_index)b;
+        neighbours[position[b]++] = (vertex_index)a;
+      }
+    };
+
+    /**
+     * Visit the edges added with add_edge
+     */
+    struct pending_edges {
+      const std::vector<std::pair<vertex_index, vertex_index> > &pending;
+      pending_edges(const std::vector<std::pair<vertex_index, vertex_index> > &p)
+          : pending(p) {}
+      template <typename Function>
+      void operator()(const Function &function) const {
+        for (std::size_t i = 0; i < pending.size(); ++i) {
+          function(pending[i].first, pending[i].second);
+        }
+      }
+    };
+
+    /**
+     * Build the compressed graph with a pass to count the degree of each
+     * vertex and a pass to scatter the edges, then sort the neighbours of
+     * each vertex.
+     */
+    template <typename EdgeVisitor>
+    void build(const EdgeVisitor &edges) {
+      std::size_t n = num_vertices();
+      std::fill(offset_.begin(), offset_.end(), 0);
+      edges(degree_counter(offset_));
+      for (std::size_t i = 0; i < n; ++i) {
+        offset_[i + 1] += offset_[i];
+      }
+      std::vector<std::size_t> position(offset_.begin(), offset_.end() - 1);
+      neighbours_.resize(offset_.back());
+      edges(edge_scatter(position, neighbours_));
+      for (std::size_t i = 0; i < n; ++i) {
+        DIALS_ASSERT(position[i] == offset_[i + 1]);
+        std::sort(neighbours_.begin() + offset_[i],
+                  neighbours_.begin() + offset_[i + 1]);
+      }
+      consistent_ = true;
+    }
+
+    /**
+     * Move the edges of a finished graph back to the list of added edges.
+     * Each edge is in the neighbours of both its vertices, so it is taken
+     * from the vertex with the lower index; a loop is in the neighbours of
+     * its vertex twice.
+     */
+    void unpack() {
+      pending_.clear();
+      pending_.reserve(neighbours_.size() / 2);
+      for (std::size_t i = 0; i < num_vertices(); ++i) {
+        bool skip_loop = false;
+        for (std::size_t j = offset_[i]; j < offset_[i + 1]; ++j) {
+          if (i < neighbours_[j] || (i == neighbours_[j] && !skip_loop)) {
+            pending_.push_back(std::make_pair((vertex_index)i, neighbours_[j]));
+          }
+          if (i == neighbours_[j]) {
+            skip_loop = !skip_loop;
+          }
+        }
+      }
+      std::vector<vertex_index>().swap(neighbours_);
+      consistent_ = false;
+    }
+
     std::vector<std::size_t> offset_;
-    std::size_t num_vertices_;
+    std::vector<vertex_index> neighbours_;
+    std::vector<std::pair<vertex_index, vertex_index> > pending_;
     bool consistent_;
   };
 
@@ -19,21 +19,18 @@ namespace dials { namespace model { namespace boost_python {
   using namespace boost::python;
 
   struct adjacent_vertices_iterator {
-    AdjacencyList::edge_iterator first_;
-    AdjacencyList::edge_iterator last_;
+    af::const_ref<AdjacencyList::vertex_index> vertices_;
+    std::size_t position_;
 
-    adjacent_vertices_iterator(AdjacencyList::edge_iterator first,
-                               AdjacencyList::edge_iterator last)
-        : first_(first), last_(last) {}
+    adjacent_vertices_iterator(af::const_ref<AdjacencyList::vertex_index> vertices)
+        : vertices_(vertices), position_(0) {}
 
     std::size_t next() {
-      if (first_ == last_) {
+      if (position_ == vertices_.size()) {
         PyErr_SetString(PyExc_StopIteration, "No more data.");
         boost::python::throw_error_already_set();
       }
-      std::size_t result = first_->second;
-      first_++;
-      return result;
+      return vertices_[position_++];
     }
 
     static object iter(object const &o) {
@@ -61,23 +58,37 @@ namespace dials { namespace model { namespace boost_python {
 
   adjacent_vertices_iterator make_adjacent_vertices_iterator(const AdjacencyList &self,
                                                              std::size_t index) {
-    return adjacent_vertices_iterator(self.edges(index).first,
-                                      self.edges(index).second);
+    return adjacent_vertices_iterator(self.adjacent_vertices(index));
   }
 
+  struct AdjacencyListPickleSuite : boost::python::pickle_suite {
+    static boost::python::tuple getinitargs(const AdjacencyList &obj) {
+      return boost::python::make_tuple(obj.offset(), obj.neighbours());
+    }
+  };
+
   void export_adjacency_list() {
     class_<AdjacencyList::edge_descriptor>("EdgeDescriptor", no_init);
 
     iterator_wrapper<adjacent_vertices_iterator>::wrap("AdjacentVerticesIter");
 
     class_<AdjacencyList>("AdjacencyList", no_init)
+      .def(init<const af::const_ref<std::size_t> &, const af::const_ref<std::size_t> &>(
+        (arg("offset"), arg("neighbours"))))
       .def("source", &AdjacencyList::source)
       .def("target", &AdjacencyList::target)
-      .def("adjacent_vertices", &make_adjacent_vertices_iterator)
+      .def("adjacent_vertices",
+           &make_adjacent_vertices_iterator,
+           with_custodian_and_ward_postcall<0, 1>())
       .def("edges", boost::python::range(edges_begin, edges_end))
       .def("add_edge", &AdjacencyList::add_edge)
+      .def("finish", &AdjacencyList::finish)
       .def("num_vertices", &AdjacencyList::num_vertices)
-      .def("num_edges", &AdjacencyList::num_edges);
+      .def("num_edges", &AdjacencyList::num_edges)
+      .def("vertex_num_edges", &AdjacencyList::vertex_num_edges)
+      .def("offset", &AdjacencyList::offset)
+      .def("neighbours", &AdjacencyList::neighbours)
+      .def_pickle(AdjacencyListPickleSuite());
   }
 
 }}}  // namespace dials::model::boost_python
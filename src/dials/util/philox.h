@@ -0,0 +1,107 @@
+/*
+ * philox.h
+ *
+ *  This code is distributed under the BSD license, a copy of which is
+ *  included in the root directory of this package.
+ */
+#ifndef DIALS_UTIL_PHILOX_H
+#define DIALS_UTIL_PHILOX_H
+
+#include <cstdint>
+
+namespace dials { namespace util {
+
+  /**
+   * The Philox4x32-10 counter based random number generator of Salmon et al.,
+   * "Parallel random numbers: as easy as 1, 2, 3" (SC11, 2011). Each counter
+   * is mapped to four random 32 bit integers by a keyed bijection, so the
+   * numbers for any (key, counter) can be generated independently of all
+   * others. This lets separate items of work, such as groups of reflections
+   * processed on different threads, each have their own reproducible stream
+   * of random numbers.
+   */
+  class Philox4x32 {
+  public:
+    /**
+     * @param key0 The first word of the key
+     * @param key1 The second word of the key
+     * @param c1 The second word of the counter
+     * @param c2 The third word of the counter
+     * @param c3 The fourth word of the counter
+     */
+    Philox4x32(std::uint32_t key0,
+               std::uint32_t key1,
+               std::uint32_t c1,
+               std::uint32_t c2,
+               std::uint32_t c3)
+        : block_(0), position_(4) {
+      key_[0] = key0;
+      key_[1] = key1;
+      counter_[0] = 0;
+      counter_[1] = c1;
+      counter_[2] = c2;
+      counter_[3] = c3;
+    }
+
+    /**
+     * Generate the four random numbers for a counter
+     */
+    static void generate(const std::uint32_t counter[4],
+                         const std::uint32_t key[2],
+                         std::uint32_t result[4]) {
+      std::uint32_t x[4] = {counter[0], counter[1], counter[2], counter[3]};
+      std::uint32_t k[2] = {key[0], key[1]};
+      for (std::size_t round = 0; round < 10; ++round) {
+        if (round > 0) {
+          k[0] += 0x9E3779B9;
+          k[1] += 0xBB67AE85;
+        }
+        std::uint64_t p0 = (std::uint64_t)0xD2511F53 * x[0];
+        std::uint64_t p1 = (std::uint64_t)0xCD9E8D57 * x[2];
+        std::uint32_t y[4] = {(std::uint32_t)(p1 >> 32) ^ x[1] ^ k[0],
+                              (std::uint32_t)p1,
+                              (std::uint32_t)(p0 >> 32) ^ x[3] ^ k[1],
+                              (std::uint32_t)p0};
+        x[0] = y[0];
+        x[1] = y[1];
+        x[2] = y[2];
+        x[3] = y[3];
+      }
+      result[0] = x[0];
+      result[1] = x[1];
+      result[2] = x[2];
+      result[3] = x[3];
+    }
+
+    /**
+     * @returns The next random 32 bit integer of the stream
+     */
+    std::uint32_t random_uint32() {
+      if (position_ == 4) {
+        counter_[0] = block_++;
+        generate(counter_, key_, block_values_);
+        position_ = 0;
+      }
+      return block_values_[position_++];
+    }
+
+    /**
+     * @returns A random double in [0, 1) with 53 random bits
+     */
+    double random_double() {
+      std::uint32_t a = random_uint32() >> 5;
+      std::uint32_t b = random_uint32() >> 6;
+      return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+    }
+
+  private:
+    std::uint32_t key_[2];
+    std::uint32_t counter_[4];
+    std::uint32_t block_values_[4];
+    std::uint32_t block_;
+    std::size_t position_;
+  };
+
+}}  // namespace dials::util
+
+#endif  // DIALS_UTIL_PHILOX_H
@@ -0,0 +1,140 @@
+from __future__ import annotations
+
+import random
+
+import pytest
+
+from dials.algorithms.background.glm import Creator, RobustPoissonMean, TiledCreator
+from dials.algorithms.shoebox import MaskCode
+from dials.array_family import flex
+from dials.model.data import ImageVolume, MultiPanelImageVolume, Shoebox
+
+
+def make_shoeboxes(values):
+    sbox = Shoebox()
+    sbox.bbox = (0, 10, 0, 10, 0, 3)
+    sbox.allocate()
+    for i in range(len(sbox.mask)):
+        sbox.mask[i] = MaskCode.Valid | MaskCode.Background
+        sbox.data[i] = values[i]
+    shoeboxes = flex.shoebox(1)
+    shoeboxes[0] = sbox
+    return shoeboxes
+
+
+@pytest.mark.parametrize("offset", [0, 0.5])
+def test_constant3d_matches_robust_poisson_mean(offset):
+    random.seed(0)
+    values = [random.choice([0, 1, 1, 2, 2, 3, 5, 50]) + offset for _ in range(300)]
+
+    # Integer counts use the histogram fast path; non-integer counts use the
+    # list of values. Both must agree with the robust mean of the values.
+    shoeboxes = make_shoeboxes(values)
+    creator = Creator(Creator.model.constant3d, 1.345, 100, 10)
+    assert creator(shoeboxes).all_eq(True)
+
+    Y = flex.double(values)
+    median = sorted(values)[len(values) // 2]
+    expected = RobustPoissonMean(Y, median if median > 0 else 1.0).mean()
+    background = shoeboxes[0].background
+    assert flex.max(flex.abs(background - expected)) < 1e-6 * expected
+
+
+def make_image_volume(height, width, tile_size):
+    random.seed(0)
+    volume = ImageVolume(0, 2, height, width)
+    images = []
+    masks = []
+    for frame in range(2):
+        data = flex.int(
+            [random.choice([0, 1, 1, 2, 2, 3, 5, 50]) for _ in range(height * width)]
+        )
+        data.reshape(flex.grid(height, width))
+        mask = flex.bool(flex.grid(height, width), True)
+        if frame == 1:
+            # Leave too few valid pixels to fit the last tile
+            for j in range(tile_size, height):
+                for i in range(2 * tile_size, width):
+                    mask[j, i] = False
+            mask[0, 0] = False
+        volume.set_image(frame, data, mask)
+        images.append(data)
+        masks.append(mask)
+    image_volume = MultiPanelImageVolume()
+    image_volume.add(volume)
+    return image_volume, images, masks
+
+
+def test_tiled_creator_fits_each_tile_once():
+    height, width, tile_size = 20, 30, 10
+    image_volume, images, masks = make_image_volume(height, width, tile_size)
+
+    reflections = flex.reflection_table()
+    reflections["bbox"] = flex.int6([(2, 8, 2, 8, 0, 2), (22, 28, 12, 18, 0, 2)])
+    reflections["panel"] = flex.size_t(2, 0)
+    creator = TiledCreator(tile_size, 1.345, 100, 10)
+    success = creator(reflections, image_volume)
+    assert list(success) == [True, False]
+
+    background = image_volume.get(0).background()
+    for frame in range(2):
+        for j0 in range(0, height, tile_size):
+            for i0 in range(0, width, tile_size):
+                if frame == 1 and j0 >= tile_size and i0 >= 2 * tile_size:
+                    continue
+                values = [
+                    images[frame][j, i]
+                    for j in range(j0, j0 + tile_size)
+                    for i in range(i0, i0 + tile_size)
+                    if masks[frame][j, i]
+                ]
+                median = sorted(values)[len(values) // 2]
+                expected = RobustPoissonMean(
+                    flex.double(values), median if median > 0 else 1.0
+                ).mean()
+                for j in range(j0, j0 + tile_size):
+                    for i in range(i0, i0 + tile_size):
+                        assert background[frame, j, i] == pytest.approx(
+                            expected, rel=1e-5
+                        )
+
+
+@pytest.mark.parametrize("nthreads", [1, 2])
+def test_tiled_creator_matches_shoebox_creator(nthreads):
+    height, width, tile_size = 20, 30, 10
+    image_volume, images, masks = make_image_volume(height, width, tile_size)
+
+    # Fit a shoebox covering each tile on each frame with the per-shoebox
+    # creator, which the tiled creator must reproduce
+    shoeboxes = flex.shoebox()
+    for frame in range(2):
+        for j0 in range(0, height, tile_size):
+            for i0 in range(0, width, tile_size):
+                sbox = Shoebox()
+                sbox.bbox = (i0, i0 + tile_size, j0, j0 + tile_size, frame, frame + 1)
+                sbox.allocate()
+                for j in range(j0, j0 + tile_size):
+                    for i in range(i0, i0 + tile_size):
+                        index = (j - j0) * tile_size + (i - i0)
+                        sbox.data[index] = images[frame][j, i]
+                        sbox.mask[index] = MaskCode.Background
+                        if masks[frame][j, i]:
+                            sbox.mask[index] |= MaskCode.Valid
+                shoeboxes.append(sbox)
+    creator = Creator(Creator.model.constant2d, 1.345, 100, 10)
+    expected_success = creator(shoeboxes)
+
+    reflections = flex.reflection_table()
+    reflections["bbox"] = shoeboxes.bounding_boxes()
+    reflections["panel"] = flex.size_t(len(shoeboxes), 0)
+    tiled_creator = TiledCreator(tile_size, 1.345, 100, 10, nthreads=nthreads)
+    success = tiled_creator(reflections, image_volume)
+    assert list(success) == list(expected_success)
+    assert success.count(False) == 1
+
+    background = image_volume.get(0).background()
+    for sbox, fitted in zip(shoeboxes, success):
+        if not fitted:
+            continue
+        x0, x1, y0, y1, z0, z1 = sbox.bbox
+        assert background[z0, y0, x0] == pytest.approx(sbox.background[0], rel=1e-6)
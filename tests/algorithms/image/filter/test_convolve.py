@@ -0,0 +1,133 @@
+from __future__ import annotations
+
+import pytest
+
+from scitbx.array_family import flex
+
+from dials.algorithms.image.filter import (
+    anisotropic_diffusion,
+    convolve,
+    convolve_col,
+    convolve_row,
+)
+
+
+def generate_image(xsize, ysize):
+    image = flex.random_double(xsize * ysize) * 100
+    image.reshape(flex.grid(ysize, xsize))
+    return image
+
+
+def brute_force_convolve(image, kernel):
+    ysize, xsize = image.all()
+    ky, kx = kernel.all()
+    result = flex.double(flex.grid(ysize, xsize))
+    for j in range(ysize):
+        for i in range(xsize):
+            value = 0
+            for jj in range(ky):
+                for ii in range(kx):
+                    y = min(max(j + jj - ky // 2, 0), ysize - 1)
+                    x = min(max(i + ii - kx // 2, 0), xsize - 1)
+                    value += image[y, x] * kernel[jj, ii]
+            result[j, i] = value
+    return result
+
+
+@pytest.mark.parametrize("nthreads", [1, 2])
+def test_convolve(nthreads):
+    image = generate_image(70, 40)
+
+    # A separable and a non-separable kernel
+    row = flex.double([1, 2, 3, 2, 1])
+    col = flex.double([1, 4, 1])
+    separable = flex.double([c * r for c in col for r in row])
+    separable.reshape(flex.grid(3, 5))
+    general = flex.double([1, 4, 7, 4, 1, 4, 16, 26, 16, 4, 7, 26, 41, 26, 7]) / 273
+    general.reshape(flex.grid(3, 5))
+
+    for kernel in (separable, general):
+        result = convolve(image, kernel, nthreads=nthreads)
+        expected = brute_force_convolve(image, kernel)
+        assert flex.max(flex.abs(result - expected)) < 1e-9
+
+    row_kernel = row.deep_copy()
+    row_kernel.reshape(flex.grid(1, 5))
+    result = convolve_row(image, row, nthreads=nthreads)
+    assert flex.max(flex.abs(result - brute_force_convolve(image, row_kernel))) < 1e-9
+
+    col_kernel = col.deep_copy()
+    col_kernel.reshape(flex.grid(3, 1))
+    result = convolve_col(image, col, nthreads=nthreads)
+    assert flex.max(flex.abs(result - brute_force_convolve(image, col_kernel))) < 1e-9
+
+
+def test_anisotropic_diffusion_threads():
+    image = generate_image(300, 200)
+    mask = flex.random_bool(image.size(), 0.9)
+    mask.reshape(image.accessor())
+
+    # Enough iterations to need more than one block of tiles
+    expected = anisotropic_diffusion(image, niter=20)
+    result = anisotropic_diffusion(image, niter=20, nthreads=3)
+    assert result.all_eq(expected)
+
+    # The image border is never changed
+    assert result[0, 10] == image[0, 10]
+    assert result[10, 299] == image[10, 299]
+
+    expected = anisotropic_diffusion(image, mask, niter=20)
+    result = anisotropic_diffusion(image, mask, niter=20, nthreads=3)
+    assert result.all_eq(expected)
+    for i in range(image.size()):
+        if not mask[i]:
+            assert result[i] == image[i]
+
+
+def brute_force_anisotropic_diffusion(image, mask, niter, kappa=50, gamma=0.1):
+    # The loops of the original implementation, which updated the whole image
+    # once per iteration
+    height, width = image.all()
+    A = image.deep_copy()
+    kappa_inv2 = 1.0 / (kappa * kappa)
+    for _ in range(niter):
+        B = flex.double(A.accessor(), 0)
+        for j in range(1, height - 1):
+            for i in range(1, width - 1):
+                if mask is not None and not mask[j, i]:
+                    continue
+                AP = A[j, i]
+                if mask is None:
+                    AN, AS, AE, AW = A[j - 1, i], A[j + 1, i], A[j, i - 1], A[j, i + 1]
+                else:
+                    AN = A[j - 1, i] if mask[j - 1, i] else AP
+                    AS = A[j + 1, i] if mask[j + 1, i] else AP
+                    AE = A[j, i - 1] if mask[j, i - 1] else AP
+                    AW = A[j, i + 1] if mask[j, i + 1] else AP
+                DN = AP - AN
+                DE = AP - AE
+                DS = AS - AP
+                DW = AW - AP
+                N = 1.0 / (1.0 + (DN * DN * kappa_inv2)) * DN
+                E = 1.0 / (1.0 + (DE * DE * kappa_inv2)) * DE
+                S = 1.0 / (1.0 + (DS * DS * kappa_inv2)) * DS
+                W = 1.0 / (1.0 + (DW * DW * kappa_inv2)) * DW
+                B[j, i] = gamma * (S - N + W - E)
+        A += B
+    return A
+
+
+@pytest.mark.parametrize("nthreads", [1, 3])
+def test_anisotropic_diffusion_matches_original(nthreads):
+    # Wider than a tile and with more iterations than a block
+    image = generate_image(140, 12)
+    mask = flex.random_bool(image.size(), 0.9)
+    mask.reshape(image.accessor())
+
+    expected = brute_force_anisotropic_diffusion(image, None, niter=10)
+    result = anisotropic_diffusion(image, niter=10, nthreads=nthreads)
+    assert flex.max(flex.abs(result - expected)) < 1e-9
+
+    expected = brute_force_anisotropic_diffusion(image, mask, niter=10)
+    result = anisotropic_diffusion(image, mask, niter=10, nthreads=nthreads)
+    assert flex.max(flex.abs(result - expected)) < 1e-9
@@ -75,3 +75,83 @@ def test_masked_filter():
                     pixels = sorted(pixels)
                     value = pixels[len(pixels) // 2]
                 assert result[j, i] == pytest.approx(value, abs=eps)
+
+
+# The large kernel is filtered with the sliding window histogram and the small
+# kernel by partially sorting each window
+@pytest.mark.parametrize("kernel", [(8, 5), (1, 1)])
+@pytest.mark.parametrize("periodic", [False, True])
+@pytest.mark.parametrize("nthreads", [1, 3])
+def test_masked_filter_integer_values(kernel, periodic, nthreads):
+    from scitbx.array_family import flex
+
+    from dials.algorithms.image.filter import median_filter
+
+    xsize = 40
+    ysize = 30
+
+    image = flex.double(
+        [float(int(x * 50)) for x in generate_image(xsize, ysize).as_1d()]
+    )
+    image.reshape(flex.grid(ysize, xsize))
+    mask = generate_mask(xsize, ysize)
+    result = median_filter(image, mask, kernel, periodic=periodic, nthreads=nthreads)
+
+    for j in range(ysize):
+        for i in range(xsize):
+            pixels = []
+            for jj in range(j - kernel[0], j + kernel[0] + 1):
+                for ii in range(i - kernel[1], i + kernel[1] + 1):
+                    if periodic:
+                        jj, ii = jj % ysize, ii % xsize
+                    elif not (0 <= jj < ysize and 0 <= ii < xsize):
+                        continue
+                    if mask[jj, ii]:
+                        pixels.append(image[jj, ii])
+            expected = sorted(pixels)[len(pixels) // 2] if pixels else 0
+            assert result[j, i] == expected
+
+
+def old_median_filter_masked(image, mask, kernel, periodic):
+    # A port of the median filter before the sliding window histogram. The
+    # periodic indices were wrapped with an unsigned modulo, which is only
+    # correct for negative indices when the size is a power of two.
+    ysize, xsize = image.all()
+    result = [0.0] * (ysize * xsize)
+    for j in range(ysize):
+        for i in range(xsize):
+            pixels = []
+            for jj in range(j - kernel[0], j + kernel[0] + 1):
+                for ii in range(i - kernel[1], i + kernel[1] + 1):
+                    if periodic:
+                        jj = ((jj % 2**64) % ysize + ysize) % ysize
+                        ii = ((ii % 2**64) % xsize + xsize) % xsize
+                    elif not (0 <= jj < ysize and 0 <= ii < xsize):
+                        continue
+                    if mask[jj, ii]:
+                        pixels.append(image[jj, ii])
+            if pixels:
+                result[j * xsize + i] = sorted(pixels)[len(pixels) // 2]
+    return result
+
+
+# The background modeller filters a polar image periodically. Where the old
+# filter wrapped the indices correctly the results must be unchanged.
+@pytest.mark.parametrize("size", [(32, 16), (30, 40)])
+@pytest.mark.parametrize("periodic", [False, True])
+@pytest.mark.parametrize("nthreads", [1, 3])
+def test_masked_filter_matches_old_filter(size, periodic, nthreads):
+    from dials.algorithms.image.filter import median_filter
+
+    ysize, xsize = size
+    kernel = (5, 0)
+    image = generate_image(xsize, ysize)
+    mask = generate_mask(xsize, ysize)
+    result = median_filter(image, mask, kernel, periodic=periodic, nthreads=nthreads)
+    expected = old_median_filter_masked(image, mask, kernel, periodic)
+    if periodic and size == (30, 40):
+        # The old filter shifted the wrapped rows at the top edge
+        top = kernel[0] * xsize
+        assert list(result)[top:] == expected[top:]
+    else:
+        assert list(result) == expected
@@ -5,6 +5,7 @@
 import os
 import pickle
 
+import numpy as np
 import pytest
 
 from dxtbx.model.experiment_list import ExperimentListFactory
@@ -424,3 +425,132 @@ def check_job(index):
     check_job(2)
     check_job(3)
     check_job(4)
+
+
+def test_reflection_manager_lookup_is_independent_of_nthreads(data):
+    from dials.algorithms.integration.parallel_integrator import (
+        SimpleBlockList,
+        SimpleReflectionManager,
+    )
+
+    jobs = SimpleBlockList((0, 60), 20)
+    manager1 = SimpleReflectionManager(jobs, data.reflections, 5, nthreads=1)
+    manager4 = SimpleReflectionManager(jobs, data.reflections, 5, nthreads=4)
+    for index in range(len(manager1)):
+        assert manager1.num_reflections(index) == manager4.num_reflections(index)
+        r1 = manager1.split(index)
+        r4 = manager4.split(index)
+        assert list(r1["bbox"]) == list(r4["bbox"])
+        assert list(r1["miller_index"]) == list(r4["miller_index"])
+
+
+def legacy_block_index(blocks, frame):
+    """The closest block to a frame, as found by the original per-frame table."""
+    lookup = []
+    closest = 0
+    for f in range(blocks[0][0], blocks[len(blocks) - 1][1]):
+        z0, z1 = blocks[closest]
+        closest_distance = abs((z0 + z1) / 2.0 - (f + 0.5))
+        for i in range(closest + 1, len(blocks)):
+            zz0, zz1 = blocks[i]
+            distance = abs((zz0 + zz1) / 2.0 - (f + 0.5))
+            if distance < closest_distance:
+                closest_distance = distance
+                closest = i
+            else:
+                break
+        lookup.append(closest)
+    index = min(max(frame - blocks[0][0], 0), len(lookup) - 1)
+    return lookup[index]
+
+
+@pytest.mark.parametrize(
+    "frames,block_size", [((0, 60), 20), ((5, 97), 7), ((-3, 40), 40), ((0, 10), 1)]
+)
+def test_block_index_matches_legacy_lookup(frames, block_size):
+    from dials.algorithms.integration.parallel_integrator import SimpleBlockList
+
+    blocks = SimpleBlockList(frames, block_size)
+    for frame in range(frames[0] - 5, frames[1] + 5):
+        assert blocks.block_index(frame) == legacy_block_index(blocks, frame)
+
+
+@pytest.mark.parametrize("nthreads", [1, 4])
+def test_reflection_manager_lookup_matches_legacy_lookup(data, nthreads):
+    from dials.algorithms.integration.parallel_integrator import (
+        SimpleBlockList,
+        SimpleReflectionManager,
+    )
+
+    blocks = SimpleBlockList((0, 60), 20)
+    manager = SimpleReflectionManager(blocks, data.reflections, 5, nthreads=nthreads)
+    total = 0
+    for index in range(len(manager)):
+        f0, f1 = manager.job(index)
+        job_blocks = [
+            i for i in range(len(blocks)) if blocks[i][0] >= f0 and blocks[i][1] <= f1
+        ]
+
+        # The reflections processed by the job come first, ordered by block and
+        # then by their order in the split table
+        n = manager.num_reflections(index)
+        r = manager.split(index)[:n]
+        keys = []
+        for (_, _, _, _, z0, z1), partial_id in zip(r["bbox"], r["partial_id"]):
+            block = legacy_block_index(blocks, int(math.floor((z0 + z1) / 2.0)))
+            assert block in job_blocks
+            keys.append((block, partial_id, z0))
+        assert keys == sorted(keys)
+        total += n
+    assert total > 0
+
+
+@pytest.mark.parametrize("nthreads", [1, 4])
+def test_job_reflection_manager_matches_legacy_lookup(nthreads):
+    from dials.algorithms.integration.processor import JobList, ReflectionManager
+
+    jobs = JobList()
+    jobs.add((0, 2), (0, 100), 20, 5)
+    jobs.add((2, 3), (10, 60), 10, 3)
+    group_frames = [(0, 100), (0, 100), (10, 60)]
+
+    random = np.random.default_rng(0)
+    n = 2000
+    ids = random.integers(0, 3, n)
+    bbox = flex.int6()
+    for eid in ids:
+        f0, f1 = group_frames[eid]
+        z0 = int(random.integers(f0, f1 - 1))
+        z1 = min(z0 + int(random.integers(1, 4)), f1)
+        bbox.append((0, 5, 0, 5, z0, z1))
+    table = flex.reflection_table()
+    table["id"] = flex.int(ids.tolist())
+    table["bbox"] = bbox
+    table["flags"] = flex.size_t(n, 0)
+    table["row"] = flex.size_t_range(n)
+    skip = flex.bool((random.random(n) < 0.1).tolist())
+    table.set_flags(skip, table.flags.dont_integrate)
+
+    # The original lookup assigns each reflection to the job of its group
+    # which contains it and whose centre is closest, taking the first of equals
+    expected = [[] for _ in range(len(jobs))]
+    for i, (eid, b) in enumerate(zip(ids, bbox)):
+        if skip[i]:
+            continue
+        z0, z1 = b[4:6]
+        best = None
+        for j in range(len(jobs)):
+            jz0, jz1 = jobs[j].frames()
+            if not (jobs[j].expr()[0] <= eid < jobs[j].expr()[1]):
+                continue
+            if z0 >= jz0 and z1 <= jz1:
+                d = abs((z0 + z1) / 2.0 - (jz0 + jz1) / 2.0)
+                if best is None or d < best[0]:
+                    best = (d, j)
+        expected[best[1]].append(i)
+
+    manager = ReflectionManager(jobs, table, nthreads=nthreads)
+    assert len(manager) == len(jobs)
+    for index in range(len(manager)):
+        assert manager.num_reflections(index) == len(expected[index])
+        assert list(manager.split(index)["row"]) == expected[index]
@@ -64,3 +64,67 @@ def test_runtime_error_raised_when_not_enough_memory(mock_flex_max):
     mock_flex_max.return_value = 750000
     manager.compute_processors()
     mock_flex_max.assert_called_with(manager.jobs.shoebox_memory.return_value)
+
+
+def test_reflection_manager_streams_results_to_file(tmp_path):
+    from dials_algorithms_integration_integrator_ext import ReflectionManager
+
+    from dials.algorithms.integration.processor import read_streamed_reflections
+
+    n = 100
+    reflections = flex.reflection_table()
+    reflections["id"] = flex.int(n, 0)
+    reflections["flags"] = flex.size_t(n, 0)
+    reflections["bbox"] = flex.int6([(0, 1, 0, 1, i % 9, i % 9 + 1) for i in range(n)])
+    reflections["value"] = flex.double(n, 0)
+
+    # Reflections which are not integrated are in no job
+    dont_integrate = flex.bool([i % 7 == 0 for i in range(n)])
+    reflections.set_flags(dont_integrate, reflections.flags.dont_integrate)
+
+    jobs = JobList()
+    jobs.add((0, 1), (0, 9), 3, 0)
+
+    # Stream two subsets to the same file, accumulating the jobs in reverse
+    filename = str(tmp_path / "streamed.refl")
+    subsets = [reflections[:60], reflections[60:]]
+    expected = flex.reflection_table()
+    for i, subset in enumerate(subsets):
+        in_memory = subset.copy()
+        streamed_manager = ReflectionManager(jobs, subset)
+        streamed_manager.stream(
+            filename,
+            rows_per_group=10,
+            keep_in_memory=False,
+            append=i > 0,
+            index_offset=0 if i == 0 else len(subsets[0]),
+        )
+        assert streamed_manager.streaming()
+        memory_manager = ReflectionManager(jobs, in_memory)
+        for index in reversed(range(len(streamed_manager))):
+            for manager in (streamed_manager, memory_manager):
+                result = manager.split(index)
+                result["value"] = result["bbox"].parts()[4].as_double() + 1
+                result["new"] = flex.int(len(result), index + 1)
+                manager.accumulate(index, result)
+        assert streamed_manager.finished()
+        with pytest.raises(RuntimeError):
+            streamed_manager.data()
+
+        # Each subset reads back in input order
+        streamed = read_streamed_reflections(
+            filename, streamed_manager.stream_row_groups()
+        )
+        in_memory = memory_manager.data()
+        assert sorted(streamed.keys()) == sorted(in_memory.keys())
+        for key in in_memory.keys():
+            assert list(streamed[key]) == list(in_memory[key])
+        expected.extend(in_memory)
+
+    # The file holds both subsets
+    streamed = flex.reflection_table.from_file(filename)
+    assert streamed.size() == n
+    streamed = streamed.select(flex.sort_permutation(streamed["stream_index"]))
+    assert list(streamed["stream_index"]) == list(range(n))
+    for key in expected.keys():
+        assert list(streamed[key]) == list(expected[key])
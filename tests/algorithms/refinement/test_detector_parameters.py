@@ -7,12 +7,15 @@
 from dxtbx.model import BeamFactory, Detector, DetectorFactory, Panel
 from libtbx.test_utils import approx_equal
 from scitbx import matrix
+from scitbx.array_family import flex
 
 from dials.algorithms.refinement.parameterisation.detector_parameters import (
+    DetectorParameterisationHierarchical,
     DetectorParameterisationMultiPanel,
     DetectorParameterisationSinglePanel,
 )
 from dials.algorithms.refinement.refinement_helpers import (
+    PanelGroupCompose,
     get_fd_gradients,
     random_param_shift,
 )
@@ -355,3 +358,86 @@ def test():
                     an=an_ds_dp[k],
                     diff=fd_ds_dp[k] - matrix.sqr(an_ds_dp[k]),
                 )
+
+
+def make_hierarchical_detector():
+    """Create a detector with three groups of three panels, each group being
+    a row of panels in a 3x3 array"""
+
+    from .test_multi_panel_detector_parameterisation import make_panel_in_array
+
+    reference = DetectorFactory.make_detector(
+        "PAD",
+        matrix.col((1, 0, 0)),
+        matrix.col((0, -1, 0)),
+        matrix.col((-126.85, 144.39, -110)),
+        (0.172, 0.172),
+        (1475, 1679),
+        (0, 2e20),
+    )[0]
+
+    detector = Detector()
+    root = detector.hierarchy()
+    for y in range(3):
+        group = root.add_group()
+        for x in range(3):
+            template = make_panel_in_array((x, y), reference)
+            panel = group.add_panel()
+            panel.set_frame(
+                template.get_fast_axis(),
+                template.get_slow_axis(),
+                template.get_origin(),
+            )
+            panel.set_pixel_size(template.get_pixel_size())
+            panel.set_image_size(template.get_image_size())
+        frame = make_panel_in_array((0, y), reference)
+        group.set_frame(
+            frame.get_fast_axis(), frame.get_slow_axis(), frame.get_origin()
+        )
+    return detector
+
+
+def test_hierarchical_composition_skips_unchanged_groups():
+    random.seed(1337)
+    detector = make_hierarchical_detector()
+
+    for nproc in (1, 4):
+        dp = DetectorParameterisationHierarchical(detector, level=1, nproc=nproc)
+        assert dp._composer.n_groups() == 3
+        assert dp._composer.n_panels() == 9
+
+        # shift the parameters of the middle group only
+        p_vals = dp.get_param_vals()
+        p_vals[6:12] = random_param_shift(p_vals[6:12], [10, 10, 10, 50, 50, 50])
+        dp.set_param_vals(p_vals)
+
+        # recomposing with the same values should not change any group
+        changed = dp._composer.compose(
+            flex.double([p.value for p in dp._param]),
+            flex.vec3_double([p.axis for p in dp._param]),
+        )
+        assert list(changed) == [False, False, False]
+
+        # the stored derivatives for every group must match a full recalculation
+        params = dp._param
+        for igp, pnl_ids in enumerate(dp._panel_ids_by_group):
+            state = dp._initial_state[igp]
+            gp_params = params[igp * 6 : (igp + 1) * 6]
+            pgc = PanelGroupCompose(
+                state["d1"],
+                state["d2"],
+                state["dn"],
+                state["gp_offset"],
+                flex.double([p.value for p in gp_params]),
+                flex.vec3_double([p.axis for p in gp_params]),
+            )
+            assert approx_equal(dp._composer.origin(igp), pgc.origin())
+            for j, panel_id in enumerate(pnl_ids):
+                expected = pgc.derivatives_for_panel(
+                    dp._offsets[igp][j], dp._dir1s[igp][j], dp._dir2s[igp][j]
+                )
+                calculated = dp.get_ds_dp(multi_state_elt=panel_id)
+                for k in range(6):
+                    assert approx_equal(
+                        calculated[igp * 6 + k], expected[k], eps=1.0e-12
+                    )
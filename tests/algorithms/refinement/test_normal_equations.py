@@ -0,0 +1,89 @@
+from __future__ import annotations
+
+import random
+
+import pytest
+
+from libtbx.test_utils import approx_equal
+from scitbx import sparse
+from scitbx.array_family import flex
+
+from dials_refinement_helpers_ext import NormalEquations
+
+
+def random_equations(nobs, nparam):
+    """Generate residuals, weights and a Jacobian with about half of the
+    elements zero, in both dense and sparse form"""
+    random.seed(42)
+    residuals = flex.double(random.uniform(-1, 1) for _ in range(nobs))
+    weights = flex.double(random.uniform(0.5, 1.5) for _ in range(nobs))
+    dense = flex.double(flex.grid(nobs, nparam), 0.0)
+    jacobian = sparse.matrix(nobs, nparam)
+    for i in range(nobs):
+        for j in range(nparam):
+            if j == i % nparam or random.random() < 0.5:
+                v = random.uniform(-1, 1)
+                dense[i, j] = v
+                jacobian[i, j] = v
+    return residuals, weights, dense, jacobian
+
+
+@pytest.mark.parametrize("nthreads", [1, 4])
+def test_normal_equations(nthreads):
+    nobs, nparam = 3000, 12
+    residuals, weights, dense, jacobian = random_equations(nobs, nparam)
+
+    # the expected normal matrix w J^T J and right hand side -w J^T r
+    weighted = dense.deep_copy()
+    for i in range(nobs):
+        for j in range(nparam):
+            weighted[i, j] *= weights[i]
+    normal_matrix = weighted.matrix_transpose().matrix_multiply(dense)
+    rhs = -1.0 * weighted.matrix_transpose().matrix_multiply(residuals)
+
+    for j in (dense, jacobian):
+        equations = NormalEquations(nparam, nthreads=nthreads)
+        equations.add_equations(residuals, j, weights)
+        assert equations.n_equations() == nobs
+        assert approx_equal(
+            equations.normal_matrix_packed_u(),
+            normal_matrix.matrix_symmetric_as_packed_u(),
+            out=None,
+        )
+        assert approx_equal(equations.right_hand_side(), rhs, out=None)
+        assert equations.objective() == pytest.approx(
+            0.5 * flex.sum(weights * residuals * residuals)
+        )
+
+        # the Cholesky and conjugate gradient solutions both satisfy the equations
+        equations.solve()
+        assert equations.has_cholesky_factor()
+        solution = equations.solution()
+        assert approx_equal(normal_matrix.matrix_multiply(solution), rhs, out=None)
+
+        equations.solve_cg(max_iterations=100, tolerance=1.0e-12)
+        assert not equations.has_cholesky_factor()
+        assert approx_equal(equations.solution(), solution, out=None)
+
+    # the accumulators of the threads are kept over several blocks and cleared
+    # on reset
+    equations.reset()
+    equations.add_equations(residuals, jacobian, weights)
+    equations.add_equations(residuals, dense, weights)
+    assert equations.n_equations() == 2 * nobs
+    assert approx_equal(
+        equations.normal_matrix_packed_u(),
+        2.0 * normal_matrix.matrix_symmetric_as_packed_u(),
+        out=None,
+    )
+    assert approx_equal(equations.right_hand_side(), 2.0 * rhs, out=None)
+    equations.add_equations(residuals, jacobian, weights)
+    equations.reset()
+    equations.add_equations(residuals, jacobian, weights)
+    assert approx_equal(equations.right_hand_side(), rhs, out=None)
+
+    # adding residuals only contributes to the objective
+    equations.reset()
+    equations.add_residuals(residuals, weights)
+    assert equations.n_equations() == nobs
+    assert flex.max(flex.abs(equations.normal_matrix_packed_u())) == 0.0
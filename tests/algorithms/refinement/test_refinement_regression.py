@@ -37,6 +37,11 @@ def test():
         DetectorParameterisationSinglePanel,
     )
 
+    # Refinement engine using the native normal equations
+    from dials.algorithms.refinement.native_engine import (
+        GaussNewtonIterations as NativeGaussNewtonIterations,
+    )
+
     # Parameterisation of the prediction equation
     from dials.algorithms.refinement.parameterisation.prediction_parameters import (
         XYPhiPredictionParameterisation,
@@ -292,3 +297,56 @@ def test():
     assert approx_equal(
         mytarget.rmsds(), (0.0558857700305, 0.0333446685335, 0.000347402754278)
     )
+
+    ###############################
+    # Undo known parameter shifts #
+    ###############################
+
+    s0_param.set_param_vals(s0_p_vals)
+    det_param.set_param_vals(det_p_vals)
+    xlo_param.set_param_vals(xlo_p_vals)
+    xluc_param.set_param_vals(xluc_p_vals)
+
+    ####################################################
+    # Set up the native Gauss-Newton refinement engine #
+    ####################################################
+
+    refiner = NativeGaussNewtonIterations(
+        target=mytarget, prediction_parameterisation=pred_param, log=None
+    )
+    refiner.set_nproc(2)
+
+    refiner.run()
+
+    # this should match the LSTBX engine above
+    assert mytarget.achieved()
+    assert refiner.get_num_steps() == 1
+    assert approx_equal(
+        mytarget.rmsds(), (0.00508252354876, 0.00420954552156, 8.97303428289e-05)
+    )
+
+    ###########################################################
+    # Repeat in a single process with smaller gradient blocks #
+    ###########################################################
+
+    s0_param.set_param_vals(s0_p_vals)
+    det_param.set_param_vals(det_p_vals)
+    xlo_param.set_param_vals(xlo_p_vals)
+    xluc_param.set_param_vals(xluc_p_vals)
+
+    refiner = NativeGaussNewtonIterations(
+        target=mytarget, prediction_parameterisation=pred_param, log=None
+    )
+    refiner.set_nproc(1)
+    refiner.max_block_size = 100
+    blocks = list(refiner._split_matches_into_blocks())
+    assert len(blocks) > 1
+    assert max(len(block) for block in blocks) <= 100
+
+    refiner.run()
+
+    assert mytarget.achieved()
+    assert refiner.get_num_steps() == 1
+    assert approx_equal(
+        mytarget.rmsds(), (0.00508252354876, 0.00420954552156, 8.97303428289e-05)
+    )
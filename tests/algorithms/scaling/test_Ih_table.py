@@ -12,6 +12,7 @@
 
 from dials.algorithms.scaling.Ih_table import IhTable, IhTableBlock, map_indices_to_asu
 from dials.array_family import flex
+from dials_scaling_ext import IhTableCore
 
 
 @pytest.fixture()
@@ -246,6 +247,11 @@ def test_IhTableblock_onedataset(large_reflection_table, test_sg):
         # test selecting initial table on groups, expecting same result as before
         new_block = block.select_on_groups(np.array([True, False, False, True, False]))
         assert list(new_block.block_selections[0]) == [0, 2, 4]
+        assert list(new_block.core.group_index()) == [0, 0, 1]
+        # selecting with the indices of the groups gives the same block
+        index_block = block.select_on_groups(np.array([0, 3], dtype=np.uint64))
+        assert list(index_block.block_selections[0]) == [0, 2, 4]
+        assert list(index_block.core.group_index()) == [0, 0, 1]
 
         assert new_block.h_index_matrix.n_rows == 3
         assert new_block.h_index_matrix.n_cols == 2
@@ -266,6 +272,32 @@ def test_IhTableblock_onedataset(large_reflection_table, test_sg):
         )
 
 
+@pytest.mark.parametrize("nthreads", [1, 3])
+def test_IhTableblock_sum_in_groups(large_reflection_table, test_sg, nthreads):
+    """Test the group sums of the core against the sparse matrix products."""
+    asu_indices = map_indices_to_asu(large_reflection_table["miller_index"], test_sg)
+    large_reflection_table["asu_miller_index"] = asu_indices
+    n_refl = large_reflection_table.size()
+    block = IhTableBlock(n_groups=5, n_refl=n_refl, nthreads=nthreads)
+    group_ids = np.array([0, 1, 0, 2, 3, 4, 4], dtype=np.uint64)
+    df = refl_table_to_df(large_reflection_table)
+    block.add_data(0, group_ids, df, large_reflection_table["miller_index"])
+
+    values = np.random.default_rng(0).uniform(0.5, 1.5, n_refl)
+    per_group = values @ block._csc_h_index_matrix
+    assert block.sum_in_groups(values) == pytest.approx(per_group)
+    assert block.sum_in_groups(values, "per_refl") == pytest.approx(
+        per_group @ block._csc_h_expand_matrix
+    )
+    counts = block.sum_in_groups(np.full(n_refl, 1))
+    assert list(counts) == [2.0, 1.0, 1.0, 1.0, 2.0]
+    # Two dimensional arrays are still summed through the sparse matrices
+    stacked = np.vstack([values, 2.0 * values])
+    assert block.sum_in_groups(stacked) == pytest.approx(
+        np.vstack([per_group, 2.0 * per_group])
+    )
+
+
 def test_IhTableblock_twodatasets(large_reflection_table, test_sg):
     """Test direct initialisation of Ih_table block. Use the same reflection
     table as previously to make comparisons easier"""
@@ -661,3 +693,86 @@ def test_apply_iterative_weighting(reflection_table_for_block, test_sg):
   gIh = block.inverse_scale_factors * block.Ih_values
   t = (block.intensities - gIh) / gIh
   assert list(block.weights) == list(1.0/(1.0 + t**2)**2)'''
+
+
+@pytest.mark.parametrize("nthreads", [1, 3])
+def test_IhTableCore(nthreads):
+    """Test the Ih table core kernels against the sparse matrix calculations."""
+    random = np.random.default_rng(0)
+    n_refl, n_groups, n_params = 100, 20, 6
+    group_index = np.concatenate(
+        [np.arange(n_groups), random.integers(0, n_groups, n_refl - n_groups)]
+    ).astype(np.uint64)
+    core = IhTableCore(flumpy.from_numpy(group_index), n_groups, nthreads)
+    assert core.size() == n_refl
+    assert core.n_groups() == n_groups
+    assert core.nthreads() == nthreads
+    assert list(core.group_index()) == list(group_index)
+    offset = core.group_offset()
+    order = core.order()
+    for i in range(n_groups):
+        assert list(order[offset[i] : offset[i + 1]]) == list(
+            np.flatnonzero(group_index == i)
+        )
+
+    intensities = random.uniform(10.0, 100.0, n_refl)
+    scales = random.uniform(0.5, 1.5, n_refl)
+    weights = random.uniform(0.5, 1.5, n_refl)
+    h_index = np.zeros((n_refl, n_groups))
+    h_index[np.arange(n_refl), group_index.astype(np.int64)] = 1.0
+    sumgsq = (scales**2 * weights) @ h_index
+    Ih = ((scales * intensities * weights) @ h_index / sumgsq)[
+        group_index.astype(np.int64)
+    ]
+    assert flumpy.to_numpy(core.sum_in_groups(flumpy.from_numpy(weights))) == (
+        pytest.approx(weights @ h_index)
+    )
+    calculated_Ih = core.calc_Ih(
+        flumpy.from_numpy(intensities),
+        flumpy.from_numpy(scales),
+        flumpy.from_numpy(weights),
+    )
+    assert flumpy.to_numpy(calculated_Ih) == pytest.approx(Ih)
+
+    # Compare the gradients with the dense Jacobian
+    derivatives = sparse.matrix(n_refl, n_params)
+    dense_derivatives = np.zeros((n_refl, n_params))
+    for r in range(n_refl):
+        for p in random.choice(n_params, size=2, replace=False):
+            value = random.uniform(0.5, 1.5)
+            derivatives[r, int(p)] = value
+            dense_derivatives[r, p] = value
+    dIh = (intensities - 2.0 * scales * Ih) * weights
+    dIh_by_dp = (dIh[:, np.newaxis] * dense_derivatives).T @ h_index / sumgsq
+    jacobian = -(
+        dense_derivatives * Ih[:, np.newaxis]
+        + scales[:, np.newaxis] * dIh_by_dp.T[group_index.astype(np.int64)]
+    )
+    args = (
+        flumpy.from_numpy(intensities),
+        flumpy.from_numpy(scales),
+        flumpy.from_numpy(Ih),
+        flumpy.from_numpy(weights),
+        derivatives,
+    )
+    gradients = core.gradients(*args)
+    expected = 2.0 * (weights * (intensities - scales * Ih)) @ jacobian
+    assert list(gradients) == pytest.approx(list(expected))
+
+    # Selecting reflections removes the empty groups
+    sel = np.full(n_refl, True)
+    sel[group_index == 0] = False
+    sel[::3] = False
+    subset = core.select(flumpy.from_numpy(sel))
+    assert subset.size() == np.count_nonzero(sel)
+    assert subset.nthreads() == nthreads
+    remaining = np.unique(group_index[sel])
+    assert subset.n_groups() == remaining.size
+    assert list(subset.group_index()) == list(
+        np.searchsorted(remaining, group_index[sel])
+    )
+
+    group_sel = np.arange(n_groups) % 2 == 1
+    subset = core.select_on_groups(flumpy.from_numpy(group_sel))
+    assert subset.n_groups() == np.count_nonzero(group_sel)
+    assert subset.size() == np.count_nonzero(group_sel[group_index.astype(np.int64)])
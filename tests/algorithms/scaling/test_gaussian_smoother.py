@@ -5,6 +5,7 @@
 import pytest
 
 from dials.algorithms.scaling.model.components.smooth_scale_components import (
+    GaussianSmoother1D,
     GaussianSmoother2D,
     GaussianSmoother3D,
 )
@@ -97,3 +98,57 @@ def test_3DGaussianSmoother():
     assert GS3D.num_x_average() == 2
     assert GS3D.num_y_average() == 3
     assert GS3D.num_y_average() == 3
+
+
+def test_smoother_weights():
+    """Test that the cached weights reproduce the multi_value_weight results."""
+    x = flex.double([0.0, 0.3, 1.1, 2.5, 3.99, 2.0])
+    y = flex.double([0.1, 2.0, 0.5, 1.5, 2.99, 0.0])
+    z = flex.double([2.9, 0.0, 1.2, 0.5, 2.0, 1.0])
+
+    GS1D = GaussianSmoother1D([0, 4], 4)
+    parameters = flex.double([1.0, 1.5, 0.5, 2.0, 1.2, 0.8])
+    weights = GS1D.cached_weights(x)
+    assert GS1D.cached_weights(x) is weights
+    assert len(weights) == 6
+    assert weights.num_values() == 6
+    value, weight, sumw = GS1D.multi_value_weight(x, parameters)
+    assert list(weights.value(parameters)) == list(value)
+    assert list(weights.sumweight()) == list(sumw)
+    assert weights.weight().as_dense_matrix().all_eq(weight.as_dense_matrix())
+    dv_dp = weights.dvalue_dparam()
+    for i in range(len(x)):
+        for j in range(parameters.size()):
+            assert dv_dp[i, j] == pytest.approx(weight[i, j] / sumw[i])
+    # Excluding the first parameter drops the first column of the derivatives.
+    dv_dp_fixed = weights.dvalue_dparam(first_param=1)
+    assert dv_dp_fixed.n_cols == parameters.size() - 1
+    for i in range(len(x)):
+        for j in range(1, parameters.size()):
+            assert dv_dp_fixed[i, j - 1] == dv_dp[i, j]
+    single = weights.value_weight(2, parameters)
+    expected = GS1D.value_weight(x[2], parameters)
+    assert single.get_value() == expected[0]
+    assert single.get_sumweight() == expected[2]
+
+    # Changing the smoothing invalidates the cache.
+    GS1D.set_smoothing(4, 1.0)
+    assert GS1D.cached_weights(x) is not weights
+    value, _, __ = GS1D.multi_value_weight(x, parameters)
+    assert list(GS1D.cached_weights(x).value(parameters)) == list(value)
+
+    GS2D = GaussianSmoother2D([0, 4], 4, [0, 3], 3)
+    parameters = flex.double(range(30)) / 10.0
+    weights = GS2D.cached_weights(x, y)
+    value, weight, sumw = GS2D.multi_value_weight(x, y, parameters)
+    assert list(weights.value(parameters)) == list(value)
+    assert list(weights.sumweight()) == list(sumw)
+    assert weights.weight().as_dense_matrix().all_eq(weight.as_dense_matrix())
+
+    GS3D = GaussianSmoother3D([0, 4], 4, [0, 3], 3, [0, 3], 2)
+    parameters = flex.double(range(90)) / 10.0
+    weights = GS3D.cached_weights(x, y, z)
+    value, weight, sumw = GS3D.multi_value_weight(x, y, z, parameters)
+    assert list(weights.value(parameters)) == list(value)
+    assert list(weights.sumweight()) == list(sumw)
+    assert weights.weight().as_dense_matrix().all_eq(weight.as_dense_matrix())
@@ -4,12 +4,15 @@
 
 from __future__ import annotations
 
+import itertools
+import math
 import os
+import random
 from unittest.mock import Mock
 
 import pytest
 
-from cctbx import uctbx
+from cctbx import crystal, miller, uctbx
 from cctbx.sgtbx import space_group
 from dxtbx.model import Beam, Crystal, Detector, Experiment, Goniometer, Scan
 from dxtbx.model.experiment_list import ExperimentList
@@ -17,6 +20,7 @@
 
 from dials.algorithms.scaling.model.model import KBScalingModel, PhysicalScalingModel
 from dials.algorithms.scaling.scaling_library import (
+    ExtendedDatasetStatistics,
     choose_initial_scaling_intensities,
     create_datastructures_for_structural_model,
     create_Ih_table,
@@ -27,6 +31,7 @@
 )
 from dials.array_family import flex
 from dials.util.options import ArgumentParser
+from dials_scaling_ext import split_unmerged
 
 
 @pytest.fixture
@@ -348,3 +353,116 @@ def test_scaled_data_as_miller_array(dials_data):
     miller_array = scaled_data_as_miller_array(reflections, experiments, wavelength=1)
     assert miller_array.size() == 5503
     assert miller_array.info().wavelength == 1
+
+
+@pytest.mark.parametrize("weighted", [True, False])
+def test_split_unmerged(weighted):
+    """Test that the random half-dataset splits are reproducible."""
+    indices = flex.miller_index()
+    data = flex.double()
+    sigmas = flex.double()
+    for i in range(200):
+        for j in range(i % 5):
+            indices.append((i % 10, i // 10, 1))
+            data.append(float(10 * i + j))
+            sigmas.append(1.0 + 0.1 * j)
+    args = (indices, data, sigmas)
+
+    split = split_unmerged(*args, weighted=weighted, seed=1)
+    assert list(split.indices()) == [
+        (i % 10, i // 10, 1) for i in range(200) if i % 5 > 1
+    ]
+    n = flex.int([i % 5 for i in range(200) if i % 5 > 1])
+    assert list(split.n1() + split.n2()) == list(n)
+    assert (flex.abs(split.n1() - split.n2()) <= 1).all_eq(True)
+
+    # The weighted mean of the two halves is the weighted mean of the group
+    w1 = 1.0 / flex.pow2(split.sigma1())
+    w2 = 1.0 / flex.pow2(split.sigma2())
+    combined = (w1 * split.data1() + w2 * split.data2()) / (w1 + w2)
+    expected = []
+    for i in range(200):
+        if i % 5 > 1:
+            w = [1.0 / (1.0 + 0.1 * j) ** 2 if weighted else 1.0 for j in range(i % 5)]
+            x = [10 * i + j for j in range(i % 5)]
+            expected.append(sum(a * b for a, b in zip(w, x)) / sum(w))
+    assert list(combined) == pytest.approx(expected)
+
+    # The splits do not depend on the number of threads, but do on the seed
+    threaded = split_unmerged(*args, weighted=weighted, seed=1, nthreads=4)
+    assert list(threaded.data1()) == list(split.data1())
+    assert list(threaded.n1()) == list(split.n1())
+    other = split_unmerged(*args, weighted=weighted, seed=2)
+    assert list(split.data1()) != list(other.data1())
+
+
+def original_half_dataset(data, sigmas, weighted):
+    """The mean and sigma of a half dataset as in the original split_unmerged."""
+    w = [1.0 / s**2 if weighted else 1.0 for s in sigmas]
+    mean = sum(a * b for a, b in zip(w, data)) / sum(w)
+    return mean, math.sqrt(1.0 / sum(w))
+
+
+@pytest.mark.parametrize("weighted", [True, False])
+def test_split_unmerged_matches_original(weighted):
+    """Test that each split is one the original implementation could make."""
+    random.seed(0)
+    groups = {}
+    indices = flex.miller_index()
+    data = flex.double()
+    sigmas = flex.double()
+    for i in range(100):
+        h = (i % 10, i // 10, 1)
+        groups[h] = [
+            (random.uniform(0, 100), random.uniform(1, 5)) for _ in range(i % 5)
+        ]
+        for x, s in groups[h]:
+            indices.append(h)
+            data.append(x)
+            sigmas.append(s)
+
+    split = split_unmerged(indices, data, sigmas, weighted=weighted, nthreads=2)
+    assert list(split.indices()) == [h for h, obs in groups.items() if len(obs) > 1]
+    for k, h in enumerate(split.indices()):
+        obs = groups[h]
+        n1 = split.n1()[k]
+        assert n1 in (len(obs) // 2, len(obs) - len(obs) // 2)
+        assert split.n2()[k] == len(obs) - n1
+
+        # Try every way the original could have chosen the first half
+        for first in itertools.combinations(range(len(obs)), n1):
+            halves = [
+                [obs[i] for i in range(len(obs)) if (i in first) == is_first]
+                for is_first in (True, False)
+            ]
+            (d1, s1), (d2, s2) = (
+                original_half_dataset(*zip(*half), weighted) for half in halves
+            )
+            if (
+                split.data1()[k] == pytest.approx(d1, rel=1e-6)
+                and split.data2()[k] == pytest.approx(d2, rel=1e-6)
+                and split.sigma1()[k] == pytest.approx(s1)
+                and split.sigma2()[k] == pytest.approx(s2)
+            ):
+                break
+        else:
+            raise AssertionError(f"No split of {h} gives the output")
+
+    # The merging statistics use the same split for any number of threads
+    i_obs = miller.array(
+        miller.set(
+            crystal.symmetry(unit_cell=(10, 11, 12, 90, 90, 90), space_group="P1"),
+            indices,
+            anomalous_flag=False,
+        ),
+        data=data,
+        sigmas=sigmas,
+    )
+    i_obs.set_observation_type_xray_intensity()
+    results = [
+        ExtendedDatasetStatistics(
+            i_obs=i_obs, n_bins=2, additional_stats=True, nproc=nproc
+        ).r_split
+        for nproc in (1, 2)
+    ]
+    assert results[0] == results[1]
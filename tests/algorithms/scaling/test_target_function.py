@@ -25,6 +25,14 @@
 from dials.algorithms.scaling.target_function import ScalingTarget, ScalingTargetFixedIH
 from dials.array_family import flex
 from dials.util.options import ArgumentParser
+from dials_scaling_ext import (
+    IhTableCore,
+    ScalingJacobianCalculator,
+    calc_dIh_by_dpi,
+    calc_jacobian,
+    elementwise_square,
+    row_multiply,
+)
 
 
 @pytest.fixture
@@ -128,9 +136,12 @@ def mock_single_Ih_table():
     # These values should give residuals of [-1.0, 0.0, 1.0]
     Ih_table.weights = np.array([1.0, 1.0, 1.0])
     Ih_table.size = 3
+    Ih_table.nthreads = 1
     Ih_table.derivatives = sparse.matrix(3, 1, [{0: 1.0, 1: 2.0, 2: 3.0}])
     Ih_table.h_index_matrix = sparse.matrix(3, 2, [{0: 1, 1: 1}, {2: 1}])
     Ih_table.h_expand_matrix = Ih_table.h_index_matrix.transpose()
+    Ih_table.jacobian_calculator = ScalingJacobianCalculator(Ih_table.h_index_matrix)
+    Ih_table.core = IhTableCore(flex.size_t([0, 0, 1]), 2)
     Ih_table._csc_h_index_matrix = csc_matrix(
         (np.array([1, 1, 1]), (np.array([0, 1, 2]), np.array([0, 0, 1])))
     )
@@ -312,6 +323,74 @@ def test_target_fixedIh():
     assert target._rmsds == pytest.approx([expected_rmsd])
 
 
+def _dense(m):
+    return m.as_dense_matrix().as_numpy_array()
+
+
+@pytest.mark.parametrize("nthreads", [1, 4])
+def test_scaling_jacobian_calculator(nthreads):
+    """Test the jacobian calculator against a dense calculation."""
+    random = np.random.default_rng(0)
+    n_refl, n_groups, n_params = 200, 50, 12
+    groups = random.integers(0, n_groups, n_refl)
+    h_index_matrix = sparse.matrix(n_refl, n_groups)
+    for i, group in enumerate(groups):
+        h_index_matrix[i, int(group)] = 1.0
+    h_index_matrix.compact()
+    derivatives = sparse.matrix(n_params, n_refl)
+    for i in range(n_refl):
+        for j in random.choice(n_params, size=3, replace=False):
+            derivatives[int(j), i] = random.uniform(0.5, 1.5)
+    Ih = random.uniform(1.0, 10.0, n_refl)
+    g = random.uniform(0.5, 1.5, n_refl)
+    dIh = random.uniform(-1.0, 1.0, n_refl)
+    sumgsq = random.uniform(1.0, 5.0, n_groups)
+
+    def expected_results():
+        # dIh/dp_j for group h is sum_l(dIh_l * dg_l/dp_j) / sum_l(g_l^2), and
+        # the Jacobian of reflection l is -(Ih_l * dg_l/dp_j + g_l * dIh/dp_j)
+        H = _dense(h_index_matrix)
+        D = _dense(derivatives)
+        dIh_by_dpi = (H.T @ (dIh[:, None] * D.T)) / sumgsq[:, None]
+        jacobian = -(Ih[:, None] * D.T) - g[:, None] * (H @ dIh_by_dpi)
+        return dIh_by_dpi, jacobian
+
+    args = [flex.double(list(a)) for a in (Ih, g, dIh, sumgsq)]
+    calculator = ScalingJacobianCalculator(h_index_matrix, nthreads=nthreads)
+    assert calculator.nthreads() == nthreads
+    expected_dIh, expected_jacobian = expected_results()
+    # repeat to check that the cached sparsity patterns are reused correctly
+    for _ in range(2):
+        dIh_by_dpi = calculator.dIh_by_dpi(args[2], args[3], derivatives)
+        assert dIh_by_dpi.n_rows == n_groups and dIh_by_dpi.n_cols == n_params
+        assert _dense(dIh_by_dpi) == pytest.approx(expected_dIh)
+        transpose = calculator.dIh_by_dpi_transpose(args[2], args[3], derivatives)
+        assert _dense(transpose) == pytest.approx(expected_dIh.T)
+        jacobian = calculator.jacobian(derivatives, *args)
+        assert jacobian.non_zeroes == np.count_nonzero(expected_jacobian)
+        assert _dense(jacobian) == pytest.approx(expected_jacobian)
+
+    # The functions wrapping a single use calculator give the same results
+    dIh_by_dpi = calc_dIh_by_dpi(args[2], args[3], h_index_matrix, derivatives)
+    assert _dense(dIh_by_dpi) == pytest.approx(expected_dIh)
+    jacobian = calc_jacobian(derivatives, h_index_matrix, *args)
+    assert _dense(jacobian) == pytest.approx(expected_jacobian)
+
+    # a change in the sparsity pattern of the derivatives must be picked up
+    derivatives[0, 0] = 2.0
+    derivatives[n_params - 1, n_refl - 1] = 2.0
+    _, expected_jacobian = expected_results()
+    jacobian = calculator.jacobian(derivatives, *args)
+    assert _dense(jacobian) == pytest.approx(expected_jacobian)
+
+    v = random.uniform(0.5, 1.5, n_params)
+    expected = v[:, None] * _dense(derivatives)
+    result = row_multiply(derivatives, flex.double(list(v)), nthreads=nthreads)
+    assert (_dense(result) == expected).all()
+    expected = _dense(derivatives) ** 2
+    assert (_dense(elementwise_square(derivatives)) == expected).all()
+
+
 # For testing the targetfunction calculations using finite difference methods,
 # need to initialise real instances of the scaling datastructures to allow
 # variation of the parameters and updating of the linked datastructures.
@@ -1,8 +1,13 @@
 from __future__ import annotations
 
+import math
 from os.path import join
 
+import pytest
+
+from dxtbx.model import tof_helpers
 from dxtbx.model.experiment_list import ExperimentListFactory
+from scitbx import matrix
 
 from dials.array_family import flex
 from dials_tof_scaling_ext import (
@@ -164,3 +169,115 @@ def test_tof_extract_shoeboxes(dials_data):
         corrections_data,
         True,
     )
+
+
+def test_tof_lorentz_correction(dials_data):
+    # Compare the Lorentz correction against sin^2(two_theta / 2) / wl^4,
+    # computed per pixel as in the original implementation
+    image_file = join(
+        dials_data("isis_sxd_example_data", pathlib=True), "sxd_nacl_run.nxs"
+    )
+    experiments = ExperimentListFactory.from_filenames([image_file])
+    reflections = flex.reflection_table.from_msgpack_file(
+        join(dials_data("isis_sxd_nacl_processed", pathlib=True), "strong.refl")
+    )
+    reflections = reflections[:20]
+    experiment = experiments[0]
+
+    shoeboxes = []
+    for lorentz in (False, True):
+        reflections["shoebox"] = flex.shoebox(
+            reflections["panel"],
+            reflections["bbox"],
+            allocate=False,
+            flatten=False,
+        )
+        tof_extract_shoeboxes_to_reflection_table(
+            reflections, experiment, experiment.imageset, lorentz
+        )
+        shoeboxes.append(reflections["shoebox"])
+
+    detector = experiment.detector
+    unit_s0 = matrix.col(experiment.beam.get_unit_s0())
+    sample_to_source_distance = experiment.beam.get_sample_to_source_distance()
+    tof = experiment.scan.get_property("time_of_flight")
+    nchecked = 0
+    for sbox, corrected in zip(*shoeboxes):
+        panel = detector[sbox.panel]
+        x0, x1, y0, y1, z0, z1 = sbox.bbox
+        for z in range(z0, z1):
+            for y in range(y0, y1):
+                for x in range(x0, x1):
+                    value = sbox.data[z - z0, y - y0, x - x0]
+                    if value == 0:
+                        continue
+                    s1 = matrix.col(panel.get_pixel_lab_coord((x, y)))
+                    distance = (s1.length() + sample_to_source_distance) * 1e-3
+                    wl = tof_helpers.wavelength_from_tof(distance, tof[z] * 1e-6)
+                    two_theta = panel.get_two_theta_at_pixel(unit_s0, (x, y))
+                    expected = value * math.sin(two_theta * 0.5) ** 2 / wl**4
+                    assert corrected.data[z - z0, y - y0, x - x0] == pytest.approx(
+                        expected, rel=1e-5
+                    )
+                    nchecked += 1
+    assert nchecked > 0
+
+
+def test_tof_extract_shoeboxes_nthreads(dials_data):
+    image_file = join(
+        dials_data("isis_sxd_example_data", pathlib=True), "sxd_nacl_run.nxs"
+    )
+    experiments = ExperimentListFactory.from_filenames([image_file])
+    reflections = flex.reflection_table.from_msgpack_file(
+        join(dials_data("isis_sxd_nacl_processed", pathlib=True), "strong.refl")
+    )
+    expt_data = experiments[0].imageset
+
+    experiment_cls = expt_data.get_format_class()
+    incident_run_file = join(
+        dials_data("isis_sxd_example_data", pathlib=True), "sxd_vanadium_run.nxs"
+    )
+    empty_run_file = join(
+        dials_data("isis_sxd_example_data", pathlib=True), "sxd_empty_run.nxs"
+    )
+    incident_data = experiment_cls(incident_run_file).get_imageset(incident_run_file)
+    empty_data = experiment_cls(empty_run_file).get_imageset(empty_run_file)
+    corrections_data = TOFCorrectionsData(
+        experiment_cls.get_instance(
+            expt_data.paths()[0], **expt_data.data().get_params()
+        ).get_proton_charge(),
+        experiment_cls.get_instance(incident_run_file).get_proton_charge(),
+        experiment_cls.get_instance(empty_run_file).get_proton_charge(),
+        0.3,
+        10.040,
+        17.015,
+        0.0223,
+        0.3,
+        5.158,
+        4.4883,
+        0.0722,
+    )
+
+    # The corrected shoeboxes do not depend on the number of threads
+    shoeboxes = []
+    for nthreads in (1, 4):
+        reflections["shoebox"] = flex.shoebox(
+            reflections["panel"],
+            reflections["bbox"],
+            allocate=False,
+            flatten=False,
+        )
+        tof_extract_shoeboxes_to_reflection_table(
+            reflections,
+            experiments[0],
+            expt_data,
+            incident_data,
+            empty_data,
+            corrections_data,
+            True,
+            nthreads=nthreads,
+        )
+        shoeboxes.append(reflections["shoebox"])
+    for sbox1, sbox2 in zip(*shoeboxes):
+        assert sbox1.data.all_eq(sbox2.data)
+        assert sbox1.mask.all_eq(sbox2.mask)
@@ -12,6 +12,7 @@
     BBoxCalculator3D,
     CoordinateSystem,
 )
+from dials.array_family import flex
 
 
 @pytest.fixture
@@ -177,3 +178,27 @@ def test_radius(setup):
             if bbox[2] > 0 and bbox[3] < height:
                 assert math.sqrt(e11**2 + e21**2) >= radius12
                 assert math.sqrt(e12**2 + e22**2) >= radius12
+
+
+def test_parallel_array(setup):
+    random.seed(0)
+    s0_length = matrix.col(setup["beam"].get_s0()).length()
+    s1 = flex.vec3_double()
+    frame = flex.double()
+    for i in range(1000):
+        x = random.uniform(0, 2000)
+        y = random.uniform(0, 2000)
+        s1.append(
+            matrix.col(setup["detector"][0].get_pixel_lab_coord((x, y))).normalize()
+            * s0_length
+        )
+        frame.append(random.uniform(0, 9))
+    panel = flex.size_t(len(s1), 0)
+
+    # The bounding boxes are identical for any number of threads
+    expected = [
+        setup["calculate_bbox"](s1[i], frame[i], panel[i]) for i in range(len(s1))
+    ]
+    for nthreads in (1, 4):
+        bbox = setup["calculate_bbox"](s1, frame, panel, nthreads=nthreads)
+        assert list(bbox) == expected
@@ -2,6 +2,8 @@
 
 import random
 
+import pytest
+
 from dials.algorithms.shoebox import find_overlapping
 
 
@@ -70,6 +72,42 @@ def test_multiple_panels():
         assert edge in edges
 
 
+def random_bbox():
+    x0 = random.randint(0, 500)
+    y0 = random.randint(0, 500)
+    z0 = random.randint(0, 10)
+    x1 = x0 + random.randint(2, 10)
+    y1 = y0 + random.randint(2, 10)
+    z1 = z0 + random.randint(2, 10)
+    return (x0, x1, y0, y1, z0, z1)
+
+
+def edge_list(overlaps):
+    return [
+        (overlaps.source(edge), overlaps.target(edge)) for edge in overlaps.edges()
+    ]
+
+
+@pytest.mark.parametrize("nthreads", [2, 4])
+def test_multiple_threads(nthreads):
+    from dials.array_family import flex
+
+    nrefl = 2000
+    bbox = flex.int6(nrefl)
+    panel = flex.size_t(nrefl)
+    for i in range(nrefl):
+        bbox[i] = random_bbox()
+        panel[i] = random.randint(0, 2)
+
+    # The result must be identical to the single threaded search
+    expected = find_overlapping(bbox, panel)
+    overlaps = find_overlapping(bbox, panel, nthreads=nthreads)
+    assert edge_list(overlaps) == edge_list(expected)
+    expected = find_overlapping(bbox)
+    overlaps = find_overlapping(bbox, nthreads=nthreads)
+    assert edge_list(overlaps) == edge_list(expected)
+
+
 def brute_force(bbox, panel=None):
     overlaps = []
     if panel is None:
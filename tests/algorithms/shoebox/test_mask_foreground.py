@@ -5,6 +5,7 @@
 
 import numpy as np
 
+from dxtbx.model import SimplePxMmStrategy
 from dxtbx.model.experiment_list import ExperimentList
 from scitbx import matrix
 
@@ -135,6 +136,85 @@ def rs_coord(i, j, k):
             assert False
 
 
+def test_parallel(dials_data):
+    experiment = ExperimentList.from_file(
+        dials_data("centroid_test_data", pathlib=True) / "experiments.json"
+    )
+    mask_foreground = MaskCalculator3D(
+        experiment[0].beam,
+        experiment[0].detector,
+        experiment[0].goniometer,
+        experiment[0].scan,
+        experiment[0].profile.delta_b(),
+        experiment[0].profile.delta_m(),
+    )
+
+    # Each shoebox is masked by one thread, so the masks are identical for
+    # any number of threads
+    masks = []
+    for nthreads in (1, 4):
+        reflections = generate_reflections(
+            experiment[0].detector,
+            experiment[0].beam,
+            experiment[0].scan,
+            experiment,
+            1000,
+        )
+        mask_foreground(
+            reflections["shoebox"],
+            reflections["s1"],
+            reflections["xyzcal.px"].parts()[2],
+            reflections["panel"],
+            nthreads=nthreads,
+        )
+        masks.append([list(sbox.mask) for sbox in reflections["shoebox"]])
+    assert masks[0] == masks[1]
+
+
+def test_flat(dials_data):
+    experiment = ExperimentList.from_file(
+        dials_data("centroid_test_data", pathlib=True) / "experiments.json"
+    )
+
+    # Shoeboxes which are not flat use the parallax correction at the position
+    # of the reflection, so the footprints only match without it
+    for panel in experiment[0].detector:
+        panel.set_px_mm_strategy(SimplePxMmStrategy())
+
+    mask_foreground = MaskCalculator3D(
+        experiment[0].beam,
+        experiment[0].detector,
+        experiment[0].goniometer,
+        experiment[0].scan,
+        experiment[0].profile.delta_b(),
+        experiment[0].profile.delta_m(),
+    )
+    reflections = generate_reflections(
+        experiment[0].detector,
+        experiment[0].beam,
+        experiment[0].scan,
+        experiment,
+        100,
+    )
+    frame = reflections["xyzcal.px"].parts()[2]
+    mask_foreground(
+        reflections["shoebox"], reflections["s1"], frame, reflections["panel"]
+    )
+
+    # Every frame of a shoebox has the same foreground, which is also that of
+    # the flattened shoebox
+    flat = flex.shoebox(
+        reflections["panel"], reflections["bbox"], allocate=True, flatten=True
+    )
+    flat.allocate_with_value(MaskCode.Valid)
+    mask_foreground(flat, reflections["s1"], frame, reflections["panel"])
+    for sbox, flat_sbox in zip(reflections["shoebox"], flat):
+        mask = sbox.mask.as_numpy_array()
+        flat_mask = flat_sbox.mask.as_numpy_array()
+        assert flat_mask.shape == (1,) + mask.shape[1:]
+        assert (mask == flat_mask).all()
+
+
 def generate_reflections(detector, beam, scan, experiment, num):
     seed(0)
     assert len(detector) == 1
@@ -1,5 +1,7 @@
 from __future__ import annotations
 
+import math
+
 import pytest
 
 
@@ -29,3 +31,67 @@ def test(dials_data):
         h0 = r["miller_index"]
         h1 = transform.h(panel, x, y, z)
         assert h0 == pytest.approx(h1, abs=1e-7)
+
+
+@pytest.mark.parametrize("nthreads", [1, 3])
+def test_mask_neighbouring(dials_data, nthreads):
+    from dxtbx.model.experiment_list import ExperimentListFactory
+
+    from dials.algorithms.shoebox import MaskCode
+    from dials.algorithms.spot_prediction import PixelToMillerIndex
+    from dials.array_family import flex
+
+    filename = dials_data("centroid_test_data", pathlib=True) / "experiments.json"
+    experiment = ExperimentListFactory.from_json_file(filename)[0]
+    transform = PixelToMillerIndex(
+        experiment.beam,
+        experiment.detector,
+        experiment.goniometer,
+        experiment.scan,
+        experiment.crystal,
+    )
+
+    reflections = flex.reflection_table.from_predictions(experiment)
+    reflections = reflections.select(flex.size_t(range(0, len(reflections), 20)))
+    x, y, _ = reflections["xyzcal.px"].parts()
+    reflections = reflections.select((x >= 5) & (y >= 5))
+    bbox = flex.int6()
+    for x, y, z in reflections["xyzcal.px"]:
+        x, y, z = int(x), int(y), int(z)
+        bbox.append((x - 4, x + 4, y - 3, y + 4, z - 1, z + 2))
+    shoeboxes = flex.shoebox(reflections["panel"], bbox, allocate=True)
+    mask_code = MaskCode.Valid | MaskCode.Foreground
+    shoeboxes.allocate_with_value(mask_code)
+
+    modified = shoeboxes.mask_neighbouring(
+        reflections["miller_index"],
+        experiment.beam,
+        experiment.detector,
+        experiment.goniometer,
+        experiment.scan,
+        experiment.crystal,
+        nthreads=nthreads,
+    )
+
+    # Compare with the original point-wise filter
+    for i, sbox in enumerate(shoeboxes):
+        x0, x1, y0, y1, z0, z1 = sbox.bbox
+        hkl = reflections["miller_index"][i]
+        expected_modified = False
+        for z in range(z1 - z0):
+            for y in range(y1 - y0):
+                for x in range(x1 - x0):
+                    h1 = transform.h(sbox.panel, x0 + x + 0.5, y0 + y + 0.5, z0 + z)
+                    h2 = transform.h(
+                        sbox.panel, x0 + x + 0.5, y0 + y + 0.5, z0 + z + 1
+                    )
+                    h1 = tuple(math.floor(v + 0.5) for v in h1)
+                    h2 = tuple(math.floor(v + 0.5) for v in h2)
+                    if h1 != hkl or h2 != hkl:
+                        expected = MaskCode.Valid | MaskCode.Background
+                        expected_modified = True
+                    else:
+                        expected = mask_code
+                    assert sbox.mask[z, y, x] == expected
+        assert modified[i] == expected_modified
+    assert modified.count(True) > 0
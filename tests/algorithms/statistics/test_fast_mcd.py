@@ -65,17 +65,12 @@ def test_maha():
 
 
 def test_fast_mcd_small():
-    # set random seeds to try to avoid assertion errors due to occasionally
-    # finding less common solutions
-    import random
-
+    # the starting subsets are drawn from a stream of random numbers determined
+    # by the seed, so fix it to avoid occasionally finding less common solutions
     from scitbx.array_family import flex
 
     from dials.algorithms.statistics.fast_mcd import FastMCD
 
-    random.seed(42)
-    flex.set_random_seed(42)
-
     # some test data, from R package robustbase: Hawkins, Bradu, Kass's Artificial Data
     hbk = """10.1 19.6 28.3
    9.5 20.5 28.9
@@ -158,7 +153,7 @@ def test_fast_mcd_small():
     x1, x2, x3 = (flex.double(e) for e in zip(*rows))
 
     # Fast MCD raw estimates
-    fast_mcd = FastMCD([x1, x2, x3])
+    fast_mcd = FastMCD([x1, x2, x3], seed=0)
     T, S = fast_mcd.get_raw_T_and_S()
     from libtbx.test_utils import approx_equal
 
@@ -193,17 +188,46 @@ def test_fast_mcd_small():
     assert approx_equal(fast_mcd._finite_samp_fac, 1.12792118859)
 
 
-def test_fast_mcd_large(dials_data):
-    # set random seeds to try to avoid assertion errors due to occasionally
-    # finding less common solutions
-    import random
+def test_fast_mcd_exact():
+    # for a small dataset the MCD solution can be found by checking every
+    # subset of h observations
+    import itertools
 
     from scitbx.array_family import flex
 
-    from dials.algorithms.statistics.fast_mcd import FastMCD
+    from dials.algorithms.statistics.fast_mcd import FastMCD, cov
 
-    random.seed(42)
-    flex.set_random_seed(42)
+    x1 = flex.double(
+        (1.2, 2.1, 2.9, 4.2, 5.1, 5.8, 7.1, 8.0, 8.9, 10.2, 3.0, 4.0, 9.0, 6.0)
+    )
+    x2 = flex.double(
+        (1.0, 2.3, 2.8, 4.1, 4.7, 6.2, 6.9, 8.3, 9.1, 9.8, 9.5, 8.0, 2.0, 1.0)
+    )
+
+    fast_mcd = FastMCD([x1, x2], seed=0)
+    h = fast_mcd._h
+    assert h == 8
+
+    def det(subset):
+        sel = flex.size_t(subset)
+        return cov(x1.select(sel), x2.select(sel)).matrix_determinant_via_lu()
+
+    best = flex.size_t(min(itertools.combinations(range(len(x1)), h), key=det))
+    assert list(best) == [0, 1, 2, 3, 5, 6, 7, 8]
+
+    T, S = fast_mcd.get_raw_T_and_S()
+    from libtbx.test_utils import approx_equal
+
+    assert approx_equal(T, [flex.mean(x1.select(best)), flex.mean(x2.select(best))])
+    assert approx_equal(S, cov(x1.select(best), x2.select(best)))
+
+
+def test_fast_mcd_large(dials_data):
+    # the starting subsets are drawn from a stream of random numbers determined
+    # by the seed, so the result is reproducible
+    from scitbx.array_family import flex
+
+    from dials.algorithms.statistics.fast_mcd import FastMCD
 
     # test large dataset algorithm
     data_pth = (
@@ -220,9 +244,10 @@ def test_fast_mcd_large(dials_data):
     X_resid_mm = flex.double(X_resid_mm)
     Y_resid_mm = flex.double(Y_resid_mm)
     Phi_resid_mm = flex.double(Phi_resid_mm)
+    cols = [X_resid_mm, Y_resid_mm, Phi_resid_mm]
 
     # Fast MCD raw estimates
-    fast_mcd = FastMCD([X_resid_mm, Y_resid_mm, Phi_resid_mm])
+    fast_mcd = FastMCD(cols, seed=0)
     T, S = fast_mcd.get_raw_T_and_S()
     from libtbx.test_utils import approx_equal
 
@@ -240,6 +265,11 @@ def test_fast_mcd_large(dials_data):
         ),
     )
 
+    # the same seed gives the same result
+    T2, S2 = FastMCD(cols, seed=0).get_raw_T_and_S()
+    assert list(T2) == list(T)
+    assert list(S2) == list(S)
+
     # Fast MCD corrected estimates
     T, S = fast_mcd.get_corrected_T_and_S()
     assert approx_equal(
@@ -259,3 +289,30 @@ def test_fast_mcd_large(dials_data):
     # Correction factors
     assert approx_equal(fast_mcd._consistency_fac, 2.45659976388)
     assert approx_equal(fast_mcd._finite_samp_fac, 1.00193273884)
+
+
+def test_fast_mcd_nproc():
+    # the random starting subsets are determined by the seed, so the result
+    # does not depend on the number of threads
+    import random
+
+    from scitbx.array_family import flex
+
+    from dials.algorithms.statistics.fast_mcd import FastMCD
+
+    random.seed(42)
+    n = 1000
+    x1 = flex.double(random.gauss(0, 1) for _ in range(n))
+    x2 = flex.double(random.gauss(0, 1) for _ in range(n)) + 0.5 * x1
+    x3 = flex.double(random.gauss(0, 1) for _ in range(n)) - 0.3 * x2
+    for i in range(0, n, 10):
+        x1[i] += 10.0
+
+    results = [FastMCD([x1, x2, x3], seed=1, nproc=nproc) for nproc in (1, 4)]
+    T1, S1 = results[0].get_raw_T_and_S()
+    T4, S4 = results[1].get_raw_T_and_S()
+    assert list(T1) == list(T4)
+    assert list(S1) == list(S4)
+
+    # the outliers do not contribute to the location estimate
+    assert abs(T1[0]) < 0.2
@@ -4,6 +4,7 @@
 import logging
 import pickle
 import random
+import struct
 
 import pytest
 
@@ -1225,6 +1226,250 @@ def test_to_from_msgpack(tmp_path):
     assert all(tuple(compare(a, b) for a, b in zip(new_table["col11"], c11)))
 
 
+def test_to_msgpack_in_parallel(tmp_path):
+    msgpack = pytest.importorskip("msgpack")
+
+    # Enough shoeboxes to be split into several chunks
+    n = 25000
+    table = flex.reflection_table()
+    table["id"] = flex.int(n, 0)
+    table["xyzobs.px.value"] = flex.vec3_double(n, (1, 2, 3))
+    table["shoebox"] = flex.shoebox(
+        flex.size_t(n, 0), flex.int6(n, (0, 2, 0, 3, 0, 1)), allocate=True
+    )
+    table.experiment_identifiers()[0] = "abcd"
+
+    serial = table.as_msgpack()
+    parallel = table.as_msgpack(nthreads=4)
+    assert serial == parallel
+
+    # Check the layout is that expected by other msgpack readers
+    filetype, version, content = msgpack.unpackb(serial, strict_map_key=False)
+    assert filetype == "dials::af::reflection_table"
+    assert version == 1
+    assert content["nrows"] == n
+    assert content["identifiers"] == {0: "abcd"}
+    assert content["data"]["id"] == ["int", [n, bytes(4 * n)]]
+    name, (size, data) = content["data"]["shoebox"]
+    assert name == "Shoebox<>"
+    assert size == n
+    assert len(data) == n * (4 + 6 * 4 + 1 + 6 * (4 + 4 + 4))
+
+    table.as_msgpack_file(tmp_path / "reflections.mpack", nthreads=4)
+    assert (tmp_path / "reflections.mpack").read_bytes() == serial
+    new_table = flex.reflection_table.from_msgpack_file(tmp_path / "reflections.mpack")
+    assert new_table.nrows() == n
+    assert all(new_table["shoebox"].is_consistent())
+
+
+def test_to_msgpack_matches_legacy_layout():
+    msgpack = pytest.importorskip("msgpack")
+
+    table = flex.reflection_table()
+    table["id"] = flex.int([0, 1, 0])
+    table["d"] = flex.double([1.5, 0.5, -0.5])
+    table["flag"] = flex.bool([False, True, False])
+    table["xyz"] = flex.vec3_double([(0, 0, 0), (1, 2, -1), (2, 4, -2)])
+    table["shoebox"] = flex.shoebox(
+        flex.size_t([0, 1, 2]),
+        flex.int6([(0, 2, 0, 3, 0, 1), (1, 2, 1, 2, 1, 3), (0, 1, 0, 1, 0, 1)]),
+    )
+    for i in range(2):
+        sbox = table["shoebox"][i]
+        sbox.allocate()
+        for j in range(len(sbox.data)):
+            sbox.data[j] = 10 * i + j
+            sbox.mask[j] = j % 2
+            sbox.background[j] = i + j / 2
+        table["shoebox"][i] = sbox
+    table.experiment_identifiers()[0] = "abcd"
+    table.experiment_identifiers()[1] = "efgh"
+
+    # Pack the table as the msgpack adapter did before the parallel writer
+    def pack_shoebox(sbox):
+        result = struct.pack("<I6i", sbox.panel, *sbox.bbox)
+        if len(sbox.data) == 0:
+            return result + struct.pack("<B", 0)
+        n = len(sbox.data)
+        return (
+            result
+            + struct.pack("<B", 1)
+            + struct.pack(f"<{n}f", *sbox.data)
+            + struct.pack(f"<{n}i", *sbox.mask)
+            + struct.pack(f"<{n}f", *sbox.background)
+        )
+
+    columns = {
+        "d": ("double", struct.pack("<3d", *table["d"])),
+        "flag": ("bool", struct.pack("<3?", *table["flag"])),
+        "id": ("int", struct.pack("<3i", *table["id"])),
+        "shoebox": ("Shoebox<>", b"".join(map(pack_shoebox, table["shoebox"]))),
+        "xyz": ("vec3<double>", struct.pack("<9d", *table["xyz"].as_double())),
+    }
+    expected = msgpack.packb(
+        [
+            "dials::af::reflection_table",
+            1,
+            {
+                "identifiers": {0: "abcd", 1: "efgh"},
+                "nrows": 3,
+                "data": {
+                    key: [name, [3, data]] for key, (name, data) in columns.items()
+                },
+            },
+        ]
+    )
+
+    assert list(table.keys()) == list(columns)
+    assert table.as_msgpack() == expected
+    assert table.as_msgpack(nthreads=2) == expected
+
+
+def test_msgpack_reader(tmp_path):
+    table, columns = table_and_columns()
+    c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11 = columns
+    table["id"] = flex.int(table.size(), 0)
+    table.experiment_identifiers()[0] = "test"
+    table.as_msgpack_file(tmp_path / "reflections.mpack")
+
+    reader = flex.MsgpackReflectionTableReader(str(tmp_path / "reflections.mpack"))
+    assert reader.nrows() == 10
+    assert reader.ncols() == 12
+    assert set(reader.keys()) == set(table.keys())
+    assert "col7" in reader
+    assert "missing" not in reader
+    assert reader.column_type_name("col7") == "vec3<double>"
+    assert dict(reader.experiment_identifiers()) == {0: "test"}
+    assert list(reader["col1"]) == c1
+    assert list(reader["col7"]) == c7
+    with pytest.raises(Exception):
+        reader["missing"]
+
+    # Decode only some of the columns
+    new_table = flex.reflection_table.from_msgpack_file(
+        tmp_path / "reflections.mpack", columns=["col2", "col10"]
+    )
+    assert new_table.is_consistent()
+    assert new_table.nrows() == 10
+    assert sorted(new_table.keys()) == ["col10", "col2"]
+    assert list(new_table["col2"]) == c2
+    assert list(new_table["col10"]) == c10
+    assert dict(new_table.experiment_identifiers()) == {0: "test"}
+
+    # The full table read via the reader matches the eager reader
+    full = reader.as_reflection_table()
+    assert full.nrows() == 10
+    assert full.ncols() == 12
+    assert all(tuple(compare(a, b) for a, b in zip(full["col11"], c11)))
+
+    # A compressed file is decoded in full and the other columns dropped
+    table.as_msgpack_file(tmp_path / "reflections.mpack.gz")
+    new_table = flex.reflection_table.from_msgpack_file(
+        tmp_path / "reflections.mpack.gz", columns=["col2", "col10"]
+    )
+    assert sorted(new_table.keys()) == ["col10", "col2"]
+    assert list(new_table["col2"]) == c2
+    assert list(new_table["col10"]) == c10
+    with pytest.raises(KeyError):
+        flex.reflection_table.from_msgpack_file(
+            tmp_path / "reflections.mpack.gz", columns=["missing"]
+        )
+
+
+def test_from_file_columns(tmp_path):
+    table, columns = table_and_columns()
+    c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11 = columns
+    table.as_msgpack_file(tmp_path / "reflections.mpack")
+    table.as_chunked_file(tmp_path / "reflections.chunked")
+    table.as_pickle(tmp_path / "reflections.pickle")
+    for filename in ["reflections.mpack", "reflections.chunked", "reflections.pickle"]:
+        new_table = flex.reflection_table.from_file(
+            tmp_path / filename, columns=["col2", "col11"]
+        )
+        assert new_table.is_consistent()
+        assert new_table.nrows() == 10
+        assert sorted(new_table.keys()) == ["col11", "col2"]
+        assert list(new_table["col2"]) == c2
+        assert all(tuple(compare(a, b) for a, b in zip(new_table["col11"], c11)))
+        with pytest.raises(KeyError):
+            flex.reflection_table.from_file(tmp_path / filename, columns=["missing"])
+
+
+def test_to_from_chunked_file(tmp_path):
+    table, columns = table_and_columns()
+    c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11 = columns
+    table["id"] = flex.int([0] * 5 + [1] * 5)
+    table.experiment_identifiers()[0] = "abcd"
+    table.experiment_identifiers()[1] = "efgh"
+    table["flags"] = flex.size_t(table.size(), 0)
+    table.set_flags(flex.bool([True, False] * 5), table.flags.indexed)
+
+    filename = tmp_path / "reflections.refl"
+    table.as_chunked_file(filename, rows_per_group=3)
+    reader = flex.ChunkedReflectionTableReader(str(filename))
+    assert reader.has_footer()
+    assert reader.nrows() == 10
+    assert reader.ncols() == 13
+    assert reader.n_row_groups() == 4
+    assert [reader.row_group_nrows(i) for i in range(4)] == [3, 3, 3, 1]
+
+    new_table = flex.reflection_table.from_file(filename)
+    assert new_table.is_consistent()
+    assert new_table.nrows() == 10
+    assert new_table.ncols() == 13
+    assert list(new_table["col1"]) == c1
+    assert list(new_table["col2"]) == c2
+    assert list(new_table["col3"]) == c3
+    assert list(new_table["col4"]) == c4
+    assert list(new_table["col5"]) == c5
+    assert list(new_table["col6"]) == c6
+    assert list(new_table["col7"]) == c7
+    assert list(new_table["col8"]) == c8
+    assert list(new_table["col9"]) == c9
+    assert list(new_table["col10"]) == c10
+    assert all(tuple(compare(a, b) for a, b in zip(new_table["col11"], c11)))
+    assert dict(new_table.experiment_identifiers()) == {0: "abcd", 1: "efgh"}
+
+    # Column projection
+    new_table = flex.reflection_table.from_chunked_file(
+        filename, columns=["col1", "col7"]
+    )
+    assert sorted(new_table.keys()) == ["col1", "col7"]
+    assert list(new_table["col7"]) == c7
+
+    # Row group pruning using the statistics
+    assert list(reader.row_groups_with_id(0)) == [0, 1]
+    assert list(reader.row_groups_with_id(1)) == [1, 2, 3]
+    assert list(reader.row_groups_in_z("col7", 9.5, 20)) == [2, 3]
+    new_table = flex.reflection_table.from_chunked_file(
+        filename, columns=["col1"], experiment_id=1, flags=table.flags.indexed
+    )
+    assert list(new_table.keys()) == ["col1"]
+    assert list(new_table["col1"]) == [6, 8]
+    new_table = flex.reflection_table.from_chunked_file(
+        filename, z_range=(5, 8), z_column="col7"
+    )
+    assert list(new_table["col1"]) == [2, 3, 4]
+
+    # Append to the existing file
+    table.as_chunked_file(filename, rows_per_group=3, append=True)
+    new_table = flex.reflection_table.from_chunked_file(filename)
+    assert new_table.nrows() == 20
+    assert list(new_table["col1"]) == c1 + c1
+    with pytest.raises(RuntimeError):
+        table.select(flex.std_string(["col1"])).as_chunked_file(filename, append=True)
+
+    # Recover a file that was not closed
+    writer = flex.ChunkedReflectionTableWriter(str(tmp_path / "partial.refl"), 4)
+    writer.write(table)
+    writer.flush()
+    reader = flex.ChunkedReflectionTableReader(str(tmp_path / "partial.refl"))
+    assert not reader.has_footer()
+    assert reader.nrows() == 10
+    assert list(reader.read()["col1"]) == c1
+    writer.close()
+
+
 def test_experiment_identifiers():
     table = flex.reflection_table()
     table["id"] = flex.int([0, 1, 2, 3])
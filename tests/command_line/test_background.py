@@ -79,3 +79,37 @@ def test_multiple_imagesets(dials_data, tmp_path):
     assert b"For imageset 0 image 2:" in lines
     assert b"For imageset 1 image 1:" in lines
     assert b"For imageset 1 image 2:" in lines
+
+
+def test_precomputed_mask_and_two_theta(dials_data):
+    import numpy as np
+
+    from dxtbx.model.experiment_list import ExperimentList
+
+    import dials.util.masking
+    from dials.command_line.background import background, phil_scope
+
+    experiments = ExperimentList.from_file(
+        dials_data("centroid_test_data", pathlib=True) / "experiments.json"
+    )
+    imageset = experiments.imagesets()[0]
+    mask_params = phil_scope.extract().masking
+    static_mask = dials.util.masking.generate_mask(imageset, mask_params)[0]
+    two_theta_array = (
+        imageset.get_detector()[0]
+        .get_two_theta_array(imageset.get_beam().get_s0())
+        .as_1d()
+    )
+    for indx in (0, 4):
+        expected = background(imageset, indx, n_bins=50, mask_params=mask_params)
+        result = background(
+            imageset,
+            indx,
+            n_bins=50,
+            mask_params=mask_params,
+            static_mask=static_mask,
+            two_theta_array=two_theta_array,
+        )
+        # Empty bins give NaN, which compare equal here
+        for a, b in zip(result, expected):
+            np.testing.assert_array_equal(a.as_numpy_array(), b.as_numpy_array())
@@ -396,15 +396,19 @@ def test_find_spots_with_per_image_statistics(dials_data, tmp_path):
     )
 
 
+@pytest.mark.parametrize("nproc,nthreads", [(1, 1), (2, 1), (1, 3)])
 @pytest.mark.parametrize(
     "blur,expected_nref", [("None", 559), ("narrow", 721), ("wide", 739)]
 )
-def test_find_spots_radial_profile(dials_data, blur, expected_nref, run_in_tmp_path):
+def test_find_spots_radial_profile(
+    dials_data, blur, expected_nref, nproc, nthreads, run_in_tmp_path
+):
     reflections = dials.command_line.find_spots.run(
         [
-            "nproc=1",
+            f"nproc={nproc}",
             "threshold.algorithm=radial_profile",
             f"blur={blur}",
+            f"radial_profile.nthreads={nthreads}",
         ]
         + [
             os.fspath(f)
@@ -211,6 +211,53 @@ def test_basic_integrate_output_integrated_only(dials_data, tmp_path):
     assert dict(table.experiment_identifiers()) == {0: "bar"}
 
 
+def test_integrate_subsets_streamed_to_file(dials_data, tmp_path):
+    # Integrate two subsets of the reflections with the results streamed to a
+    # file and compare against integrating them in memory
+    exp = load.experiment_list(
+        dials_data("centroid_test_data", pathlib=True) / "experiments.json"
+    )
+    exp.as_json(tmp_path / "modified_input.json")
+
+    args = [
+        shutil.which("dials.integrate"),
+        "nproc=1",
+        "modified_input.json",
+        "profile.fitting=False",
+        "integration.integrator=3d",
+        "prediction.padding=0",
+        "mp.method=multiprocessing",
+        "mp.multiprocessing.n_subset_split=2",
+    ]
+    result = subprocess.run(
+        args + ["output.reflections=in_memory.refl"],
+        cwd=tmp_path,
+        capture_output=True,
+    )
+    assert not result.returncode and not result.stderr
+    result = subprocess.run(
+        args
+        + [
+            "output.reflections=streamed.refl",
+            "stream.filename=stream.refl",
+            "stream.keep_in_memory=False",
+        ],
+        cwd=tmp_path,
+        capture_output=True,
+    )
+    assert not result.returncode and not result.stderr
+
+    in_memory = flex.reflection_table.from_file(tmp_path / "in_memory.refl")
+    streamed = flex.reflection_table.from_file(tmp_path / "streamed.refl")
+    assert len(streamed) == len(in_memory) == 1666
+    for key in ("miller_index", "bbox", "flags", "intensity.sum.value"):
+        assert list(streamed[key]) == list(in_memory[key])
+
+    # The stream file holds every reflection of both subsets once
+    stream = flex.reflection_table.from_file(tmp_path / "stream.refl")
+    assert sorted(stream["stream_index"]) == list(range(len(in_memory)))
+
+
 def test_integration_with_sampling(dials_data, tmp_path):
     exp = load.experiment_list(
         dials_data("centroid_test_data", pathlib=True) / "experiments.json"
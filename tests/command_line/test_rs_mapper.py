@@ -103,3 +103,71 @@ def test_masked(dials_data, tmp_path):
     assert masked.header_max < unmasked.header_max
     assert masked.header_max == pytest.approx(289.11111)
     assert unmasked.header_max == pytest.approx(65535.0)
+
+
+def test_threads_and_trilinear(dials_data, tmp_path):
+    experiments = (
+        dials_data("centroid_test_data", pathlib=True) / "imported_experiments.json"
+    )
+    for name, options in (
+        ("serial", ["nproc=1"]),
+        ("threaded", ["nproc=3"]),
+        ("trilinear", ["nproc=2", "trilinear=True"]),
+    ):
+        result = subprocess.run(
+            [
+                shutil.which("dials.rs_mapper"),
+                experiments,
+                f"map_file={name}.ccp4",
+                "grid_size=64",
+            ]
+            + options,
+            cwd=tmp_path,
+            capture_output=True,
+        )
+        assert not result.returncode and not result.stderr
+
+    serial = ccp4_map.map_reader(file_name=str(tmp_path / "serial.ccp4"))
+    threaded = ccp4_map.map_reader(file_name=str(tmp_path / "threaded.ccp4"))
+    trilinear = ccp4_map.map_reader(file_name=str(tmp_path / "trilinear.ccp4"))
+
+    # Nearest voxel sums of integer counts do not depend on the order of
+    # accumulation, so the maps must be identical
+    assert threaded.data.all_eq(serial.data)
+
+    # Splatting spreads each pixel over the voxels around its nearest voxel
+    assert (trilinear.data > 0).count(True) >= (serial.data > 0).count(True)
+
+
+def test_process_blocks(dials_data):
+    from dxtbx.model.experiment_list import ExperimentListFactory
+
+    import dials.algorithms.rs_mapper as recviewer
+    from dials.command_line.rs_mapper import process_block
+
+    experiments = ExperimentListFactory.from_json_file(
+        dials_data("centroid_test_data", pathlib=True) / "imported_experiments.json"
+    )
+    imageset = experiments[0].imageset
+    beam = imageset.get_beam()
+    panel = imageset.get_detector()[0]
+    max_resolution = 6
+    nfast, nslow = panel.get_image_size()
+    xy = recviewer.get_target_pixels(
+        panel, beam.get_s0(), nfast, nslow, max_resolution
+    )
+    s1 = panel.get_lab_coord(xy * panel.get_pixel_size()[0])
+    s1 = s1 / s1.norms() * (1 / beam.get_wavelength())
+    S = s1 - beam.get_s0()
+    args = (imageset, 0, 32, False, S, False, xy, 1 / max_resolution, False)
+
+    # Mapping the images in separate blocks, as the worker processes do, must
+    # give the same map as mapping them all in one
+    images = list(range(len(imageset)))
+    grid, counts = process_block(images, *args, 2)
+    block_grid, block_counts = process_block(images[:4], *args, 1)
+    g, c = process_block(images[4:], *args, 1)
+    block_grid += g
+    block_counts += c
+    assert block_grid.all_eq(grid)
+    assert block_counts.all_eq(counts)
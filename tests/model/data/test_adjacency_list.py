@@ -0,0 +1,71 @@
+from __future__ import annotations
+
+import pickle
+import random
+
+
+def make_list(num_vertices):
+    from dials.algorithms.shoebox import find_overlapping
+    from dials.array_family import flex
+
+    bbox = flex.int6(num_vertices)
+    for i in range(num_vertices):
+        x0 = random.randint(0, 100)
+        y0 = random.randint(0, 100)
+        z0 = random.randint(0, 10)
+        bbox[i] = (x0, x0 + 10, y0, y0 + 10, z0, z0 + 5)
+    return find_overlapping(bbox)
+
+
+def test_adjacent_vertices():
+    random.seed(0)
+    adjacency_list = make_list(200)
+    expected = {i: [] for i in range(adjacency_list.num_vertices())}
+    for edge in adjacency_list.edges():
+        source = adjacency_list.source(edge)
+        target = adjacency_list.target(edge)
+        expected[source].append(target)
+    assert sum(len(v) for v in expected.values()) == 2 * adjacency_list.num_edges()
+    offset = adjacency_list.offset()
+    neighbours = adjacency_list.neighbours()
+    for i in range(adjacency_list.num_vertices()):
+        adjacent = list(adjacency_list.adjacent_vertices(i))
+        assert adjacent == sorted(expected[i])
+        assert adjacent == list(neighbours[offset[i] : offset[i + 1]])
+        assert adjacency_list.vertex_num_edges(i) == len(adjacent)
+        for j in adjacent:
+            assert i in expected[j]
+
+
+def test_pickle():
+    random.seed(0)
+    adjacency_list = make_list(200)
+    adjacency_list2 = pickle.loads(pickle.dumps(adjacency_list))
+    assert adjacency_list2.num_vertices() == adjacency_list.num_vertices()
+    assert adjacency_list2.num_edges() == adjacency_list.num_edges()
+    assert adjacency_list2.offset().all_eq(adjacency_list.offset())
+    assert adjacency_list2.neighbours().all_eq(adjacency_list.neighbours())
+
+
+def test_add_edge():
+    random.seed(0)
+    adjacency_list = make_list(50)
+    expected = {
+        (adjacency_list.source(edge), adjacency_list.target(edge))
+        for edge in adjacency_list.edges()
+    }
+    num_edges = adjacency_list.num_edges()
+
+    # Adding edges to a built graph keeps the existing edges
+    adjacency_list.add_edge(0, 49)
+    adjacency_list.add_edge(7, 7)
+    assert adjacency_list.num_edges() == num_edges + 2
+    adjacency_list.finish()
+    assert adjacency_list.num_edges() == num_edges + 2
+    expected |= {(0, 49), (49, 0), (7, 7)}
+    edges = [
+        (adjacency_list.source(edge), adjacency_list.target(edge))
+        for edge in adjacency_list.edges()
+    ]
+    assert set(edges) == expected
+    assert list(adjacency_list.adjacent_vertices(7)).count(7) == 2
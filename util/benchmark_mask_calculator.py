@@ -0,0 +1,124 @@
+"""
+Microbenchmark for MaskCalculator3D. Masks the shoeboxes of random
+reflections on the detector of an experiment and reports the number of
+voxels masked per second, for shoeboxes with one slice per frame and for
+flattened shoeboxes.
+
+This is a manual script, not a test. To compare two builds, save the results of the first and compare the
+second against them:
+
+  dials.python util/benchmark_mask_calculator.py experiments.json --save before.json
+  dials.python util/benchmark_mask_calculator.py experiments.json --compare before.json
+
+The experiments.json of the centroid_test_data in dials_data is suitable.
+"""
+
+from __future__ import annotations
+
+import argparse
+import json
+import random
+import time
+
+from dxtbx.model.experiment_list import ExperimentList
+from scitbx import matrix
+
+from dials.algorithms.profile_model.gaussian_rs import MaskCalculator3D
+from dials.algorithms.shoebox import MaskCode
+from dials.array_family import flex
+
+
+def generate_reflections(experiments, num):
+    """Generate reflections at random pixels and frames, with the bounding
+    boxes of the experiment profile model"""
+    random.seed(0)
+    detector = experiments[0].detector
+    beam = experiments[0].beam
+    scan = experiments[0].scan
+    width, height = detector[0].get_image_size()
+    z0, z1 = scan.get_array_range()
+    s0_length = matrix.col(beam.get_s0()).length()
+    s1 = flex.vec3_double(num)
+    xyzcal_px = flex.vec3_double(num)
+    xyzcal_mm = flex.vec3_double(num)
+    for i in range(num):
+        x = random.uniform(0, width)
+        y = random.uniform(0, height)
+        z = random.uniform(z0, z1)
+        s1[i] = matrix.col(detector[0].get_pixel_lab_coord((x, y))).normalize() * (
+            s0_length
+        )
+        xyzcal_px[i] = (x, y, z)
+        x_mm, y_mm = detector[0].pixel_to_millimeter((x, y))
+        xyzcal_mm[i] = (x_mm, y_mm, scan.get_angle_from_array_index(z, deg=False))
+    reflections = flex.reflection_table()
+    reflections["id"] = flex.int(num, 0)
+    reflections["panel"] = flex.size_t(num, 0)
+    reflections["s1"] = s1
+    reflections["xyzcal.px"] = xyzcal_px
+    reflections["xyzcal.mm"] = xyzcal_mm
+    reflections["bbox"] = reflections.compute_bbox(experiments)
+    return reflections
+
+
+def voxels_per_second(mask_calculator, reflections, flatten, repeats):
+    """Return the best number of voxels masked per second over the repeats"""
+    frame = reflections["xyzcal.px"].parts()[2]
+    best = None
+    for _ in range(repeats):
+        shoeboxes = flex.shoebox(
+            reflections["panel"], reflections["bbox"], allocate=True, flatten=flatten
+        )
+        shoeboxes.allocate_with_value(MaskCode.Valid)
+        start = time.perf_counter()
+        mask_calculator(shoeboxes, reflections["s1"], frame, reflections["panel"])
+        elapsed = time.perf_counter() - start
+        if best is None or elapsed < best:
+            best = elapsed
+    nvoxels = sum(len(sbox.mask) for sbox in shoeboxes)
+    return nvoxels / best
+
+
+def run(args=None):
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("experiments", help="The experiment list")
+    parser.add_argument("--reflections", type=int, default=10000)
+    parser.add_argument("--repeats", type=int, default=5)
+    parser.add_argument("--save", help="Save the results to a json file")
+    parser.add_argument("--compare", help="Compare with results from a json file")
+    params = parser.parse_args(args)
+
+    experiments = ExperimentList.from_file(params.experiments)
+    mask_calculator = MaskCalculator3D(
+        experiments[0].beam,
+        experiments[0].detector,
+        experiments[0].goniometer,
+        experiments[0].scan,
+        experiments[0].profile.delta_b(),
+        experiments[0].profile.delta_m(),
+    )
+    reflections = generate_reflections(experiments, params.reflections)
+
+    results = {}
+    for layout, flatten in (("normal", False), ("flat", True)):
+        results[layout] = voxels_per_second(
+            mask_calculator, reflections, flatten, params.repeats
+        )
+
+    previous = None
+    if params.compare:
+        with open(params.compare) as infile:
+            previous = json.load(infile)
+    for layout, rate in results.items():
+        line = f"{layout:>8}: {rate / 1e6:8.2f} Mvoxels/s"
+        if previous and layout in previous:
+            line += f" (before {previous[layout] / 1e6:8.2f}, "
+            line += f"speed up {rate / previous[layout]:.2f})"
+        print(line)
+    if params.save:
+        with open(params.save, "w") as outfile:
+            json.dump(results, outfile, indent=2)
+
+
+if __name__ == "__main__":
+    run()